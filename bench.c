@@ -0,0 +1,1686 @@
+/*
+ * PubSub broker benchmarks
+ * bench.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: alexo
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "psb.h"
+#include "platform.h"
+#include "trie.h"
+#include "bench.h"
+
+#if defined(_WIN32) || defined(_WIN64) // use the native win32 API on windows
+
+#define DEFINE_THREAD(NAME, PARAM)  DWORD WINAPI NAME( LPVOID PARAM )
+#define bench_thread_t              HANDLE
+#define bench_thread_start(t, fn, arg)  (*(t) = CreateThread(NULL, 0, (fn), (arg), 0, NULL))
+#define bench_thread_join(t)        (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+
+// get monotonic time in nanoseconds
+static double bench_now_ns(void)
+{
+	LARGE_INTEGER freq, cnt;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (double)cnt.QuadPart * 1e9 / (double)freq.QuadPart;
+}
+
+#else
+#include <time.h>
+
+#define DEFINE_THREAD(NAME, PARAM)  void* NAME(void* PARAM)
+#define bench_thread_t              pthread_t
+#define bench_thread_start(t, fn, arg)  pthread_create((t), NULL, (fn), (arg))
+#define bench_thread_join(t)        pthread_join((t), NULL)
+
+// get monotonic time in nanoseconds
+static double bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+#endif
+
+// receive and free 'count' messages from subscriber
+static void bench_drain(psb_subscriber* subscriber, int count)
+{
+	psb_message msg;
+
+	while (count-- > 0)
+	{
+		if (psb_get_message(subscriber, &msg, 1000) == 0)
+		{
+			psb_free_message(&msg);
+		}
+	}
+}
+
+/*********************************** FANOUT **********************************/
+
+#define FANOUT_NMSG		1000
+#define FANOUT_DATALEN	4096
+
+// publish cost of 4KB message as function of matched subscribers count
+static void bench_fanout(void)
+{
+	static const int nsub_list[] = {1, 10, 50, 200};
+	char* data;
+	int i, k;
+
+	data = (char*)malloc(FANOUT_DATALEN);
+	memset(data, 'x', FANOUT_DATALEN);
+
+	printf("fanout: %d messages of %d bytes\n", FANOUT_NMSG, FANOUT_DATALEN);
+	printf("%12s %16s %16s\n", "subscribers", "ns/publish", "ns/delivery");
+
+	for (k = 0; k < (int)(sizeof(nsub_list) / sizeof(nsub_list[0])); k++)
+	{
+		int nsub = nsub_list[k];
+		psb_broker* broker = psb_new_broker();
+		psb_subscriber** subs = (psb_subscriber**)malloc(nsub * sizeof(psb_subscriber*));
+		double t0, t1;
+
+		for (i = 0; i < nsub; i++)
+		{
+			subs[i] = psb_new_subscriber(broker);
+			psb_subscribe(subs[i], "bench/");
+		}
+		psb_sync_subscriptions(broker);
+
+		t0 = bench_now_ns();
+		for (i = 0; i < FANOUT_NMSG; i++)
+		{
+			psb_publish_message(broker, "bench/fanout", data, FANOUT_DATALEN);
+		}
+		t1 = bench_now_ns();
+
+		printf("%12d %16.0f %16.1f\n", nsub, (t1 - t0) / FANOUT_NMSG, (t1 - t0) / FANOUT_NMSG / nsub);
+
+		for (i = 0; i < nsub; i++)
+		{
+			bench_drain(subs[i], FANOUT_NMSG);
+		}
+
+		psb_delete_broker(broker);
+		free(subs);
+	}
+
+	free(data);
+}
+
+/*********************************** SPARSE **********************************/
+
+#define SPARSE_NMSG		10000
+
+// publish cost with one matched subscriber as function of subscribers population
+static void bench_sparse(void)
+{
+	static const int nsub_list[] = {100, 1000, 10000};
+	char channel[32];
+	int data = 0;
+	int i, k;
+
+	printf("sparse: %d messages, each subscriber subscribed to own channel\n", SPARSE_NMSG);
+	printf("%12s %16s %24s\n", "subscribers", "ns/publish", "ns/publish (publisher)");
+
+	for (k = 0; k < (int)(sizeof(nsub_list) / sizeof(nsub_list[0])); k++)
+	{
+		int nsub = nsub_list[k];
+		psb_broker* broker = psb_new_broker();
+		psb_subscriber** subs = (psb_subscriber**)malloc(nsub * sizeof(psb_subscriber*));
+		psb_publisher* publisher;
+		double t0, t1, t2;
+
+		for (i = 0; i < nsub; i++)
+		{
+			subs[i] = psb_new_subscriber(broker);
+			sprintf(channel, "sparse/%d/", i);
+			psb_subscribe(subs[i], channel);
+		}
+		psb_sync_subscriptions(broker);
+
+		t0 = bench_now_ns();
+		for (i = 0; i < SPARSE_NMSG; i++)
+		{
+			psb_publish_message(broker, "sparse/7/data", &data, sizeof(data));
+		}
+		t1 = bench_now_ns();
+		bench_drain(subs[7], SPARSE_NMSG);
+
+		// the same channel published by the publisher with cached routing
+		publisher = psb_new_publisher(broker, "sparse/7/data");
+		t2 = bench_now_ns();
+		for (i = 0; i < SPARSE_NMSG; i++)
+		{
+			psb_publish(publisher, &data, sizeof(data));
+		}
+		t2 = bench_now_ns() - t2;
+		bench_drain(subs[7], SPARSE_NMSG);
+
+		printf("%12d %16.0f %24.0f\n", nsub, (t1 - t0) / SPARSE_NMSG, t2 / SPARSE_NMSG);
+
+		psb_delete_publisher(publisher);
+		psb_delete_broker(broker);
+		free(subs);
+	}
+}
+
+/*********************************** PUBLISHERS ******************************/
+
+#define PUBLISHERS_NMSG		200000
+#define PUBLISHERS_NSUB		4
+#define PUBLISHERS_MAX		16
+
+// publisher thread arguments
+struct bench_publisher
+{
+	psb_broker* broker;
+	volatile long* start;	// publishers wait for nonzero value
+	int count;				// number of messages to publish
+};
+
+// publisher thread: wait for start and publish messages
+static DEFINE_THREAD(bench_publisher_fn, param)
+{
+	struct bench_publisher* pub = (struct bench_publisher*)param;
+	int data = 0;
+	int i;
+
+	while (atomic_load_long(pub->start) == 0)
+	{
+		thread_yield();
+	}
+
+	for (i = 0; i < pub->count; i++)
+	{
+		psb_publish_message(pub->broker, "pub/data", &data, sizeof(data));
+	}
+
+	return 0;
+}
+
+// publish throughput as function of concurrent publisher threads
+static void bench_publishers(void)
+{
+	static const int npub_list[] = {1, 2, 4, 8, 16};
+	struct bench_publisher pubs[PUBLISHERS_MAX];
+	bench_thread_t threads[PUBLISHERS_MAX];
+	psb_subscriber* subs[PUBLISHERS_NSUB];
+	volatile long start;
+	int i, k;
+
+	printf("publishers: %d messages total, %d subscribers\n", PUBLISHERS_NMSG, PUBLISHERS_NSUB);
+	printf("%12s %16s\n", "publishers", "Kmsg/s");
+
+	for (k = 0; k < (int)(sizeof(npub_list) / sizeof(npub_list[0])); k++)
+	{
+		int npub = npub_list[k];
+		psb_broker* broker = psb_new_broker();
+		double t0, t1;
+
+		for (i = 0; i < PUBLISHERS_NSUB; i++)
+		{
+			subs[i] = psb_new_subscriber(broker);
+			psb_subscribe(subs[i], "pub/");
+		}
+		psb_sync_subscriptions(broker);
+
+		start = 0;
+		for (i = 0; i < npub; i++)
+		{
+			pubs[i].broker = broker;
+			pubs[i].start = &start;
+			pubs[i].count = PUBLISHERS_NMSG / npub;
+			bench_thread_start(&threads[i], bench_publisher_fn, &pubs[i]);
+		}
+
+		t0 = bench_now_ns();
+		atomic_store_long(&start, 1);
+		for (i = 0; i < npub; i++)
+		{
+			bench_thread_join(threads[i]);
+		}
+		t1 = bench_now_ns();
+
+		printf("%12d %16.0f\n", npub, (double)(PUBLISHERS_NMSG / npub) * npub * 1e6 / (t1 - t0));
+
+		for (i = 0; i < PUBLISHERS_NSUB; i++)
+		{
+			bench_drain(subs[i], (PUBLISHERS_NMSG / npub) * npub);
+		}
+
+		psb_delete_broker(broker);
+	}
+}
+
+/*********************************** SHARDS **********************************/
+
+#define SHARDS_NMSG		64000
+#define SHARDS_NSUB		1024
+#define SHARDS_MAX		32
+#define SHARDS_CHURN	64
+
+// sharded publisher thread arguments
+struct bench_shards
+{
+	psb_broker* broker;
+	psb_subscriber* subscriber;	// resubscribed every SHARDS_CHURN messages
+	volatile long* start;	// publishers wait for nonzero value
+	int count;				// number of messages to publish
+	char channel[32];		// channel to publish
+};
+
+// publisher thread: publish messages, changing subscriptions of own subscriber meanwhile
+static DEFINE_THREAD(bench_shards_fn, param)
+{
+	struct bench_shards* pub = (struct bench_shards*)param;
+	int data = 0;
+	int i;
+
+	while (atomic_load_long(pub->start) == 0)
+	{
+		thread_yield();
+	}
+
+	for (i = 0; i < pub->count; i++)
+	{
+		psb_publish_message(pub->broker, pub->channel, &data, sizeof(data));
+		if ((i % SHARDS_CHURN) == 0)
+		{
+			psb_subscribe(pub->subscriber, "churn/");
+			psb_unsubscribe(pub->subscriber, "churn/");
+		}
+	}
+
+	return 0;
+}
+
+// publish throughput with subscriptions change as function of publisher threads and shards
+static void bench_shards(void)
+{
+	static const int npub_list[] = {1, 2, 4, 8, 16, 32};
+	static const int nshards_list[] = {1, 8};
+	struct bench_shards pubs[SHARDS_MAX];
+	bench_thread_t threads[SHARDS_MAX];
+	volatile long start;
+	char channel[32];
+	int i, k, n;
+
+	printf("shards: %d messages total, %d subscribers, resubscribe every %d messages\n",
+		SHARDS_NMSG, SHARDS_NSUB, SHARDS_CHURN);
+	printf("%12s %16s %16s\n", "publishers", "Kmsg/s 1 shard", "Kmsg/s 8 shards");
+
+	for (k = 0; k < (int)(sizeof(npub_list) / sizeof(npub_list[0])); k++)
+	{
+		int npub = npub_list[k];
+
+		printf("%12d", npub);
+		for (n = 0; n < (int)(sizeof(nshards_list) / sizeof(nshards_list[0])); n++)
+		{
+			psb_broker* broker = psb_new_broker_ex(nshards_list[n]);
+			double t0, t1;
+
+			for (i = 0; i < SHARDS_NSUB; i++)
+			{
+				sprintf(channel, "shard/%d/", i);
+				psb_subscribe(psb_new_subscriber(broker), channel);
+			}
+			psb_sync_subscriptions(broker);
+
+			start = 0;
+			for (i = 0; i < npub; i++)
+			{
+				pubs[i].broker = broker;
+				pubs[i].subscriber = psb_new_subscriber(broker);
+				pubs[i].start = &start;
+				pubs[i].count = SHARDS_NMSG / npub;
+				sprintf(pubs[i].channel, "shard/%d/data", i);
+				bench_thread_start(&threads[i], bench_shards_fn, &pubs[i]);
+			}
+
+			t0 = bench_now_ns();
+			atomic_store_long(&start, 1);
+			for (i = 0; i < npub; i++)
+			{
+				bench_thread_join(threads[i]);
+			}
+			t1 = bench_now_ns();
+
+			printf(" %16.0f", (double)(SHARDS_NMSG / npub) * npub * 1e6 / (t1 - t0));
+
+			// queued messages are freed with subscribers
+			psb_delete_broker(broker);
+		}
+		printf("\n");
+	}
+}
+
+/*********************************** BATCH ***********************************/
+
+#define BATCH_NMSG		102400
+#define BATCH_NSUB		4
+#define BATCH_MAX		256
+#define BATCH_RUNS		3
+
+// publish BATCH_NMSG messages by batches or one by one, returns best time of BATCH_RUNS runs
+static double bench_batch_run(psb_batch_entry* entries, int batch, int use_batch)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subs[BATCH_NSUB];
+	double best = 0, t;
+	int i, r;
+
+	for (i = 0; i < BATCH_NSUB; i++)
+	{
+		subs[i] = psb_new_subscriber(broker);
+		psb_subscribe(subs[i], "batch/");
+	}
+	psb_sync_subscriptions(broker);
+
+	for (r = 0; r < BATCH_RUNS; r++)
+	{
+		t = bench_now_ns();
+		for (i = 0; i < BATCH_NMSG; i += batch)
+		{
+			if (use_batch)
+			{
+				psb_publish_batch(broker, entries, batch);
+			}
+			else
+			{
+				int k;
+				for (k = 0; k < batch; k++)
+				{
+					psb_publish_message(broker, entries[k].channel, entries[k].data, entries[k].datalen);
+				}
+			}
+		}
+		t = bench_now_ns() - t;
+		best = ((r == 0) || (t < best)) ? t : best;
+
+		for (i = 0; i < BATCH_NSUB; i++)
+		{
+			bench_drain(subs[i], BATCH_NMSG);
+		}
+	}
+
+	psb_delete_broker(broker);
+	return best;
+}
+
+// publish throughput of psb_publish_message() versus psb_publish_batch()
+static void bench_batch(void)
+{
+	static const int batch_list[] = {1, 16, 256};
+	psb_batch_entry entries[BATCH_MAX];
+	int data[BATCH_MAX];
+	int i, k;
+
+	printf("batch: %d messages of %d bytes, %d subscribers, best of %d runs\n", BATCH_NMSG, (int)sizeof(int), BATCH_NSUB, BATCH_RUNS);
+	printf("%12s %16s %16s\n", "batch", "Kmsg/s", "Kmsg/s (single)");
+
+	for (i = 0; i < BATCH_MAX; i++)
+	{
+		data[i] = i;
+		entries[i].channel = "batch/data";
+		entries[i].data = &data[i];
+		entries[i].datalen = sizeof(int);
+	}
+
+	for (k = 0; k < (int)(sizeof(batch_list) / sizeof(batch_list[0])); k++)
+	{
+		double t_single = bench_batch_run(entries, batch_list[k], 0);
+		double t_batch = bench_batch_run(entries, batch_list[k], 1);
+
+		printf("%12d %16.0f %16.0f\n", batch_list[k], BATCH_NMSG * 1e6 / t_batch, BATCH_NMSG * 1e6 / t_single);
+	}
+}
+
+/*********************************** RECEIVE *********************************/
+
+#define RECEIVE_NMSG	100000
+#define RECEIVE_MAX		64
+
+// receive throughput of psb_get_message() versus psb_get_messages()
+static void bench_receive(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber = psb_new_subscriber(broker);
+	psb_message msgs[RECEIVE_MAX];
+	double t0, t1, t2;
+	int data = 0;
+	int i, k, n;
+
+	psb_subscribe(subscriber, "receive/");
+	psb_sync_subscriptions(broker);
+
+	printf("receive: %d messages of %d bytes from one subscriber's queue\n", RECEIVE_NMSG, (int)sizeof(data));
+	printf("%12s %16s\n", "max", "Kmsg/s");
+
+	for (i = 0; i < RECEIVE_NMSG; i++)
+	{
+		psb_publish_message(broker, "receive/data", &data, sizeof(data));
+	}
+	t0 = bench_now_ns();
+	bench_drain(subscriber, RECEIVE_NMSG);
+	t1 = bench_now_ns();
+
+	for (i = 0; i < RECEIVE_NMSG; i++)
+	{
+		psb_publish_message(broker, "receive/data", &data, sizeof(data));
+	}
+	t2 = bench_now_ns();
+	for (i = 0; i < RECEIVE_NMSG; i += n)
+	{
+		n = psb_get_messages(subscriber, msgs, RECEIVE_MAX, 1000);
+		if ((n <= 0) || (n > RECEIVE_MAX))
+		{
+			break;	// timeout
+		}
+		for (k = 0; k < n; k++)
+		{
+			psb_free_message(&msgs[k]);
+		}
+	}
+	t2 = bench_now_ns() - t2;
+
+	printf("%12d %16.0f\n", 1, RECEIVE_NMSG * 1e6 / (t1 - t0));
+	printf("%12d %16.0f\n", RECEIVE_MAX, RECEIVE_NMSG * 1e6 / t2);
+
+	psb_delete_broker(broker);
+}
+
+/*********************************** CONTENTION ******************************/
+
+#define CONTENTION_NMSG		100000
+#define CONTENTION_MAX		8
+
+// contention publisher thread arguments
+struct bench_contention
+{
+	psb_broker* broker;
+	volatile long* start;	// publishers wait for nonzero value
+	int count;				// number of messages to publish
+};
+
+// consumer thread arguments
+struct bench_consumer
+{
+	psb_subscriber* subscriber;
+	double* latency;		// latency of each message, ns
+	int count;				// number of messages to receive
+};
+
+// publisher thread: publish the send time of each message
+static DEFINE_THREAD(bench_contention_fn, param)
+{
+	struct bench_contention* pub = (struct bench_contention*)param;
+	double now;
+	int i;
+
+	while (atomic_load_long(pub->start) == 0)
+	{
+		thread_yield();
+	}
+
+	for (i = 0; i < pub->count; i++)
+	{
+		now = bench_now_ns();
+		psb_publish_message(pub->broker, "contention/data", &now, sizeof(now));
+	}
+
+	return 0;
+}
+
+// consumer thread: receive messages and record their latency
+static DEFINE_THREAD(bench_consumer_fn, param)
+{
+	struct bench_consumer* con = (struct bench_consumer*)param;
+	psb_message msg;
+	int i = 0;
+
+	while (i < con->count)
+	{
+		if (psb_get_message(con->subscriber, &msg, 1000) == 0)
+		{
+			con->latency[i++] = bench_now_ns() - *(double*)msg.data;
+			psb_free_message(&msg);
+		}
+	}
+
+	return 0;
+}
+
+static int bench_compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// throughput and latency of one subscriber fed by concurrent publishers
+static void bench_contention(void)
+{
+	static const int npub_list[] = {1, 2, 4, 8};
+	static const struct { int type; const char* name; } queue_list[] =
+	{
+		{PSB_QUEUE_LOCKED, "locked"},
+		{PSB_QUEUE_MPSC, "mpsc"},
+	};
+	struct bench_contention pubs[CONTENTION_MAX];
+	bench_thread_t threads[CONTENTION_MAX];
+	bench_thread_t consumer;
+	struct bench_consumer con;
+	volatile long start;
+	int i, k, q;
+
+	con.latency = (double*)malloc(CONTENTION_NMSG * sizeof(double));
+
+	printf("contention: %d messages total to one subscriber\n", CONTENTION_NMSG);
+	printf("%8s %12s %16s %12s %12s\n", "queue", "publishers", "Kmsg/s", "p50 us", "p99 us");
+
+	for (q = 0; q < (int)(sizeof(queue_list) / sizeof(queue_list[0])); q++)
+	{
+		for (k = 0; k < (int)(sizeof(npub_list) / sizeof(npub_list[0])); k++)
+		{
+			int npub = npub_list[k];
+			psb_broker* broker = psb_new_broker();
+			double t0, t1;
+
+			con.subscriber = psb_new_subscriber_ex(broker, queue_list[q].type);
+			con.count = (CONTENTION_NMSG / npub) * npub;
+			psb_subscribe(con.subscriber, "contention/");
+			psb_sync_subscriptions(broker);
+			bench_thread_start(&consumer, bench_consumer_fn, &con);
+
+			start = 0;
+			for (i = 0; i < npub; i++)
+			{
+				pubs[i].broker = broker;
+				pubs[i].start = &start;
+				pubs[i].count = CONTENTION_NMSG / npub;
+				bench_thread_start(&threads[i], bench_contention_fn, &pubs[i]);
+			}
+
+			t0 = bench_now_ns();
+			atomic_store_long(&start, 1);
+			for (i = 0; i < npub; i++)
+			{
+				bench_thread_join(threads[i]);
+			}
+			bench_thread_join(consumer);
+			t1 = bench_now_ns();
+
+			qsort(con.latency, con.count, sizeof(double), bench_compare_double);
+			printf("%8s %12d %16.0f %12.1f %12.1f\n", queue_list[q].name, npub,
+					con.count * 1e6 / (t1 - t0),
+					con.latency[con.count / 2] / 1000,
+					con.latency[(int)(con.count * 0.99)] / 1000);
+
+			psb_delete_broker(broker);
+		}
+	}
+
+	free(con.latency);
+}
+
+/*********************************** PINGPONG ********************************/
+
+#define PINGPONG_NROUND		10000
+
+// pong thread arguments
+struct bench_pong
+{
+	psb_subscriber* subscriber;	// receives pings
+	psb_publisher* publisher;	// sends pongs
+	int count;					// number of rounds
+};
+
+// pong thread: answer each ping
+static DEFINE_THREAD(bench_pong_fn, param)
+{
+	struct bench_pong* pong = (struct bench_pong*)param;
+	psb_message msg;
+	int i = 0;
+
+	while (i < pong->count)
+	{
+		if (psb_get_message(pong->subscriber, &msg, 1000) == 0)
+		{
+			psb_free_message(&msg);
+			psb_publish(pong->publisher, &i, sizeof(i));
+			i++;
+		}
+	}
+
+	return 0;
+}
+
+// round trip latency between two threads for each wait strategy
+static void bench_pingpong(void)
+{
+	static const struct { long spin; long yield; const char* name; } wait_list[] =
+	{
+		{0, 0, "park"},
+		{0, 1000, "yield"},
+		{20000, 0, "spin"},
+		{2000, 100, "adaptive"},
+	};
+	static const struct { int type; const char* name; } queue_list[] =
+	{
+		{PSB_QUEUE_LOCKED, "locked"},
+		{PSB_QUEUE_MPSC, "mpsc"},
+	};
+	struct bench_pong pong;
+	bench_thread_t thread;
+	double* rtt;
+	int i, k, q;
+
+	rtt = (double*)malloc(PINGPONG_NROUND * sizeof(double));
+
+	printf("pingpong: %d round trips\n", PINGPONG_NROUND);
+	printf("%8s %10s %12s %12s\n", "queue", "wait", "p50 us", "p99 us");
+
+	for (q = 0; q < (int)(sizeof(queue_list) / sizeof(queue_list[0])); q++)
+	{
+		for (k = 0; k < (int)(sizeof(wait_list) / sizeof(wait_list[0])); k++)
+		{
+			psb_broker* broker = psb_new_broker();
+			psb_subscriber* ping = psb_new_subscriber_ex(broker, queue_list[q].type);
+			psb_publisher* publisher = psb_new_publisher(broker, "ping/data");
+			psb_message msg;
+
+			pong.subscriber = psb_new_subscriber_ex(broker, queue_list[q].type);
+			pong.publisher = psb_new_publisher(broker, "pong/data");
+			pong.count = PINGPONG_NROUND;
+			psb_subscribe(ping, "pong/");
+			psb_subscribe(pong.subscriber, "ping/");
+			psb_sync_subscriptions(broker);
+			psb_set_queue_wait(ping, wait_list[k].spin, wait_list[k].yield);
+			psb_set_queue_wait(pong.subscriber, wait_list[k].spin, wait_list[k].yield);
+			bench_thread_start(&thread, bench_pong_fn, &pong);
+
+			for (i = 0; i < PINGPONG_NROUND; i++)
+			{
+				double t0 = bench_now_ns();
+				psb_publish(publisher, &i, sizeof(i));
+				while (psb_get_message(ping, &msg, 1000) != 0)
+				{
+				}
+				rtt[i] = bench_now_ns() - t0;
+				psb_free_message(&msg);
+			}
+			bench_thread_join(thread);
+
+			qsort(rtt, PINGPONG_NROUND, sizeof(double), bench_compare_double);
+			printf("%8s %10s %12.1f %12.1f\n", queue_list[q].name, wait_list[k].name,
+					rtt[PINGPONG_NROUND / 2] / 1000,
+					rtt[(int)(PINGPONG_NROUND * 0.99)] / 1000);
+
+			psb_delete_publisher(publisher);
+			psb_delete_publisher(pong.publisher);
+			psb_delete_broker(broker);
+		}
+	}
+
+	free(rtt);
+}
+
+/*********************************** GROUP ***********************************/
+
+#define GROUP_NMSG		100000
+#define GROUP_MAX		8
+
+// worker thread arguments
+struct bench_worker
+{
+	psb_subscriber* subscriber;
+	volatile long* received;	// messages received by all workers
+	long count;					// stop when all workers have received 'count' messages
+};
+
+// worker thread: receive messages until all workers have received the count
+static DEFINE_THREAD(bench_worker_fn, param)
+{
+	struct bench_worker* worker = (struct bench_worker*)param;
+	psb_message msg;
+
+	while (atomic_load_long(worker->received) < worker->count)
+	{
+		if (psb_get_message(worker->subscriber, &msg, 10) == 0)
+		{
+			atomic_inc(worker->received);
+			psb_free_message(&msg);
+		}
+	}
+
+	return 0;
+}
+
+// work queue: consumer group members versus own subscriber per worker
+static void bench_group(void)
+{
+	static const int nworker_list[] = {1, 2, 4, 8};
+	struct bench_worker workers[GROUP_MAX];
+	bench_thread_t threads[GROUP_MAX];
+	volatile long received;
+	int i, k, g;
+
+	printf("group: %d messages to workers\n", GROUP_NMSG);
+	printf("%12s %10s %16s %16s\n", "workers", "group", "ns/publish", "Kmsg/s");
+
+	for (k = 0; k < (int)(sizeof(nworker_list) / sizeof(nworker_list[0])); k++)
+	{
+		for (g = 0; g < 2; g++)
+		{
+			int nworker = nworker_list[k];
+			psb_broker* broker = psb_new_broker();
+			psb_publisher* publisher = psb_new_publisher(broker, "group/data");
+			double t0, t1, t2;
+
+			// every worker gets a copy of each message without group
+			received = 0;
+			for (i = 0; i < nworker; i++)
+			{
+				workers[i].subscriber = g ? psb_join_group(broker, "workers") : psb_new_subscriber(broker);
+				workers[i].received = &received;
+				workers[i].count = g ? GROUP_NMSG : (long)GROUP_NMSG * nworker;
+				if (!g || (i == 0))
+				{
+					psb_subscribe(workers[i].subscriber, "group/");
+				}
+			}
+			psb_sync_subscriptions(broker);
+			for (i = 0; i < nworker; i++)
+			{
+				bench_thread_start(&threads[i], bench_worker_fn, &workers[i]);
+			}
+
+			t0 = bench_now_ns();
+			for (i = 0; i < GROUP_NMSG; i++)
+			{
+				psb_publish(publisher, &i, sizeof(i));
+			}
+			t1 = bench_now_ns();
+			for (i = 0; i < nworker; i++)
+			{
+				bench_thread_join(threads[i]);
+			}
+			t2 = bench_now_ns();
+
+			printf("%12d %10s %16.0f %16.0f\n", nworker, g ? "yes" : "no",
+					(t1 - t0) / GROUP_NMSG, GROUP_NMSG * 1e6 / (t2 - t0));
+
+			for (i = 0; i < nworker; i++)
+			{
+				psb_delete_subscriber(workers[i].subscriber);
+			}
+			psb_delete_publisher(publisher);
+			psb_delete_broker(broker);
+		}
+	}
+}
+
+/*********************************** POLL ************************************/
+
+#define POLL_NROUND		5000
+#define POLL_MAX		256
+
+// poller thread arguments
+struct bench_poller
+{
+	psb_subscriber** subscribers;	// polled subscribers, pings come to the last one
+	int nsub;						// number of subscribers
+	psb_publisher* publisher;		// sends pongs
+	int count;						// number of rounds
+};
+
+// poller thread: wait for pings on all subscribers and answer each
+static DEFINE_THREAD(bench_poller_fn, param)
+{
+	struct bench_poller* poller = (struct bench_poller*)param;
+	int ready[POLL_MAX];
+	psb_message msg;
+	int i = 0;
+	int k;
+
+	while (i < poller->count)
+	{
+		if (psb_poll(poller->subscribers, poller->nsub, 1000, ready) <= 0)
+		{
+			continue;
+		}
+		for (k = 0; k < poller->nsub; k++)
+		{
+			while (ready[k] && (psb_try_get_message(poller->subscribers[k], &msg) == 0))
+			{
+				psb_free_message(&msg);
+				psb_publish(poller->publisher, &i, sizeof(i));
+				i++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// round trip latency through psb_poll() as function of polled subscribers count
+static void bench_poll(void)
+{
+	static const int nsub_list[] = {1, 16, 256};
+	psb_subscriber* subs[POLL_MAX];
+	struct bench_poller poller;
+	bench_thread_t thread;
+	double* rtt;
+	char channel[32];
+	int i, k;
+
+	rtt = (double*)malloc(POLL_NROUND * sizeof(double));
+
+	printf("poll: %d round trips\n", POLL_NROUND);
+	printf("%12s %12s %12s\n", "subscribers", "p50 us", "p99 us");
+
+	for (k = 0; k < (int)(sizeof(nsub_list) / sizeof(nsub_list[0])); k++)
+	{
+		int nsub = nsub_list[k];
+		psb_broker* broker = psb_new_broker();
+		psb_subscriber* pong = psb_new_subscriber(broker);
+		psb_publisher* publisher = psb_new_publisher(broker, "poll/ping");
+		psb_message msg;
+
+		for (i = 0; i < nsub; i++)
+		{
+			// the other subscribers are subscribed to the channels nobody publishes
+			sprintf(channel, "poll/%d", i);
+			subs[i] = psb_new_subscriber(broker);
+			psb_subscribe(subs[i], (i == nsub - 1) ? "poll/ping" : channel);
+		}
+		psb_subscribe(pong, "poll/pong");
+		psb_sync_subscriptions(broker);
+
+		poller.subscribers = subs;
+		poller.nsub = nsub;
+		poller.publisher = psb_new_publisher(broker, "poll/pong");
+		poller.count = POLL_NROUND;
+		bench_thread_start(&thread, bench_poller_fn, &poller);
+
+		for (i = 0; i < POLL_NROUND; i++)
+		{
+			double t0 = bench_now_ns();
+			psb_publish(publisher, &i, sizeof(i));
+			while (psb_get_message(pong, &msg, 1000) != 0)
+			{
+			}
+			rtt[i] = bench_now_ns() - t0;
+			psb_free_message(&msg);
+		}
+		bench_thread_join(thread);
+
+		qsort(rtt, POLL_NROUND, sizeof(double), bench_compare_double);
+		printf("%12d %12.1f %12.1f\n", nsub, rtt[POLL_NROUND / 2] / 1000,
+				rtt[(int)(POLL_NROUND * 0.99)] / 1000);
+
+		psb_delete_publisher(publisher);
+		psb_delete_publisher(poller.publisher);
+		psb_delete_broker(broker);
+	}
+
+	free(rtt);
+}
+
+/*********************************** PRIO ************************************/
+
+#define PRIO_ROUNDS		20
+
+// control message latency under backlog of bulk messages, with and without priority
+static void bench_prio(void)
+{
+	static const int backlog_list[] = {100, 1000, 10000};
+	static const int prio_list[] = {0, PSB_PRIORITIES - 1};
+	double* latency;
+	int i, k, p, r;
+
+	latency = (double*)malloc(PRIO_ROUNDS * sizeof(double));
+
+	printf("prio: control message latency, median of %d rounds\n", PRIO_ROUNDS);
+	printf("%12s %8s %12s %16s\n", "backlog", "prio", "us", "bulk before");
+
+	for (k = 0; k < (int)(sizeof(backlog_list) / sizeof(backlog_list[0])); k++)
+	{
+		for (p = 0; p < (int)(sizeof(prio_list) / sizeof(prio_list[0])); p++)
+		{
+			psb_broker* broker = psb_new_broker();
+			psb_subscriber* subscriber = psb_new_subscriber(broker);
+			psb_message msg;
+			int before = 0;
+
+			psb_subscribe(subscriber, "prio/");
+			psb_sync_subscriptions(broker);
+
+			for (r = 0; r < PRIO_ROUNDS; r++)
+			{
+				double t0;
+
+				for (i = 0; i < backlog_list[k]; i++)
+				{
+					psb_publish_message(broker, "prio/bulk", &i, sizeof(i));
+				}
+
+				// the subscriber drains its queue until the control message
+				t0 = bench_now_ns();
+				psb_publish_message_prio(broker, "prio/control", &r, sizeof(r), prio_list[p]);
+				before = 0;
+				while (psb_get_message(subscriber, &msg, 1000) == 0)
+				{
+					int control = (msg.prio == prio_list[p]) && (strcmp(msg.channel, "prio/control") == 0);
+					psb_free_message(&msg);
+					if (control)
+					{
+						break;
+					}
+					before++;
+				}
+				latency[r] = bench_now_ns() - t0;
+				bench_drain(subscriber, backlog_list[k] - before);
+			}
+
+			qsort(latency, PRIO_ROUNDS, sizeof(double), bench_compare_double);
+			printf("%12d %8d %12.1f %16d\n", backlog_list[k], prio_list[p], latency[PRIO_ROUNDS / 2] / 1000, before);
+
+			psb_delete_broker(broker);
+		}
+	}
+
+	free(latency);
+}
+
+/*********************************** SPSC ************************************/
+
+#define SPSC_NMSG		100000
+
+// single publisher thread arguments
+struct bench_spsc
+{
+	psb_broker* broker;
+	int size;				// data object size, starts with the send time
+	int count;				// number of messages to publish
+};
+
+// publisher thread: publish the send time of each message padded to the size
+static DEFINE_THREAD(bench_spsc_fn, param)
+{
+	struct bench_spsc* pub = (struct bench_spsc*)param;
+	double data[64];
+	int i;
+
+	memset(data, 0, sizeof(data));
+	for (i = 0; i < pub->count; i++)
+	{
+		data[0] = bench_now_ns();
+		psb_publish_message(pub->broker, "spsc/data", data, pub->size);
+	}
+
+	return 0;
+}
+
+// one publisher to one subscriber: queue types, small messages fit the SPSC slot
+static void bench_spsc(void)
+{
+	static const int size_list[] = {16, 256};
+	static const struct { int type; const char* name; } queue_list[] =
+	{
+		{PSB_QUEUE_LOCKED, "locked"},
+		{PSB_QUEUE_MPSC, "mpsc"},
+		{PSB_QUEUE_SPSC, "spsc"},
+	};
+	struct bench_spsc pub;
+	bench_thread_t publisher;
+	bench_thread_t consumer;
+	struct bench_consumer con;
+	int k, q;
+
+	con.latency = (double*)malloc(SPSC_NMSG * sizeof(double));
+
+	printf("spsc: %d messages from one publisher to one subscriber (%d slots of %d bytes)\n",
+		SPSC_NMSG, PSB_SPSC_SLOTS, PSB_SPSC_INLINE);
+	printf("%8s %8s %16s %12s %12s\n", "queue", "bytes", "Kmsg/s", "p50 us", "p99 us");
+
+	for (k = 0; k < (int)(sizeof(size_list) / sizeof(size_list[0])); k++)
+	{
+		for (q = 0; q < (int)(sizeof(queue_list) / sizeof(queue_list[0])); q++)
+		{
+			psb_broker* broker = psb_new_broker();
+			double t0, t1;
+
+			con.subscriber = psb_new_subscriber_ex(broker, queue_list[q].type);
+			con.count = SPSC_NMSG;
+			psb_subscribe(con.subscriber, "spsc/");
+			psb_sync_subscriptions(broker);
+
+			pub.broker = broker;
+			pub.size = size_list[k];
+			pub.count = SPSC_NMSG;
+
+			t0 = bench_now_ns();
+			bench_thread_start(&consumer, bench_consumer_fn, &con);
+			bench_thread_start(&publisher, bench_spsc_fn, &pub);
+			bench_thread_join(publisher);
+			bench_thread_join(consumer);
+			t1 = bench_now_ns();
+
+			qsort(con.latency, con.count, sizeof(double), bench_compare_double);
+			printf("%8s %8d %16.0f %12.1f %12.1f\n", queue_list[q].name, size_list[k],
+					con.count * 1e6 / (t1 - t0),
+					con.latency[con.count / 2] / 1000,
+					con.latency[(int)(con.count * 0.99)] / 1000);
+
+			psb_delete_broker(broker);
+		}
+	}
+
+	free(con.latency);
+}
+
+/*********************************** TRIE ************************************/
+
+#define TRIE_REGIONS	8
+#define TRIE_SITES		16
+#define TRIE_DEVICES	32
+#define TRIE_METRICS	8
+#define TRIE_TOPICS		(TRIE_REGIONS * TRIE_SITES * TRIE_DEVICES * TRIE_METRICS)
+#define TRIE_ROUNDS		10
+#define TRIE_NAME_MAX	64
+
+// match_all callback: count matched subscriptions
+static void bench_trie_count(void* value, void* arg)
+{
+	(void)value;
+	(*(long*)arg)++;
+}
+
+// hierarchical topic of index: fleet/regionR/siteS/deviceD/metricM
+static int bench_trie_topic(char* name, int index)
+{
+	return sprintf(name, "fleet/region%d/site%02d/device%03d/metric%d",
+		index / (TRIE_SITES * TRIE_DEVICES * TRIE_METRICS),
+		(index / (TRIE_DEVICES * TRIE_METRICS)) % TRIE_SITES,
+		(index / TRIE_METRICS) % TRIE_DEVICES,
+		index % TRIE_METRICS);
+}
+
+// times both kinds of lookups of all the topics in random order
+static void bench_trie_lookup(struct ptrie* trie, char (*names)[TRIE_NAME_MAX], int* lens, int* order,
+	int nsubs, const char* label)
+{
+	long matched = 0;
+	long found = 0;
+	size_t used, allocated;
+	double t0, t1, t2;
+	int i, r;
+
+	t0 = bench_now_ns();
+	for (r = 0; r < TRIE_ROUNDS; r++)
+	{
+		for (i = 0; i < TRIE_TOPICS; i++)
+		{
+			ptrie_match_all(trie, (const uint8_t*)names[order[i]], lens[order[i]], bench_trie_count, &matched);
+		}
+	}
+	t1 = bench_now_ns();
+	for (r = 0; r < TRIE_ROUNDS; r++)
+	{
+		for (i = 0; i < TRIE_TOPICS; i++)
+		{
+			found += (ptrie_value(trie, (const uint8_t*)names[order[i]], lens[order[i]]) != NULL);
+		}
+	}
+	t2 = bench_now_ns();
+
+	ptrie_memory(trie, &used, &allocated);
+	printf("%12s %12.1f %12.2f\n", "match_all", (t1 - t0) / (TRIE_ROUNDS * TRIE_TOPICS),
+		(double)matched / (TRIE_ROUNDS * TRIE_TOPICS));
+	printf("%12s %12.1f %12.2f\n", "value", (t2 - t1) / (TRIE_ROUNDS * TRIE_TOPICS),
+		(double)found / (TRIE_ROUNDS * TRIE_TOPICS));
+	printf("%12s %12lu bytes of nodes (%.1f per subscription), %lu allocated\n", label,
+		(unsigned long)used, (double)used / nsubs, (unsigned long)allocated);
+}
+
+// channel index lookups over telemetry-like topic tree with subscriptions on every level
+static void bench_trie(void)
+{
+	struct ptrie trie;
+	struct ptrie_frozen* frozen;
+	char (*names)[TRIE_NAME_MAX];
+	int* lens;
+	int* order;
+	long matched = 0;
+	unsigned int seed = 1;
+	double t0, t1;
+	int i, k, r, nsubs = 0;
+
+	names = (char(*)[TRIE_NAME_MAX])malloc(TRIE_TOPICS * TRIE_NAME_MAX);
+	lens = (int*)malloc(TRIE_TOPICS * sizeof(int));
+	order = (int*)malloc(TRIE_TOPICS * sizeof(int));
+
+	ptrie_init(&trie);
+	for (i = 0; i < TRIE_TOPICS; i++)
+	{
+		const char* end;
+
+		lens[i] = bench_trie_topic(names[i], i);
+		order[i] = i;
+
+		// subscribers of regions, sites and devices (added with the device's first topic)
+		for (k = 0, end = names[i]; (i % TRIE_METRICS == 0) && (k < 4); k++)
+		{
+			end = strchr(end, '/') + 1;
+			if ((k > 0) && (ptrie_add_str(&trie, (const uint8_t*)names[i], end - names[i]) == 1))
+			{
+				nsubs++;
+			}
+		}
+
+		// subscribers of single metrics
+		if ((i % 3) == 0)
+		{
+			ptrie_add_str(&trie, (const uint8_t*)names[i], lens[i]);
+			nsubs++;
+		}
+	}
+
+	// random publishing order
+	for (i = TRIE_TOPICS - 1; i > 0; i--)
+	{
+		seed = seed * 1103515245 + 12345;
+		k = (int)((seed >> 8) % (unsigned int)(i + 1));
+		r = order[i];
+		order[i] = order[k];
+		order[k] = r;
+	}
+
+#ifdef PTRIE_SSE2
+	printf("trie: %d topics, %d subscriptions, sse2\n", TRIE_TOPICS, nsubs);
+#else
+	printf("trie: %d topics, %d subscriptions, scalar\n", TRIE_TOPICS, nsubs);
+#endif
+	printf("%12s %12s %12s\n", "lookup", "ns/topic", "matched");
+	bench_trie_lookup(&trie, names, lens, order, nsubs, "built");
+	ptrie_compact(&trie);
+	bench_trie_lookup(&trie, names, lens, order, nsubs, "compacted");
+
+	// the same matching against the frozen form
+	frozen = ptrie_freeze(&trie);
+	t0 = bench_now_ns();
+	for (r = 0; r < TRIE_ROUNDS; r++)
+	{
+		for (i = 0; i < TRIE_TOPICS; i++)
+		{
+			ptrie_frozen_match(frozen, (const uint8_t*)names[order[i]], lens[order[i]], bench_trie_count, &matched);
+		}
+	}
+	t1 = bench_now_ns();
+	printf("%12s %12.1f %12.2f\n", "frozen", (t1 - t0) / (TRIE_ROUNDS * TRIE_TOPICS),
+		(double)matched / (TRIE_ROUNDS * TRIE_TOPICS));
+	ptrie_frozen_free(frozen);
+
+	ptrie_term(&trie);
+	free(order);
+	free(lens);
+	free(names);
+}
+
+/*********************************** WILDCARD ********************************/
+
+#define WILDCARD_NMSG		200000
+#define WILDCARD_ROOMS		10
+#define WILDCARD_METRICS	10
+
+// receive all queued messages, count the ones of 'metric' channels (the last level)
+static long bench_wildcard_drain(psb_subscriber* subscriber, const char* metric, long* received)
+{
+	psb_message msg;
+	const char* level;
+	long wanted = 0;
+
+	while (psb_try_get_message(subscriber, &msg) == 0)
+	{
+		level = strrchr(msg.channel, '/');
+		wanted += (strcmp(level + 1, metric) == 0);
+		(*received)++;
+		psb_free_message(&msg);
+	}
+
+	return wanted;
+}
+
+// one metric of all rooms: prefix subscription filtered by consumer vs pattern filtered by broker
+static void bench_wildcard(void)
+{
+	static const char* modes[] = {"prefix", "pattern"};
+	char channels[WILDCARD_ROOMS * WILDCARD_METRICS][48];
+	int data[8] = {0};
+	int i, k;
+
+	for (i = 0; i < WILDCARD_ROOMS * WILDCARD_METRICS; i++)
+	{
+		sprintf(channels[i], "sensors/room%d/metric%d", i / WILDCARD_METRICS, i % WILDCARD_METRICS);
+	}
+
+	printf("wildcard: %d messages over %d rooms x %d metrics, subscriber wants metric0 of all rooms\n",
+		WILDCARD_NMSG, WILDCARD_ROOMS, WILDCARD_METRICS);
+	printf("%12s %12s %12s %16s\n", "subscription", "received", "wanted", "ns/wanted msg");
+
+	for (k = 0; k < 2; k++)
+	{
+		psb_broker* broker = psb_new_broker();
+		psb_subscriber* subscriber = psb_new_subscriber(broker);
+		long received = 0;
+		long wanted = 0;
+		double t0, t1;
+
+		if (k == 0)
+		{
+			psb_subscribe(subscriber, "sensors/");
+		}
+		else
+		{
+			psb_subscribe_pattern(subscriber, "sensors/+/metric0");
+		}
+		psb_sync_subscriptions(broker);
+
+		t0 = bench_now_ns();
+		for (i = 0; i < WILDCARD_NMSG; i++)
+		{
+			psb_publish_message(broker, channels[i % (WILDCARD_ROOMS * WILDCARD_METRICS)], data, sizeof(data));
+			if ((i % 1000) == 999)
+			{
+				wanted += bench_wildcard_drain(subscriber, "metric0", &received);
+			}
+		}
+		wanted += bench_wildcard_drain(subscriber, "metric0", &received);
+		t1 = bench_now_ns();
+
+		printf("%12s %12ld %12ld %16.0f\n", modes[k], received, wanted, (t1 - t0) / wanted);
+
+		psb_delete_broker(broker);
+	}
+}
+
+/*********************************** EXACT ***********************************/
+
+#define EXACT_NMSG			204800	// multiple of EXACT_NCHANNEL, all messages are drained
+#define EXACT_NSUB			64
+#define EXACT_NCHANNEL		4096
+
+// routing of channels more than match cache holds: prefix subscriptions vs exact ones
+static void bench_exact(void)
+{
+	static const char* modes[] = {"prefix", "exact"};
+	static char channels[EXACT_NCHANNEL][32];
+	psb_subscriber* subs[EXACT_NSUB];
+	int data[8] = {0};
+	int i, j, k;
+
+	for (i = 0; i < EXACT_NCHANNEL; i++)
+	{
+		sprintf(channels[i], "exact/%d/value", i);
+	}
+
+	printf("exact: %d messages over %d channels, %d subscribers of %d channels each\n",
+		EXACT_NMSG, EXACT_NCHANNEL, EXACT_NSUB, EXACT_NCHANNEL / EXACT_NSUB);
+	printf("%12s %12s\n", "subscription", "ns/publish");
+
+	for (k = 0; k < 2; k++)
+	{
+		psb_broker* broker = psb_new_broker();
+		double t0, t1;
+
+		for (i = 0; i < EXACT_NSUB; i++)
+		{
+			subs[i] = psb_new_subscriber(broker);
+		}
+		for (i = 0; i < EXACT_NCHANNEL; i++)
+		{
+			if (k == 0)
+			{
+				psb_subscribe(subs[i % EXACT_NSUB], channels[i]);
+			}
+			else
+			{
+				psb_subscribe_exact(subs[i % EXACT_NSUB], channels[i]);
+			}
+		}
+		psb_sync_subscriptions(broker);
+
+		t0 = bench_now_ns();
+		for (i = 0; i < EXACT_NMSG; i++)
+		{
+			psb_publish_message(broker, channels[i % EXACT_NCHANNEL], data, sizeof(data));
+			if ((i % EXACT_NCHANNEL) == EXACT_NCHANNEL - 1)
+			{
+				for (j = 0; j < EXACT_NSUB; j++)
+				{
+					bench_drain(subs[j], EXACT_NCHANNEL / EXACT_NSUB);
+				}
+			}
+		}
+		t1 = bench_now_ns();
+
+		printf("%12s %12.0f\n", modes[k], (t1 - t0) / EXACT_NMSG);
+
+		psb_delete_broker(broker);
+	}
+}
+
+/*********************************** NOCOPY **********************************/
+
+#define NOCOPY_NMSG		1000
+#define NOCOPY_NSUB		4
+
+// psb_publish_message_nocopy() release callback: count released buffers
+static void bench_nocopy_release(void* data, void* arg)
+{
+	(void)data;
+	(*(long*)arg)++;
+}
+
+// publish cost of copying versus zero-copy publish as function of data size
+static void bench_nocopy(void)
+{
+	static const int size_list[] = {1024, 16384, 262144};
+	psb_subscriber* subs[NOCOPY_NSUB];
+	long released;
+	char* data;
+	int i, k;
+
+	printf("nocopy: %d messages, %d subscribers\n", NOCOPY_NMSG, NOCOPY_NSUB);
+	printf("%12s %16s %20s\n", "bytes", "ns/publish", "ns/publish (nocopy)");
+
+	for (k = 0; k < (int)(sizeof(size_list) / sizeof(size_list[0])); k++)
+	{
+		psb_broker* broker = psb_new_broker();
+		double t0, t1, t2;
+
+		data = (char*)malloc(size_list[k]);
+		memset(data, 'x', size_list[k]);
+		for (i = 0; i < NOCOPY_NSUB; i++)
+		{
+			subs[i] = psb_new_subscriber(broker);
+			psb_subscribe(subs[i], "nocopy/");
+		}
+		psb_sync_subscriptions(broker);
+
+		t0 = bench_now_ns();
+		for (i = 0; i < NOCOPY_NMSG; i++)
+		{
+			psb_publish_message(broker, "nocopy/data", data, size_list[k]);
+		}
+		t1 = bench_now_ns();
+		for (i = 0; i < NOCOPY_NSUB; i++)
+		{
+			bench_drain(subs[i], NOCOPY_NMSG);
+		}
+
+		// the same buffer is published every time, it is never changed
+		released = 0;
+		t2 = bench_now_ns();
+		for (i = 0; i < NOCOPY_NMSG; i++)
+		{
+			psb_publish_message_nocopy(broker, "nocopy/data", data, size_list[k], bench_nocopy_release, &released);
+		}
+		t2 = bench_now_ns() - t2;
+		for (i = 0; i < NOCOPY_NSUB; i++)
+		{
+			bench_drain(subs[i], NOCOPY_NMSG);
+		}
+
+		printf("%12d %16.0f %20.0f\n", size_list[k], (t1 - t0) / NOCOPY_NMSG, t2 / NOCOPY_NMSG);
+		if (released != NOCOPY_NMSG)
+		{
+			printf("nocopy: %ld of %d buffers released\n", released, NOCOPY_NMSG);
+		}
+
+		psb_delete_broker(broker);
+		free(data);
+	}
+}
+
+/*********************************** CHANNEL *********************************/
+
+#define CHANNEL_NMSG	10000
+
+// publish by channel name versus publish by interned channel handle
+static void bench_channel(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* sub = psb_new_subscriber(broker);
+	psb_channel* channel = psb_channel_get(broker, "channel/data/item");
+	char data[64];
+	double t0, t1, t2;
+	int i;
+
+	memset(data, 'x', sizeof(data));
+	psb_subscribe(sub, "channel/");
+	psb_sync_subscriptions(broker);
+
+	t0 = bench_now_ns();
+	for (i = 0; i < CHANNEL_NMSG; i++)
+	{
+		psb_publish_message(broker, "channel/data/item", data, sizeof(data));
+	}
+	t1 = bench_now_ns();
+	bench_drain(sub, CHANNEL_NMSG);
+
+	t2 = bench_now_ns();
+	for (i = 0; i < CHANNEL_NMSG; i++)
+	{
+		psb_publish_channel(channel, data, sizeof(data));
+	}
+	t2 = bench_now_ns() - t2;
+	bench_drain(sub, CHANNEL_NMSG);
+
+	printf("channel: %d messages, ns/publish by name %.0f, by handle %.0f\n",
+		CHANNEL_NMSG, (t1 - t0) / CHANNEL_NMSG, t2 / CHANNEL_NMSG);
+
+	psb_delete_broker(broker);
+}
+
+/*********************************** CACHE ***********************************/
+
+#define CACHE_NMSG		100000
+#define CACHE_NSUB		1000
+#define CACHE_NCHANNEL	64
+
+// publish by channel name with topic reuse: the match cache resolves the repeated channels
+static void bench_cache(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subs[CACHE_NSUB];
+	psb_cache_stats stats;
+	char channel[32];
+	int data = 0;
+	double t;
+	int i;
+
+	for (i = 0; i < CACHE_NSUB; i++)
+	{
+		subs[i] = psb_new_subscriber(broker);
+		sprintf(channel, "cache/%d/", i);
+		psb_subscribe(subs[i], channel);
+	}
+	psb_sync_subscriptions(broker);
+
+	t = bench_now_ns();
+	for (i = 0; i < CACHE_NMSG; i++)
+	{
+		sprintf(channel, "cache/%d/data", i % CACHE_NCHANNEL);
+		psb_publish_message(broker, channel, &data, sizeof(data));
+	}
+	t = bench_now_ns() - t;
+	psb_get_cache_stats(broker, &stats);
+
+	printf("cache: %d messages to %d channels, %d subscribers, %.0f ns/publish, hits %ld, misses %ld\n",
+		CACHE_NMSG, CACHE_NCHANNEL, CACHE_NSUB, t / CACHE_NMSG, stats.hits, stats.misses);
+
+	for (i = 0; i < CACHE_NCHANNEL; i++)
+	{
+		bench_drain(subs[i], CACHE_NMSG / CACHE_NCHANNEL);
+	}
+	psb_delete_broker(broker);
+}
+
+/*********************************** POOL ************************************/
+
+#define POOL_NMSG		1000
+#define POOL_ROUNDS		100
+#define POOL_NCLASS		16
+
+// total number of blocks allocated from system by the message pool
+static long bench_pool_blocks(void)
+{
+	psb_pool_stats stats[POOL_NCLASS];
+	long blocks = 0;
+	int i, n;
+
+	n = psb_get_pool_stats(stats, POOL_NCLASS);
+	for (i = 0; i < n; i++)
+	{
+		blocks += stats[i].blocks;
+	}
+
+	return blocks;
+}
+
+// steady-state publish/consume: the pool must not grow after the first round
+static void bench_pool(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* sub = psb_new_subscriber(broker);
+	psb_pool_stats stats[POOL_NCLASS];
+	char data[100];
+	long warm, blocks;
+	double t;
+	int i, k, n;
+
+	memset(data, 'x', sizeof(data));
+	psb_subscribe(sub, "pool/");
+	psb_sync_subscriptions(broker);
+
+	// warm up
+	for (i = 0; i < POOL_NMSG; i++)
+	{
+		psb_publish_message(broker, "pool/data", data, sizeof(data));
+	}
+	bench_drain(sub, POOL_NMSG);
+	warm = bench_pool_blocks();
+
+	t = bench_now_ns();
+	for (k = 0; k < POOL_ROUNDS; k++)
+	{
+		for (i = 0; i < POOL_NMSG; i++)
+		{
+			psb_publish_message(broker, "pool/data", data, sizeof(data));
+		}
+		bench_drain(sub, POOL_NMSG);
+	}
+	t = bench_now_ns() - t;
+	blocks = bench_pool_blocks();
+
+	printf("pool: %d x %d messages of %d bytes, %.0f ns/message, %ld blocks allocated in steady state\n",
+		POOL_ROUNDS, POOL_NMSG, (int)sizeof(data), t / (POOL_ROUNDS * POOL_NMSG), blocks - warm);
+	printf("%12s %12s %12s %12s\n", "size", "blocks", "free", "held");
+	n = psb_get_pool_stats(stats, POOL_NCLASS);
+	for (i = 0; i < n; i++)
+	{
+		if (stats[i].blocks != 0)
+		{
+			printf("%12ld %12ld %12ld %12ld\n", stats[i].size, stats[i].blocks, stats[i].free, stats[i].held);
+		}
+	}
+
+	psb_delete_broker(broker);
+}
+
+/*********************************** MAIN ************************************/
+
+struct bench_entry
+{
+	const char* name;
+	void (*fn)(void);
+};
+
+static const struct bench_entry g_bench_list[] =
+{
+	{"fanout", bench_fanout},
+	{"sparse", bench_sparse},
+	{"publishers", bench_publishers},
+	{"shards", bench_shards},
+	{"batch", bench_batch},
+	{"receive", bench_receive},
+	{"contention", bench_contention},
+	{"pingpong", bench_pingpong},
+	{"group", bench_group},
+	{"poll", bench_poll},
+	{"prio", bench_prio},
+	{"spsc", bench_spsc},
+	{"trie", bench_trie},
+	{"wildcard", bench_wildcard},
+	{"exact", bench_exact},
+	{"nocopy", bench_nocopy},
+	{"pool", bench_pool},
+	{"channel", bench_channel},
+	{"cache", bench_cache},
+};
+
+#define BENCH_COUNT (int)(sizeof(g_bench_list) / sizeof(g_bench_list[0]))
+
+/**
+ * Run benchmarks
+ *
+ * psb_bench() runs the benchmark(s) named in argv (all benchmarks if argc is 0)
+ * and prints results to stdout.
+ *
+ * @param argc number of benchmark names
+ * @param argv benchmark names
+ * @return 0 if success or negative value in case of unknown benchmark name
+ */
+int psb_bench(int argc, char** argv)
+{
+	int i, k;
+
+	if (argc == 0)
+	{
+		for (k = 0; k < BENCH_COUNT; k++)
+		{
+			g_bench_list[k].fn();
+		}
+		return 0;
+	}
+
+	for (i = 0; i < argc; i++)
+	{
+		for (k = 0; k < BENCH_COUNT; k++)
+		{
+			if (strcmp(argv[i], g_bench_list[k].name) == 0)
+			{
+				g_bench_list[k].fn();
+				break;
+			}
+		}
+
+		if (k == BENCH_COUNT)
+		{
+			printf("unknown benchmark: %s\n", argv[i]);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * PubSub broker benchmarks
+ * bench.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: alexo
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Run benchmarks
+ *
+ * psb_bench() runs the benchmark(s) named in argv (all benchmarks if argc is 0)
+ * and prints results to stdout.
+ *
+ * @param argc number of benchmark names
+ * @param argv benchmark names
+ * @return 0 if success or negative value in case of unknown benchmark name
+ */
+int psb_bench(int argc, char** argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_H_ */
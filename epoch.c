@@ -0,0 +1,217 @@
+/*
+ * Epoch based read-copy-update synchronization
+ * epoch.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: alexo
+ */
+
+#include <string.h>
+#include "epoch.h"
+
+// reader counter slot of calling thread (-1 until the first use)
+static THREAD_LOCAL int g_epoch_slot = -1;
+
+// next slot assigned to a thread
+static volatile long g_epoch_next_slot = 0;
+
+// get reader counter slot of calling thread
+static int epoch_slot(void)
+{
+	if (g_epoch_slot < 0)
+	{
+		g_epoch_slot = (int)((unsigned long)atomic_inc(&g_epoch_next_slot) % EPOCH_SLOTS);
+	}
+
+	return g_epoch_slot;
+}
+
+// number of reader counter slots assigned to threads
+static int epoch_slots_used(void)
+{
+	long used = atomic_load_long(&g_epoch_next_slot) + 1;
+
+	return (used < EPOCH_SLOTS) ? (int)used : EPOCH_SLOTS;
+}
+
+// free list of retired objects
+static void epoch_free(struct epoch_node* node)
+{
+	struct epoch_node* next;
+
+	for (; node != NULL; node = next)
+	{
+		next = node->next;
+		node->free(node);
+	}
+}
+
+// check that no reader is in read section of 'phase'
+static int epoch_idle(struct epoch* epoch, int phase)
+{
+	int used = epoch_slots_used();
+	int i;
+
+	for (i = 0; i < used; i++)
+	{
+		if (atomic_load_long(&epoch->slots[i].readers[phase]) != 0)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// wait for readers of 'phase'
+static void epoch_wait(struct epoch* epoch, int phase)
+{
+	int used = epoch_slots_used();
+	int i;
+
+	for (i = 0; i < used; i++)
+	{
+		while (atomic_load_long(&epoch->slots[i].readers[phase]) != 0)
+		{
+			thread_yield();
+		}
+	}
+}
+
+// start new phase (under mutex, no reader of the other phase), objects retired in current phase
+// wait for its readers. Returns objects waiting since the previous flip, no reader references them.
+static struct epoch_node* epoch_flip(struct epoch* epoch)
+{
+	struct epoch_node* reclaimed = epoch->waiting;
+
+	epoch->waiting = (struct epoch_node*)atomic_xchg_ptr(&epoch->retired, NULL);
+	atomic_store_long(&epoch->nretired, 0);
+
+	// new readers enter the other phase and see the new data
+	atomic_store_long(&epoch->phase, !atomic_load_long(&epoch->phase));
+
+	return reclaimed;
+}
+
+// pass list of objects not referenced by readers to epoch_reclaim()
+static void epoch_release(struct epoch* epoch, struct epoch_node* list)
+{
+	struct epoch_node* tail;
+	struct epoch_node* head;
+
+	if (list == NULL)
+	{
+		return;
+	}
+
+	for (tail = list; tail->next != NULL; tail = tail->next)
+	{
+	}
+
+	do
+	{
+		head = (struct epoch_node*)atomic_load_ptr(&epoch->reclaimed);
+		tail->next = head;
+	} while (!atomic_cas_ptr(&epoch->reclaimed, head, list));
+}
+
+void epoch_init(struct epoch* epoch)
+{
+	memset(epoch, 0, sizeof(struct epoch));
+	mutex_init(&epoch->mutex);
+}
+
+void epoch_term(struct epoch* epoch)
+{
+	epoch_free(epoch->reclaimed);
+	epoch_free(epoch->waiting);
+	epoch_free(epoch->retired);
+	epoch->reclaimed = NULL;
+	epoch->waiting = NULL;
+	epoch->retired = NULL;
+	mutex_destroy(&epoch->mutex);
+}
+
+int epoch_enter(struct epoch* epoch)
+{
+	int slot = epoch_slot();
+	int phase;
+
+	while (1)
+	{
+		// announce reader in current phase and check that phase was not flipped meanwhile,
+		// otherwise writer may not see the reader
+		phase = (int)atomic_load_long(&epoch->phase);
+		atomic_inc(&epoch->slots[slot].readers[phase]);
+		if (atomic_load_long(&epoch->phase) == phase)
+		{
+			break;
+		}
+		atomic_dec(&epoch->slots[slot].readers[phase]);
+	}
+
+	return slot * 2 + phase;
+}
+
+void epoch_leave(struct epoch* epoch, int token)
+{
+	atomic_dec(&epoch->slots[token / 2].readers[token % 2]);
+}
+
+void epoch_synchronize(struct epoch* epoch)
+{
+	struct epoch_node* reclaimed;
+
+	mutex_lock(&epoch->mutex);
+
+	// epoch_reclaim() flips phase without waiting, readers of the other phase may be left
+	epoch_wait(epoch, !(int)atomic_load_long(&epoch->phase));
+
+	// wait for readers of the old phase, then nothing retired before the flip is referenced
+	reclaimed = epoch_flip(epoch);
+	epoch_wait(epoch, !(int)atomic_load_long(&epoch->phase));
+	epoch_release(epoch, epoch->waiting);
+	epoch->waiting = NULL;
+
+	mutex_unlock(&epoch->mutex);
+
+	// the objects are freed by readers, the writer may be delayed by them already
+	epoch_release(epoch, reclaimed);
+}
+
+void epoch_retire(struct epoch* epoch, struct epoch_node* node)
+{
+	struct epoch_node* head;
+
+	do
+	{
+		head = (struct epoch_node*)atomic_load_ptr(&epoch->retired);
+		node->next = head;
+	} while (!atomic_cas_ptr(&epoch->retired, head, node));
+	atomic_inc(&epoch->nretired);
+}
+
+void epoch_reclaim(struct epoch* epoch)
+{
+	struct epoch_node* reclaimed = NULL;
+
+	// objects released by epoch_synchronize()
+	if (atomic_load_ptr(&epoch->reclaimed) != NULL)
+	{
+		epoch_free((struct epoch_node*)atomic_xchg_ptr(&epoch->reclaimed, NULL));
+	}
+
+	// start new phase if epoch_synchronize() did not do it for a while and readers of the other one
+	// have left (checked before the lock too, the readers do not contend for it), nobody waits meanwhile
+	if ((atomic_load_long(&epoch->nretired) >= EPOCH_RECLAIM_BATCH) &&
+		epoch_idle(epoch, !(int)atomic_load_long(&epoch->phase)) && mutex_trylock(&epoch->mutex))
+	{
+		if (epoch_idle(epoch, !(int)atomic_load_long(&epoch->phase)))
+		{
+			reclaimed = epoch_flip(epoch);
+		}
+		mutex_unlock(&epoch->mutex);
+	}
+
+	epoch_free(reclaimed);
+}
@@ -0,0 +1,177 @@
+/*
+ * Epoch based read-copy-update synchronization
+ * epoch.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: alexo
+ */
+
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * @defgroup Epoch Epoch
+ *
+ * Little API for read-mostly shared data. Readers access the data without locks
+ * inside epoch_enter()/epoch_leave() section. Writer replaces the shared pointer
+ * with a new copy of data, calls epoch_synchronize() and then may free the old copy,
+ * because no reader can reference it anymore. Writer that must not wait (e.g. a reader
+ * replacing data in read section) passes the old copy to epoch_retire() instead,
+ * and epoch_reclaim() frees it later.
+ *
+ */
+
+/* Number of reader counters, threads are spread over them to avoid sharing cache line */
+#define EPOCH_SLOTS		64
+
+/* Cache line size used for padding of reader counters */
+#define EPOCH_CACHELINE	64
+
+/* Number of retired objects epoch_reclaim() starts new phase for */
+#define EPOCH_RECLAIM_BATCH	64
+
+/**
+ * Reader counters
+ *
+ * @ingroup Epoch
+ *
+ * Count of readers inside read section for both phases, never touch.
+ */
+struct epoch_slot
+{
+	volatile long readers[2];
+	char pad[EPOCH_CACHELINE - 2 * sizeof(long)];
+};
+
+/**
+ * Retired object
+ *
+ * @ingroup Epoch
+ *
+ * Node embedded in object passed to epoch_retire(), 'free' is called for the object
+ * when no reader can reference it.
+ */
+struct epoch_node
+{
+	struct epoch_node* next;
+	void (*free)(struct epoch_node* node);
+};
+
+/**
+ * An epoch
+ *
+ * @ingroup Epoch
+ *
+ * You should threat this struct as opaque, never ever set/get any
+ * of the variables.
+ */
+struct epoch
+{
+	volatile long phase;			// current phase of readers (0 or 1)
+	mutex_t mutex;					// serializes writers in epoch_synchronize() and epoch_reclaim()
+	struct epoch_node* retired;		// objects retired in current phase, pushed without lock
+	volatile long nretired;			// number of objects retired since the last phase flip
+	struct epoch_node* waiting;		// objects retired before the last phase flip (under mutex)
+	struct epoch_node* reclaimed;	// objects not referenced by readers, freed by epoch_reclaim()
+	struct epoch_slot slots[EPOCH_SLOTS];	// per-thread reader counters
+};
+
+/* Static initializer of an epoch */
+#define EPOCH_INITIALIZER	{0, MUTEX_INITIALIZER, NULL, 0, NULL, NULL, {{{0, 0}, {0}}}}
+
+/**
+ * Initializes an epoch.
+ *
+ * @ingroup Epoch
+ *
+ * @param epoch Pointer to the epoch that should be initialized
+ */
+void epoch_init(struct epoch* epoch);
+
+/**
+ * Cleans up an epoch.
+ *
+ * @ingroup Epoch
+ *
+ * Objects retired and not freed yet are freed.
+ *
+ * @param epoch Pointer to the epoch, there must be no readers
+ */
+void epoch_term(struct epoch* epoch);
+
+/**
+ * Enter read section
+ *
+ * @ingroup Epoch
+ *
+ * epoch_enter() never blocks. The data published before epoch_enter() is valid
+ * until epoch_leave(). Read sections may be nested.
+ *
+ * @param epoch Pointer to the epoch
+ * @return token that must be passed to epoch_leave()
+ */
+int epoch_enter(struct epoch* epoch);
+
+/**
+ * Leave read section
+ *
+ * @ingroup Epoch
+ *
+ * @param epoch Pointer to the epoch
+ * @param token value returned by epoch_enter()
+ */
+void epoch_leave(struct epoch* epoch, int token);
+
+/**
+ * Wait for readers
+ *
+ * @ingroup Epoch
+ *
+ * epoch_synchronize() returns when all read sections entered before the call
+ * are left. Must not be called from read section.
+ *
+ * @param epoch Pointer to the epoch
+ */
+void epoch_synchronize(struct epoch* epoch);
+
+/**
+ * Free object when readers leave
+ *
+ * @ingroup Epoch
+ *
+ * epoch_retire() never blocks and may be called from read section. The object must
+ * be unreachable for new readers already; 'node->free' is called for it by epoch_reclaim()
+ * or epoch_term() when all read sections entered before the call are left.
+ *
+ * @param epoch Pointer to the epoch
+ * @param node node embedded in the retired object, 'free' must be set
+ */
+void epoch_retire(struct epoch* epoch, struct epoch_node* node);
+
+/**
+ * Free retired objects
+ *
+ * @ingroup Epoch
+ *
+ * epoch_reclaim() never blocks: it frees retired objects that no reader can reference
+ * after epoch_synchronize(). If EPOCH_RECLAIM_BATCH objects are retired since the last
+ * phase flip (nobody calls epoch_synchronize()), it starts new phase when readers of the
+ * previous one have left and frees the objects retired before the previous flip.
+ * Call it after epoch_leave(), the objects are freed by calling thread.
+ *
+ * @param epoch Pointer to the epoch
+ */
+void epoch_reclaim(struct epoch* epoch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EPOCH_H_ */
@@ -1,9 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include "threadqueue.h"
 #include "psb.h"
 #include "platform.h"
+#include "bench.h"
+#include "trie.h"
 
 /*********************************** TEST **********************************/
 #include <stdio.h>
@@ -15,13 +18,16 @@
 
 #if defined(_WIN32) || defined(_WIN64) // use the native win32 API on windows
 #define DEFINE_THREAD(NAME, PARAM)  DWORD WINAPI NAME( LPVOID PARAM )
+#define CHECK_TIMEOUT	ERROR_TIMEOUT	// psb_get_message() timeout
 void usleep(DWORD waitTime)
 {
 	Sleep(waitTime/1000);
 }
 #else
 #include <unistd.h>
+#include <poll.h>
 #define DEFINE_THREAD(NAME, PARAM)  void* NAME(void* PARAM)
+#define CHECK_TIMEOUT	ETIMEDOUT
 #endif
 
 char* channel_list[] =
@@ -224,9 +230,1931 @@ void psb_test_multithread(void)
 #endif
 
 
+/********************************** CHECKS *********************************/
+
+static int g_check_failures;
+
+// report failed condition, returns the condition
+static int check(int cond, const char* text, int line)
+{
+	if (!cond)
+	{
+		printf("  line %d: %s\n", line, text);
+		g_check_failures++;
+	}
+	return cond;
+}
+
+#define CHECK(cond)	check((cond) != 0, #cond, __LINE__)
+
+// receive message without waiting and compare it with string 'expected' (NULL if no message is expected)
+static int check_receive(psb_subscriber* subscriber, const char* expected, int line)
+{
+	psb_message msg;
+	int rval = psb_try_get_message(subscriber, &msg);
+	int ok;
+
+	if (expected == NULL)
+	{
+		ok = check(rval == -EAGAIN, "no message", line);
+	}
+	else
+	{
+		ok = check(rval == 0, expected, line) &&
+			check((msg.datalen == (int)strlen(expected) + 1) && (strcmp((char*)msg.data, expected) == 0), expected, line);
+	}
+	if (rval == 0)
+	{
+		psb_free_message(&msg);
+	}
+
+	return ok;
+}
+
+#define CHECK_RECEIVE(subscriber, expected)	check_receive((subscriber), (expected), __LINE__)
+
+// publish string as data object
+static int publish_string(psb_broker* broker, char* channel, const char* text)
+{
+	return psb_publish_message(broker, channel, (void*)text, (int)strlen(text) + 1);
+}
+
+// the message body is copied once and shared by all matched subscribers until the last one frees it
+static void check_shared(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscribers[3];
+	psb_message msgs[3];
+	char data[] = "body";
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		subscribers[i] = psb_new_subscriber(broker);
+		psb_subscribe(subscribers[i], "s");
+	}
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	CHECK(publish_string(broker, "s/x", data) == 3);
+	data[0] = 'B';	// the publisher's buffer is copied
+	for (i = 0; i < 3; i++)
+	{
+		CHECK(psb_try_get_message(subscribers[i], &msgs[i]) == 0);
+	}
+	CHECK((msgs[0].data == msgs[1].data) && (msgs[1].data == msgs[2].data));
+	CHECK((msgs[0].channel == msgs[1].channel) && (msgs[1].channel == msgs[2].channel));
+
+	// the body stays valid for the subscribers that did not free it yet
+	for (i = 0; i < 3; i++)
+	{
+		CHECK((msgs[i].datalen == 5) && (strcmp((char*)msgs[i].data, "body") == 0));
+		CHECK(strcmp(msgs[i].channel, "s/x") == 0);
+		psb_free_message(&msgs[i]);
+	}
+
+	// the received message outlives its subscriber and broker
+	CHECK(publish_string(broker, "s", data) == 3);
+	CHECK(psb_try_get_message(subscribers[0], &msgs[0]) == 0);
+	for (i = 0; i < 3; i++)
+	{
+		psb_delete_subscriber(subscribers[i]);
+	}
+	psb_delete_broker(broker);
+	CHECK((strcmp((char*)msgs[0].data, "Body") == 0) && (strcmp(msgs[0].channel, "s") == 0));
+	psb_free_message(&msgs[0]);
+}
+
+#define CHECK_BATCH_MSGS	700
+
+// receive numbered messages without waiting, returns 1 if they are 'first', 'first + step'... up to 'count' messages
+static int receive_numbers(psb_subscriber* subscriber, int first, int step, int count)
+{
+	psb_message msg;
+	int ok = 1;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (psb_try_get_message(subscriber, &msg) != 0)
+		{
+			return 0;
+		}
+		ok = ok && (*(int*)msg.data == first + i * step);
+		psb_free_message(&msg);
+	}
+	return ok;
+}
+
+// batch publish returns the number of deliveries and keeps the order of entries for every subscriber
+static void check_batch(void)
+{
+	static psb_batch_entry entries[CHECK_BATCH_MSGS];
+	static int numbers[CHECK_BATCH_MSGS];
+	psb_broker* broker = psb_new_broker_ex(2);
+	psb_subscriber* all = psb_new_subscriber(broker);
+	psb_subscriber* odd = psb_new_subscriber_ex(broker, PSB_QUEUE_MPSC);
+	psb_subscriber* bounded = psb_new_subscriber(broker);
+	psb_queue_stats stats;
+	int i;
+
+	psb_subscribe(all, "b");
+	psb_subscribe(odd, "b/odd");
+	psb_subscribe_exact(bounded, "b/even");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	// more messages for a subscriber than one put takes at once
+	for (i = 0; i < CHECK_BATCH_MSGS; i++)
+	{
+		numbers[i] = i;
+		entries[i].channel = (i & 1) ? "b/odd" : "b/even";
+		entries[i].data = &numbers[i];
+		entries[i].datalen = sizeof(numbers[i]);
+	}
+	CHECK(psb_publish_batch(broker, entries, CHECK_BATCH_MSGS) == 2 * CHECK_BATCH_MSGS);
+	CHECK(receive_numbers(all, 0, 1, CHECK_BATCH_MSGS));
+	CHECK(receive_numbers(odd, 1, 2, CHECK_BATCH_MSGS / 2));
+	CHECK(receive_numbers(bounded, 0, 2, CHECK_BATCH_MSGS / 2));
+	CHECK_RECEIVE(all, NULL);
+	CHECK_RECEIVE(odd, NULL);
+	CHECK_RECEIVE(bounded, NULL);
+
+	// the full queue drops the rest of its messages, the others get all of them
+	CHECK(psb_set_queue_limit(bounded, 3, 0, PSB_OVERFLOW_DROP_NEWEST, 0) == 0);
+	CHECK(psb_publish_batch(broker, entries, 20) == 40);
+	CHECK(receive_numbers(bounded, 0, 2, 3));
+	CHECK_RECEIVE(bounded, NULL);
+	CHECK((psb_get_queue_stats(bounded, &stats) == 0) && (stats.dropped == 7));
+	CHECK(receive_numbers(all, 0, 1, 20));
+	CHECK(receive_numbers(odd, 1, 2, 10));
+
+	// the refused messages fail the publish, the other messages are delivered anyway
+	CHECK(psb_set_queue_limit(bounded, 3, 0, PSB_OVERFLOW_FAIL, 0) == 0);
+	CHECK(psb_publish_batch(broker, entries, 20) == -ENOBUFS);
+	CHECK(receive_numbers(bounded, 0, 2, 3));
+	CHECK(receive_numbers(all, 0, 1, 20));
+	CHECK(receive_numbers(odd, 1, 2, 10));
+
+	// invalid entries publish nothing
+	entries[5].channel = NULL;
+	CHECK(psb_publish_batch(broker, entries, 10) == -EINVAL);
+	CHECK(psb_publish_batch(broker, entries, 0) == -EINVAL);
+	CHECK(psb_get_messages_count(all) == 0);
+
+	psb_delete_subscriber(bounded);
+	psb_delete_subscriber(odd);
+	psb_delete_subscriber(all);
+	psb_delete_broker(broker);
+}
+
+#define CHECK_FIFO_THREADS	4
+#define CHECK_FIFO_MSGS		20000
+
+// message of FIFO check: number of publisher and its sequence number
+struct check_fifo_msg
+{
+	int publisher;
+	int seq;
+};
+
+// publisher of FIFO check
+struct check_fifo_publisher
+{
+	psb_broker* broker;
+	int publisher;
+};
+
+DEFINE_THREAD(check_fifo_fn, param)
+{
+	struct check_fifo_publisher* publisher = (struct check_fifo_publisher*)param;
+	struct check_fifo_msg msg;
+
+	msg.publisher = publisher->publisher;
+	for (msg.seq = 0; msg.seq < CHECK_FIFO_MSGS; msg.seq++)
+	{
+		psb_publish_message(publisher->broker, "fifo", &msg, sizeof(msg));
+	}
+
+	return 0;
+}
+
+// receive messages of 'count' publishers, returns 1 if messages of every publisher come in order
+static int receive_fifo(psb_subscriber* subscriber, int count)
+{
+	static psb_message msgs[64];
+	int next[CHECK_FIFO_THREADS] = {0};
+	int received = 0;
+	int ok = 1;
+	int i, n;
+
+	while (received < count * CHECK_FIFO_MSGS)
+	{
+		n = psb_get_messages(subscriber, msgs, 64, 5000);
+		if ((n <= 0) || (n > 64))
+		{
+			return 0;	// timeout
+		}
+		for (i = 0; i < n; i++)
+		{
+			struct check_fifo_msg* msg = (struct check_fifo_msg*)msgs[i].data;
+			if ((msg->publisher < 0) || (msg->publisher >= count) || (msg->seq != next[msg->publisher]))
+			{
+				ok = 0;
+			}
+			else
+			{
+				next[msg->publisher]++;
+			}
+			psb_free_message(&msgs[i]);
+		}
+		received += n;
+	}
+
+	return ok;
+}
+
+// lock-free MPSC queue keeps the order of every publisher's messages
+static void check_mpsc(void)
+{
+	struct check_fifo_publisher publishers[CHECK_FIFO_THREADS];
+	thread_t threads[CHECK_FIFO_THREADS];
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber = psb_new_subscriber_ex(broker, PSB_QUEUE_MPSC);
+	int k;
+
+	psb_subscribe(subscriber, "fifo");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	// single publisher
+	publishers[0].broker = broker;
+	publishers[0].publisher = 0;
+	check_fifo_fn(&publishers[0]);
+	CHECK(psb_get_messages_count(subscriber) == CHECK_FIFO_MSGS);
+	CHECK(receive_fifo(subscriber, 1));
+
+	// concurrent publishers and the subscriber receiving meanwhile
+	for (k = 0; k < CHECK_FIFO_THREADS; k++)
+	{
+		publishers[k].broker = broker;
+		publishers[k].publisher = k;
+		CHECK(thread_create(&threads[k], check_fifo_fn, &publishers[k]) == 0);
+	}
+	CHECK(receive_fifo(subscriber, CHECK_FIFO_THREADS));
+	for (k = 0; k < CHECK_FIFO_THREADS; k++)
+	{
+		thread_join(threads[k]);
+	}
+	CHECK_RECEIVE(subscriber, NULL);
+
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+#define CHECK_POOL_MSGS		1000
+
+// total number of blocks and of blocks held of the message pool, returns 0 in case of error
+static int pool_blocks(long* blocks, long* held)
+{
+	psb_pool_stats stats[32];
+	int i, n;
+
+	*blocks = 0;
+	*held = 0;
+	n = psb_get_pool_stats(stats, 32);
+	for (i = 0; i < n; i++)
+	{
+		if ((stats[i].free < 0) || (stats[i].held < 0) || (stats[i].free + stats[i].held != stats[i].blocks) ||
+			((i > 0) && (stats[i].size <= stats[i - 1].size)))
+		{
+			return 0;
+		}
+		*blocks += stats[i].blocks;
+		*held += stats[i].held;
+	}
+
+	return n > 0;
+}
+
+// publish numbered messages of 'size' bytes
+static void pool_publish(psb_broker* broker, int size)
+{
+	static char data[1000];
+	int i;
+
+	for (i = 0; i < CHECK_POOL_MSGS; i++)
+	{
+		memcpy(data, &i, sizeof(i));
+		psb_publish_message(broker, "pool", data, size);
+	}
+}
+
+// message bodies and queue entries come from the pool and return to it when freed
+static void check_pool(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber = psb_new_subscriber(broker);
+	long blocks, held, used, warm;
+	int round, size;
+
+	psb_subscribe(subscriber, "pool");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(psb_get_pool_stats(NULL, 1) == -EINVAL);
+
+	for (size = 8; size <= 1000; size *= 5)
+	{
+		warm = 0;
+		for (round = 0; round < 3; round++)
+		{
+			// a body and a queue entry of every queued message are used, the freed ones
+			// go back to the shared pool except the few cached by the thread
+			pool_publish(broker, size);
+			CHECK(pool_blocks(&blocks, &used) && (used >= 2 * CHECK_POOL_MSGS));
+			CHECK(receive_numbers(subscriber, 0, 1, CHECK_POOL_MSGS));
+			CHECK(pool_blocks(&blocks, &held) && (held <= used - CHECK_POOL_MSGS));
+
+			// the pool does not grow once warmed up
+			CHECK((round < 2) || (blocks == warm));
+			warm = blocks;
+		}
+	}
+
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+#define CHECK_CHANNELS		5000
+
+// publish to 'count' distinct channels nobody reads, the unused ones are dropped meanwhile
+static void publish_channels(psb_broker* broker, int count)
+{
+	char channel[32];
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		sprintf(channel, "other/%d", i);
+		publish_string(broker, channel, "x");
+	}
+}
+
+// channel names are interned: one handle per name, kept while referenced
+static void check_channels(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber = psb_new_subscriber(broker);
+	psb_channel* pinned;
+	psb_message held;
+	psb_message msg;
+
+	psb_subscribe(subscriber, "i");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	pinned = psb_channel_get(broker, "i/pinned");
+	CHECK((pinned != NULL) && (psb_channel_get(broker, "i/pinned") == pinned));
+	CHECK(psb_channel_get(broker, "i/other") != pinned);
+	CHECK(psb_channel_get(broker, NULL) == NULL);
+
+	// messages published by name and by handle refer to the handle
+	CHECK(publish_string(broker, "i/pinned", "a") == 1);
+	CHECK(psb_publish_channel(pinned, "b", 2) == 1);
+	CHECK((psb_try_get_message(subscriber, &msg) == 0) && (msg.channel_id == pinned));
+	psb_free_message(&msg);
+	CHECK((psb_try_get_message(subscriber, &msg) == 0) && (msg.channel_id == pinned));
+	CHECK(strcmp(msg.channel, "i/pinned") == 0);
+	psb_free_message(&msg);
+
+	// the channel published by name only is kept by the message, the pinned one by the broker
+	CHECK(publish_string(broker, "i/held", "c") == 1);
+	CHECK(psb_try_get_message(subscriber, &held) == 0);
+	psb_unsubscribe(subscriber, "i");	// the match cache entries are dropped
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	publish_channels(broker, CHECK_CHANNELS);
+	CHECK(strcmp(held.channel, "i/held") == 0);
+	CHECK(psb_channel_get(broker, "i/held") == held.channel_id);
+	CHECK(psb_channel_get(broker, "i/pinned") == pinned);
+	psb_free_message(&held);
+
+	// the pinned channel is still delivered by handle
+	psb_subscribe(subscriber, "i");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	publish_channels(broker, CHECK_CHANNELS);
+	CHECK(psb_publish_channel(pinned, "d", 2) == 1);
+	CHECK((psb_try_get_message(subscriber, &msg) == 0) && (msg.channel_id == pinned));
+	psb_free_message(&msg);
+
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+// publisher reuses its matched subscribers until subscriptions change
+static void check_publisher(void)
+{
+	psb_broker* broker = psb_new_broker_ex(2);
+	psb_subscriber* prefix = psb_new_subscriber(broker);
+	psb_subscriber* exact = psb_new_subscriber(broker);
+	psb_subscriber* pattern = psb_new_subscriber(broker);
+	psb_publisher* publisher = psb_new_publisher(broker, "p/x");
+	int i;
+
+	CHECK(publisher != NULL);
+	CHECK(psb_new_publisher(broker, NULL) == NULL);
+	CHECK(psb_publish(publisher, "0", 2) == 0);
+
+	// every change of subscriptions is seen by the next publish
+	CHECK(psb_subscribe(prefix, "p") == 0);
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	for (i = 0; i < 3; i++)
+	{
+		CHECK(psb_publish(publisher, "1", 2) == 1);
+	}
+	CHECK(psb_subscribe_exact(exact, "p/x") == 0);
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(psb_publish(publisher, "2", 2) == 2);
+	CHECK(psb_subscribe_pattern(pattern, "+/x") == 0);
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(psb_publish(publisher, "3", 2) == 3);
+	CHECK(psb_unsubscribe(prefix, "p") == 0);
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(psb_publish(publisher, "4", 2) == 2);
+
+	// deleted subscriber is not delivered to
+	CHECK(psb_delete_subscriber(exact) == 0);
+	CHECK(psb_publish(publisher, "5", 2) == 1);
+
+	CHECK_RECEIVE(prefix, "1");
+	CHECK_RECEIVE(prefix, "1");
+	CHECK_RECEIVE(prefix, "1");
+	CHECK_RECEIVE(prefix, "2");
+	CHECK_RECEIVE(prefix, "3");
+	CHECK_RECEIVE(prefix, NULL);
+	CHECK_RECEIVE(pattern, "3");
+	CHECK_RECEIVE(pattern, "4");
+	CHECK_RECEIVE(pattern, "5");
+	CHECK_RECEIVE(pattern, NULL);
+
+	CHECK(psb_delete_publisher(publisher) == 0);
+	CHECK(psb_delete_publisher(NULL) == -EINVAL);
+	psb_delete_subscriber(pattern);
+	psb_delete_subscriber(prefix);
+	psb_delete_broker(broker);
+}
+
+// check hit and miss counters of the broker's match cache
+static int cache_is(psb_broker* broker, long hits, long misses)
+{
+	psb_cache_stats stats;
+
+	return (psb_get_cache_stats(broker, &stats) == 0) && (stats.hits == hits) && (stats.misses == misses);
+}
+
+// the first publish of channel searches the index, the next ones hit the cache until subscriptions change
+static void check_cache(void)
+{
+	psb_broker* broker = psb_new_broker_ex(2);
+	psb_subscriber* subscriber = psb_new_subscriber(broker);
+	int i;
+
+	CHECK(psb_get_cache_stats(broker, NULL) == -EINVAL);
+	CHECK(publish_string(broker, "c/1", "x") == 0);
+	CHECK(cache_is(broker, 0, 0));	// not counted before the first subscription
+
+	psb_subscribe(subscriber, "c");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	for (i = 0; i < 3; i++)
+	{
+		CHECK(publish_string(broker, "c/1", "x") == 1);
+	}
+	CHECK(cache_is(broker, 2, 1));
+
+	// not matched channels are cached too
+	CHECK(publish_string(broker, "d", "x") == 0);
+	CHECK(publish_string(broker, "d", "x") == 0);
+	CHECK(cache_is(broker, 3, 2));
+
+	// change of subscriptions empties the cache
+	psb_subscribe(subscriber, "e");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(publish_string(broker, "c/1", "x") == 1);
+	CHECK(publish_string(broker, "c/1", "x") == 1);
+	CHECK(cache_is(broker, 4, 3));
+
+	// counters of dropped channels are kept, the publish is counted once even if evicted from the cache
+	publish_channels(broker, CHECK_CHANNELS);
+	CHECK(cache_is(broker, 4, 3 + CHECK_CHANNELS));
+	CHECK(publish_string(broker, "c/1", "x") == 1);
+	CHECK(cache_is(broker, 5, 3 + CHECK_CHANNELS) || cache_is(broker, 4, 4 + CHECK_CHANNELS));
+
+	while (psb_get_messages_count(subscriber) > 0)
+	{
+		CHECK_RECEIVE(subscriber, "x");
+	}
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+#define CHECK_SHARD_THREADS	4
+#define CHECK_SHARD_SUBS	8
+
+// subscribers of one thread of shards check
+struct check_shard_thread
+{
+	psb_broker* broker;
+	int first;
+	psb_subscriber* subscribers[CHECK_SHARD_SUBS];
+};
+
+DEFINE_THREAD(check_shard_fn, param)
+{
+	struct check_shard_thread* thread = (struct check_shard_thread*)param;
+	char channel[32];
+	int i;
+
+	for (i = 0; i < CHECK_SHARD_SUBS; i++)
+	{
+		thread->subscribers[i] = psb_new_subscriber(thread->broker);
+		sprintf(channel, "t/%d", thread->first + i);
+		psb_subscribe(thread->subscribers[i], "s");
+		psb_subscribe_exact(thread->subscribers[i], channel);
+		psb_subscribe(thread->subscribers[i], "u");
+		psb_unsubscribe(thread->subscribers[i], "u");
+	}
+
+	return 0;
+}
+
+// subscribers of all shards are delivered to, subscriptions are changed in parallel
+static void check_shards(void)
+{
+	struct check_shard_thread threads[CHECK_SHARD_THREADS];
+	thread_t ids[CHECK_SHARD_THREADS];
+	psb_broker* broker = psb_new_broker_ex(8);
+	psb_batch_entry entries[2];
+	char channel[32];
+	int i, k;
+
+	CHECK(psb_new_broker_ex(0) == NULL);
+	CHECK(psb_new_broker_ex(257) == NULL);
+
+	for (k = 0; k < CHECK_SHARD_THREADS; k++)
+	{
+		threads[k].broker = broker;
+		threads[k].first = k * CHECK_SHARD_SUBS;
+		CHECK(thread_create(&ids[k], check_shard_fn, &threads[k]) == 0);
+	}
+	for (k = 0; k < CHECK_SHARD_THREADS; k++)
+	{
+		thread_join(ids[k]);
+	}
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	CHECK(publish_string(broker, "s/all", "s") == CHECK_SHARD_THREADS * CHECK_SHARD_SUBS);
+	CHECK(publish_string(broker, "u", "u") == 0);
+	for (k = 0; k < CHECK_SHARD_THREADS; k++)
+	{
+		for (i = 0; i < CHECK_SHARD_SUBS; i++)
+		{
+			sprintf(channel, "t/%d", threads[k].first + i);
+			CHECK(publish_string(broker, channel, channel) == 1);
+			CHECK_RECEIVE(threads[k].subscribers[i], "s");
+			CHECK_RECEIVE(threads[k].subscribers[i], channel);
+		}
+	}
+
+	// the batch is routed through all shards
+	entries[0].channel = "s";
+	entries[0].data = "b";
+	entries[0].datalen = 2;
+	entries[1].channel = "t/0";
+	entries[1].data = "c";
+	entries[1].datalen = 2;
+	CHECK(psb_publish_batch(broker, entries, 2) == CHECK_SHARD_THREADS * CHECK_SHARD_SUBS + 1);
+	CHECK_RECEIVE(threads[0].subscribers[0], "b");
+	CHECK_RECEIVE(threads[0].subscribers[0], "c");
+
+	for (k = 0; k < CHECK_SHARD_THREADS; k++)
+	{
+		for (i = 0; i < CHECK_SHARD_SUBS; i++)
+		{
+			psb_delete_subscriber(threads[k].subscribers[i]);
+		}
+		CHECK(publish_string(broker, "s", "s") == (CHECK_SHARD_THREADS - k - 1) * CHECK_SHARD_SUBS);
+	}
+	psb_delete_broker(broker);
+}
+
+// message published by other thread after a delay
+struct check_delayed
+{
+	psb_broker* broker;
+	char* channel;
+	int delay_ms;
+	thread_t thread;
+};
+
+DEFINE_THREAD(check_delayed_fn, param)
+{
+	struct check_delayed* delayed = (struct check_delayed*)param;
+
+	usleep(delayed->delay_ms * 1000);
+	publish_string(delayed->broker, delayed->channel, "delayed");
+
+	return 0;
+}
+
+// start the thread publishing to 'channel' after 'delay_ms'
+static int publish_delayed(struct check_delayed* delayed, psb_broker* broker, char* channel, int delay_ms)
+{
+	delayed->broker = broker;
+	delayed->channel = channel;
+	delayed->delay_ms = delay_ms;
+	return thread_create(&delayed->thread, check_delayed_fn, delayed);
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+// check if the descriptor becomes readable in 'timeout_ms'
+static int fd_readable(int fd, int timeout_ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, timeout_ms) == 1) && (pfd.revents & POLLIN);
+}
+#endif
+
+// the descriptor is readable while the queue has messages, psb_try_get_message() never waits
+static void check_fd(void)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	static const int types[] = {PSB_QUEUE_LOCKED, PSB_QUEUE_MPSC, PSB_QUEUE_SPSC};
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber;
+	struct check_delayed delayed;
+	psb_message msg;
+	int fd, t;
+
+	CHECK(psb_subscriber_get_fd(NULL) == -EINVAL);
+	CHECK(psb_try_get_message(NULL, &msg) == -EINVAL);
+
+	for (t = 0; t < (int)(sizeof(types) / sizeof(types[0])); t++)
+	{
+		subscriber = psb_new_subscriber_ex(broker, types[t]);
+		psb_subscribe(subscriber, "fd");
+		CHECK(psb_sync_subscriptions(broker) == 0);
+
+		// the message queued before the descriptor is created makes it readable at once
+		CHECK(publish_string(broker, "fd", "0") == 1);
+		fd = psb_subscriber_get_fd(subscriber);
+		CHECK((fd >= 0) && (psb_subscriber_get_fd(subscriber) == fd));
+		CHECK(fd_readable(fd, 0));
+		CHECK_RECEIVE(subscriber, "0");
+		CHECK_RECEIVE(subscriber, NULL);
+		CHECK(!fd_readable(fd, 0));
+
+		// readable after publish until the queue is found empty
+		CHECK(publish_string(broker, "fd", "1") == 1);
+		CHECK(publish_string(broker, "fd", "2") == 1);
+		CHECK(fd_readable(fd, 0));
+		CHECK_RECEIVE(subscriber, "1");
+		CHECK(fd_readable(fd, 0));
+		CHECK_RECEIVE(subscriber, "2");
+		CHECK_RECEIVE(subscriber, NULL);
+		CHECK(!fd_readable(fd, 0));
+
+		// publisher of other thread wakes up the waiting event loop
+		CHECK(publish_delayed(&delayed, broker, "fd", 20) == 0);
+		CHECK(fd_readable(fd, 5000));
+		thread_join(delayed.thread);
+		CHECK_RECEIVE(subscriber, "delayed");
+		CHECK_RECEIVE(subscriber, NULL);
+
+		psb_delete_subscriber(subscriber);
+	}
+
+	psb_delete_broker(broker);
+#endif
+}
+
+// the subscriber polling before it sleeps gets the message published meanwhile and times out on empty queue
+static void check_wait(void)
+{
+	static const int types[] = {PSB_QUEUE_LOCKED, PSB_QUEUE_MPSC, PSB_QUEUE_SPSC};
+	static const long waits[][2] = {{0, 0}, {1000000, 0}, {0, 1000}, {1000, 10}};
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber;
+	struct check_delayed delayed;
+	psb_message msg;
+	int t, w;
+
+	CHECK(psb_set_queue_wait(NULL, 0, 0) == -EINVAL);
+
+	for (t = 0; t < (int)(sizeof(types) / sizeof(types[0])); t++)
+	{
+		subscriber = psb_new_subscriber_ex(broker, types[t]);
+		psb_subscribe(subscriber, "w");
+		CHECK(psb_sync_subscriptions(broker) == 0);
+		CHECK(psb_set_queue_wait(subscriber, -1, 0) == -EINVAL);
+		CHECK(psb_set_queue_wait(subscriber, 0, -1) == -EINVAL);
+
+		for (w = 0; w < (int)(sizeof(waits) / sizeof(waits[0])); w++)
+		{
+			CHECK(psb_set_queue_wait(subscriber, waits[w][0], waits[w][1]) == 0);
+
+			// woken up while polling or sleeping
+			CHECK(publish_delayed(&delayed, broker, "w", 1 + w * 5) == 0);
+			CHECK(psb_get_message(subscriber, &msg, 5000) == 0);
+			thread_join(delayed.thread);
+			CHECK(strcmp((char*)msg.data, "delayed") == 0);
+			psb_free_message(&msg);
+
+			// queued message is taken at once, the empty queue times out after polling
+			CHECK(publish_string(broker, "w", "q") == 1);
+			CHECK(psb_get_message(subscriber, &msg, 5000) == 0);
+			psb_free_message(&msg);
+			CHECK(psb_get_message(subscriber, &msg, 10) == CHECK_TIMEOUT);
+		}
+
+		psb_delete_subscriber(subscriber);
+	}
+
+	psb_delete_broker(broker);
+}
+
+// check the ready flags of polled subscribers
+static int ready_is(const int* ready, int a, int b, int c)
+{
+	return ((ready[0] != 0) == a) && ((ready[1] != 0) == b) && ((ready[2] != 0) == c);
+}
+
+// psb_poll() reports the subscribers with messages and waits for the first message of any of them
+static void check_poll(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscribers[3];
+	struct check_delayed delayed;
+	int ready[3];
+
+	subscribers[0] = psb_new_subscriber(broker);
+	subscribers[1] = psb_new_subscriber_ex(broker, PSB_QUEUE_MPSC);
+	subscribers[2] = psb_new_subscriber_ex(broker, PSB_QUEUE_SPSC);
+	psb_subscribe(subscribers[0], "a");
+	psb_subscribe(subscribers[1], "b");
+	psb_subscribe(subscribers[2], "c");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	CHECK(psb_poll(NULL, 3, 10, ready) == -EINVAL);
+	CHECK(psb_poll(subscribers, 0, 10, ready) == -EINVAL);
+	CHECK(psb_poll(subscribers, 3, 10, NULL) == -EINVAL);
+
+	CHECK(psb_poll(subscribers, 3, 10, ready) == 0);
+	CHECK(ready_is(ready, 0, 0, 0));
+
+	CHECK(publish_string(broker, "b", "b") == 1);
+	CHECK(psb_poll(subscribers, 3, 10, ready) == 1);
+	CHECK(ready_is(ready, 0, 1, 0));
+	CHECK(publish_string(broker, "a", "a") == 1);
+	CHECK(publish_string(broker, "c", "c") == 1);
+	CHECK(psb_poll(subscribers, 3, 10, ready) == 3);
+	CHECK(ready_is(ready, 1, 1, 1));
+
+	CHECK_RECEIVE(subscribers[1], "b");
+	CHECK(psb_poll(subscribers, 3, 10, ready) == 2);
+	CHECK(ready_is(ready, 1, 0, 1));
+	CHECK_RECEIVE(subscribers[0], "a");
+	CHECK_RECEIVE(subscribers[2], "c");
+	CHECK(psb_poll(subscribers, 3, 10, ready) == 0);
+
+	// publisher of other thread wakes up the poller
+	CHECK(publish_delayed(&delayed, broker, "c", 20) == 0);
+	CHECK(psb_poll(subscribers, 3, 5000, ready) == 1);
+	CHECK(ready_is(ready, 0, 0, 1));
+	thread_join(delayed.thread);
+	CHECK_RECEIVE(subscribers[2], "delayed");
+
+	// a subset of the subscribers is polled the same way
+	CHECK(publish_delayed(&delayed, broker, "a", 20) == 0);
+	CHECK(psb_poll(subscribers, 1, 5000, ready) == 1);
+	thread_join(delayed.thread);
+	CHECK_RECEIVE(subscribers[0], "delayed");
+
+	psb_delete_subscriber(subscribers[2]);
+	psb_delete_subscriber(subscribers[1]);
+	psb_delete_subscriber(subscribers[0]);
+	psb_delete_broker(broker);
+}
+
+// single publisher ring keeps the order, received messages hold their slots until freed
+static void check_spsc(void)
+{
+	static const int inline_sizes[] = {64, 0};
+	struct check_fifo_publisher publisher;
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber;
+	psb_message msgs[2];
+	thread_t thread;
+	int i;
+
+	CHECK(psb_new_subscriber_spsc(broker, 0, 0) == NULL);
+
+	// the publisher waits for free slot of the small ring
+	for (i = 0; i < 2; i++)
+	{
+		subscriber = psb_new_subscriber_spsc(broker, 8, inline_sizes[i]);
+		psb_subscribe(subscriber, "fifo");
+		CHECK(psb_sync_subscriptions(broker) == 0);
+
+		publisher.broker = broker;
+		publisher.publisher = 0;
+		CHECK(thread_create(&thread, check_fifo_fn, &publisher) == 0);
+		CHECK(receive_fifo(subscriber, 1));
+		thread_join(thread);
+		CHECK_RECEIVE(subscriber, NULL);
+
+		psb_delete_subscriber(subscriber);
+	}
+
+	subscriber = psb_new_subscriber_spsc(broker, 2, 64);
+	psb_subscribe(subscriber, "r");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(psb_set_queue_limit(subscriber, 0, 0, PSB_OVERFLOW_FAIL, 0) == 0);
+	CHECK(psb_set_queue_limit(subscriber, 1, 0, PSB_OVERFLOW_FAIL, 0) == -EINVAL);
+	CHECK(publish_string(broker, "r", "0") == 1);
+	CHECK(publish_string(broker, "r", "1") == 1);
+	CHECK(publish_string(broker, "r", "2") == -ENOBUFS);
+	CHECK(psb_try_get_message(subscriber, &msgs[0]) == 0);
+	CHECK(psb_try_get_message(subscriber, &msgs[1]) == 0);
+	CHECK(publish_string(broker, "r", "2") == -ENOBUFS);
+	psb_free_message(&msgs[0]);
+	CHECK(publish_string(broker, "r", "2") == 1);
+	CHECK(strcmp((char*)msgs[1].data, "1") == 0);
+	psb_free_message(&msgs[1]);
+	CHECK_RECEIVE(subscriber, "2");
+	CHECK_RECEIVE(subscriber, NULL);
+
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+// overflow policies of bounded queue
+static void check_overflow(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber = psb_new_subscriber(broker);
+	psb_subscriber* other = psb_new_subscriber(broker);
+	psb_queue_stats stats;
+
+	psb_subscribe(subscriber, "q");
+	psb_subscribe(other, "q");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	// the oldest message makes room for the new one
+	CHECK(psb_set_queue_limit(subscriber, 2, 0, PSB_OVERFLOW_DROP_OLDEST, 0) == 0);
+	CHECK(publish_string(broker, "q", "1") == 2);
+	CHECK(publish_string(broker, "q", "2") == 2);
+	CHECK(publish_string(broker, "q", "3") == 2);
+	CHECK_RECEIVE(subscriber, "2");
+	CHECK_RECEIVE(subscriber, "3");
+	CHECK_RECEIVE(subscriber, NULL);
+	CHECK((psb_get_queue_stats(subscriber, &stats) == 0) && (stats.dropped == 1) && (stats.rejected == 0));
+
+	// the new message is refused, the other subscriber gets it anyway
+	CHECK(psb_set_queue_limit(subscriber, 2, 0, PSB_OVERFLOW_FAIL, 0) == 0);
+	CHECK(publish_string(broker, "q", "4") == 2);
+	CHECK(publish_string(broker, "q", "5") == 2);
+	CHECK(publish_string(broker, "q", "6") == -ENOBUFS);
+	CHECK_RECEIVE(subscriber, "4");
+	CHECK_RECEIVE(subscriber, "5");
+	CHECK_RECEIVE(subscriber, NULL);
+	CHECK((psb_get_queue_stats(subscriber, &stats) == 0) && (stats.rejected == 1));
+
+	// the publisher waits for free space until the timeout
+	CHECK(psb_set_queue_limit(subscriber, 1, 0, PSB_OVERFLOW_BLOCK, 20) == 0);
+	CHECK(publish_string(broker, "q", "7") == 2);
+	CHECK(publish_string(broker, "q", "8") == -ETIMEDOUT);
+	CHECK_RECEIVE(subscriber, "7");
+	CHECK(publish_string(broker, "q", "9") == 2);
+	CHECK_RECEIVE(subscriber, "9");
+	CHECK_RECEIVE(subscriber, NULL);
+	CHECK((psb_get_queue_stats(subscriber, &stats) == 0) && (stats.rejected == 2));
+
+	// the other subscriber got every message
+	CHECK(psb_get_messages_count(other) == 9);
+
+	psb_delete_subscriber(other);
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+#define CHECK_GROUP_MSGS	200
+
+// member of consumer group receiving messages until the queue stays empty
+struct check_member
+{
+	psb_subscriber* subscriber;
+	int received[CHECK_GROUP_MSGS];	// number of receptions of every message
+	int count;
+};
+
+DEFINE_THREAD(check_member_fn, param)
+{
+	struct check_member* member = (struct check_member*)param;
+	psb_message msg;
+	int i;
+
+	while (psb_get_message(member->subscriber, &msg, 200) == 0)
+	{
+		i = *(int*)msg.data;
+		if ((i >= 0) && (i < CHECK_GROUP_MSGS))
+		{
+			member->received[i]++;
+		}
+		member->count++;
+		psb_free_message(&msg);
+	}
+
+	return 0;
+}
+
+// every message of consumer group is received by one member only
+static void check_group(void)
+{
+	psb_broker* broker = psb_new_broker();
+	struct check_member members[2];
+	psb_subscriber* other;
+	char channel[32];
+	int i, k, n;
+#if defined(_WIN32) || defined(_WIN64)
+	HANDLE threads[2];
+#else
+	pthread_t threads[2];
+#endif
+
+	memset(members, 0, sizeof(members));
+	members[0].subscriber = psb_join_group(broker, "workers");
+	members[1].subscriber = psb_join_group(broker, "workers");
+	other = psb_join_group(broker, "auditors");
+	CHECK((members[0].subscriber != NULL) && (members[0].subscriber == members[1].subscriber));
+	CHECK((other != NULL) && (other != members[0].subscriber));
+
+	// overlapping subscriptions of the members deliver the message to the group once
+	CHECK(psb_subscribe(members[0].subscriber, "jobs") == 0);
+	CHECK(psb_subscribe_pattern(members[1].subscriber, "jobs/+") == 0);
+	CHECK(psb_subscribe(other, "jobs") == 0);
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	for (i = 0; i < CHECK_GROUP_MSGS; i++)
+	{
+		sprintf(channel, "jobs/%d", i % 7);
+		CHECK(psb_publish_message(broker, channel, &i, sizeof(i)) == 2);
+	}
+
+	for (k = 0; k < 2; k++)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		threads[k] = CreateThread(NULL, 0, check_member_fn, &members[k], 0, NULL);
+#else
+		pthread_create(&threads[k], NULL, check_member_fn, &members[k]);
+#endif
+	}
+	for (k = 0; k < 2; k++)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		WaitForSingleObject(threads[k], INFINITE);
+		CloseHandle(threads[k]);
+#else
+		pthread_join(threads[k], NULL);
+#endif
+	}
+
+	CHECK(members[0].count + members[1].count == CHECK_GROUP_MSGS);
+	for (i = 0, n = 0; i < CHECK_GROUP_MSGS; i++)
+	{
+		n += (members[0].received[i] + members[1].received[i] == 1);
+	}
+	CHECK(n == CHECK_GROUP_MSGS);
+	CHECK(psb_get_messages_count(other) == CHECK_GROUP_MSGS);
+
+	// the group is deleted with its subscriptions when the last member leaves
+	CHECK(psb_leave_group(members[0].subscriber) == 0);
+	CHECK(publish_string(broker, "jobs", "x") == 2);
+	CHECK(psb_leave_group(members[1].subscriber) == 0);
+	CHECK(publish_string(broker, "jobs", "y") == 1);
+	CHECK(psb_leave_group(other) == 0);
+
+	psb_delete_broker(broker);
+}
+
+// publish string with priority
+static int publish_prio(psb_broker* broker, char* channel, const char* text, int prio)
+{
+	return psb_publish_message_prio(broker, channel, (void*)text, (int)strlen(text) + 1, prio);
+}
+
+// messages of higher priority are received first, messages of the same priority in order
+static void check_prio(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber = psb_new_subscriber(broker);
+	psb_subscriber* mpsc = psb_new_subscriber_ex(broker, PSB_QUEUE_MPSC);
+	psb_queue_stats stats;
+	psb_message msg;
+
+	psb_subscribe(subscriber, "p");
+	psb_subscribe(mpsc, "p");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	CHECK(publish_prio(broker, "p", "low1", 0) == 2);
+	CHECK(publish_prio(broker, "p", "low2", 0) == 2);
+	CHECK(publish_prio(broker, "p", "top1", PSB_PRIORITIES - 1) == 2);
+	CHECK(publish_prio(broker, "p", "mid", 1) == 2);
+	CHECK(publish_prio(broker, "p", "top2", PSB_PRIORITIES - 1) == 2);
+	CHECK(publish_prio(broker, "p", "bad", PSB_PRIORITIES) == -EINVAL);
+
+	CHECK((psb_try_get_message(subscriber, &msg) == 0) && (msg.prio == PSB_PRIORITIES - 1) &&
+		(strcmp((char*)msg.data, "top1") == 0));
+	psb_free_message(&msg);
+	CHECK_RECEIVE(subscriber, "top2");
+	CHECK_RECEIVE(subscriber, "mid");
+	CHECK_RECEIVE(subscriber, "low1");
+	CHECK_RECEIVE(subscriber, "low2");
+	CHECK_RECEIVE(subscriber, NULL);
+
+	// MPSC queue keeps the order of publishing
+	CHECK_RECEIVE(mpsc, "low1");
+	CHECK_RECEIVE(mpsc, "low2");
+	CHECK_RECEIVE(mpsc, "top1");
+	CHECK_RECEIVE(mpsc, "mid");
+	CHECK_RECEIVE(mpsc, "top2");
+	CHECK_RECEIVE(mpsc, NULL);
+	psb_delete_subscriber(mpsc);
+
+	// full queue drops the lowest priority, never a higher one for the new message
+	CHECK(psb_set_queue_limit(subscriber, 2, 0, PSB_OVERFLOW_DROP_OLDEST, 0) == 0);
+	CHECK(publish_prio(broker, "p", "high1", 2) == 1);
+	CHECK(publish_prio(broker, "p", "high2", 2) == 1);
+	CHECK(publish_prio(broker, "p", "low", 0) == 1);
+	CHECK(publish_prio(broker, "p", "top", PSB_PRIORITIES - 1) == 1);
+	CHECK_RECEIVE(subscriber, "top");
+	CHECK_RECEIVE(subscriber, "high2");
+	CHECK_RECEIVE(subscriber, NULL);
+	CHECK((psb_get_queue_stats(subscriber, &stats) == 0) && (stats.dropped == 2));
+
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+// MQTT-style patterns: '+' matches a level, '#' any number of levels (none included)
+static void check_pattern(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* single = psb_new_subscriber(broker);
+	psb_subscriber* multi = psb_new_subscriber(broker);
+	psb_subscriber* any = psb_new_subscriber(broker);
+
+	CHECK(psb_subscribe_pattern(single, "sensors/+/temperature") == 0);
+	CHECK(psb_subscribe_pattern(multi, "a/#") == 0);
+	CHECK(psb_subscribe_pattern(any, "+") == 0);
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	CHECK(publish_string(broker, "sensors/kitchen/temperature", "t") == 1);
+	CHECK(publish_string(broker, "sensors/kitchen/humidity", "h") == 0);
+	CHECK(publish_string(broker, "sensors/kitchen/oven/temperature", "o") == 0);
+	CHECK(publish_string(broker, "sensors/temperature", "s") == 0);
+	CHECK_RECEIVE(single, "t");
+	CHECK_RECEIVE(single, NULL);
+
+	// "a/#" matches "a" itself, not "ab"
+	CHECK(publish_string(broker, "a", "a") == 2);
+	CHECK(publish_string(broker, "a/b", "ab") == 1);
+	CHECK(publish_string(broker, "a/b/c", "abc") == 1);
+	CHECK(publish_string(broker, "ab", "x") == 1);
+	CHECK(publish_string(broker, "b/a", "y") == 0);
+	CHECK_RECEIVE(multi, "a");
+	CHECK_RECEIVE(multi, "ab");
+	CHECK_RECEIVE(multi, "abc");
+	CHECK_RECEIVE(multi, NULL);
+	CHECK_RECEIVE(any, "a");
+	CHECK_RECEIVE(any, "x");
+	CHECK_RECEIVE(any, NULL);
+
+	// wildcards must be whole levels, '#' the last one
+	CHECK(psb_subscribe_pattern(single, "a/b#") == -EINVAL);
+	CHECK(psb_subscribe_pattern(single, "a/#/b") == -EINVAL);
+	CHECK(psb_subscribe_pattern(single, "a+/b") == -EINVAL);
+	CHECK(psb_subscribe_pattern(single, "#/a") == -EINVAL);
+	CHECK(psb_subscribe_pattern(single, "sensors/+/temperature") == -EINVAL);
+	CHECK(psb_unsubscribe_pattern(single, "sensors/#") == -EINVAL);
+
+	// the separator can't change under subscriptions
+	CHECK(psb_set_separator(broker, '.') == -EBUSY);
+	CHECK(psb_unsubscribe_pattern(single, "sensors/+/temperature") == 0);
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(publish_string(broker, "sensors/kitchen/temperature", "t") == 0);
+
+	psb_delete_subscriber(any);
+	psb_delete_subscriber(multi);
+	psb_delete_subscriber(single);
+	psb_delete_broker(broker);
+
+	// other separator is set before the first subscription
+	broker = psb_new_broker();
+	single = psb_new_subscriber(broker);
+	CHECK(psb_set_separator(broker, '+') == -EINVAL);
+	CHECK(psb_set_separator(broker, '.') == 0);
+	CHECK(psb_subscribe_pattern(single, "sensors.+.temperature") == 0);
+	CHECK(psb_set_separator(broker, '/') == -EBUSY);
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(publish_string(broker, "sensors.kitchen.temperature", "t") == 1);
+	CHECK(publish_string(broker, "sensors/kitchen/temperature", "s") == 0);
+	CHECK_RECEIVE(single, "t");
+	CHECK_RECEIVE(single, NULL);
+
+	psb_delete_subscriber(single);
+	psb_delete_broker(broker);
+}
+
+// exact, prefix and pattern subscriptions deliver their channels, each message once per subscriber
+static void check_modes(void)
+{
+	psb_broker* broker;
+	psb_subscriber* exact;
+	psb_subscriber* prefix;
+	psb_subscriber* pattern;
+	psb_subscriber* all;
+	psb_publisher* publisher;
+	int nshards;
+
+	for (nshards = 1; nshards <= 4; nshards *= 4)
+	{
+		broker = psb_new_broker_ex(nshards);
+		exact = psb_new_subscriber(broker);
+		prefix = psb_new_subscriber(broker);
+		pattern = psb_new_subscriber(broker);
+		all = psb_new_subscriber(broker);
+
+		CHECK(psb_subscribe_exact(exact, "a/b") == 0);
+		CHECK(psb_subscribe_exact(exact, "a/b") == -EINVAL);
+		CHECK(psb_subscribe(prefix, "a/b") == 0);
+		CHECK(psb_subscribe(prefix, "a/b/c") == -EINVAL);	// covered by "a/b"
+		CHECK(psb_subscribe_pattern(pattern, "a/+") == 0);
+
+		// overlapping subscriptions of all modes
+		CHECK(psb_subscribe_exact(all, "a/b") == 0);
+		CHECK(psb_subscribe(all, "a") == 0);
+		CHECK(psb_subscribe_pattern(all, "a/#") == 0);
+		CHECK(psb_sync_subscriptions(broker) == 0);
+
+		CHECK(publish_string(broker, "a/b", "ab") == 4);
+		CHECK(publish_string(broker, "a/b/c", "abc") == 2);
+		CHECK(publish_string(broker, "a/bc", "abc2") == 3);
+		CHECK(publish_string(broker, "a", "a") == 1);
+
+		CHECK_RECEIVE(exact, "ab");
+		CHECK_RECEIVE(exact, NULL);
+		CHECK_RECEIVE(prefix, "ab");
+		CHECK_RECEIVE(prefix, "abc");
+		CHECK_RECEIVE(prefix, "abc2");
+		CHECK_RECEIVE(prefix, NULL);
+		CHECK_RECEIVE(pattern, "ab");
+		CHECK_RECEIVE(pattern, "abc2");
+		CHECK_RECEIVE(pattern, NULL);
+		CHECK_RECEIVE(all, "ab");
+		CHECK_RECEIVE(all, "abc");
+		CHECK_RECEIVE(all, "abc2");
+		CHECK_RECEIVE(all, "a");
+		CHECK_RECEIVE(all, NULL);
+
+		// publishing by handle and by publisher routes the same way
+		CHECK(psb_publish_channel(psb_channel_get(broker, "a/b"), "h", 2) == 4);
+		publisher = psb_new_publisher(broker, "a/b");
+		CHECK((publisher != NULL) && (psb_publish(publisher, "p", 2) == 4));
+		psb_delete_publisher(publisher);
+		CHECK_RECEIVE(exact, "h");
+		CHECK_RECEIVE(exact, "p");
+		CHECK_RECEIVE(all, "h");
+		CHECK_RECEIVE(all, "p");
+
+		// the other modes of the subscriber still deliver
+		CHECK(psb_unsubscribe_exact(all, "a/b") == 0);
+		CHECK(psb_unsubscribe_exact(all, "a/b") == -EINVAL);
+		CHECK(psb_unsubscribe(all, "a") == 0);
+		CHECK(psb_sync_subscriptions(broker) == 0);
+		CHECK(publish_string(broker, "a/b", "ab") == 4);
+		CHECK(psb_unsubscribe_pattern(all, "a/#") == 0);
+		CHECK(psb_sync_subscriptions(broker) == 0);
+		CHECK(publish_string(broker, "a/b", "ab") == 3);
+		CHECK_RECEIVE(all, "ab");
+		CHECK_RECEIVE(all, NULL);
+
+		psb_delete_subscriber(all);
+		psb_delete_subscriber(pattern);
+		psb_delete_subscriber(prefix);
+		psb_delete_subscriber(exact);
+		psb_delete_broker(broker);
+	}
+}
+
+// psb_publish_message_nocopy() release callback: count the calls
+static void check_release(void* data, void* arg)
+{
+	(void)data;
+	(*(int*)arg)++;
+}
+
+// publish string without copy, its release calls are counted in 'released'
+static int publish_nocopy(psb_broker* broker, char* channel, const char* text, int* released)
+{
+	return psb_publish_message_nocopy(broker, channel, (void*)text, (int)strlen(text) + 1, check_release, released);
+}
+
+// the caller's data object is released once, after the last subscriber freed it or it was dropped
+static void check_nocopy(void)
+{
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber = psb_new_subscriber(broker);
+	psb_subscriber* other = psb_new_subscriber(broker);
+	psb_subscriber* mpsc = psb_new_subscriber_ex(broker, PSB_QUEUE_MPSC);
+	psb_subscriber* spsc = psb_new_subscriber_spsc(broker, 2, 0);
+	psb_queue_stats stats;
+	psb_message msg;
+	int released[6] = {0};
+
+	psb_subscribe(subscriber, "n");
+	psb_subscribe(other, "n");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	// the last free releases the object
+	CHECK(publish_nocopy(broker, "n", "0", &released[0]) == 2);
+	CHECK(released[0] == 0);
+	CHECK(psb_try_get_message(subscriber, &msg) == 0);
+	CHECK((msg.data != NULL) && (strcmp((char*)msg.data, "0") == 0));
+	psb_free_message(&msg);
+	CHECK(released[0] == 0);
+	CHECK_RECEIVE(other, "0");
+	CHECK(released[0] == 1);
+
+	// nobody matched
+	CHECK(publish_nocopy(broker, "x", "1", &released[1]) == 0);
+	CHECK(released[1] == 1);
+
+	// the dropped oldest message is released by the publisher, the other subscriber still holds it
+	CHECK(psb_set_queue_limit(subscriber, 1, 0, PSB_OVERFLOW_DROP_OLDEST, 0) == 0);
+	CHECK(publish_nocopy(broker, "n", "2", &released[2]) == 2);
+	CHECK(publish_nocopy(broker, "n", "3", &released[3]) == 2);
+	CHECK(released[2] == 0);
+	CHECK_RECEIVE(other, "2");
+	CHECK(released[2] == 1);
+	CHECK_RECEIVE(subscriber, "3");
+	CHECK_RECEIVE(other, "3");
+	CHECK((released[2] == 1) && (released[3] == 1));
+	CHECK((psb_get_queue_stats(subscriber, &stats) == 0) && (stats.dropped == 1));
+	psb_unsubscribe(subscriber, "n");
+	psb_unsubscribe(other, "n");
+
+	// the dropped newest message of every queue type
+	CHECK(psb_set_queue_limit(subscriber, 1, 0, PSB_OVERFLOW_DROP_NEWEST, 0) == 0);
+	CHECK(psb_set_queue_limit(mpsc, 1, 0, PSB_OVERFLOW_DROP_NEWEST, 0) == 0);
+	CHECK(psb_set_queue_limit(spsc, 0, 0, PSB_OVERFLOW_DROP_NEWEST, 0) == 0);
+	psb_subscribe(subscriber, "d");
+	psb_subscribe(mpsc, "d");
+	psb_subscribe(spsc, "d");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+	CHECK(publish_nocopy(broker, "d", "4", &released[4]) == 3);
+	CHECK(publish_nocopy(broker, "d", "4", &released[4]) == 3);
+	CHECK(publish_nocopy(broker, "d", "5", &released[5]) == 3);
+	CHECK((released[4] == 0) && (released[5] == 1));
+	CHECK_RECEIVE(subscriber, "4");
+	CHECK_RECEIVE(subscriber, NULL);
+	CHECK_RECEIVE(mpsc, "4");
+	CHECK_RECEIVE(mpsc, NULL);
+	CHECK_RECEIVE(spsc, "4");
+	CHECK_RECEIVE(spsc, "4");
+	CHECK_RECEIVE(spsc, NULL);
+	CHECK((released[4] == 2) && (released[5] == 1));
+
+	psb_delete_subscriber(spsc);
+	psb_delete_subscriber(mpsc);
+	psb_delete_subscriber(other);
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+// number of blocks held in the pool classes, returns number of classes
+static int pool_held(long* held, int max)
+{
+	psb_pool_stats stats[32];
+	int i, n;
+
+	n = psb_get_pool_stats(stats, (max < 32) ? max : 32);
+	for (i = 0; i < n; i++)
+	{
+		held[i] = stats[i].held;
+	}
+	return n;
+}
+
+// the body of 'size' bytes data object takes block of 'class' (the smallest ones) and not bigger
+static int body_class_is(psb_broker* broker, psb_subscriber* subscriber, int size, int class)
+{
+	long before[32], queued[32];
+	int i, n, rval;
+
+	n = pool_held(before, 32);
+	pool_publish(broker, size);
+	rval = (pool_held(queued, 32) == n) && (n > class) && (queued[class] >= before[class] + CHECK_POOL_MSGS / 2);
+	for (i = class + 1; i < n; i++)
+	{
+		rval = rval && (queued[i] == before[i]);
+	}
+	return receive_numbers(subscriber, 0, 1, CHECK_POOL_MSGS) && rval;
+}
+
+// small message body shares cache line with its header, SPSC slot holds copy of small data object
+static void check_body(void)
+{
+	static char data[300];
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber = psb_new_subscriber(broker);
+	psb_subscriber* spsc = psb_new_subscriber_spsc(broker, 4, 64);
+	psb_message msg, copy;
+	int released = 0;
+	int size;
+
+	psb_subscribe(subscriber, "pool");
+	psb_subscribe(subscriber, "body");
+	psb_subscribe(spsc, "body");
+	CHECK(psb_sync_subscriptions(broker) == 0);
+
+	// warm up the thread cache and the match cache
+	pool_publish(broker, 8);
+	CHECK(receive_numbers(subscriber, 0, 1, CHECK_POOL_MSGS));
+
+	// the 8 bytes body and the queue entry take the smallest blocks, the 88 bytes body the next class
+	CHECK(body_class_is(broker, subscriber, 8, 0));
+	CHECK(body_class_is(broker, subscriber, 88, 1));
+
+	// data objects of any size arrive intact, the SPSC subscriber copies the small ones
+	// and gets the shared body of the big ones
+	for (size = 1; size < (int)sizeof(data); size++)
+	{
+		memset(data, size, sizeof(data));
+		data[0] = 'x';
+		CHECK(psb_publish_message(broker, "body", data, size) == 2);
+		CHECK(psb_try_get_message(subscriber, &msg) == 0);
+		CHECK(psb_try_get_message(spsc, &copy) == 0);
+		CHECK((msg.datalen == size) && (copy.datalen == size));
+		CHECK((memcmp(msg.data, data, size) == 0) && (memcmp(copy.data, data, size) == 0));
+		CHECK((size > 64) || (msg.data != copy.data));
+		CHECK((size <= 128) || (msg.data == copy.data));	// the slot is rounded up to cache line
+		CHECK((strcmp(msg.channel, "body") == 0) && (strcmp(copy.channel, "body") == 0));
+		psb_free_message(&msg);
+		psb_free_message(&copy);
+	}
+
+	// the body of psb_publish_message_nocopy() refers to the publisher's data object
+	CHECK(psb_publish_message_nocopy(broker, "body", data, 8, check_release, &released) == 2);
+	CHECK(psb_try_get_message(subscriber, &msg) == 0);
+	CHECK(psb_try_get_message(spsc, &copy) == 0);
+	CHECK((msg.data == data) && (copy.data == data) && (msg.datalen == 8));
+	psb_free_message(&msg);
+	CHECK(released == 0);
+	psb_free_message(&copy);
+	CHECK(released == 1);
+
+	psb_delete_subscriber(spsc);
+	psb_delete_subscriber(subscriber);
+	psb_delete_broker(broker);
+}
+
+// channel index trie against brute force search of prefixes
+
+#define CHECK_TRIE_NAMES	1000
+#define CHECK_TRIE_LEN		16
+
+struct check_trie_name
+{
+	uint8_t data[CHECK_TRIE_LEN];
+	size_t size;
+	int refs;		// number of adds not removed yet
+};
+
+static struct check_trie_name g_trie_names[CHECK_TRIE_NAMES];
+
+// matched values of the names, shortest first
+struct check_trie_matches
+{
+	int count;
+	int names[CHECK_TRIE_LEN + 1];
+};
+
+static int trie_random_byte(int alphabet)
+{
+	return 1 + rand() % alphabet;
+}
+
+// distinct random names of 'alphabet' bytes, many of them extending other names
+static void trie_names_make(int alphabet)
+{
+	struct check_trie_name* name;
+	int i, k, dup;
+
+	for (i = 0; i < CHECK_TRIE_NAMES; i++)
+	{
+		name = &g_trie_names[i];
+		do
+		{
+			name->size = 0;
+			if ((i > 0) && (rand() % 2))
+			{
+				k = rand() % i;
+				name->size = 1 + rand() % g_trie_names[k].size;
+				memcpy(name->data, g_trie_names[k].data, name->size);
+			}
+			for (k = rand() % 5 + (name->size == 0); (k > 0) && (name->size < CHECK_TRIE_LEN); k--)
+			{
+				name->data[name->size++] = (uint8_t)trie_random_byte(alphabet);
+			}
+			for (dup = 0, k = 0; (k < i) && !dup; k++)
+			{
+				dup = (g_trie_names[k].size == name->size) && (memcmp(g_trie_names[k].data, name->data, name->size) == 0);
+			}
+		}
+		while (dup);
+		name->refs = 0;
+	}
+}
+
+// random adds and removes of the names, the trie values point to the names
+static int trie_churn(struct ptrie* trie, int ops)
+{
+	struct check_trie_name* name;
+	int rval = 1;
+	int rc;
+
+	while (ops-- > 0)
+	{
+		name = &g_trie_names[rand() % CHECK_TRIE_NAMES];
+		if ((name->refs > 0) && (rand() % 3 == 0))
+		{
+			rc = ptrie_remove_str(trie, name->data, name->size);
+			rval = rval && (rc == (name->refs == 1));
+			name->refs--;
+		}
+		else
+		{
+			rc = ptrie_add_str(trie, name->data, name->size);
+			rval = rval && (rc == (name->refs == 0));
+			if (rc == 1)
+			{
+				*ptrie_value(trie, name->data, name->size) = name;
+			}
+			name->refs++;
+		}
+	}
+
+	return rval;
+}
+
+// remove all the names left
+static void trie_clear(struct ptrie* trie)
+{
+	struct check_trie_name* name;
+	int i;
+
+	for (i = 0; i < CHECK_TRIE_NAMES; i++)
+	{
+		for (name = &g_trie_names[i]; name->refs > 0; name->refs--)
+		{
+			ptrie_remove_str(trie, name->data, name->size);
+		}
+	}
+}
+
+// ptrie_match_all() callback: collect the matched names
+static void trie_collect(void* value, void* arg)
+{
+	struct check_trie_matches* matches = (struct check_trie_matches*)arg;
+
+	if (matches->count <= CHECK_TRIE_LEN)
+	{
+		matches->names[matches->count] = (int)((struct check_trie_name*)value - g_trie_names);
+	}
+	matches->count++;
+}
+
+// names in the trie being prefix of the data, shortest first (one name of each length at most)
+static void trie_reference(const uint8_t* data, size_t size, struct check_trie_matches* matches)
+{
+	int prefix[CHECK_TRIE_LEN + 1];
+	struct check_trie_name* name;
+	size_t len;
+	int i;
+
+	memset(prefix, -1, sizeof(prefix));
+	for (i = 0; i < CHECK_TRIE_NAMES; i++)
+	{
+		name = &g_trie_names[i];
+		if ((name->refs > 0) && (name->size <= size) && (memcmp(name->data, data, name->size) == 0))
+		{
+			prefix[name->size] = i;
+		}
+	}
+
+	matches->count = 0;
+	for (len = 0; len <= CHECK_TRIE_LEN; len++)
+	{
+		if (prefix[len] >= 0)
+		{
+			matches->names[matches->count++] = prefix[len];
+		}
+	}
+}
+
+static int trie_matches_equal(const struct check_trie_matches* a, const struct check_trie_matches* b)
+{
+	return (a->count == b->count) && (memcmp(a->names, b->names, a->count * sizeof(a->names[0])) == 0);
+}
+
+// the trie and its frozen form (either may be NULL) agree with the reference on the data
+static int trie_agrees(struct ptrie* trie, const struct ptrie_frozen* frozen, const uint8_t* data, size_t size)
+{
+	struct check_trie_matches expected, matches;
+	int rval;
+
+	trie_reference(data, size, &expected);
+	rval = 1;
+
+	if (trie != NULL)
+	{
+		rval = (ptrie_match_str(trie, data, size) == (expected.count > 0));
+		matches.count = 0;
+		rval = rval && (ptrie_match_all(trie, data, size, trie_collect, &matches) == expected.count);
+		rval = rval && trie_matches_equal(&matches, &expected);
+	}
+
+	if (frozen != NULL)
+	{
+		matches.count = 0;
+		rval = rval && (ptrie_frozen_match(frozen, data, size, trie_collect, &matches) == expected.count);
+		rval = rval && trie_matches_equal(&matches, &expected);
+	}
+
+	return rval;
+}
+
+// match the names, their prefixes and extensions and random strings, the byte past the data is not NUL
+static int trie_queries(struct ptrie* trie, const struct ptrie_frozen* frozen, int alphabet)
+{
+	struct check_trie_name* name;
+	uint8_t data[CHECK_TRIE_LEN + 2];
+	size_t size;
+	int i, rval = 1;
+
+	for (i = 0; i < CHECK_TRIE_NAMES; i++)
+	{
+		name = &g_trie_names[i];
+		for (size = name->size - 1; size <= name->size + 1; size++)
+		{
+			memcpy(data, name->data, name->size);
+			data[name->size] = (uint8_t)trie_random_byte(alphabet);
+			data[size] = (uint8_t)trie_random_byte(alphabet);
+			rval = rval && trie_agrees(trie, frozen, data, size);
+		}
+
+		for (size = 0; size < (size_t)(rand() % CHECK_TRIE_LEN); size++)
+		{
+			data[size] = (uint8_t)trie_random_byte(alphabet);
+		}
+		data[size] = (uint8_t)trie_random_byte(alphabet);
+		rval = rval && trie_agrees(trie, frozen, data, size);
+	}
+
+	return rval;
+}
+
+// narrow alphabet makes deep trie of long prefixes, wide one nodes of many children
+static const int g_trie_alphabets[] = {2, 4, 40, 255};
+
+#define CHECK_TRIE_ALPHABETS	(int)(sizeof(g_trie_alphabets) / sizeof(g_trie_alphabets[0]))
+
+// matching agrees with the reference on random names as the trie grows and shrinks
+static void check_trie(void)
+{
+	struct ptrie trie;
+	int i, round;
+
+	srand(1);
+	for (i = 0; i < CHECK_TRIE_ALPHABETS; i++)
+	{
+		trie_names_make(g_trie_alphabets[i]);
+		ptrie_init(&trie);
+		CHECK(trie_queries(&trie, NULL, g_trie_alphabets[i]));
+		for (round = 0; round < 4; round++)
+		{
+			CHECK(trie_churn(&trie, CHECK_TRIE_NAMES * 2));
+			CHECK(trie_queries(&trie, NULL, g_trie_alphabets[i]));
+		}
+
+		// the emptied nodes go away
+		trie_clear(&trie);
+		CHECK(trie_queries(&trie, NULL, g_trie_alphabets[i]));
+		ptrie_term(&trie);
+	}
+}
+
+// ptrie_clone() callback: count the copied values, keep them
+static void* trie_clone_value(void* value, void* arg)
+{
+	(*(int*)arg)++;
+	return value;
+}
+
+// ptrie_walk() callback: count the values
+static void trie_count(void* value, void* arg)
+{
+	(void)value;
+	(*(int*)arg)++;
+}
+
+// number of names in the trie
+static int trie_names_count(void)
+{
+	int i, count = 0;
+
+	for (i = 0; i < CHECK_TRIE_NAMES; i++)
+	{
+		count += (g_trie_names[i].refs > 0);
+	}
+	return count;
+}
+
+// the nodes of the arena are copied, compacted and reused without changing the matching
+static void check_trie_arena(void)
+{
+	struct ptrie trie, copy;
+	size_t used, allocated, copy_used, copy_allocated;
+	int i, round, copied, walked;
+
+	srand(2);
+	for (i = 0; i < CHECK_TRIE_ALPHABETS; i++)
+	{
+		trie_names_make(g_trie_alphabets[i]);
+		ptrie_init(&trie);
+		for (round = 0; round < 4; round++)
+		{
+			// the removed nodes are left free in the arena
+			CHECK(trie_churn(&trie, CHECK_TRIE_NAMES * 2));
+			ptrie_memory(&trie, &used, &allocated);
+			CHECK(used <= allocated);
+
+			// the copy takes the same nodes, its values are copied
+			copied = 0;
+			CHECK(ptrie_clone(&copy, &trie, trie_clone_value, &copied) == 0);
+			CHECK(copied == trie_names_count());
+			ptrie_memory(&copy, &copy_used, &copy_allocated);
+			CHECK((copy_used == used) && (copy_used <= copy_allocated));
+			CHECK(trie_queries(&copy, NULL, g_trie_alphabets[i]));
+			walked = 0;
+			ptrie_walk(&copy, trie_count, &walked);
+			CHECK(walked == copied);
+			ptrie_term(&copy);
+
+			// the compacted trie keeps its nodes and values and grows again
+			CHECK(ptrie_compact(&trie) == 0);
+			ptrie_memory(&trie, &copy_used, &copy_allocated);
+			CHECK((copy_used == used) && (copy_used <= copy_allocated));
+			CHECK(trie_queries(&trie, NULL, g_trie_alphabets[i]));
+		}
+
+		// the copy of the empty trie is empty
+		trie_clear(&trie);
+		CHECK(ptrie_clone(&copy, &trie, NULL, NULL) == 0);
+		CHECK(trie_queries(&copy, NULL, g_trie_alphabets[i]));
+		ptrie_term(&copy);
+		ptrie_term(&trie);
+	}
+}
+
+// the frozen form matches as the trie it was made of, whatever happens to the trie later
+static void check_trie_frozen(void)
+{
+	static int refs[CHECK_TRIE_NAMES];
+	struct ptrie_frozen* frozen;
+	struct ptrie trie;
+	int i, k, round, current;
+
+	srand(3);
+	for (i = 0; i < CHECK_TRIE_ALPHABETS; i++)
+	{
+		trie_names_make(g_trie_alphabets[i]);
+		ptrie_init(&trie);
+		frozen = ptrie_freeze(&trie);
+		CHECK((frozen != NULL) && trie_queries(&trie, frozen, g_trie_alphabets[i]));
+		ptrie_frozen_free(frozen);
+
+		for (round = 0; round < 4; round++)
+		{
+			CHECK(trie_churn(&trie, CHECK_TRIE_NAMES * 2));
+			frozen = ptrie_freeze(&trie);
+			CHECK((frozen != NULL) && trie_queries(&trie, frozen, g_trie_alphabets[i]));
+			if (frozen == NULL)
+			{
+				continue;
+			}
+
+			// the trie changes, the frozen form still matches the old names
+			for (k = 0; k < CHECK_TRIE_NAMES; k++)
+			{
+				refs[k] = g_trie_names[k].refs;
+			}
+			CHECK(trie_churn(&trie, CHECK_TRIE_NAMES));
+			for (k = 0; k < CHECK_TRIE_NAMES; k++)
+			{
+				current = g_trie_names[k].refs;
+				g_trie_names[k].refs = refs[k];
+				refs[k] = current;
+			}
+			CHECK(trie_queries(NULL, frozen, g_trie_alphabets[i]));
+			for (k = 0; k < CHECK_TRIE_NAMES; k++)
+			{
+				g_trie_names[k].refs = refs[k];
+			}
+			ptrie_frozen_free(frozen);
+		}
+
+		trie_clear(&trie);
+		ptrie_term(&trie);
+	}
+}
+
+#define CHECK_RECEIVE_MSGS	600
+
+// publish numbered messages starting with 'first'
+static void publish_numbers(psb_broker* broker, char* channel, int first, int count)
+{
+	int i;
+
+	for (i = first; i < first + count; i++)
+	{
+		psb_publish_message(broker, channel, &i, sizeof(i));
+	}
+}
+
+// psb_get_messages() fills up to 'max' messages in order, more than one chunk at once
+static void check_receive_many(void)
+{
+	static psb_message msgs[CHECK_RECEIVE_MSGS + 1];
+	static const int types[] = {PSB_QUEUE_LOCKED, PSB_QUEUE_MPSC, PSB_QUEUE_SPSC};
+	psb_broker* broker = psb_new_broker();
+	psb_subscriber* subscriber;
+	psb_message msg;
+	int t, i, n;
+
+	for (t = 0; t < (int)(sizeof(types) / sizeof(types[0])); t++)
+	{
+		subscriber = psb_new_subscriber_ex(broker, types[t]);
+		psb_subscribe(subscriber, "r");
+		CHECK(psb_sync_subscriptions(broker) == 0);
+
+		// the whole backlog fits
+		publish_numbers(broker, "r", 0, CHECK_RECEIVE_MSGS);
+		n = psb_get_messages(subscriber, msgs, CHECK_RECEIVE_MSGS + 1, 100);
+		CHECK(n == CHECK_RECEIVE_MSGS);
+		for (i = 0; i < n; i++)
+		{
+			if (!CHECK(*(int*)msgs[i].data == i))
+			{
+				break;
+			}
+		}
+		for (i = 0; i < n; i++)
+		{
+			psb_free_message(&msgs[i]);
+		}
+
+		// 'max' smaller than the backlog leaves the rest queued
+		publish_numbers(broker, "r", 0, CHECK_RECEIVE_MSGS);
+		n = psb_get_messages(subscriber, msgs, 300, 100);
+		CHECK(n == 300);
+		CHECK(psb_get_messages_count(subscriber) == CHECK_RECEIVE_MSGS - 300);
+		for (i = 0; i < n; i++)
+		{
+			psb_free_message(&msgs[i]);
+		}
+		n = psb_get_messages(subscriber, msgs, CHECK_RECEIVE_MSGS, 100);
+		CHECK((n == CHECK_RECEIVE_MSGS - 300) && (*(int*)msgs[0].data == 300));
+		for (i = 0; i < n; i++)
+		{
+			psb_free_message(&msgs[i]);
+		}
+
+		// both receive calls time out the same way
+		CHECK(psb_get_messages(subscriber, msgs, 10, 10) == CHECK_TIMEOUT);
+		CHECK(psb_get_message(subscriber, &msg, 10) == CHECK_TIMEOUT);
+
+		psb_delete_subscriber(subscriber);
+	}
+
+	psb_delete_broker(broker);
+}
+
+struct check_entry
+{
+	const char* name;
+	void (*fn)(void);
+};
+
+static const struct check_entry g_check_list[] =
+{
+	{"shared", check_shared},
+	{"batch", check_batch},
+	{"mpsc", check_mpsc},
+	{"pool", check_pool},
+	{"channels", check_channels},
+	{"publisher", check_publisher},
+	{"cache", check_cache},
+	{"shards", check_shards},
+	{"fd", check_fd},
+	{"wait", check_wait},
+	{"poll", check_poll},
+	{"spsc", check_spsc},
+	{"overflow", check_overflow},
+	{"receive", check_receive_many},
+	{"nocopy", check_nocopy},
+	{"body", check_body},
+	{"trie", check_trie},
+	{"arena", check_trie_arena},
+	{"frozen", check_trie_frozen},
+	{"group", check_group},
+	{"prio", check_prio},
+	{"pattern", check_pattern},
+	{"modes", check_modes},
+};
+
+#define CHECK_COUNT	(int)(sizeof(g_check_list) / sizeof(g_check_list[0]))
+
+// run check, returns 1 if it failed
+static int run_check(const struct check_entry* entry)
+{
+	int failures = g_check_failures;
+
+	printf("%s:\n", entry->name);
+	entry->fn();
+	printf("%s: %s\n", entry->name, (g_check_failures == failures) ? "ok" : "FAILED");
+
+	return g_check_failures != failures;
+}
+
+// run the named checks (all checks if argc is 0), returns the number of failed checks or -EINVAL
+static int psb_check(int argc, char** argv)
+{
+	int failed = 0;
+	int i, k;
+
+	if (argc == 0)
+	{
+		for (k = 0; k < CHECK_COUNT; k++)
+		{
+			failed += run_check(&g_check_list[k]);
+		}
+		return failed;
+	}
+
+	for (i = 0; i < argc; i++)
+	{
+		for (k = 0; k < CHECK_COUNT; k++)
+		{
+			if (strcmp(argv[i], g_check_list[k].name) == 0)
+			{
+				failed += run_check(&g_check_list[k]);
+				break;
+			}
+		}
+
+		if (k == CHECK_COUNT)
+		{
+			printf("unknown check: %s\n", argv[i]);
+			return -EINVAL;
+		}
+	}
+
+	return failed;
+}
 
 int main(int argc, char** argv)
 {
+	// "libpsb-test bench [name...]" runs benchmarks instead of test
+	if ((argc > 1) && (strcmp(argv[1], "bench") == 0))
+	{
+		return psb_bench(argc - 2, argv + 2);
+	}
+
+	// "libpsb-test check [name...]" runs behavioural checks, exits with nonzero status if any fails
+	if ((argc > 1) && (strcmp(argv[1], "check") == 0))
+	{
+		return (psb_check(argc - 2, argv + 2) != 0) ? 1 : 0;
+	}
+
 	psb_test_multithread();
 	return 0;
 }
@@ -38,6 +38,7 @@ struct timespec
 #define mutex_init          InitializeSRWLock
 #define mutex_lock          AcquireSRWLockExclusive
 #define mutex_unlock        ReleaseSRWLockExclusive
+#define mutex_trylock(m)    (TryAcquireSRWLockExclusive(m) != 0)
 #define mutex_destroy(m)
 #define MUTEX_INITIALIZER   SRWLOCK_INIT
 
@@ -48,6 +49,42 @@ struct timespec
 #define cond_broadcast      WakeAllConditionVariable
 #define cond_wait(c, m)     SleepConditionVariableSRW((c), (m), INFINITE, 0)
 #define cond_destroy(c)
+#define COND_INITIALIZER    CONDITION_VARIABLE_INIT
+
+// Threads, THREAD_PROC() declares the thread function
+#define thread_t            HANDLE
+#define THREAD_PROC(NAME, PARAM)    DWORD WINAPI NAME(LPVOID PARAM)
+#define THREAD_RETURN       0
+#define thread_create(t, f, a)  (((*(t) = CreateThread(NULL, 0, (f), (a), 0, NULL)) != NULL) ? 0 : -1)
+#define thread_join(t)      (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+
+// Atomic counters, the functions return the new value
+#define atomic_inc(p)       InterlockedIncrement((volatile LONG*)(p))
+#define atomic_dec(p)       InterlockedDecrement((volatile LONG*)(p))
+#define atomic_add(p, v)    (InterlockedExchangeAdd((volatile LONG*)(p), (v)) + (v))
+
+// Sequentially consistent loads and stores
+#define atomic_load_long(p)     InterlockedCompareExchange((volatile LONG*)(p), 0, 0)
+#define atomic_store_long(p, v) InterlockedExchange((volatile LONG*)(p), (v))
+#define atomic_load_ptr(p)      InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define atomic_store_ptr(p, v)  InterlockedExchangePointer((PVOID volatile*)(p), (v))
+
+// Acquire loads and release stores (volatile accesses have these semantics with /volatile:ms)
+#define atomic_load_acquire(p)      (*(volatile LONG*)(p))
+#define atomic_store_release(p, v)  (*(volatile LONG*)(p) = (v))
+
+// Atomic exchange, returns the previous value
+#define atomic_xchg_ptr(p, v)   InterlockedExchangePointer((PVOID volatile*)(p), (v))
+
+// Atomic compare and swap, returns nonzero if '*p' was 'o' and is replaced by 'v'
+#define atomic_cas_ptr(p, o, v) (InterlockedCompareExchangePointer((PVOID volatile*)(p), (v), (o)) == (PVOID)(o))
+#define atomic_cas_long(p, o, v) (InterlockedCompareExchange((volatile LONG*)(p), (v), (o)) == (LONG)(o))
+
+#define thread_yield()      SwitchToThread()
+#define THREAD_LOCAL        __declspec(thread)
+
+// Hint to the processor in a busy-wait loop
+#define cpu_relax()         YieldProcessor()
 
 // Oh god. Microsoft lacks native condition variables on
 // anything lower than Vista.
@@ -58,6 +95,7 @@ struct timespec
 #elif defined(__linux__)
 
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
 
 #define mutex_t pthread_mutex_t
@@ -67,6 +105,7 @@ struct timespec
 
 #define mutex_lock     pthread_mutex_lock
 #define mutex_unlock   pthread_mutex_unlock
+#define mutex_trylock(m) (pthread_mutex_trylock(m) == 0)
 #define mutex_destroy  pthread_mutex_destroy
 #define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 
@@ -76,6 +115,48 @@ struct timespec
 #define cond_wait      pthread_cond_wait
 #define cond_timedwait pthread_cond_timedwait
 #define cond_destroy   pthread_cond_destroy
+#define COND_INITIALIZER PTHREAD_COND_INITIALIZER
+
+// Threads, THREAD_PROC() declares the thread function
+#define thread_t pthread_t
+#define THREAD_PROC(NAME, PARAM) void* NAME(void* PARAM)
+#define THREAD_RETURN  NULL
+#define thread_create(t, f, a) pthread_create((t), NULL, (f), (a))
+#define thread_join(t) pthread_join((t), NULL)
+
+// Atomic counters, the functions return the new value
+#define atomic_inc(p)  __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(p)  __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define atomic_add(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+
+// Sequentially consistent loads and stores
+#define atomic_load_long(p)     __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_store_long(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_load_ptr(p)      __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_store_ptr(p, v)  __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+// Acquire loads and release stores
+#define atomic_load_acquire(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_release(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Atomic exchange, returns the previous value
+#define atomic_xchg_ptr(p, v)   __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+// Atomic compare and swap, returns nonzero if '*p' was 'o' and is replaced by 'v'
+#define atomic_cas_ptr(p, o, v) __sync_bool_compare_and_swap((p), (o), (v))
+#define atomic_cas_long(p, o, v) __sync_bool_compare_and_swap((p), (o), (v))
+
+#define thread_yield   sched_yield
+#define THREAD_LOCAL   __thread
+
+// Hint to the processor in a busy-wait loop
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()    __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()    __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()    __asm__ __volatile__("" ::: "memory")
+#endif
 
 #else
 #error The unsupported platform
@@ -9,29 +9,305 @@ l * psb_broker.c
 #include <string.h>
 #include <errno.h>
 #include "trie.h"
+#include "wildcard.h"
 #include "threadqueue.h"
+#include "epoch.h"
+#include "slab.h"
 #include "platform.h"
 #include "psb.h"
 
+// Declare broker's shard - partition of subscribers with own routing and lock
+struct psb_shard
+{
+	psb_subscriber* subscriber_list;	// reference to subscriber's list
+	mutex_t mutex;				// mutex for subscriber's list and subscriptions change
+	struct psb_route* route;		// current routing snapshot, publishers read it without lock
+	struct psb_route* table;		// subscriptions of shard changed in place under mutex (NULL before the first one)
+	volatile long stale;		// 'table' is changed since 'route' was built from it
+	long commits;				// number of snapshots published (under mutex)
+};
+
+// Declare router - broker's thread rebuilding routing snapshots of shards with changed subscriptions
+struct psb_router
+{
+	mutex_t mutex;			// mutex for router's state
+	cond_t wake;			// wakes the router when subscriptions change, it is waited for or stopped
+	cond_t done;			// wakes psb_sync_subscriptions() when the router rebuilt the snapshots
+	thread_t thread;		// the router thread (PSB_ROUTER_RUNNING state)
+	int state;				// PSB_ROUTER_NONE, PSB_ROUTER_RUNNING, PSB_ROUTER_STOP or PSB_ROUTER_FAILED
+	int waiters;			// number of threads in psb_sync_subscriptions()
+	int error;				// result of the last rebuild (-ENOMEM if a snapshot stays stale)
+	long changes;			// number of subscription changes
+	long routed;			// number of changes the published snapshots contain
+};
+
+// Router states
+#define PSB_ROUTER_NONE		0	// the thread is started by the first subscription change
+#define PSB_ROUTER_RUNNING	1	// the thread rebuilds snapshots
+#define PSB_ROUTER_STOP		2	// the thread is asked to exit, see psb_delete_broker()
+#define PSB_ROUTER_FAILED	3	// the thread could not be started, subscribing threads rebuild snapshots
+
+#define PSB_ROUTER_INITIALIZER	{MUTEX_INITIALIZER, COND_INITIALIZER, COND_INITIALIZER, 0, PSB_ROUTER_NONE, 0, 0, 0, 0}
+
+// Delay of rebuild after subscriptions change (milliseconds), bursts of changes are rebuilt once
+#define PSB_ROUTER_DELAY		1
+#define PSB_ROUTER_DELAY_MAX	100
+
 // Declare broker object structure
 struct psb_broker
 {
-	psb_subscriber* subscriber_list;	// reference to subscriber's list
-	mutex_t mutex;				// mutex for thread access share
+	mutex_t mutex;				// mutex for channel table and consumer groups change
+	struct epoch epoch;			// publisher's read section, protects routes of shards and subscribers in them
+	struct psb_router router;	// thread rebuilding routing snapshots
+	struct psb_channels* channels;	// interned channel names, publishers read it without lock
+	struct psb_consumer_group* groups;	// consumer groups
+	long hits;					// cache hits of dropped channels (under mutex), see psb_get_cache_stats
+	long misses;				// cache misses of dropped channels (under mutex)
+	volatile long generation;	// number of routing changes of all shards, see psb_publisher
+	volatile long next_shard;	// shard of the next subscriber (round robin)
+	int nshards;				// number of shards
+	int separator;				// level separator of pattern subscriptions
+	struct psb_shard* shards;	// shards ('shard' or allocated array)
+	struct psb_shard shard;		// the only shard of broker created by psb_new_broker()
+};
+
+// Maximum number of broker's shards
+#define PSB_SHARDS_MAX		256
+
+// Declare routing snapshot - channel names of all subscriptions, node value is psb_subset.
+// The snapshot is never changed after publishing: subscriptions change the shard's table in place
+// and the broker's router thread replaces the snapshot by a copy of the table, the old one is freed
+// when no publisher reads it. Publishers only load the snapshot, a burst of changes is published by one copy.
+struct psb_route
+{
+	struct ptrie index;			// channel index
+	struct ptrie_frozen* frozen;	// read-only copy of index publishers match against (NULL if out of memory)
+	struct wildcard_index patterns;	// index of pattern subscriptions, node value is psb_subset
+	struct psb_exact* exact;	// table of exact subscriptions (NULL if there is none)
+	struct psb_cache* cache;	// subscribers resolved for published channels, filled by publishers
 };
 
 // Declare subscribers object structure
 struct psb_subscriber
 {
-	struct ptrie* ptrie;		// exclusive ptrie object (used for channel name search)
 	struct threadqueue* thqueue;	// exclusive message queue 
 	psb_subscriber* next;		// next subscribers (double linked list)
 	psb_subscriber* prev;		// prev subscribers (double linked list)
 	psb_broker* broker;		// pointer to the broker (owner)
+	struct psb_shard* shard;	// the broker's shard of subscriber
+	struct psb_subscription* subscriptions;	// list of subscribed channel names
+	struct psb_consumer_group* group;	// consumer group sharing the subscriber (NULL for own subscriber)
+	volatile long refcount;		// the broker's reference and publishers waiting for free space in queue
+};
+
+// Declare subscription list entry
+struct psb_subscription
+{
+	struct psb_subscription* next;	// next subscription of the same subscriber
+	size_t channel_len;		// channel name length
+	int mode;				// subscription mode (PSB_MODE_PREFIX, PSB_MODE_PATTERN or PSB_MODE_EXACT)
+	char channel[1];		// channel name, allocated with the structure
+};
+
+// Subscription modes
+#define PSB_MODE_PREFIX		0	// the channel name is prefix of channels (see psb_subscribe)
+#define PSB_MODE_PATTERN	1	// the channel name is a pattern (see psb_subscribe_pattern)
+#define PSB_MODE_EXACT		2	// the very channel (see psb_subscribe_exact)
+
+// Declare entry of exact subscriptions table
+struct psb_exact_entry
+{
+	unsigned int hash;		// hash of channel name (see channel_hash)
+	size_t name_len;		// channel name length
+	char* name;				// channel name (NULL for free entry)
+	struct psb_subset* set;	// subscribers of channel
+};
+
+// Declare table of exact subscriptions - open addressing with linear probing, at most half full
+struct psb_exact
+{
+	int size;				// number of entries (power of 2)
+	int count;				// number of used entries
+	struct psb_exact_entry entries[1];	// entries, allocated with the structure
+};
+
+// Minimal size of exact subscriptions table
+#define PSB_EXACT_MIN		16
+
+// Declare consumer group - subscriber shared by group members, each message is received by one member
+struct psb_consumer_group
+{
+	struct psb_consumer_group* next;		// next group of the broker
+	psb_subscriber* subscriber;	// the group's subscriber
+	int members;			// number of members
+	size_t name_len;		// group name length
+	char name[1];			// group name, allocated with the structure
+};
+
+// Declare interned channel name - single object for each channel name published to broker,
+// referenced by the broker's table, by message bodies (which may outlive the broker),
+// by match cache entries and by publishers looking it up. The channel referenced
+// by the table only is dropped from the table, unless it is pinned by psb_channel_get().
+struct psb_channel
+{
+	psb_channel* next;		// next channel of the same hash bucket
+	psb_channel* dropped;	// next channel dropped from the table, waiting for free
+	psb_broker* broker;		// pointer to the broker (owner)
+	volatile long refcount;	// references to the channel, 0 when dropped from the table
+	int pinned;				// the table keeps extra reference for psb_channel_get() (under the broker's mutex)
+	volatile long hits;		// publishes resolved by match cache
+	volatile long misses;	// publishes resolved by channel index
+	unsigned int hash;		// hash of channel name
+	size_t name_len;		// channel name length
+	char name[1];			// channel name, allocated with the structure
+};
+
+// Declare hash table of interned channels. Channels are added and dropped under the broker's mutex,
+// dropped channels and the replaced table of growing one are freed when no publisher reads them
+struct psb_channels
+{
+	size_t mask;			// number of buckets - 1
+	size_t count;			// number of channels
+	psb_channel* buckets[1];	// hash buckets, allocated with the structure
+};
+
+// Initial number of buckets of channel table (power of 2)
+#define PSB_CHANNELS_INIT	64
+
+// Declare set of subscribers subscribed to the same channel name (broker's index value)
+struct psb_subset
+{
+	int count;			// number of subscribers in set
+	int size;			// allocated size of 'subs' array
+	psb_subscriber* subs[1];	// subscribers, allocated with the structure
+};
+
+// Declare search of subscriber in sets, see subset_find()
+struct psb_subset_find
+{
+	psb_subscriber* subscriber;	// the subscriber looked for
+	int found;				// the subscriber is in some set
+};
+
+// Number of match cache entries of routing snapshot (power of 2) and number of entries
+// probed for channel; the least recently used of them is replaced if all are taken
+#define PSB_CACHE_SIZE		1024
+#define PSB_CACHE_PROBES	4
+
+// Declare subscribers resolved for channel (entry of match cache), never changed after insert
+// except of its age
+struct psb_resolved
+{
+	struct epoch_node node;		// the replaced entry is freed when no publisher reads it
+	psb_channel* channel;		// published channel, referenced by the entry
+	volatile long stamp;		// cache clock of the last use, refreshed by hits once per PSB_CACHE_PROBES misses
+	struct psb_subset set;		// matched subscribers (each subscriber once)
+};
+
+// Declare match cache of routing snapshot. Publishers insert and replace entries without lock,
+// the entries are freed with the snapshot, so changed subscriptions invalidate the cache
+struct psb_cache
+{
+	volatile long clock;		// number of entries inserted, age of entries
+	struct psb_resolved* entries[PSB_CACHE_SIZE];
+};
+
+// Number of subscribers polled by psb_poll() without allocation
+#define PSB_POLL_LOCAL		64
+
+// Size of subscribers array that does not require allocation in publish
+#define PSB_MATCH_LOCAL		64
+
+// Declare list of subscribers matched by published channel name
+struct psb_match
+{
+	int count;			// number of matched subscribers
+	int size;			// allocated size of 'subs' array
+	int nsets;			// number of matched subscriber's sets
+	int nomem;			// set in case of allocation error
+	psb_subscriber** subs;		// matched subscribers ('local' or allocated array)
+	psb_subscriber* local[PSB_MATCH_LOCAL];
+};
+
+// Generation of publisher's cache that matches no routing snapshot
+#define PSB_GENERATION_NONE		(-1L)
+
+// Declare publisher bound to channel, it keeps the subscribers matched by the channel
+// while the routing snapshot is not changed
+struct psb_publisher
+{
+	psb_channel* channel;		// interned channel to publish
+	long generation;			// routing generation of 'match', PSB_GENERATION_NONE if not valid
+	struct psb_match match;		// subscribers matched by channel
+};
+
+// Size of batch arrays that do not require allocation (groups size is power of 2)
+#define PSB_BATCH_DELIVERIES	256
+#define PSB_BATCH_GROUPS		16
+
+// Declare batch delivery - entry delivered to subscriber, chained per subscriber
+struct psb_delivery
+{
+	int index;			// entry index in batch
+	int next;			// next delivery to the same subscriber (-1 for last)
+};
+
+// Declare batch group - all deliveries of batch to one subscriber (hash table entry)
+struct psb_group
+{
+	psb_subscriber* subscriber;	// matched subscriber, NULL for empty entry
+	int first;			// first delivery of the group
+	int last;			// last delivery of the group
+	int count;			// number of deliveries
+	int deferred;			// publisher waits for free space in the subscriber's queue after read section
+};
+
+// Declare batch deliveries grouped by subscriber
+struct psb_batch
+{
+	struct psb_delivery* deliveries;	// deliveries ('local_deliveries' or allocated array)
+	int ndeliveries;		// number of deliveries
+	int size;			// allocated size of 'deliveries'
+	struct psb_group* groups;	// hash table of groups ('local_groups' or allocated array)
+	int ngroups;			// number of groups
+	int mask;			// hash table size - 1
+	struct psb_delivery local_deliveries[PSB_BATCH_DELIVERIES];
+	struct psb_group local_groups[PSB_BATCH_GROUPS];
+};
+
+// Declare shared message body - the single copy of channel name and data
+// referenced by all the subscriber's queues the message was delivered to.
+// The header is kept small: the body of data object up to 24 bytes fits the smallest pool block (one cache line)
+struct psb_payload
+{
+	volatile long refcount;	// number of references (queued or received messages)
+	int datalen;		// data object size
+	unsigned char prio;	// message priority
+	unsigned char flags;	// PSB_PAYLOAD_WRAP, PSB_PAYLOAD_SLOT
+	psb_channel* channel;	// interned channel name, referenced by the body
+	// data object copy follows the structure (unless PSB_PAYLOAD_WRAP)
 };
 
+// Body referencing the publisher's data object, see psb_publish_message_nocopy()
+struct psb_payload_wrap
+{
+	struct psb_payload header;
+	void* data;			// the publisher's data object
+	psb_release_fn release;	// releases the publisher's data object
+	void* release_arg;	// argument of 'release'
+};
+
+// Flags of message body
+#define PSB_PAYLOAD_WRAP	1	// the body is psb_payload_wrap
+#define PSB_PAYLOAD_SLOT	2	// the body is stored in the slot of PSB_QUEUE_SPSC queue, see message_put()
+
+// Number of messages psb_get_messages() takes from queue under one lock
+#define PSB_GET_MESSAGES_CHUNK	256
+
 // Global broker - simplify code in case only broker in program
-static psb_broker g_global_psb_broker = {NULL, MUTEX_INITIALIZER};
+static psb_broker g_global_psb_broker = {MUTEX_INITIALIZER, EPOCH_INITIALIZER, PSB_ROUTER_INITIALIZER,
+	NULL, NULL, 0, 0, 0, 0, 1,
+	WILDCARD_SEPARATOR, &g_global_psb_broker.shard, {NULL, MUTEX_INITIALIZER, NULL, NULL, 0, 0}};
 
 // insert new subscriber to subscriber's double-linked list
 static void slist_insert(psb_subscriber* list, psb_subscriber* entry);
@@ -39,8 +315,170 @@ static void slist_insert(psb_subscriber* list, psb_subscriber* entry);
 // remove subscriber from subscriber's double-linked list
 static void slist_remove(psb_subscriber* entry); 
 
-// duplicate memory object
-static void* memdup(const void* mem, size_t size);
+// remove subscriber from subscriber's list of the shard
+static void subscriber_unlink(psb_subscriber* subscriber);
+
+// freeing subscriber and all linked objects
+static void subscriber_free(psb_subscriber* subscriber);
+
+// drop reference to subscriber, the subscriber freed with last reference
+static void subscriber_release(psb_subscriber* subscriber);
+
+// make a modifiable copy of routing snapshot (empty snapshot if 'route' is NULL)
+static struct psb_route* route_clone(psb_broker* broker, struct psb_route* route);
+
+// compile the snapshot's index for publishers (before route_commit(), out of the shard's mutex if possible)
+static void route_freeze(struct psb_route* route);
+
+// replace the shard's routing snapshot (under the shard's mutex), returns the old snapshot for route_retire()
+static struct psb_route* route_commit(psb_broker* broker, struct psb_shard* shard, struct psb_route* route);
+
+// free the old routing snapshot when publishers left it (out of the shard's mutex and read section)
+static void route_retire(psb_broker* broker, struct psb_route* route);
+
+// rebuild the shard's routing snapshot from its table if subscriptions were changed since
+static int route_refresh(psb_broker* broker, struct psb_shard* shard);
+
+// rebuild routing snapshots of shards with changed subscriptions (by router, out of shard's mutex)
+static int broker_refresh(psb_broker* broker);
+
+// hand the change of shard's table to the router (out of shard's mutex)
+static void router_notify(psb_broker* broker);
+
+// the router thread: rebuilds routing snapshots after subscriptions change
+static THREAD_PROC(router_proc, arg);
+
+// wait for the router's wake up at most 'timeout_ms' milliseconds (under router's mutex)
+static void router_wait(struct psb_router* router, long timeout_ms);
+
+// stop the router thread
+static void router_stop(struct psb_router* router);
+
+// milliseconds of wall clock (measures the router's rebuild)
+static long router_clock(void);
+
+// remove subscription of subscriber from routing
+static void route_remove(struct psb_route* route, psb_subscriber* subscriber, struct psb_subscription* subscription);
+
+// freeing routing snapshot
+static void route_free(struct psb_route* route);
+
+// add subscriber to the index of channel 'channel'
+static int index_add(struct ptrie* index, psb_subscriber* subscriber, const char* channel, size_t channel_len);
+
+// remove subscriber from the index of channel 'channel'
+static void index_remove(struct ptrie* index, psb_subscriber* subscriber, const char* channel, size_t channel_len);
+
+// add subscriber to the index of pattern 'pattern'
+static int patterns_add(struct wildcard_index* patterns, psb_subscriber* subscriber, const char* pattern,
+	size_t pattern_len);
+
+// remove subscriber from the index of pattern 'pattern'
+static void patterns_remove(struct wildcard_index* patterns, psb_subscriber* subscriber, const char* pattern,
+	size_t pattern_len);
+
+// add subscriber to the table of exact subscriptions of channel 'channel'
+static int exact_add(struct psb_exact** table, psb_subscriber* subscriber, const char* channel, size_t channel_len);
+
+// remove subscriber from the table of exact subscriptions of channel 'channel'
+static void exact_remove(struct psb_exact** table, psb_subscriber* subscriber, const char* channel,
+	size_t channel_len);
+
+// copy table of exact subscriptions to 'copy', -ENOMEM if some set is not copied (the copy is partial)
+static int exact_clone(struct psb_exact** copy, const struct psb_exact* table);
+
+// freeing table of exact subscriptions
+static void exact_free(struct psb_exact* table);
+
+// subscribe to channel, pattern or exact channel
+static int subscription_add(psb_subscriber* subscriber, const char* channel_name, int mode);
+
+// ptrie_match_all() callback: look for subscriber in set
+static void subset_find(void* value, void* arg);
+
+// unsubscribe from channel, pattern or exact channel
+static int subscription_remove(psb_subscriber* subscriber, const char* channel_name, int mode);
+
+// find all subscribers matched by channel name with hash 'hash' (each subscriber appears once)
+static int match_subscribers(struct psb_route* route, const char* channel, size_t channel_len, unsigned int hash,
+	struct psb_match* match);
+
+// find all subscribers matched by channel using match cache of routing snapshot, 'cached' is set
+// if they were found in the cache
+static int route_match(struct psb_route* route, psb_channel* channel, struct psb_match* match, int* cached);
+
+// get age of match cache entry, number of entries inserted since its last use
+static unsigned long resolved_age(struct psb_resolved* resolved, unsigned long clock);
+
+// freeing match cache entry and drop its reference to channel
+static void resolved_free(struct epoch_node* node);
+
+// find all subscribers matched by channel in routing snapshots of all shards (in read section)
+static int broker_match(psb_broker* broker, psb_channel* channel, struct psb_match* match);
+
+// freeing memory allocated by match_subscribers()
+static void match_free(struct psb_match* match);
+
+// find or add interned channel and take reference to it, NULL if out of memory
+static psb_channel* channel_intern(psb_broker* broker, const char* name, size_t name_len);
+
+// drop reference to interned channel, the channel freed with last reference
+static void channel_release(psb_channel* channel);
+
+// freeing the broker's channel table and drop its references to channels
+static void channels_free(struct psb_channels* table);
+
+// initialize empty batch
+static void batch_init(struct psb_batch* batch);
+
+// add delivery of entry 'index' to subscriber
+static int batch_add(struct psb_batch* batch, psb_subscriber* subscriber, int index);
+
+// freeing memory allocated by batch_add()
+static void batch_free(struct psb_batch* batch);
+
+// convert timeout in milliseconds to 'ts' (NULL for infinite timeout)
+static struct timespec* timeout_ts(int timeout_ms, struct timespec* ts);
+
+// fill received message, the message references shared body
+static void message_init(psb_message* msg, struct psb_payload* payload);
+
+// allocate shared message body, reference count is set to 1
+static struct psb_payload* payload_new(psb_channel* channel, void* data, int datalen);
+
+// allocate shared message body referencing the publisher's data object, reference count is set to 1
+static struct psb_payload* payload_wrap(psb_channel* channel, void* data, int datalen,
+	psb_release_fn release, void* release_arg);
+
+// drop reference to shared message body, the body freed with last reference
+static void payload_release(struct psb_payload* payload);
+
+// data object of message body
+static void* payload_data(struct psb_payload* payload);
+
+// queue's size function: data object size of message body
+static long payload_size(void* data);
+
+// put message body to subscriber's queue, the caller's reference is passed to queue on success
+static int message_put(psb_subscriber* subscriber, struct psb_payload* payload, int wait);
+
+// build message body of data object in the slot of PSB_QUEUE_SPSC subscriber's queue
+static int message_put_inline(psb_subscriber* subscriber, psb_channel* channel, void* data, int datalen, int prio);
+
+// route message body (or data object, if 'payload' is NULL) and put it to matched subscriber's queues,
+// the publisher's reference is dropped; subscribers matched for 'publisher' (if not NULL) are reused
+// until routing is changed
+static int publish_payload(psb_channel* channel, void* data, int datalen, int prio,
+	struct psb_payload* payload, psb_publisher* publisher);
+
+// find consumer group by name, the broker's mutex must be held
+static struct psb_consumer_group* group_find(psb_broker* broker, const char* name, size_t name_len);
+
+// allocate subscriber with queue of given type, the ring size applies to PSB_QUEUE_SPSC
+static psb_subscriber* subscriber_new(psb_broker* broker, int queue_type, long slots, int inline_size);
+
+// freeing message's memory
+void freedata(void* data);
 
 /**
  * Create new broker
@@ -55,11 +493,75 @@ static void* memdup(const void* mem, size_t size);
  */
 psb_broker* psb_new_broker()
 {
-	psb_broker* new_broker = (psb_broker*)malloc(sizeof(struct psb_broker));
-	if (new_broker != NULL)
+	return psb_new_broker_ex(1);
+}
+
+/**
+ * Create new sharded broker
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_new_broker_ex() is psb_new_broker() with subscribers partitioned over 'nshards' shards.
+ * Every shard has own lock and routing, so subscriptions change locks and rebuilds the routing
+ * of the subscriber's shard only and subscribers of different shards are changed in parallel.
+ * The publish searches subscribers of all shards.
+ *
+ * @param nshards number of shards (1 to 256)
+ * @return allocated psb_broker or NULL in case of error
+ */
+psb_broker* psb_new_broker_ex(int nshards)
+{
+	psb_broker* new_broker;
+	int i;
+
+	if ((nshards < 1) || (nshards > PSB_SHARDS_MAX))
+	{
+		return NULL;
+	}
+
+	new_broker = (psb_broker*)malloc(sizeof(struct psb_broker));
+	if (new_broker == NULL)
 	{
-		new_broker->subscriber_list = NULL;
-		mutex_init(&new_broker->mutex);
+		return NULL;
+	}
+
+	new_broker->shards = &new_broker->shard;
+	if (nshards > 1)
+	{
+		new_broker->shards = (struct psb_shard*)malloc(nshards * sizeof(struct psb_shard));
+		if (new_broker->shards == NULL)
+		{
+			free(new_broker);
+			return NULL;
+		}
+	}
+
+	mutex_init(&new_broker->mutex);
+	epoch_init(&new_broker->epoch);
+	mutex_init(&new_broker->router.mutex);
+	cond_init(&new_broker->router.wake);
+	cond_init(&new_broker->router.done);
+	new_broker->router.state = PSB_ROUTER_NONE;
+	new_broker->router.waiters = 0;
+	new_broker->router.error = 0;
+	new_broker->router.changes = 0;
+	new_broker->router.routed = 0;
+	new_broker->channels = NULL;
+	new_broker->groups = NULL;
+	new_broker->hits = 0;
+	new_broker->misses = 0;
+	new_broker->generation = 0;
+	new_broker->next_shard = 0;
+	new_broker->nshards = nshards;
+	new_broker->separator = WILDCARD_SEPARATOR;
+	for (i = 0; i < nshards; i++)
+	{
+		new_broker->shards[i].subscriber_list = NULL;
+		mutex_init(&new_broker->shards[i].mutex);
+		new_broker->shards[i].route = NULL;
+		new_broker->shards[i].table = NULL;
+		new_broker->shards[i].stale = 0;
+		new_broker->shards[i].commits = 0;
 	}
 
 	return new_broker;
@@ -77,22 +579,66 @@ psb_broker* psb_new_broker()
  */
 int psb_delete_broker(psb_broker* broker)
 {
+	int i;
+
 	// If the broker is not defined use global broker
 	if (broker == NULL)
 	{
 		broker = &g_global_psb_broker;
 	}
 
-	// remove all subscribers
-	while (broker->subscriber_list->next != broker->subscriber_list)
+	// no snapshot is rebuilt from now on
+	router_stop(&broker->router);
+
+	for (i = 0; i < broker->nshards; i++)
+	{
+		struct psb_shard* shard = &broker->shards[i];
+
+		// there are no publishers while broker is deleted, drop routing at once
+		route_free(shard->route);
+		shard->route = NULL;
+		route_free(shard->table);
+		shard->table = NULL;
+		shard->stale = 0;
+
+		// remove all subscribers
+		while (shard->subscriber_list != NULL)
+		{
+			psb_subscriber* subscriber = shard->subscriber_list;
+			subscriber_unlink(subscriber);
+			subscriber_release(subscriber);
+		}
+	}
+
+	// the groups' subscribers are removed above
+	while (broker->groups != NULL)
+	{
+		struct psb_consumer_group* group = broker->groups;
+		broker->groups = group->next;
+		free(group);
+	}
+
+	// channels are freed with the last message referencing them
+	channels_free(broker->channels);
+	broker->channels = NULL;
+
+	// free match cache entries replaced by publishers, the global broker stays usable
+	epoch_term(&broker->epoch);
+	if (broker == &g_global_psb_broker)
 	{
-		psb_delete_subscriber(broker->subscriber_list->next);
+		epoch_init(&broker->epoch);
 	}
-	psb_delete_subscriber(broker->subscriber_list);
 
 	// if broker is not global, freeing memory
 	if (broker != &g_global_psb_broker)
 	{
+		cond_destroy(&broker->router.wake);
+		cond_destroy(&broker->router.done);
+		mutex_destroy(&broker->router.mutex);
+		if (broker->shards != &broker->shard)
+		{
+			free(broker->shards);
+		}
 		free(broker);
 	}
 
@@ -111,9 +657,81 @@ int psb_delete_broker(psb_broker* broker)
  * @return allocated psb_subscriber or NULL in case of error
  */
 psb_subscriber* psb_new_subscriber(psb_broker* broker)
+{
+	return psb_new_subscriber_ex(broker, PSB_QUEUE_LOCKED);
+}
+
+/**
+ * Create new subscriber with given queue type
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_new_subscriber_ex() is psb_new_subscriber() with the choice of message queue.
+ * PSB_QUEUE_LOCKED is the default mutex guarded queue.
+ * PSB_QUEUE_MPSC is lock-free for publishers and blocks the subscriber only when
+ * the queue is empty, it suits channels with many concurrent publishers.
+ * Messages of PSB_QUEUE_MPSC subscriber must be received by one thread at a time.
+ * PSB_QUEUE_SPSC is psb_new_subscriber_spsc() with PSB_SPSC_SLOTS slots of PSB_SPSC_INLINE bytes.
+ *
+ * @param parent broker
+ * @param queue_type PSB_QUEUE_LOCKED, PSB_QUEUE_MPSC or PSB_QUEUE_SPSC
+ * @return allocated psb_subscriber or NULL in case of error
+ */
+psb_subscriber* psb_new_subscriber_ex(psb_broker* broker, int queue_type)
+{
+	return subscriber_new(broker, queue_type, PSB_SPSC_SLOTS, PSB_SPSC_INLINE);
+}
+
+/**
+ * Create new subscriber with single publisher ring
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_new_subscriber_spsc() creates subscriber of PSB_QUEUE_SPSC queue: a ring of 'slots'
+ * cache line aligned slots (rounded up to power of two) passing messages by acquire/release atomics,
+ * without lock. Messages with data objects up to 'inline_size' bytes are stored in the slot itself:
+ * the message published to this subscriber only is built in the slot without allocation, the message
+ * matched by other subscribers too is copied into the slot from the shared body. Bigger ones
+ * (and psb_publish_message_nocopy() ones) are passed as shared body the usual way. The subscriber
+ * must be published to by one thread at a time and its messages must be received by one thread at a time.
+ * The ring is the capacity of queue: the publisher waits for free slot when the ring is full
+ * (the received but not freed messages hold their slots), see psb_set_queue_limit() for other choices.
+ *
+ * @param parent broker
+ * @param slots number of slots
+ * @param inline_size maximum size of data object copied into the slot, 0 for none
+ * @return allocated psb_subscriber or NULL in case of error
+ */
+psb_subscriber* psb_new_subscriber_spsc(psb_broker* broker, long slots, int inline_size)
+{
+	if ((slots <= 0) || (inline_size < 0))
+	{
+		return NULL;
+	}
+	return subscriber_new(broker, PSB_QUEUE_SPSC, slots, inline_size);
+}
+
+static psb_subscriber* subscriber_new(psb_broker* broker, int queue_type, long slots, int inline_size)
 {
 	psb_subscriber* new_sub;
-	
+	int thqueue_type;
+	int rval;
+
+	switch (queue_type)
+	{
+	case PSB_QUEUE_LOCKED:
+		thqueue_type = THREAD_QUEUE_LOCKED;
+		break;
+	case PSB_QUEUE_MPSC:
+		thqueue_type = THREAD_QUEUE_MPSC;
+		break;
+	case PSB_QUEUE_SPSC:
+		thqueue_type = THREAD_QUEUE_SPSC;
+		break;
+	default:
+		return NULL;
+	}
+
 	// If the broker is not defined use global broker
 	if (broker == NULL)
 	{
@@ -136,18 +754,17 @@ psb_subscriber* psb_new_subscriber(psb_broker* broker)
 		return NULL;
 	}
 
-	// allocate ptrie object
-	new_sub->ptrie = (struct ptrie*)malloc(sizeof(struct ptrie));
-	if (new_sub->ptrie == NULL)
+	// initialize message queue, the slot holds the message body and its data object
+	if (thqueue_type == THREAD_QUEUE_SPSC)
 	{
-		// freeing and return NULL in case of error allocation
-		free(new_sub->thqueue);
-		free(new_sub);
-		return NULL;
+		rval = thread_queue_init_spsc(new_sub->thqueue, slots,
+			(inline_size > 0) ? sizeof(struct psb_payload) + inline_size : 0);
 	}
-
-	// initialize message queue	
-	if (thread_queue_init(new_sub->thqueue) != 0)
+	else
+	{
+		rval = thread_queue_init_ex(new_sub->thqueue, thqueue_type);
+	}
+	if (rval != 0)
 	{
 		// freeing and return NULL in case of error allocation
 		free(new_sub->thqueue);
@@ -155,29 +772,30 @@ psb_subscriber* psb_new_subscriber(psb_broker* broker)
 		return NULL;
 	}
 
-	// initialize ptrie
-	ptrie_init(new_sub->ptrie);
-
 	// initialize private vars to safe state
 	new_sub->prev = new_sub;
 	new_sub->next = new_sub;
 	new_sub->broker = broker;
+	new_sub->shard = &broker->shards[(unsigned long)(atomic_inc(&broker->next_shard) - 1) % broker->nshards];
+	new_sub->subscriptions = NULL;
+	new_sub->group = NULL;
+	new_sub->refcount = 1;
 
 	// enter critical section
-	mutex_lock(&broker->mutex);
+	mutex_lock(&new_sub->shard->mutex);
 
 	// insert new subscriber to subscriber list
-	if (broker->subscriber_list != NULL)
+	if (new_sub->shard->subscriber_list != NULL)
 	{
-		slist_insert(broker->subscriber_list, new_sub);
+		slist_insert(new_sub->shard->subscriber_list, new_sub);
 	}
 	else
 	{
-		broker->subscriber_list = new_sub;
+		new_sub->shard->subscriber_list = new_sub;
 	}
 
 	// leave critical section
-	mutex_unlock(&broker->mutex);
+	mutex_unlock(&new_sub->shard->mutex);
 
 	return new_sub;
 }
@@ -185,9 +803,11 @@ psb_subscriber* psb_new_subscriber(psb_broker* broker)
 // freeing message's memory
 void freedata(void* data)
 {
-	psb_message* msg = (psb_message*)data;
-	psb_free_message(msg);
-	free(msg);
+	// the queue passes also it's empty cached entries
+	if (data != NULL)
+	{
+		payload_release((struct psb_payload*)data);
+	}
 }
 
 /**
@@ -202,17 +822,56 @@ void freedata(void* data)
  */
 int psb_delete_subscriber(psb_subscriber* subscriber)
 {
-	// remove all linked objects - mutex, queue, ptrie
+	// the group's subscriber is deleted by the last member
+	if ((subscriber != NULL) && (subscriber->group != NULL))
+	{
+		return psb_leave_group(subscriber);
+	}
+
+	// remove all linked objects - queue, subscriptions
 	if (subscriber != NULL)
 	{
-		mutex_t* mutex = &subscriber->broker->mutex;
-		mutex_lock(mutex);		// enter to critical section
-		slist_remove(subscriber);	// remove subscriber from list
-		ptrie_term(subscriber->ptrie);	// remove ptrie object
-		free(subscriber->ptrie);	// freeing ptrie memory
-		thread_queue_free(subscriber->thqueue, freedata);	// freeing queue (and all queued messages)
-		free(subscriber);	// freeing subscriber memory
-		mutex_unlock(mutex);	// leave critical section
+		struct psb_shard* shard = subscriber->shard;
+		struct psb_subscription* subscription;
+		struct psb_route* route;
+		struct psb_route* old = NULL;
+		struct threadqueue_limit limit;
+
+		mutex_lock(&shard->mutex);		// enter to critical section
+
+		// remove subscriber from routing at once (the snapshot not rebuilt yet may have its removed subscriptions too),
+		// no publisher can reach it after the old snapshot is retired
+		if ((subscriber->subscriptions != NULL) || shard->stale)
+		{
+			// the snapshot is copied before the table is changed, nothing fails after the change
+			route = route_clone(subscriber->broker, shard->table);
+			if (route == NULL)
+			{
+				mutex_unlock(&shard->mutex);
+				return -ENOMEM;
+			}
+			for (subscription = subscriber->subscriptions; subscription != NULL; subscription = subscription->next)
+			{
+				route_remove(shard->table, subscriber, subscription);
+				route_remove(route, subscriber, subscription);
+			}
+			route_freeze(route);
+			old = route_commit(subscriber->broker, shard, route);
+			atomic_store_long(&shard->stale, 0);
+		}
+
+		subscriber_unlink(subscriber);	// remove subscriber from list
+		mutex_unlock(&shard->mutex);	// leave critical section
+
+		route_retire(subscriber->broker, old);
+
+		// don't keep publishers waiting for free space, the queue is freed with their last reference
+		// (no limit would keep waiting for free slot of SPSC ring)
+		memset(&limit, 0, sizeof(limit));
+		limit.policy = THREAD_QUEUE_FAIL;
+		thread_queue_set_limit(subscriber->thqueue, &limit);
+
+		subscriber_release(subscriber);	// freeing queue (and all queued messages) and subscriber
 
 		return 0;	// success
 	}
@@ -221,42 +880,168 @@ int psb_delete_subscriber(psb_subscriber* subscriber)
 }
 
 /**
- * Subscribe to channel
+ * Join consumer group
  *
  * @ingroup PubSubBroker
  *
- * psb_subscribe() bind subscriber with channel 'channel_name'.
- * A subscriber can be subscribed to many channels.
- * if subscriber already subscribed to channel error EINVAL returned
+ * psb_join_group() returns the subscriber shared by all members of consumer group 'group_name',
+ * the first member creates it. Every message delivered to the group is put to the group's
+ * queue once and is received by exactly one member that calls psb_get_message() (or other get function)
+ * with the returned subscriber, so the work is balanced between the members without copies.
+ * Subscriptions and the queue settings of the subscriber are those of the group: a channel subscribed by
+ * one member is delivered to the group.
+ * Every member must leave the group by psb_leave_group() (or psb_delete_subscriber()),
+ * the last one deletes the group's subscriber.
  *
- * @param  subscriber
- * @param  channel_name
- * @return 0 if success or negetive value EINVAL if channel already subscribed
+ * @param broker the broker (NULL for the global broker)
+ * @param group_name name of consumer group
+ * @return the group's subscriber or NULL in case of error
  */
-int psb_subscribe(psb_subscriber* subscriber, char* channel_name)
+psb_subscriber* psb_join_group(psb_broker* broker, char* group_name)
 {
-	int rval = -EINVAL;
-	if ((subscriber != NULL) && (channel_name != NULL))
+	struct psb_consumer_group* new_group;
+	struct psb_consumer_group* group;
+	psb_subscriber* subscriber = NULL;
+	size_t name_len;
+
+	if (group_name == NULL)
 	{
-		// enter critical section
-		mutex_lock(&subscriber->broker->mutex);
+		return NULL;
+	}
 
-		// check that subscriber is not already subscribed to channel
-		if (ptrie_match_str(subscriber->ptrie, (uint8_t*)channel_name, strlen(channel_name)) == 0)
-		{
-			// subscribe to channel: add channel name to ptrie object
-			if (ptrie_add_str(subscriber->ptrie, (uint8_t*)channel_name, strlen(channel_name)) == 1)
-			{
-				rval = 0;
-			}
-		}
-		
-		// leave critical section
-		mutex_unlock(&subscriber->broker->mutex);
-		return rval;
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
 	}
 
-	return rval;
+	name_len = strlen(group_name);
+
+	mutex_lock(&broker->mutex);
+	group = group_find(broker, group_name, name_len);
+	if (group != NULL)
+	{
+		group->members++;
+		subscriber = group->subscriber;
+	}
+	mutex_unlock(&broker->mutex);
+
+	if (subscriber != NULL)
+	{
+		return subscriber;
+	}
+
+	// the first member creates the group, the subscriber is created out of the broker's lock
+	new_group = (struct psb_consumer_group*)malloc(sizeof(struct psb_consumer_group) + name_len);
+	if (new_group == NULL)
+	{
+		return NULL;
+	}
+	new_group->subscriber = psb_new_subscriber_ex(broker, PSB_QUEUE_LOCKED);
+	if (new_group->subscriber == NULL)
+	{
+		free(new_group);
+		return NULL;
+	}
+	new_group->members = 1;
+	new_group->name_len = name_len;
+	memcpy(new_group->name, group_name, name_len + 1);
+	new_group->subscriber->group = new_group;
+
+	mutex_lock(&broker->mutex);
+	group = group_find(broker, group_name, name_len);
+	if (group == NULL)
+	{
+		new_group->next = broker->groups;
+		broker->groups = new_group;
+		group = new_group;
+	}
+	else
+	{
+		group->members++;
+	}
+	subscriber = group->subscriber;
+	mutex_unlock(&broker->mutex);
+
+	// other member has created the group meanwhile
+	if (group != new_group)
+	{
+		new_group->subscriber->group = NULL;
+		psb_delete_subscriber(new_group->subscriber);
+		free(new_group);
+	}
+
+	return subscriber;
+}
+
+/**
+ * Leave consumer group
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_leave_group() ends the membership taken by psb_join_group(). The last member
+ * deletes the group's subscriber with all queued messages, as psb_delete_subscriber() does.
+ *
+ * @param subscriber the group's subscriber returned by psb_join_group()
+ * @return 0 if success or -EINVAL if subscriber is not a group's subscriber
+ */
+int psb_leave_group(psb_subscriber* subscriber)
+{
+	struct psb_consumer_group* group;
+	struct psb_consumer_group** link;
+	psb_broker* broker;
+	int last;
+
+	if ((subscriber == NULL) || (subscriber->group == NULL))
+	{
+		return -EINVAL;
+	}
+
+	group = subscriber->group;
+	broker = subscriber->broker;
+
+	mutex_lock(&broker->mutex);
+	last = (--group->members == 0);
+	if (last)
+	{
+		// the group can't be joined any more
+		for (link = &broker->groups; *link != group; link = &(*link)->next)
+		{
+		}
+		*link = group->next;
+	}
+	mutex_unlock(&broker->mutex);
+
+	if (!last)
+	{
+		return 0;
+	}
+
+	free(group);
+	subscriber->group = NULL;
+
+	return psb_delete_subscriber(subscriber);
+}
+
+/**
+ * Subscribe to channel
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_subscribe() bind subscriber with channel 'channel_name'.
+ * A subscriber can be subscribed to many channels.
+ * if subscriber already subscribed to channel error EINVAL returned
+ * The subscription is routed once the broker's router thread rebuilt the routing, shortly
+ * after the call; psb_sync_subscriptions() waits for it. The same holds for other
+ * subscribe and unsubscribe functions.
+ *
+ * @param  subscriber
+ * @param  channel_name
+ * @return 0 if success or negetive value EINVAL if channel already subscribed
+ */
+int psb_subscribe(psb_subscriber* subscriber, char* channel_name)
+{
+	return subscription_add(subscriber, channel_name, PSB_MODE_PREFIX);
 }
 
 /**
@@ -266,6 +1051,8 @@ int psb_subscribe(psb_subscriber* subscriber, char* channel_name)
  *
  * psb_unsubscribe() unbind subscriber from channel 'channel_name'.
  * if subscriber is not subscribed to channel error EINVAL returned
+ * Messages published before the router rebuilt the routing may still be delivered
+ * (see psb_sync_subscriptions()).
  *
  * @param  subscriber
  * @param  channel_name
@@ -273,24 +1060,189 @@ int psb_subscribe(psb_subscriber* subscriber, char* channel_name)
  */
 int psb_unsubscribe(psb_subscriber* subscriber, char* channel_name)
 {
-	int rval = -EINVAL;
+	return subscription_remove(subscriber, channel_name, PSB_MODE_PREFIX);
+}
 
-	if ((subscriber != NULL) && (channel_name != NULL))
+/**
+ * Subscribe to channels matching pattern
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_subscribe_pattern() bind subscriber with all channels matching MQTT-style 'pattern'.
+ * Channel names are split to levels by the broker's separator (see psb_set_separator()),
+ * the pattern level '+' matches any single level and the last pattern level '#' matches
+ * any number of levels: "sensors/+/temperature" matches "sensors/kitchen/temperature",
+ * "sensors/#" matches "sensors" and "sensors/kitchen/humidity". Other levels match equal
+ * levels only, so a pattern without wildcards matches the very channel (not the channels
+ * it is prefix of, as psb_subscribe() does).
+ * The patterns of all subscribers are matched together in one walk over the channel levels,
+ * and a message is delivered to the subscriber once however many of its subscriptions match.
+ *
+ * @param  subscriber
+ * @param  pattern
+ * @return 0 if success or negative value EINVAL if the pattern is invalid or already subscribed
+ */
+int psb_subscribe_pattern(psb_subscriber* subscriber, char* pattern)
+{
+	return subscription_add(subscriber, pattern, PSB_MODE_PATTERN);
+}
+
+/**
+ * Unsubscribe pattern
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_unsubscribe_pattern() unbind subscriber from 'pattern' subscribed by psb_subscribe_pattern().
+ *
+ * @param  subscriber
+ * @param  pattern
+ * @return 0 if success or negative value EINVAL if the pattern is not subscribed
+ */
+int psb_unsubscribe_pattern(psb_subscriber* subscriber, char* pattern)
+{
+	return subscription_remove(subscriber, pattern, PSB_MODE_PATTERN);
+}
+
+/**
+ * Subscribe to exact channel
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_subscribe_exact() bind subscriber with the very channel 'channel_name' (not the channels
+ * it is prefix of, as psb_subscribe() does).
+ * Exact channels are kept in a hash table probed before the prefix and pattern indexes
+ * with the hash kept in the channel handle, so publishing to subscribers having only exact
+ * subscriptions costs a single table probe. Publishing by handle (psb_publish_channel(),
+ * psb_publish()) never hashes the name, publishing by name hashes it once to find the handle.
+ *
+ * @param  subscriber
+ * @param  channel_name
+ * @return 0 if success or negative value EINVAL if channel already subscribed
+ */
+int psb_subscribe_exact(psb_subscriber* subscriber, char* channel_name)
+{
+	return subscription_add(subscriber, channel_name, PSB_MODE_EXACT);
+}
+
+/**
+ * Unsubscribe exact channel
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_unsubscribe_exact() unbind subscriber from channel 'channel_name' subscribed by psb_subscribe_exact().
+ *
+ * @param  subscriber
+ * @param  channel_name
+ * @return 0 if success or negative value EINVAL if channel is not subscribed
+ */
+int psb_unsubscribe_exact(psb_subscriber* subscriber, char* channel_name)
+{
+	return subscription_remove(subscriber, channel_name, PSB_MODE_EXACT);
+}
+
+/**
+ * Set level separator
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_set_separator() sets the character separating levels of channel names for pattern
+ * subscriptions, '/' by default. The separator can be set before the first subscription
+ * of the broker only.
+ *
+ * @param  broker the broker or NULL for the global broker
+ * @param  separator level separator, not '+' or '#'
+ * @return 0 if success or negative value EINVAL if the separator is invalid,
+ *         EBUSY if the broker already has subscriptions
+ */
+int psb_set_separator(psb_broker* broker, char separator)
+{
+	int rval = 0;
+	int i;
+
+	if ((separator == WILDCARD_SINGLE) || (separator == WILDCARD_MULTI))
 	{
-		// enter critical section
-		mutex_lock(&subscriber->broker->mutex);
+		return -EINVAL;
+	}
 
-		// unsubscribe from channel: remove channel name from ptrie object
-		if (ptrie_remove_str(subscriber->ptrie, (uint8_t*)channel_name, strlen(channel_name)) == 1)
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
+	}
+
+	// the table of shard is created by its first subscription
+	for (i = 0; i < broker->nshards; i++)
+	{
+		mutex_lock(&broker->shards[i].mutex);
+	}
+	for (i = 0; i < broker->nshards; i++)
+	{
+		if (broker->shards[i].table != NULL)
 		{
-			rval = 0;
+			rval = -EBUSY;
 		}
-		
-		// leave critical section
-		mutex_unlock(&subscriber->broker->mutex);
-		return rval;
 	}
+	if (rval == 0)
+	{
+		broker->separator = separator;
+	}
+	for (i = broker->nshards - 1; i >= 0; i--)
+	{
+		mutex_unlock(&broker->shards[i].mutex);
+	}
+
+	return rval;
+}
+
+/**
+ * Wait for subscriptions routing
+ *
+ * @ingroup PubSubBroker
+ *
+ * Subscriptions change the broker's routing table in place, publishers route by a snapshot
+ * of it rebuilt by the broker's router thread (delayed a little to rebuild a burst of changes
+ * once), so publishers never wait for subscriptions change. psb_sync_subscriptions() returns
+ * when the snapshots contain all subscriptions changed before the call: the messages published
+ * after it are routed by them. psb_delete_subscriber() does not need it, it removes the subscriber
+ * from routing before returning.
+ *
+ * @param  broker the broker or NULL for the global broker
+ * @return 0 if success or negative value ENOMEM if the routing could not be rebuilt
+ */
+int psb_sync_subscriptions(psb_broker* broker)
+{
+	struct psb_router* router;
+	long changes;
+	int rval;
+
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
+	}
+	router = &broker->router;
+
+	mutex_lock(&router->mutex);
+
+	// without router the subscribing threads rebuilt the snapshots, the failed ones are tried again
+	if (router->state != PSB_ROUTER_RUNNING)
+	{
+		mutex_unlock(&router->mutex);
+		return broker_refresh(broker);
+	}
+
+	// the router does not delay the rebuild for waiters
+	changes = router->changes;
+	router->waiters++;
+	cond_signal(&router->wake);
+	while ((router->routed - changes < 0) && (router->state == PSB_ROUTER_RUNNING))
+	{
+		cond_wait(&router->done, &router->mutex);
+	}
+	router->waiters--;
+	rval = router->error;
 
+	mutex_unlock(&router->mutex);
 	return rval;
 }
 
@@ -315,28 +1267,14 @@ int psb_get_message(psb_subscriber* subscriber, psb_message* msg, int timeout_ms
 	int rval = -EINVAL;
 	struct threadmsg tmsg;
 	struct timespec ts;
-	struct timespec* pts;
-
-	// fill 'ts' structure
-	if (timeout_ms > 0)
-	{
-		ts.tv_sec = timeout_ms / 1000;
-		ts.tv_nsec = (timeout_ms % 1000) * 1000000;
-		pts = &ts;
-	}
-	else
-	{
-		pts = NULL;
-	}
 
 	// if subscriber valid, get message from queue
 	if ((subscriber != NULL) && (msg != NULL))
 	{
-		rval = thread_queue_get_msg(subscriber->thqueue, pts, &tmsg);
+		rval = thread_queue_get_msg(subscriber->thqueue, timeout_ts(timeout_ms, &ts), &tmsg);
 		if (rval == 0)
 		{
-			*msg = *((psb_message*)tmsg.data);
-			free(tmsg.data);
+			message_init(msg, (struct psb_payload*)tmsg.data);
 		}
 	}
 
@@ -344,170 +1282,2853 @@ int psb_get_message(psb_subscriber* subscriber, psb_message* msg, int timeout_ms
 }
 
 /**
- * Gets the count of messages in subscriber's queue
+ * Gets several messages from all channels subscribed.
  *
  * @ingroup PubSubBroker
  *
- * psb_get_messages_count returns the number of messages waiting in the subscriber's queue
+ * psb_get_messages waits for a message as psb_get_message does, then takes up to 'max'
+ * messages queued for the subscriber. The queue is locked once per 256 messages.
  *
- * @param subscriber Pointer to the subscriber
- * @return the number of pending messages in the subscriber's queue
+ * @param subscriber Pointer to the subscriber.
+ * @param msgs array of 'max' psb_message. Every received message should be deallocated with psb_free_message()
+ * @param max maximum number of messages to receive
+ * @param timeout timeout on how long to wait on a message in milliseconds
+ *
+ * @return number of received messages on success, -EINVAL if subscriber is NULL and ETIMEDOUT (or ERROR_TIMEOUT for windows) if timeout occurs
  */
-int psb_get_messages_count(psb_subscriber* subscriber)
+int psb_get_messages(psb_subscriber* subscriber, psb_message* msgs, int max, int timeout_ms)
 {
 	int rval = -EINVAL;
+	struct threadmsg tmsgs[PSB_GET_MESSAGES_CHUNK];
+	struct timespec ts;
+	int count;
+	int i;
 
-	if (subscriber != NULL)
+	// if subscriber valid, get messages from queue
+	if ((subscriber != NULL) && (msgs != NULL) && (max > 0))
 	{
-		rval = thread_queue_length(subscriber->thqueue);
+		// only the first chunk waits, the next ones take the messages queued already
+		count = thread_queue_get_msgs(subscriber->thqueue, timeout_ts(timeout_ms, &ts), tmsgs,
+			(max < PSB_GET_MESSAGES_CHUNK) ? max : PSB_GET_MESSAGES_CHUNK);
+		if (count < 0)
+		{
+			return -count;
+		}
+
+		rval = 0;
+		while (count > 0)
+		{
+			for (i = 0; i < count; i++)
+			{
+				message_init(&msgs[rval + i], (struct psb_payload*)tmsgs[i].data);
+			}
+			rval += count;
+
+			count = 0;
+			if (rval < max)
+			{
+				count = thread_queue_try_get_msgs(subscriber->thqueue, tmsgs,
+					(max - rval < PSB_GET_MESSAGES_CHUNK) ? max - rval : PSB_GET_MESSAGES_CHUNK);
+			}
+		}
 	}
 
 	return rval;
 }
 
 /**
- * Freeing a memory allocated for messages.
+ * Gets a message without waiting
  *
  * @ingroup PubSubBroker
  *
- * psb_free_message freeing memory allocated or channel name and data but not for psb_message itself
- * use it after psb_get_message().
+ * psb_try_get_message takes a message from the subscriber's queue if there is one and returns at once otherwise.
+ * Together with psb_subscriber_get_fd() it lets an event loop receive messages: when the descriptor
+ * becomes readable, take messages until -EAGAIN.
  *
- * @param msg Pointer to the message.
- * @return 0 on success EINVAL if msg is NULL
+ * @param subscriber Pointer to the subscriber.
+ * @param msg pointer to psb_message. The msg should be deallocated with psb_free_message()
+ *
+ * @return 0 on success, -EINVAL if subscriber is NULL and -EAGAIN if the queue is empty
  */
-int psb_free_message(psb_message* msg)
+int psb_try_get_message(psb_subscriber* subscriber, psb_message* msg)
 {
 	int rval = -EINVAL;
-	if (msg)
+	struct threadmsg tmsg;
+
+	if ((subscriber != NULL) && (msg != NULL))
 	{
-		// freeing message's channel name
-		if (msg->channel)
+		rval = -thread_queue_try_get_msg(subscriber->thqueue, &tmsg);
+		if (rval == 0)
 		{
-			free(msg->channel);
+			message_init(msg, (struct psb_payload*)tmsg.data);
 		}
+	}
 
-		// freeing data
-		if (msg->data)
-		{
-			free(msg->data);
-		}
+	return rval;
+}
 
-		rval = 0;
+/**
+ * Gets the subscriber's event descriptor
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_subscriber_get_fd returns a descriptor (Linux eventfd) to wait for messages with poll/epoll/select.
+ * The descriptor becomes readable when a message arrives to the empty queue and stays readable until
+ * psb_try_get_message() returns -EAGAIN, so the subscriber should take messages until then
+ * (the descriptor is fit for edge-triggered epoll). It may be readable spuriously.
+ * The descriptor is created on the first call and closed with the subscriber by psb_delete_subscriber(); the caller must not
+ * read or close it. Publishers make the write system call only after the subscriber
+ * has found the queue empty, not per message.
+ *
+ * @param subscriber Pointer to the subscriber
+ * @return the descriptor, -EINVAL if subscriber is NULL, -ENOSYS if not supported (non-Linux) or other negative errno
+ */
+int psb_subscriber_get_fd(psb_subscriber* subscriber)
+{
+	int rval = -EINVAL;
+
+	if (subscriber != NULL)
+	{
+		rval = thread_queue_get_fd(subscriber->thqueue);
 	}
 
 	return rval;
 }
 
 /**
- * Publish the data object within channel.
+ * Waits for messages of several subscribers
  *
  * @ingroup PubSubBroker
  *
- * psb_publish_message() search for all subscribers that subscribe on channel and
- * copy data object to subscriber's queue.
+ * psb_poll() blocks the calling thread until any of the subscribers has a message or the (optional) timeout occurs,
+ * then the messages are received by psb_get_message() or psb_try_get_message() of the ready subscribers.
+ * The publishers wake up the caller through a single wait object shared by the subscribers, and only
+ * the first message after the subscribers were found empty costs the wake up.
+ * A subscriber can be polled by one thread at a time.
  *
- * @param broker Pointer to the pub/sub broker.
- * @param channel Pointer to the channel name to publish.
- * @param data Pointer to the data object.
- * @param datalen data object size.
- * @return total count of subscribers with matched channels or negative value in case of error
+ * @param subscribers array of 'count' subscribers
+ * @param count number of subscribers
+ * @param timeout_ms timeout on how long to wait on a message in milliseconds, 0 for no timeout
+ * @param ready array of 'count' flags, set to nonzero for subscribers with messages
+ * @return number of subscribers with messages, 0 if timeout occurs, -EINVAL in case of invalid arguments,
+ * -EBUSY if a subscriber is polled by other thread or -ENOMEM if out of memory
  */
-int psb_publish_message(psb_broker* broker, char* channel, void* data, int datalen)
+int psb_poll(psb_subscriber** subscribers, int count, int timeout_ms, int* ready)
 {
-	int cnt = 0;
-	int res;
+	struct threadqueue* local[PSB_POLL_LOCAL];
+	struct threadqueue** queues = local;
+	struct timespec ts;
+	int rval;
+	int i;
 
-	// If the broker is not defined use global broker
-	if (broker == NULL)
+	if ((subscribers == NULL) || (ready == NULL) || (count <= 0))
 	{
-		broker = &g_global_psb_broker;
+		return -EINVAL;
 	}
 
-	// check arguments
-	if ((channel != NULL) && (data != NULL) && (datalen > 0))
+	if (count > PSB_POLL_LOCAL)
 	{
-		// enter critical section
-		mutex_lock(&broker->mutex);
-		
-		if (broker->subscriber_list != NULL)
+		queues = (struct threadqueue**)malloc(count * sizeof(struct threadqueue*));
+		if (queues == NULL)
 		{
-			// iterate over all subscribers in list and check channel name match
-			psb_subscriber* iterator=broker->subscriber_list;
-			do
-			{
-				res = ptrie_match_str(iterator->ptrie, (uint8_t*)channel, strlen(channel));
-
-				// if channel name match, duplicate data and put it to queue
-				if (res)
-				{
-					psb_message* msg = (psb_message*)malloc(sizeof(struct psb_message));
-					if (msg)
-					{
-						msg->channel = strdup(channel);
-						msg->data = memdup(data, datalen);
-						msg->datalen = datalen;
-						thread_queue_put_msg(iterator->thqueue, msg, 0);
-						cnt++;	// increment counter
-					}
-					else
-					{
-						// leave critical section
-						mutex_unlock(&broker->mutex);
-						return -ENOMEM;
-					}
-				}
-
-				iterator = iterator->next;
-			}
-			while (iterator != broker->subscriber_list);
+			return -ENOMEM;
+		}
+	}
+
+	rval = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (subscribers[i] == NULL)
+		{
+			rval = -EINVAL;
+			break;
+		}
+		queues[i] = subscribers[i]->thqueue;
+	}
+
+	if (rval == 0)
+	{
+		rval = thread_queue_poll(queues, count, timeout_ts(timeout_ms, &ts), ready);
+	}
+
+	if (queues != local)
+	{
+		free(queues);
+	}
+
+	return rval;
+}
+
+/**
+ * Gets the count of messages in subscriber's queue
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_get_messages_count returns the number of messages waiting in the subscriber's queue
+ *
+ * @param subscriber Pointer to the subscriber
+ * @return the number of pending messages in the subscriber's queue
+ */
+int psb_get_messages_count(psb_subscriber* subscriber)
+{
+	int rval = -EINVAL;
+
+	if (subscriber != NULL)
+	{
+		rval = thread_queue_length(subscriber->thqueue);
+	}
+
+	return rval;
+}
+
+/**
+ * Limit the subscriber's queue
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_set_queue_limit() bounds the subscriber's queue by number of messages and/or by
+ * total size of data objects and selects what happens to the message published to full queue:
+ * PSB_OVERFLOW_BLOCK - the publisher waits for free space up to 'timeout_ms', then the publish fails with -ETIMEDOUT;
+ * PSB_OVERFLOW_DROP_NEWEST - the new message is dropped;
+ * PSB_OVERFLOW_DROP_OLDEST - the oldest queued messages are dropped;
+ * PSB_OVERFLOW_FAIL - the publish fails with -ENOBUFS.
+ * The other matched subscribers get the message anyway. Dropped and refused messages
+ * are counted, see psb_get_queue_stats().
+ * PSB_QUEUE_MPSC subscriber supports PSB_OVERFLOW_DROP_NEWEST and PSB_OVERFLOW_FAIL only,
+ * its limit must be set before subscribing.
+ * PSB_QUEUE_SPSC subscriber is bounded by its ring: 'max_msgs' and 'max_bytes' must be 0,
+ * the policy (except PSB_OVERFLOW_DROP_OLDEST) applies to the full ring.
+ *
+ * @param subscriber Pointer to the subscriber.
+ * @param max_msgs maximum number of queued messages, 0 for unlimited
+ * @param max_bytes maximum total size of queued data objects, 0 for unlimited
+ * @param policy overflow policy
+ * @param timeout_ms PSB_OVERFLOW_BLOCK: how long the publisher waits for free space in milliseconds
+ * @return 0 if success or -EINVAL in case of invalid arguments
+ */
+int psb_set_queue_limit(psb_subscriber* subscriber, long max_msgs, long max_bytes, int policy, int timeout_ms)
+{
+	struct threadqueue_limit limit;
+
+	if ((subscriber == NULL) || (max_msgs < 0) || (max_bytes < 0))
+	{
+		return -EINVAL;
+	}
+
+	switch (policy)
+	{
+	case PSB_OVERFLOW_BLOCK:
+		limit.policy = THREAD_QUEUE_BLOCK;
+		break;
+	case PSB_OVERFLOW_DROP_NEWEST:
+		limit.policy = THREAD_QUEUE_DROP_NEWEST;
+		break;
+	case PSB_OVERFLOW_DROP_OLDEST:
+		limit.policy = THREAD_QUEUE_DROP_OLDEST;
+		break;
+	case PSB_OVERFLOW_FAIL:
+		limit.policy = THREAD_QUEUE_FAIL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	// the publisher waits in bounded time only
+	if ((policy == PSB_OVERFLOW_BLOCK) && (timeout_ms < 0))
+	{
+		return -EINVAL;
+	}
+
+	limit.max_msgs = max_msgs;
+	limit.max_bytes = max_bytes;
+	limit.timeout.tv_sec = timeout_ms / 1000;
+	limit.timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+	limit.size = payload_size;
+	limit.free = freedata;
+
+	return -thread_queue_set_limit(subscriber->thqueue, &limit);
+}
+
+/**
+ * Select how the subscriber waits for messages
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_set_queue_wait() trades the subscriber's processor time for the wake up latency of
+ * psb_get_message() and psb_get_messages(): on the empty queue the subscriber polls it 'spin' times,
+ * then yields the processor 'yield' times polling after each yield, then sleeps until a publisher wakes it up.
+ * Publishers make the wake up system call only if the subscriber sleeps.
+ * Zero counts (the default) sleep at once; busy polling makes sense only if the subscriber has a processor of its own.
+ *
+ * @param subscriber Pointer to the subscriber.
+ * @param spin number of busy polls before yielding
+ * @param yield number of yields before sleeping
+ * @return 0 if success or -EINVAL in case of invalid arguments
+ */
+int psb_set_queue_wait(psb_subscriber* subscriber, long spin, long yield)
+{
+	struct threadqueue_wait wait;
+
+	if (subscriber == NULL)
+	{
+		return -EINVAL;
+	}
+
+	wait.spin = spin;
+	wait.yield = yield;
+
+	return -thread_queue_set_wait(subscriber->thqueue, &wait);
+}
+
+/**
+ * Gets statistics of the subscriber's queue
+ *
+ * @ingroup PubSubBroker
+ *
+ * @param subscriber Pointer to the subscriber.
+ * @param stats filled in with length, size of data and overflow counters of the queue
+ * @return 0 if success or -EINVAL if subscriber or stats is NULL
+ */
+int psb_get_queue_stats(psb_subscriber* subscriber, psb_queue_stats* stats)
+{
+	struct threadqueue_stats qstats;
+
+	if ((subscriber == NULL) || (stats == NULL))
+	{
+		return -EINVAL;
+	}
+
+	thread_queue_stats(subscriber->thqueue, &qstats);
+	stats->length = qstats.length;
+	stats->bytes = qstats.bytes;
+	stats->dropped = qstats.dropped;
+	stats->rejected = qstats.rejected;
+
+	return 0;
+}
+
+/**
+ * Gets statistics of the message memory pool
+ *
+ * @ingroup PubSubBroker
+ *
+ * Message bodies and queue entries are allocated from the process-wide pool of
+ * size classes (the bodies outlive their broker until the last psb_free_message()).
+ * psb_get_pool_stats() reports occupancy of each size class.
+ *
+ * @param stats array of 'max' entries filled in with statistics of size classes
+ * @param max size of stats array
+ * @return number of filled entries or -EINVAL if stats is NULL
+ */
+int psb_get_pool_stats(psb_pool_stats* stats, int max)
+{
+	struct slab_stats sstats[SLAB_CLASSES];
+	int i, n;
+
+	if (stats == NULL)
+	{
+		return -EINVAL;
+	}
+
+	n = slab_get_stats(sstats, (max < SLAB_CLASSES) ? max : SLAB_CLASSES);
+	for (i = 0; i < n; i++)
+	{
+		stats[i].size = (long)sstats[i].size;
+		stats[i].blocks = sstats[i].blocks;
+		stats[i].free = sstats[i].free;
+		stats[i].held = sstats[i].held;
+	}
+
+	return n;
+}
+
+/**
+ * Gets statistics of the broker's match cache
+ *
+ * @ingroup PubSubBroker
+ *
+ * Subscribers matched by published channel are cached until subscriptions of the broker
+ * are changed. psb_get_cache_stats() reports how many publishes were resolved by the cache
+ * and how many searched the channel index (of any shard). Each publish is counted once,
+ * publishes before the first subscription are not counted.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param stats filled in with hit and miss counters of the cache
+ * @return 0 if success or -EINVAL if stats is NULL
+ */
+int psb_get_cache_stats(psb_broker* broker, psb_cache_stats* stats)
+{
+	psb_channel* channel;
+	size_t i;
+
+	if (stats == NULL)
+	{
+		return -EINVAL;
+	}
+
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
+	}
+
+	// the counters are kept by channels (publishers of channel share its cache line anyway),
+	// the broker keeps the counters of channels dropped from the table
+	mutex_lock(&broker->mutex);
+	stats->hits = broker->hits;
+	stats->misses = broker->misses;
+	for (i = 0; (broker->channels != NULL) && (i <= broker->channels->mask); i++)
+	{
+		for (channel = broker->channels->buckets[i]; channel != NULL; channel = channel->next)
+		{
+			stats->hits += atomic_load_long(&channel->hits);
+			stats->misses += atomic_load_long(&channel->misses);
+		}
+	}
+	mutex_unlock(&broker->mutex);
+
+	return 0;
+}
+
+/**
+ * Freeing a memory allocated for messages.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_free_message drops the subscriber's reference to the shared channel name and data,
+ * the memory is freed when the last subscriber frees its message. The psb_message itself is not freed.
+ * use it after psb_get_message().
+ *
+ * @param msg Pointer to the message.
+ * @return 0 on success EINVAL if msg is NULL
+ */
+int psb_free_message(psb_message* msg)
+{
+	int rval = -EINVAL;
+	if (msg)
+	{
+		// drop reference to the shared body
+		if (msg->payload)
+		{
+			payload_release((struct psb_payload*)msg->payload);
+		}
+
+		// the message is not valid anymore, make repeated call harmless
+		msg->data = NULL;
+		msg->datalen = 0;
+		msg->channel = NULL;
+		msg->channel_id = NULL;
+		msg->prio = 0;
+		msg->payload = NULL;
+
+		rval = 0;
+	}
+
+	return rval;
+}
+
+/**
+ * Publish the data object within channel.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_message() search for all subscribers that subscribe on channel and
+ * put data object to subscriber's queue. The data object is copied only once
+ * and the copy is shared by all matched subscribers.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel Pointer to the channel name to publish.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_message(psb_broker* broker, char* channel, void* data, int datalen)
+{
+	psb_channel* interned;
+	int rval;
+
+	// check arguments
+	if ((channel == NULL) || (data == NULL) || (datalen <= 0))
+	{
+		return -EINVAL;
+	}
+
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
+	}
+
+	// the channel is referenced while published, messages keep their own references
+	interned = channel_intern(broker, channel, strlen(channel));
+	if (interned == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	rval = psb_publish_channel(interned, data, datalen);
+	channel_release(interned);
+
+	return rval;
+}
+
+/**
+ * Publish the data object within channel with priority.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_message_prio() is psb_publish_message() for message of priority 'prio':
+ * subscribers receive it before all queued messages of lower priority, so control messages
+ * don't wait behind the backlog of bulk data. psb_publish_message() publishes with priority 0 (the lowest).
+ * PSB_OVERFLOW_DROP_OLDEST policy drops messages of the lowest priority first and never
+ * drops a message of higher priority for the new one.
+ * PSB_QUEUE_MPSC subscribers receive messages in order of publishing regardless of priority.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel Pointer to the channel name to publish.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @param prio message priority, 0 to PSB_PRIORITIES - 1
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_message_prio(psb_broker* broker, char* channel, void* data, int datalen, int prio)
+{
+	psb_channel* interned;
+	int rval;
+
+	// check arguments
+	if ((channel == NULL) || (data == NULL) || (datalen <= 0) || (prio < 0) || (prio >= PSB_PRIORITIES))
+	{
+		return -EINVAL;
+	}
+
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
+	}
+
+	// the channel is referenced while published, messages keep their own references
+	interned = channel_intern(broker, channel, strlen(channel));
+	if (interned == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	rval = publish_payload(interned, data, datalen, prio, NULL, NULL);
+	channel_release(interned);
+
+	return rval;
+}
+
+/**
+ * Gets the channel handle
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_channel_get() returns the broker's interned channel of name 'channel_name',
+ * the channel is created on first use. The handle is the same for the same name
+ * and is valid until the broker is deleted. Every received message refers to its
+ * channel handle (psb_message::channel_id), so channels are compared by handle instead of name.
+ * Channels published by name only are dropped by the broker when no message or match cache
+ * entry refers to them, so their psb_message::channel_id is valid until the message is freed.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel_name Pointer to the channel name.
+ * @return channel handle or NULL in case of error
+ */
+psb_channel* psb_channel_get(psb_broker* broker, char* channel_name)
+{
+	psb_channel* channel;
+
+	if (channel_name == NULL)
+	{
+		return NULL;
+	}
+
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
+	}
+
+	// the reference taken by lookup pins the channel in the table until the broker is deleted
+	channel = channel_intern(broker, channel_name, strlen(channel_name));
+	if (channel != NULL)
+	{
+		mutex_lock(&broker->mutex);
+		if (channel->pinned)
+		{
+			channel_release(channel);
+		}
+		channel->pinned = 1;
+		mutex_unlock(&broker->mutex);
+	}
+
+	return channel;
+}
+
+/**
+ * Publish the data object within channel given by handle.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_channel() is psb_publish_message() for channel handle returned
+ * by psb_channel_get(), it skips the channel name lookup.
+ *
+ * @param channel channel handle.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_channel(psb_channel* channel, void* data, int datalen)
+{
+	// check arguments
+	if ((channel == NULL) || (data == NULL) || (datalen <= 0))
+	{
+		return -EINVAL;
+	}
+
+	// data is copied once after routing, the copy is shared by all matched subscribers
+	return publish_payload(channel, data, datalen, 0, NULL, NULL);
+}
+
+/**
+ * Create new publisher
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_new_publisher() creates a publisher bound to channel 'channel_name'. The publisher
+ * keeps the list of subscribers matched by its channel, psb_publish() reuses the list
+ * while subscriptions of the broker are not changed, so it does not search the channel
+ * index. A publisher must be used by one thread at a time and deleted before its broker.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel_name Pointer to the channel name to publish.
+ * @return allocated psb_publisher or NULL in case of error
+ */
+psb_publisher* psb_new_publisher(psb_broker* broker, char* channel_name)
+{
+	psb_publisher* new_pub;
+	psb_channel* channel;
+
+	channel = psb_channel_get(broker, channel_name);
+	if (channel == NULL)
+	{
+		return NULL;
+	}
+
+	new_pub = (psb_publisher*)malloc(sizeof(struct psb_publisher));
+	if (new_pub != NULL)
+	{
+		new_pub->channel = channel;
+		new_pub->generation = PSB_GENERATION_NONE;
+		new_pub->match.count = 0;
+		new_pub->match.subs = new_pub->match.local;
+	}
+
+	return new_pub;
+}
+
+/**
+ * Delete publisher
+ *
+ * @ingroup PubSubBroker
+ *
+ * @param publisher Pointer to the publisher.
+ * @return 0 if success or -EINVAL if publisher is NULL
+ */
+int psb_delete_publisher(psb_publisher* publisher)
+{
+	if (publisher == NULL)
+	{
+		return -EINVAL;
+	}
+
+	match_free(&publisher->match);
+	free(publisher);
+
+	return 0;
+}
+
+/**
+ * Publish the data object within the publisher's channel.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish() is psb_publish_message() for the channel of publisher,
+ * the subscribers matched by the previous call are reused if subscriptions
+ * of the broker are not changed since.
+ *
+ * @param publisher Pointer to the publisher.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish(psb_publisher* publisher, void* data, int datalen)
+{
+	// check arguments
+	if ((publisher == NULL) || (data == NULL) || (datalen <= 0))
+	{
+		return -EINVAL;
+	}
+
+	// data is copied once after routing, the copy is shared by all matched subscribers
+	return publish_payload(publisher->channel, data, datalen, 0, NULL, publisher);
+}
+
+/**
+ * Publish the caller's data object within channel without copy.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_message_nocopy() delivers the data object itself (not a copy) to all
+ * subscribers that subscribe on channel, as psb_publish_message() does otherwise.
+ * The data object is passed to the broker: it must not be changed or freed by the caller,
+ * the broker calls 'release' once, when the last subscriber called psb_free_message()
+ * (immediately if nobody matched) or the message is dropped by the overflow policy of all
+ * subscribers holding it. The callback is called in any case, also if the publish fails;
+ * it may be called from the publisher's or any subscriber's thread. The publisher calls it
+ * after routing, out of the broker's and the queues' locks.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel Pointer to the channel name to publish.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @param release callback releasing the data object
+ * @param release_arg argument passed to 'release'
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_message_nocopy(psb_broker* broker, char* channel, void* data, int datalen,
+	psb_release_fn release, void* release_arg)
+{
+	struct psb_payload* payload = NULL;
+	psb_channel* interned;
+
+	// check arguments
+	if ((channel == NULL) || (data == NULL) || (datalen <= 0) || (release == NULL))
+	{
+		if ((data != NULL) && (release != NULL))
+		{
+			release(data, release_arg);
+		}
+		return -EINVAL;
+	}
+
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
+	}
+
+	// all matched subscribers reference the caller's data
+	interned = channel_intern(broker, channel, strlen(channel));
+	if (interned != NULL)
+	{
+		payload = payload_wrap(interned, data, datalen, release, release_arg);
+		channel_release(interned);
+	}
+	if (payload == NULL)
+	{
+		release(data, release_arg);
+		return -ENOMEM;
+	}
+
+	return publish_payload(payload->channel, NULL, 0, 0, payload, NULL);
+}
+
+/**
+ * Publish several data objects at once.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_batch() publishes 'count' entries as psb_publish_message() does
+ * (each data object copied once and shared by matched subscribers), but routes
+ * the whole batch in one read section and puts all messages of a subscriber
+ * to its queue under single lock with single wakeup.
+ * The messages are delivered to every subscriber in the order of entries.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param entries Pointer to the array of channel/data entries.
+ * @param count number of entries.
+ * @return total count of delivered messages or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_batch(psb_broker* broker, psb_batch_entry* entries, int count)
+{
+	int cnt = 0;
+	int err = 0;
+	int rval;
+	int i, k, n;
+	int token;
+	struct psb_payload** payloads;
+	void** data;
+	psb_channel* interned = NULL;
+	struct psb_match match;
+	struct psb_batch batch;
+
+	// If the broker is not defined use global broker
+	if (broker == NULL)
+	{
+		broker = &g_global_psb_broker;
+	}
+
+	// check arguments
+	if ((entries == NULL) || (count <= 0))
+	{
+		return -EINVAL;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if ((entries[i].channel == NULL) || (entries[i].data == NULL) || (entries[i].datalen <= 0))
+		{
+			return -EINVAL;
+		}
+	}
+
+	// copy all entries before routing, each copy is shared by matched subscribers;
+	// the same array is used later for passing subscriber's messages to queue
+	payloads = (struct psb_payload**)slab_alloc(count * sizeof(struct psb_payload*));
+	data = (void**)slab_alloc(count * sizeof(void*));
+	if ((payloads == NULL) || (data == NULL))
+	{
+		slab_free(payloads);
+		slab_free(data);
+		return -ENOMEM;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if ((i == 0) || (strcmp(entries[i].channel, entries[i - 1].channel) != 0))
+		{
+			if (interned != NULL)
+			{
+				channel_release(interned);
+			}
+			interned = channel_intern(broker, entries[i].channel, strlen(entries[i].channel));
+		}
+		payloads[i] = (interned != NULL) ? payload_new(interned, entries[i].data, entries[i].datalen) : NULL;
+		if (payloads[i] == NULL)
+		{
+			if (interned != NULL)
+			{
+				channel_release(interned);
+			}
+			while (i-- > 0)
+			{
+				payload_release(payloads[i]);
+			}
+			slab_free(payloads);
+			slab_free(data);
+			return -ENOMEM;
+		}
+	}
+	channel_release(interned);	// the bodies reference their channels
+
+	// enter read section once for the whole batch
+	token = epoch_enter(&broker->epoch);
+
+	// route all entries and group deliveries by subscriber (consecutive entries of the same channel are routed once)
+	batch_init(&batch);
+	match.count = 0;
+	match.subs = match.local;
+	for (i = 0; (cnt >= 0) && (i < count); i++)
+	{
+		if ((i == 0) || (payloads[i]->channel != payloads[i - 1]->channel))
+		{
+			match_free(&match);
+			if (broker_match(broker, payloads[i]->channel, &match) < 0)
+			{
+				cnt = -ENOMEM;
+			}
+		}
+
+		for (k = 0; (cnt >= 0) && (k < match.count); k++)
+		{
+			if (batch_add(&batch, match.subs[k], i) < 0)
+			{
+				cnt = -ENOMEM;
+			}
+		}
+
+		// the body is not shared yet, queue references are taken at once
+		payloads[i]->refcount += k;
+	}
+	match_free(&match);
+
+	// routing failed, drop all queue references
+	if (cnt < 0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			payloads[i]->refcount = 1;
+		}
+		batch.ngroups = 0;
+	}
+
+	// put every subscriber's messages to its queue at once, keeping the order of entries
+	for (i = 0; (batch.ngroups > 0) && (i <= batch.mask); i++)
+	{
+		struct psb_group* group = &batch.groups[i];
+		if (group->subscriber != NULL)
+		{
+			for (k = group->first, n = 0; k >= 0; k = batch.deliveries[k].next)
+			{
+				data[n++] = payloads[batch.deliveries[k].index];
+			}
+
+			rval = thread_queue_try_put_msgs(group->subscriber->thqueue, data, group->count, 0);
+			if (rval == 0)
+			{
+				cnt += (cnt >= 0) ? group->count : 0;
+			}
+			else if (rval == ENOMEM)
+			{
+				// drop the queue references if queue is out of memory
+				for (n = 0; n < group->count; n++)
+				{
+					payload_release((struct psb_payload*)data[n]);
+				}
+				cnt = -ENOMEM;
+			}
+			else
+			{
+				// bounded queue is full, apply the overflow policy to each message;
+				// if the publisher has to wait (or drop), the rest of group is put after leaving the read section
+				for (; group->first >= 0; group->first = batch.deliveries[group->first].next, group->count--)
+				{
+					struct psb_payload* payload = payloads[batch.deliveries[group->first].index];
+					rval = message_put(group->subscriber, payload, 0);
+					if (rval == -EAGAIN)
+					{
+						atomic_inc(&group->subscriber->refcount);
+						group->deferred = 1;
+						break;
+					}
+					if (rval == 0)
+					{
+						cnt += (cnt >= 0) ? 1 : 0;
+					}
+					else
+					{
+						payload_release(payload);
+						err = rval;
+					}
+				}
+			}
+		}
+	}
+
+	// leave read section, free match cache entries replaced by publishers
+	epoch_leave(&broker->epoch, token);
+	epoch_reclaim(&broker->epoch);
+
+	// wait for free space in the bounded queues (or drop), keeping the order of entries
+	for (i = 0; (batch.ngroups > 0) && (i <= batch.mask); i++)
+	{
+		struct psb_group* group = &batch.groups[i];
+		if ((group->subscriber != NULL) && group->deferred)
+		{
+			for (k = group->first; k >= 0; k = batch.deliveries[k].next)
+			{
+				struct psb_payload* payload = payloads[batch.deliveries[k].index];
+				rval = (cnt >= 0) ? message_put(group->subscriber, payload, 1) : cnt;
+				if (rval == 0)
+				{
+					cnt++;
+				}
+				else
+				{
+					payload_release(payload);
+					if (cnt >= 0)
+					{
+						err = rval;
+					}
+				}
+			}
+			subscriber_release(group->subscriber);
+		}
+	}
+	batch_free(&batch);
+
+	// drop publisher references
+	for (i = 0; i < count; i++)
+	{
+		payload_release(payloads[i]);
+	}
+	slab_free(payloads);
+	slab_free(data);
+
+	return ((cnt >= 0) && (err != 0)) ? err : cnt;
+}
+
+// insert new subscriber to subscriber's double-linked list
+static void slist_insert(psb_subscriber* list, psb_subscriber* entry)
+{
+	entry->prev = list;
+	entry->next = list->next;
+
+	list->next->prev = entry;
+	list->next       = entry;
+}
+
+// remove subscriber from subscriber's double-linked liststatic void slist_remove(psb_subscriber* entry)
+static void slist_remove(psb_subscriber* entry) 
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+
+	/*
+	* Set the entry to point to itself, so that any further calls to
+	* slist_remove() are harmless.
+	*/
+
+	entry->prev = entry;
+	entry->next = entry;
+}
+
+// remove subscriber from subscriber's list of the shard
+static void subscriber_unlink(psb_subscriber* subscriber)
+{
+	if (subscriber->shard->subscriber_list == subscriber)
+	{
+		// move list head to the next subscriber (or empty list)
+		subscriber->shard->subscriber_list = (subscriber->next != subscriber) ? subscriber->next : NULL;
+	}
+	slist_remove(subscriber);
+}
+
+// find consumer group by name, the broker's mutex must be held
+static struct psb_consumer_group* group_find(psb_broker* broker, const char* name, size_t name_len)
+{
+	struct psb_consumer_group* group;
+
+	for (group = broker->groups; group != NULL; group = group->next)
+	{
+		if ((group->name_len == name_len) && (memcmp(group->name, name, name_len) == 0))
+		{
+			break;
+		}
+	}
+
+	return group;
+}
+
+// freeing subscriber and all linked objects
+static void subscriber_free(psb_subscriber* subscriber)
+{
+	while (subscriber->subscriptions != NULL)
+	{
+		struct psb_subscription* subscription = subscriber->subscriptions;
+		subscriber->subscriptions = subscription->next;
+		free(subscription);
+	}
+	thread_queue_free(subscriber->thqueue, freedata);	// freeing queue (and all queued messages)
+	free(subscriber);	// freeing subscriber memory
+}
+
+// drop reference to subscriber, the subscriber freed with last reference
+static void subscriber_release(psb_subscriber* subscriber)
+{
+	if (atomic_dec(&subscriber->refcount) == 0)
+	{
+		subscriber_free(subscriber);
+	}
+}
+
+// subscribe to channel, pattern or exact channel
+static int subscription_add(psb_subscriber* subscriber, const char* channel_name, int mode)
+{
+	int rval = -EINVAL;
+	if ((subscriber != NULL) && (channel_name != NULL))
+	{
+		size_t channel_len = strlen(channel_name);
+		struct psb_subscription* iterator;
+		int subscribed = 0;
+
+		// enter critical section
+		mutex_lock(&subscriber->shard->mutex);
+
+		// check that subscriber is not already subscribed to channel
+		if (mode != PSB_MODE_PREFIX)
+		{
+			for (iterator = subscriber->subscriptions; iterator != NULL; iterator = iterator->next)
+			{
+				if ((iterator->mode == mode) && (iterator->channel_len == channel_len) &&
+					(memcmp(iterator->channel, channel_name, channel_len) == 0))
+				{
+					subscribed = 1;
+				}
+			}
+		}
+		else if (subscriber->shard->table != NULL)
+		{
+			// the channel is subscribed by the subscriber's prefix subscriptions of its prefixes too,
+			// they are the sets of the shard's index matching the channel
+			struct psb_subset_find find;
+
+			find.subscriber = subscriber;
+			find.found = 0;
+			ptrie_match_all(&subscriber->shard->table->index, (const uint8_t*)channel_name, channel_len,
+				subset_find, &find);
+			subscribed = find.found;
+		}
+
+		if (subscribed == 0)
+		{
+			struct psb_subscription* subscription;
+			struct psb_shard* shard = subscriber->shard;
+			struct psb_route* table = shard->table;
+			int added = -ENOMEM;
+
+			// the first subscription of shard creates its table
+			if (table == NULL)
+			{
+				table = route_clone(subscriber->broker, NULL);
+			}
+
+			subscription = (struct psb_subscription*)malloc(sizeof(struct psb_subscription) + channel_len);
+			if ((subscription != NULL) && (table != NULL))
+			{
+				if (mode == PSB_MODE_PREFIX)
+				{
+					added = index_add(&table->index, subscriber, channel_name, channel_len);
+				}
+				else if (mode == PSB_MODE_EXACT)
+				{
+					added = exact_add(&table->exact, subscriber, channel_name, channel_len);
+				}
+				else if (wildcard_valid(&table->patterns, channel_name, channel_len))
+				{
+					added = patterns_add(&table->patterns, subscriber, channel_name, channel_len);
+				}
+				else
+				{
+					added = -EINVAL;
+				}
+			}
+
+			if (added == 0)
+			{
+				// the routing snapshot is rebuilt by the router
+				shard->table = table;
+				atomic_store_long(&shard->stale, 1);
+
+				// subscribe to channel: add channel name to subscriber's list
+				subscription->channel_len = channel_len;
+				subscription->mode = mode;
+				memcpy(subscription->channel, channel_name, channel_len + 1);
+				subscription->next = subscriber->subscriptions;
+				subscriber->subscriptions = subscription;
+				rval = 0;
+			}
+			else
+			{
+				if (table != shard->table)
+				{
+					route_free(table);
+				}
+				free(subscription);
+				rval = added;
+			}
+		}
+
+		// leave critical section
+		mutex_unlock(&subscriber->shard->mutex);
+
+		if ((subscribed == 0) && (rval == 0))
+		{
+			router_notify(subscriber->broker);
+		}
+		return rval;
+	}
+
+	return rval;
+}
+
+// unsubscribe from channel, pattern or exact channel
+static int subscription_remove(psb_subscriber* subscriber, const char* channel_name, int mode)
+{
+	int rval = -EINVAL;
+
+	if ((subscriber != NULL) && (channel_name != NULL))
+	{
+		size_t channel_len = strlen(channel_name);
+		struct psb_subscription** iterator;
+
+		// enter critical section
+		mutex_lock(&subscriber->shard->mutex);
+
+		// find channel name in subscriber's list
+		for (iterator = &subscriber->subscriptions; *iterator != NULL; iterator = &(*iterator)->next)
+		{
+			if (((*iterator)->mode == mode) && ((*iterator)->channel_len == channel_len) &&
+				(memcmp((*iterator)->channel, channel_name, channel_len) == 0))
+			{
+				break;
+			}
+		}
+
+		// unsubscribe from channel: remove channel name from routing and subscriber's list
+		// (the routing snapshot is rebuilt by the router)
+		if (*iterator != NULL)
+		{
+			struct psb_subscription* subscription = *iterator;
+
+			route_remove(subscriber->shard->table, subscriber, subscription);
+			atomic_store_long(&subscriber->shard->stale, 1);
+
+			*iterator = subscription->next;
+			free(subscription);
+			rval = 0;
+		}
+
+		// leave critical section
+		mutex_unlock(&subscriber->shard->mutex);
+
+		if (rval == 0)
+		{
+			router_notify(subscriber->broker);
+		}
+		return rval;
+	}
+
+	return rval;
+}
+
+// ptrie_clone() callback: copy subscriber's set
+static void* subset_clone(void* value, void* arg)
+{
+	struct psb_subset* set = (struct psb_subset*)value;
+	size_t size = sizeof(struct psb_subset) + (set->size - 1) * sizeof(psb_subscriber*);
+	struct psb_subset* copy = (struct psb_subset*)malloc(size);
+
+	(void)arg;
+	if (copy != NULL)
+	{
+		memcpy(copy, set, size);
+	}
+
+	return copy;	// NULL fails the copy of index
+}
+
+// ptrie_match_all() callback: look for subscriber in set
+static void subset_find(void* value, void* arg)
+{
+	struct psb_subset* set = (struct psb_subset*)value;
+	struct psb_subset_find* find = (struct psb_subset_find*)arg;
+	int i;
+
+	for (i = 0; (i < set->count) && !find->found; i++)
+	{
+		find->found = (set->subs[i] == find->subscriber);
+	}
+}
+
+// ptrie_walk() callback: freeing subscriber's set
+static void subset_free(void* value, void* arg)
+{
+	(void)arg;
+	free(value);
+}
+
+// make a modifiable copy of routing snapshot (empty snapshot if 'route' is NULL)
+static struct psb_route* route_clone(psb_broker* broker, struct psb_route* route)
+{
+	struct psb_route* copy = (struct psb_route*)malloc(sizeof(struct psb_route));
+	int rval = 0;
+
+	if (copy != NULL)
+	{
+		copy->cache = NULL;
+		copy->frozen = NULL;
+		copy->exact = NULL;
+		if (route != NULL)
+		{
+			// the indexes are copied as far as memory lasts, route_free() frees the partial copy
+			rval = ptrie_clone(&copy->index, &route->index, subset_clone, NULL);
+			if (wildcard_clone(&copy->patterns, &route->patterns, subset_clone, NULL) != 0)
+			{
+				rval = -ENOMEM;
+			}
+			if (exact_clone(&copy->exact, route->exact) != 0)
+			{
+				rval = -ENOMEM;
+			}
+		}
+		else
+		{
+			ptrie_init(&copy->index);
+			wildcard_init(&copy->patterns, broker->separator);
+		}
+
+		if (rval != 0)
+		{
+			route_free(copy);
+			copy = NULL;
+		}
+	}
+
+	return copy;
+}
+
+// compile the snapshot's index for publishers (before route_commit(), out of the shard's mutex if possible)
+static void route_freeze(struct psb_route* route)
+{
+	// publishers fall back to the index itself if it fails
+	route->frozen = ptrie_freeze(&route->index);
+}
+
+// replace the shard's routing snapshot (under the shard's mutex), returns the old snapshot for route_retire()
+static struct psb_route* route_commit(psb_broker* broker, struct psb_shard* shard, struct psb_route* route)
+{
+	struct psb_route* old = shard->route;
+
+	// the new generation invalidates subscribers cached by publishers
+	// (the snapshot is published before, so the publisher seeing the generation sees the snapshot)
+	atomic_store_ptr(&shard->route, route);
+	atomic_inc(&broker->generation);
+	shard->commits++;
+
+	return old;
+}
+
+// free the old routing snapshot when publishers left it (out of the shard's mutex and read section)
+static void route_retire(psb_broker* broker, struct psb_route* route)
+{
+	if (route != NULL)
+	{
+		epoch_synchronize(&broker->epoch);
+		route_free(route);
+	}
+}
+
+// rebuild the shard's routing snapshot from its table if subscriptions were changed since
+static int route_refresh(psb_broker* broker, struct psb_shard* shard)
+{
+	struct psb_route* route = NULL;
+	struct psb_route* old;
+	long commits;
+	int rval = 0;
+
+	// psb_delete_subscriber() may have rebuilt it meanwhile,
+	// the changes after the copy make the shard stale again
+	mutex_lock(&shard->mutex);
+	if (shard->stale)
+	{
+		route = route_clone(broker, shard->table);
+		if (route != NULL)
+		{
+			atomic_store_long(&shard->stale, 0);
+		}
+		else
+		{
+			rval = -ENOMEM;
+		}
+	}
+	commits = shard->commits;
+	mutex_unlock(&shard->mutex);
+
+	if (route == NULL)
+	{
+		return rval;
+	}
+
+	// the copy is compiled while subscriptions change the table
+	route_freeze(route);
+
+	// psb_delete_subscriber() may have published newer copy meanwhile
+	mutex_lock(&shard->mutex);
+	if (shard->commits == commits)
+	{
+		old = route_commit(broker, shard, route);
+		route = NULL;
+	}
+	mutex_unlock(&shard->mutex);
+
+	if (route != NULL)
+	{
+		route_free(route);	// never published
+		return 0;
+	}
+
+	route_retire(broker, old);
+	return 0;
+}
+
+// rebuild routing snapshots of shards with changed subscriptions (by router, out of shard's mutex)
+static int broker_refresh(psb_broker* broker)
+{
+	int rval = 0;
+	int i;
+
+	for (i = 0; i < broker->nshards; i++)
+	{
+		if (atomic_load_long(&broker->shards[i].stale) && (route_refresh(broker, &broker->shards[i]) != 0))
+		{
+			rval = -ENOMEM;
+		}
+	}
+
+	return rval;
+}
+
+// hand the change of shard's table to the router (out of shard's mutex)
+static void router_notify(psb_broker* broker)
+{
+	struct psb_router* router = &broker->router;
+	int state;
+
+	mutex_lock(&router->mutex);
+
+	// the first change starts the router
+	if (router->state == PSB_ROUTER_NONE)
+	{
+		router->state = (thread_create(&router->thread, router_proc, broker) == 0) ?
+			PSB_ROUTER_RUNNING : PSB_ROUTER_FAILED;
+	}
+
+	// the router waiting for changes is woken, the one delaying the rebuild takes this change too
+	if (router->changes++ == router->routed)
+	{
+		cond_signal(&router->wake);
+	}
+	state = router->state;
+
+	mutex_unlock(&router->mutex);
+
+	// without router the subscribing thread rebuilds the snapshot
+	if (state == PSB_ROUTER_FAILED)
+	{
+		broker_refresh(broker);
+	}
+}
+
+// the router thread: rebuilds routing snapshots after subscriptions change
+static THREAD_PROC(router_proc, arg)
+{
+	psb_broker* broker = (psb_broker*)arg;
+	struct psb_router* router = &broker->router;
+	long delay = PSB_ROUTER_DELAY;
+	long changes;
+	long start;
+	int delayed = 0;
+	int rval;
+
+	mutex_lock(&router->mutex);
+	while (router->state == PSB_ROUTER_RUNNING)
+	{
+		if (router->changes == router->routed)
+		{
+			cond_wait(&router->wake, &router->mutex);
+		}
+		else if (!delayed && (router->waiters == 0))
+		{
+			// let the burst of changes come, the rebuild is delayed as long as the last one took,
+			// so subscribing threads wait for the shard's mutex at most half of time
+			delayed = 1;
+			router_wait(router, delay);
+		}
+		else
+		{
+			// the changes counted so far are in the tables of shards
+			changes = router->changes;
+			delayed = 0;
+			mutex_unlock(&router->mutex);
+
+			start = router_clock();
+			rval = broker_refresh(broker);
+			delay = router_clock() - start;
+			if (delay < PSB_ROUTER_DELAY)
+			{
+				delay = PSB_ROUTER_DELAY;
+			}
+			else if (delay > PSB_ROUTER_DELAY_MAX)
+			{
+				delay = PSB_ROUTER_DELAY_MAX;
+			}
+
+			// the stale snapshot (out of memory) is rebuilt with the next change
+			mutex_lock(&router->mutex);
+			router->routed = changes;
+			router->error = rval;
+			cond_broadcast(&router->done);
+		}
+	}
+	mutex_unlock(&router->mutex);
+
+	return THREAD_RETURN;
+}
+
+// wait for the router's wake up at most 'timeout_ms' milliseconds (under router's mutex)
+static void router_wait(struct psb_router* router, long timeout_ms)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	SleepConditionVariableSRW(&router->wake, &router->mutex, (DWORD)timeout_ms, 0);
+#else
+	struct timespec abstimeout;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	abstimeout.tv_sec = now.tv_sec + timeout_ms / 1000;
+	abstimeout.tv_nsec = (now.tv_usec * 1000) + (timeout_ms % 1000) * 1000000;
+	if (abstimeout.tv_nsec >= 1000000000)
+	{
+		abstimeout.tv_sec++;
+		abstimeout.tv_nsec -= 1000000000;
+	}
+	cond_timedwait(&router->wake, &router->mutex, &abstimeout);
+#endif
+}
+
+// stop the router thread
+static void router_stop(struct psb_router* router)
+{
+	mutex_lock(&router->mutex);
+	if (router->state == PSB_ROUTER_RUNNING)
+	{
+		router->state = PSB_ROUTER_STOP;
+		cond_signal(&router->wake);
+		mutex_unlock(&router->mutex);
+
+		thread_join(router->thread);
+		mutex_lock(&router->mutex);
+	}
+
+	// the global broker stays usable, its next change starts the router again
+	router->state = PSB_ROUTER_NONE;
+	router->error = 0;
+	router->changes = 0;
+	router->routed = 0;
+	mutex_unlock(&router->mutex);
+}
+
+// milliseconds of wall clock (measures the router's rebuild)
+static long router_clock(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return (long)GetTickCount();
+#else
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (long)(now.tv_sec * 1000 + now.tv_usec / 1000);
+#endif
+}
+
+// remove subscription of subscriber from routing
+static void route_remove(struct psb_route* route, psb_subscriber* subscriber, struct psb_subscription* subscription)
+{
+	if (subscription->mode == PSB_MODE_PATTERN)
+	{
+		patterns_remove(&route->patterns, subscriber, subscription->channel, subscription->channel_len);
+	}
+	else if (subscription->mode == PSB_MODE_EXACT)
+	{
+		exact_remove(&route->exact, subscriber, subscription->channel, subscription->channel_len);
+	}
+	else
+	{
+		index_remove(&route->index, subscriber, subscription->channel, subscription->channel_len);
+	}
+}
+
+// freeing routing snapshot
+static void route_free(struct psb_route* route)
+{
+	int i;
+
+	if (route != NULL)
+	{
+		ptrie_walk(&route->index, subset_free, NULL);	// NULL sets of failed copy are passed to free() too
+		ptrie_term(&route->index);
+		ptrie_frozen_free(route->frozen);
+		wildcard_walk(&route->patterns, subset_free, NULL);
+		wildcard_term(&route->patterns);
+		exact_free(route->exact);
+		if (route->cache != NULL)
+		{
+			for (i = 0; i < PSB_CACHE_SIZE; i++)
+			{
+				if (route->cache->entries[i] != NULL)
+				{
+					resolved_free(&route->cache->entries[i]->node);
+				}
+			}
+			free(route->cache);
+		}
+		free(route);
+	}
+}
+
+// add subscriber to the set in 'slot' (the set is allocated or grown)
+static int subset_add(struct psb_subset** slot, psb_subscriber* subscriber)
+{
+	struct psb_subset* set = *slot;
+
+	// allocate or grow the set
+	if ((set == NULL) || (set->count == set->size))
+	{
+		int size = (set == NULL) ? 4 : set->size * 2;
+		set = (struct psb_subset*)realloc(set, sizeof(struct psb_subset) + (size - 1) * sizeof(psb_subscriber*));
+		if (set == NULL)
+		{
+			return -ENOMEM;	// the old set if any is still valid
+		}
+		if (*slot == NULL)
+		{
+			set->count = 0;
+		}
+		set->size = size;
+		*slot = set;
+	}
+
+	set->subs[set->count++] = subscriber;
+	return 0;
+}
+
+// remove subscriber from the set in 'slot', the set is freed with the last subscriber
+static void subset_remove(struct psb_subset** slot, psb_subscriber* subscriber)
+{
+	struct psb_subset* set = *slot;
+	int i;
+
+	// remove subscriber from set (order is not important)
+	for (i = 0; i < set->count; i++)
+	{
+		if (set->subs[i] == subscriber)
+		{
+			set->subs[i] = set->subs[--set->count];
+			break;
+		}
+	}
+
+	if (set->count == 0)
+	{
+		free(set);
+		*slot = NULL;
+	}
+}
+
+// add subscriber to the index of channel 'channel'
+static int index_add(struct ptrie* index, psb_subscriber* subscriber, const char* channel, size_t channel_len)
+{
+	struct psb_subset** slot;
+
+	// the index node's reference count is the number of subscribers in set
+	if (ptrie_add_str(index, (const uint8_t*)channel, channel_len) < 0)
+	{
+		return -ENOMEM;
+	}
+	slot = (struct psb_subset**)ptrie_value(index, (const uint8_t*)channel, channel_len);
+	if (subset_add(slot, subscriber) != 0)
+	{
+		// allocation error, drop the node's reference
+		ptrie_remove_str(index, (const uint8_t*)channel, channel_len);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+// remove subscriber from the index of channel 'channel'
+static void index_remove(struct ptrie* index, psb_subscriber* subscriber, const char* channel, size_t channel_len)
+{
+	struct psb_subset** slot;
+
+	slot = (struct psb_subset**)ptrie_value(index, (const uint8_t*)channel, channel_len);
+	if (slot == NULL)
+	{
+		return;
+	}
+
+	// the last subscriber removed, release the set before the index node
+	subset_remove(slot, subscriber);
+	ptrie_remove_str(index, (const uint8_t*)channel, channel_len);
+}
+
+// add subscriber to the index of pattern 'pattern'
+static int patterns_add(struct wildcard_index* patterns, psb_subscriber* subscriber, const char* pattern,
+	size_t pattern_len)
+{
+	struct psb_subset** slot;
+
+	slot = (struct psb_subset**)wildcard_add(patterns, pattern, pattern_len);
+	if ((slot == NULL) || (subset_add(slot, subscriber) != 0))
+	{
+		// allocation error, remove the pattern unless other subscribers have it
+		if ((slot == NULL) || (*slot == NULL))
+		{
+			wildcard_remove(patterns, pattern, pattern_len);
+		}
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+// remove subscriber from the index of pattern 'pattern'
+static void patterns_remove(struct wildcard_index* patterns, psb_subscriber* subscriber, const char* pattern,
+	size_t pattern_len)
+{
+	struct psb_subset** slot;
+
+	slot = (struct psb_subset**)wildcard_value(patterns, pattern, pattern_len);
+	if (slot == NULL)
+	{
+		return;
+	}
+
+	// the pattern is removed with the last subscriber
+	subset_remove(slot, subscriber);
+	if (*slot == NULL)
+	{
+		wildcard_remove(patterns, pattern, pattern_len);
+	}
+}
+
+// hash of channel name (FNV-1a)
+static unsigned int channel_hash(const char* name, size_t name_len)
+{
+	unsigned int hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < name_len; i++)
+	{
+		hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+// find the entry of channel in table of exact subscriptions or the free entry it would take, NULL if no table
+static struct psb_exact_entry* exact_find(struct psb_exact* table, const char* name, size_t name_len,
+	unsigned int hash)
+{
+	struct psb_exact_entry* entry;
+	int mask, i;
+
+	if (table == NULL)
+	{
+		return NULL;
+	}
+
+	// the table is at most half full, so the probing stops at a free entry
+	mask = table->size - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask)
+	{
+		entry = &table->entries[i];
+		if ((entry->name == NULL) ||
+			((entry->hash == hash) && (entry->name_len == name_len) && (memcmp(entry->name, name, name_len) == 0)))
+		{
+			return entry;
+		}
+	}
+}
+
+// allocate table of exact subscriptions of 'size' entries
+static struct psb_exact* exact_new(int size)
+{
+	struct psb_exact* table;
+
+	table = (struct psb_exact*)calloc(1, sizeof(struct psb_exact) + (size - 1) * sizeof(struct psb_exact_entry));
+	if (table != NULL)
+	{
+		table->size = size;
+	}
+
+	return table;
+}
+
+// move entries of table to a new table of 'size' entries, the old table is freed
+static int exact_resize(struct psb_exact** table, int size)
+{
+	struct psb_exact* old = *table;
+	struct psb_exact* resized = exact_new(size);
+	int i;
+
+	if (resized == NULL)
+	{
+		return -ENOMEM;	// the old table is still valid
+	}
+
+	if (old != NULL)
+	{
+		for (i = 0; i < old->size; i++)
+		{
+			if (old->entries[i].name != NULL)
+			{
+				*exact_find(resized, old->entries[i].name, old->entries[i].name_len, old->entries[i].hash) =
+					old->entries[i];
+			}
+		}
+		resized->count = old->count;
+		free(old);
+	}
+
+	*table = resized;
+	return 0;
+}
+
+// add subscriber to the table of exact subscriptions of channel 'channel'
+static int exact_add(struct psb_exact** table, psb_subscriber* subscriber, const char* channel, size_t channel_len)
+{
+	unsigned int hash = channel_hash(channel, channel_len);
+	struct psb_exact_entry* entry = exact_find(*table, channel, channel_len, hash);
+	char* name;
+
+	if ((entry != NULL) && (entry->name != NULL))
+	{
+		return subset_add(&entry->set, subscriber);
+	}
+
+	// new channel, keep the table at most half full
+	if ((entry == NULL) || ((*table)->count + 1 > (*table)->size / 2))
+	{
+		if (exact_resize(table, (*table == NULL) ? PSB_EXACT_MIN : (*table)->size * 2) != 0)
+		{
+			return -ENOMEM;
+		}
+		entry = exact_find(*table, channel, channel_len, hash);
+	}
+
+	name = (char*)malloc(channel_len + 1);
+	if (name == NULL)
+	{
+		return -ENOMEM;
+	}
+	entry->set = NULL;
+	if (subset_add(&entry->set, subscriber) != 0)
+	{
+		free(name);
+		return -ENOMEM;
+	}
+	memcpy(name, channel, channel_len);
+	name[channel_len] = 0;
+	entry->name = name;
+	entry->name_len = channel_len;
+	entry->hash = hash;
+	(*table)->count++;
+
+	return 0;
+}
+
+// remove subscriber from the table of exact subscriptions of channel 'channel'
+static void exact_remove(struct psb_exact** table, psb_subscriber* subscriber, const char* channel,
+	size_t channel_len)
+{
+	struct psb_exact_entry* entry = exact_find(*table, channel, channel_len, channel_hash(channel, channel_len));
+	struct psb_exact_entry* entries;
+	int mask, home, i, j;
+
+	if ((entry == NULL) || (entry->name == NULL))
+	{
+		return;
+	}
+
+	// the channel is removed with the last subscriber
+	subset_remove(&entry->set, subscriber);
+	if (entry->set != NULL)
+	{
+		return;
+	}
+	free(entry->name);
+	entry->name = NULL;
+	if (--(*table)->count == 0)
+	{
+		free(*table);
+		*table = NULL;
+		return;
+	}
+
+	// shift back the following entries of probe sequence which may not be behind the free entry
+	entries = (*table)->entries;
+	mask = (*table)->size - 1;
+	i = (int)(entry - entries);
+	for (j = (i + 1) & mask; entries[j].name != NULL; j = (j + 1) & mask)
+	{
+		home = entries[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			entries[i] = entries[j];
+			entries[j].name = NULL;
+			i = j;
+		}
+	}
+}
+
+// copy table of exact subscriptions to 'copy', -ENOMEM if some set is not copied (the copy is partial)
+static int exact_clone(struct psb_exact** copy, const struct psb_exact* table)
+{
+	struct psb_exact_entry* entry;
+	int rval = 0;
+	int i;
+
+	*copy = NULL;
+	if (table == NULL)
+	{
+		return 0;
+	}
+
+	*copy = exact_new(table->size);
+	if (*copy == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	// entries keep their places, an entry failed to be copied is left free
+	for (i = 0; i < table->size; i++)
+	{
+		if (table->entries[i].name != NULL)
+		{
+			entry = &(*copy)->entries[i];
+			*entry = table->entries[i];
+			entry->name = (char*)malloc(entry->name_len + 1);
+			entry->set = (struct psb_subset*)subset_clone(table->entries[i].set, NULL);
+			if ((entry->name == NULL) || (entry->set == NULL))
+			{
+				free(entry->name);
+				free(entry->set);
+				entry->name = NULL;
+				rval = -ENOMEM;
+				continue;
+			}
+			memcpy(entry->name, table->entries[i].name, entry->name_len + 1);
+			(*copy)->count++;
+		}
+	}
+
+	return rval;
+}
+
+// freeing table of exact subscriptions
+static void exact_free(struct psb_exact* table)
+{
+	int i;
+
+	if (table != NULL)
+	{
+		for (i = 0; i < table->size; i++)
+		{
+			if (table->entries[i].name != NULL)
+			{
+				free(table->entries[i].name);
+				free(table->entries[i].set);
+			}
+		}
+		free(table);
+	}
+}
+
+// find interned channel in table (in read section or under the broker's mutex), NULL if not found
+static psb_channel* channel_find(struct psb_channels* table, const char* name, size_t name_len, unsigned int hash)
+{
+	psb_channel* channel;
+
+	if (table == NULL)
+	{
+		return NULL;
+	}
+
+	for (channel = (psb_channel*)atomic_load_ptr(&table->buckets[hash & table->mask]); channel != NULL;
+		channel = (psb_channel*)atomic_load_ptr(&channel->next))
+	{
+		if ((channel->hash == hash) && (channel->name_len == name_len) && (memcmp(channel->name, name, name_len) == 0))
+		{
+			return channel;
+		}
+	}
+
+	return NULL;
+}
+
+// replace the broker's channel table by twice bigger one (under the broker's mutex).
+// Publisher reading the old table meanwhile may miss a channel and look for it again under mutex.
+static struct psb_channels* channels_grow(psb_broker* broker)
+{
+	struct psb_channels* old = broker->channels;
+	struct psb_channels* table;
+	psb_channel* channel;
+	psb_channel* next;
+	size_t size = (old != NULL) ? (old->mask + 1) * 2 : PSB_CHANNELS_INIT;
+	size_t i;
+
+	table = (struct psb_channels*)calloc(1, sizeof(struct psb_channels) + (size - 1) * sizeof(psb_channel*));
+	if (table == NULL)
+	{
+		return NULL;
+	}
+	table->mask = size - 1;
+
+	// move channels to the new buckets
+	for (i = 0; (old != NULL) && (i <= old->mask); i++)
+	{
+		for (channel = old->buckets[i]; channel != NULL; channel = next)
+		{
+			next = channel->next;
+			atomic_store_ptr(&channel->next, table->buckets[channel->hash & table->mask]);
+			table->buckets[channel->hash & table->mask] = channel;
+			table->count++;
+		}
+	}
+
+	atomic_store_ptr(&broker->channels, table);
+	if (old != NULL)
+	{
+		epoch_synchronize(&broker->epoch);
+		free(old);
+	}
+
+	return table;
+}
+
+// drop channels referenced by the broker's table only (under the broker's mutex).
+// Publisher reading the table meanwhile can't take reference to dropped channel and looks for it again under mutex.
+static void channels_sweep(psb_broker* broker)
+{
+	struct psb_channels* table = broker->channels;
+	psb_channel* dropped = NULL;
+	psb_channel* channel;
+	psb_channel** link;
+	size_t i;
+
+	for (i = 0; i <= table->mask; i++)
+	{
+		link = &table->buckets[i];
+		while ((channel = *link) != NULL)
+		{
+			// the last reference is taken from the table, the channel keeps its link for publishers reading it
+			if (atomic_cas_long(&channel->refcount, 1, 0))
+			{
+				atomic_store_ptr(link, channel->next);
+				broker->hits += atomic_load_long(&channel->hits);
+				broker->misses += atomic_load_long(&channel->misses);
+				channel->dropped = dropped;
+				dropped = channel;
+				table->count--;
+			}
+			else
+			{
+				link = &channel->next;
+			}
+		}
+	}
+
+	if (dropped != NULL)
+	{
+		epoch_synchronize(&broker->epoch);
+		while ((channel = dropped) != NULL)
+		{
+			dropped = channel->dropped;
+			free(channel);
+		}
+	}
+}
+
+// add channel to the broker's table (under the broker's mutex), NULL if out of memory.
+// The channel is referenced by the table and by the caller.
+static psb_channel* channel_add(psb_broker* broker, const char* name, size_t name_len, unsigned int hash)
+{
+	struct psb_channels* table = broker->channels;
+	psb_channel* channel;
+
+	// keep number of channels not above number of buckets, unused channels are
+	// dropped first and the table grows if more than half of them are in use
+	if ((table == NULL) || (table->count > table->mask))
+	{
+		if (table != NULL)
+		{
+			channels_sweep(broker);
+		}
+		if ((table == NULL) || (table->count > table->mask / 2))
+		{
+			table = channels_grow(broker);
+			if (table == NULL)
+			{
+				return NULL;
+			}
+		}
+	}
+
+	channel = (psb_channel*)malloc(sizeof(struct psb_channel) + name_len);
+	if (channel != NULL)
+	{
+		channel->dropped = NULL;
+		channel->broker = broker;
+		channel->refcount = 2;
+		channel->pinned = 0;
+		channel->hits = 0;
+		channel->misses = 0;
+		channel->hash = hash;
+		channel->name_len = name_len;
+		memcpy(channel->name, name, name_len);
+		channel->name[name_len] = '\0';
+		channel->next = table->buckets[hash & table->mask];
+
+		// the channel is complete before publishers can see it
+		atomic_store_ptr(&table->buckets[hash & table->mask], channel);
+		table->count++;
+	}
+
+	return channel;
+}
+
+// take reference to channel found in read section, 0 if the channel is dropped from the table
+static int channel_acquire(psb_channel* channel)
+{
+	long refcount;
+
+	do
+	{
+		refcount = atomic_load_long(&channel->refcount);
+		if (refcount == 0)
+		{
+			return 0;
+		}
+	} while (!atomic_cas_long(&channel->refcount, refcount, refcount + 1));
+
+	return 1;
+}
+
+// find or add interned channel and take reference to it, NULL if out of memory
+static psb_channel* channel_intern(psb_broker* broker, const char* name, size_t name_len)
+{
+	unsigned int hash = channel_hash(name, name_len);
+	psb_channel* channel;
+	int token;
+
+	// the channel is usually known already
+	token = epoch_enter(&broker->epoch);
+	channel = channel_find((struct psb_channels*)atomic_load_ptr(&broker->channels), name, name_len, hash);
+	if ((channel != NULL) && !channel_acquire(channel))
+	{
+		channel = NULL;
+	}
+	epoch_leave(&broker->epoch, token);
+
+	if (channel == NULL)
+	{
+		mutex_lock(&broker->mutex);
+		channel = channel_find(broker->channels, name, name_len, hash);
+		if (channel != NULL)
+		{
+			atomic_inc(&channel->refcount);	// channels are dropped under mutex only
+		}
+		else
+		{
+			channel = channel_add(broker, name, name_len, hash);
 		}
-		
-		// leave critical section
 		mutex_unlock(&broker->mutex);
 	}
+
+	return channel;
+}
+
+// drop reference to interned channel, the channel freed with last reference
+static void channel_release(psb_channel* channel)
+{
+	if (atomic_dec(&channel->refcount) == 0)
+	{
+		free(channel);
+	}
+}
+
+// freeing the broker's channel table and drop its references to channels
+static void channels_free(struct psb_channels* table)
+{
+	psb_channel* channel;
+	psb_channel* next;
+	size_t i;
+
+	if (table != NULL)
+	{
+		for (i = 0; i <= table->mask; i++)
+		{
+			for (channel = table->buckets[i]; channel != NULL; channel = next)
+			{
+				next = channel->next;
+				if (channel->pinned)
+				{
+					channel_release(channel);
+				}
+				channel_release(channel);
+			}
+		}
+		free(table);
+	}
+}
+
+// append subscribers to the match list, 'nomem' is set in case of allocation error
+static void match_append(struct psb_match* match, psb_subscriber** subs, int count)
+{
+	if (match->count + count > match->size)
+	{
+		int size = (match->count + count) * 2;
+		psb_subscriber** grown = (psb_subscriber**)slab_alloc(size * sizeof(psb_subscriber*));
+		if (grown == NULL)
+		{
+			match->nomem = 1;
+			return;
+		}
+		memcpy(grown, match->subs, match->count * sizeof(psb_subscriber*));
+		if (match->subs != match->local)
+		{
+			slab_free(match->subs);
+		}
+		match->subs = grown;
+		match->size = size;
+	}
+
+	memcpy(match->subs + match->count, subs, count * sizeof(psb_subscriber*));
+	match->count += count;
+}
+
+// ptrie_match_all() callback: append subscriber's set to the match list
+static void match_collect(void* value, void* arg)
+{
+	struct psb_subset* set = (struct psb_subset*)value;
+	struct psb_match* match = (struct psb_match*)arg;
+
+	match_append(match, set->subs, set->count);
+	match->nsets++;
+}
+
+// compare subscribers by address (qsort callback)
+static int match_compare(const void* a, const void* b)
+{
+	psb_subscriber* sa = *(psb_subscriber* const*)a;
+	psb_subscriber* sb = *(psb_subscriber* const*)b;
+
+	return (sa < sb) ? -1 : (sa > sb);
+}
+
+// find all subscribers matched by channel name with hash 'hash' (each subscriber appears once)
+static int match_subscribers(struct psb_route* route, const char* channel, size_t channel_len, unsigned int hash,
+	struct psb_match* match)
+{
+	struct psb_exact_entry* entry;
+	int i, k;
+
+	match->count = 0;
+	match->size = PSB_MATCH_LOCAL;
+	match->nsets = 0;
+	match->nomem = 0;
+	match->subs = match->local;
+
+	if (route == NULL)
+	{
+		return 0;	// nobody subscribed yet
+	}
+
+	// the exact table and the indexes are skipped at once if they are empty
+	entry = exact_find(route->exact, channel, channel_len, hash);
+	if ((entry != NULL) && (entry->name != NULL))
+	{
+		match_collect(entry->set, match);
+	}
+	if (route->frozen != NULL)
+	{
+		ptrie_frozen_match(route->frozen, (const uint8_t*)channel, channel_len, match_collect, match);
+	}
 	else
 	{
-		return -EINVAL;
+		ptrie_match_all(&route->index, (const uint8_t*)channel, channel_len, match_collect, match);
+	}
+	wildcard_match(&route->patterns, channel, channel_len, match_collect, match);
+	if (match->nomem)
+	{
+		match->count = 0;
+		return -ENOMEM;
+	}
+
+	// subscriber subscribed to several prefixes of channel name (or the channel too) is in several sets
+	if ((match->nsets > 1) && (match->count > 1))
+	{
+		qsort(match->subs, match->count, sizeof(psb_subscriber*), match_compare);
+		for (i = 1, k = 1; i < match->count; i++)
+		{
+			if (match->subs[i] != match->subs[k - 1])
+			{
+				match->subs[k++] = match->subs[i];
+			}
+		}
+		match->count = k;
 	}
 
-	return cnt;
+	return match->count;
 }
 
-// insert new subscriber to subscriber's double-linked list
-static void slist_insert(psb_subscriber* list, psb_subscriber* entry)
+// freeing memory allocated by match_subscribers()
+static void match_free(struct psb_match* match)
 {
-	entry->prev = list;
-	entry->next = list->next;
+	if (match->subs != match->local)
+	{
+		slab_free(match->subs);
+	}
+}
 
-	list->next->prev = entry;
-	list->next       = entry;
+// find all subscribers matched by channel using match cache of routing snapshot
+static int route_match(struct psb_route* route, psb_channel* channel, struct psb_match* match, int* cached)
+{
+	struct psb_cache* cache = NULL;
+	struct psb_resolved* resolved;
+	struct psb_resolved* victim = NULL;
+	unsigned long age = 0;
+	unsigned long clock = 0;
+	size_t entry = 0;
+	size_t i;
+
+	*cached = 0;
+	if (route != NULL)
+	{
+		// the cache is allocated by the first publisher of snapshot
+		cache = (struct psb_cache*)atomic_load_ptr(&route->cache);
+		if (cache == NULL)
+		{
+			cache = (struct psb_cache*)calloc(1, sizeof(struct psb_cache));
+			if ((cache != NULL) && !atomic_cas_ptr(&route->cache, NULL, cache))
+			{
+				free(cache);
+				cache = (struct psb_cache*)atomic_load_ptr(&route->cache);
+			}
+		}
+	}
+
+	// look for the channel's entry, stop at the first free one; the oldest entry is the victim otherwise
+	if (cache != NULL)
+	{
+		clock = (unsigned long)atomic_load_long(&cache->clock);
+	}
+	for (i = 0; (cache != NULL) && (i < PSB_CACHE_PROBES); i++)
+	{
+		resolved = (struct psb_resolved*)atomic_load_ptr(&cache->entries[(channel->hash + i) & (PSB_CACHE_SIZE - 1)]);
+		if (resolved == NULL)
+		{
+			entry = (channel->hash + i) & (PSB_CACHE_SIZE - 1);
+			victim = NULL;
+			break;
+		}
+		if (resolved->channel == channel)
+		{
+			// the age is written rarely, hot entries are read by many publishers
+			if (resolved_age(resolved, clock) > PSB_CACHE_PROBES)
+			{
+				atomic_store_long(&resolved->stamp, (long)clock);
+			}
+			*cached = 1;
+			match_subscribers(NULL, NULL, 0, 0, match);	// empty list
+			match_collect(&resolved->set, match);
+			if (match->nomem)
+			{
+				match->count = 0;
+				return -ENOMEM;
+			}
+			return match->count;
+		}
+		if ((victim == NULL) || (resolved_age(resolved, clock) > age))
+		{
+			entry = (channel->hash + i) & (PSB_CACHE_SIZE - 1);
+			victim = resolved;
+			age = resolved_age(resolved, clock);
+		}
+	}
+
+	if (match_subscribers(route, channel->name, channel->name_len, channel->hash, match) < 0)
+	{
+		return -ENOMEM;
+	}
+
+	// cache subscribers in the free or the oldest entry (if other publisher did not change it meanwhile),
+	// publishers may still read the replaced entry
+	if (cache != NULL)
+	{
+		resolved = (struct psb_resolved*)slab_alloc(sizeof(struct psb_resolved) +
+			((match->count > 0) ? match->count - 1 : 0) * sizeof(psb_subscriber*));
+		if (resolved != NULL)
+		{
+			atomic_inc(&channel->refcount);	// the channel is not dropped while cached
+			resolved->node.free = resolved_free;
+			resolved->channel = channel;
+			resolved->stamp = atomic_inc(&cache->clock);
+			resolved->set.count = match->count;
+			resolved->set.size = (match->count > 0) ? match->count : 1;
+			memcpy(resolved->set.subs, match->subs, match->count * sizeof(psb_subscriber*));
+			if (!atomic_cas_ptr(&cache->entries[entry], victim, resolved))
+			{
+				resolved_free(&resolved->node);
+			}
+			else if (victim != NULL)
+			{
+				epoch_retire(&channel->broker->epoch, &victim->node);	// freed by epoch_reclaim() after the publish
+			}
+		}
+	}
+
+	return match->count;
 }
 
-// remove subscriber from subscriber's double-linked liststatic void slist_remove(psb_subscriber* entry)
-static void slist_remove(psb_subscriber* entry) 
+// get age of match cache entry, number of entries inserted since its last use
+static unsigned long resolved_age(struct psb_resolved* resolved, unsigned long clock)
 {
-	entry->next->prev = entry->prev;
-	entry->prev->next = entry->next;
+	unsigned long stamp = (unsigned long)atomic_load_long(&resolved->stamp);
 
-	/*
-	* Set the entry to point to itself, so that any further calls to
-	* slist_remove() are harmless.
-	*/
+	// entry inserted after the clock was read is the youngest
+	return ((long)(clock - stamp) > 0) ? clock - stamp : 0;
+}
 
-	entry->prev = entry;
-	entry->next = entry;
+// freeing match cache entry and drop its reference to channel
+static void resolved_free(struct epoch_node* node)
+{
+	struct psb_resolved* resolved = (struct psb_resolved*)node;
+
+	channel_release(resolved->channel);
+	slab_free(resolved);
+}
+
+// find all subscribers matched by channel in routing snapshots of all shards (in read section),
+// the publish is a cache hit if the subscribers of every shard with subscriptions were cached
+static int broker_match(psb_broker* broker, psb_channel* channel, struct psb_match* match)
+{
+	struct psb_route* route;
+	struct psb_match part;
+	int routes = 0;
+	int hits = 0;
+	int cached;
+	int rval;
+	int i;
+
+	if (broker->nshards == 1)
+	{
+		route = (struct psb_route*)atomic_load_ptr(&broker->shards[0].route);
+		rval = route_match(route, channel, match, &cached);
+		routes = (route != NULL);
+		hits = cached;
+	}
+	else
+	{
+		// every subscriber is in one shard, the shard's lists are simply concatenated
+		match_subscribers(NULL, NULL, 0, 0, match);	// empty list
+		for (i = 0; i < broker->nshards; i++)
+		{
+			route = (struct psb_route*)atomic_load_ptr(&broker->shards[i].route);
+			if (route_match(route, channel, &part, &cached) < 0)
+			{
+				match->nomem = 1;
+			}
+			routes += (route != NULL);
+			hits += cached;
+			match_append(match, part.subs, part.count);
+			match_free(&part);
+			if (match->nomem)
+			{
+				match->count = 0;
+				return -ENOMEM;
+			}
+		}
+		rval = match->count;
+	}
+
+	// shards without subscriptions are not searched
+	if (routes > 0)
+	{
+		atomic_inc((hits == routes) ? &channel->hits : &channel->misses);
+	}
+
+	return rval;
+}
+
+// initialize empty batch
+static void batch_init(struct psb_batch* batch)
+{
+	batch->deliveries = batch->local_deliveries;
+	batch->ndeliveries = 0;
+	batch->size = PSB_BATCH_DELIVERIES;
+	batch->groups = batch->local_groups;
+	batch->ngroups = 0;
+	batch->mask = PSB_BATCH_GROUPS - 1;
+	memset(batch->local_groups, 0, sizeof(batch->local_groups));
+}
+
+// find group of subscriber in hash table (or empty entry for it)
+static struct psb_group* batch_group(struct psb_group* groups, int mask, psb_subscriber* subscriber)
+{
+	size_t i = ((size_t)subscriber >> 4) * 2654435761u;
+
+	while ((groups[i & mask].subscriber != NULL) && (groups[i & mask].subscriber != subscriber))
+	{
+		i++;
+	}
+
+	return &groups[i & mask];
+}
+
+// add delivery of entry 'index' to subscriber
+static int batch_add(struct psb_batch* batch, psb_subscriber* subscriber, int index)
+{
+	struct psb_group* group;
+	int i;
+
+	// grow deliveries array
+	if (batch->ndeliveries == batch->size)
+	{
+		struct psb_delivery* deliveries = (struct psb_delivery*)malloc(batch->size * 2 * sizeof(struct psb_delivery));
+		if (deliveries == NULL)
+		{
+			return -ENOMEM;
+		}
+		memcpy(deliveries, batch->deliveries, batch->ndeliveries * sizeof(struct psb_delivery));
+		if (batch->deliveries != batch->local_deliveries)
+		{
+			free(batch->deliveries);
+		}
+		batch->deliveries = deliveries;
+		batch->size *= 2;
+	}
+
+	// grow groups hash table, keep it half empty
+	if ((batch->ngroups + 1) * 2 > batch->mask + 1)
+	{
+		int mask = batch->mask * 2 + 1;
+		struct psb_group* groups = (struct psb_group*)calloc(mask + 1, sizeof(struct psb_group));
+		if (groups == NULL)
+		{
+			return -ENOMEM;
+		}
+		for (i = 0; i <= batch->mask; i++)
+		{
+			if (batch->groups[i].subscriber != NULL)
+			{
+				*batch_group(groups, mask, batch->groups[i].subscriber) = batch->groups[i];
+			}
+		}
+		if (batch->groups != batch->local_groups)
+		{
+			free(batch->groups);
+		}
+		batch->groups = groups;
+		batch->mask = mask;
+	}
+
+	// append delivery to subscriber's chain
+	group = batch_group(batch->groups, batch->mask, subscriber);
+	if (group->subscriber == NULL)
+	{
+		group->subscriber = subscriber;
+		group->first = batch->ndeliveries;
+		group->count = 0;
+		group->deferred = 0;
+		batch->ngroups++;
+	}
+	else
+	{
+		batch->deliveries[group->last].next = batch->ndeliveries;
+	}
+	group->last = batch->ndeliveries;
+	group->count++;
+
+	batch->deliveries[batch->ndeliveries].index = index;
+	batch->deliveries[batch->ndeliveries].next = -1;
+	batch->ndeliveries++;
+
+	return 0;
+}
+
+// freeing memory allocated by batch_add()
+static void batch_free(struct psb_batch* batch)
+{
+	if (batch->deliveries != batch->local_deliveries)
+	{
+		free(batch->deliveries);
+	}
+	if (batch->groups != batch->local_groups)
+	{
+		free(batch->groups);
+	}
+}
+
+// convert timeout in milliseconds to 'ts' (NULL for infinite timeout)
+static struct timespec* timeout_ts(int timeout_ms, struct timespec* ts)
+{
+	if (timeout_ms > 0)
+	{
+		ts->tv_sec = timeout_ms / 1000;
+		ts->tv_nsec = (timeout_ms % 1000) * 1000000;
+		return ts;
+	}
+
+	return NULL;
+}
+
+// fill received message, the message references shared body
+static void message_init(psb_message* msg, struct psb_payload* payload)
+{
+	msg->data = payload_data(payload);
+	msg->datalen = payload->datalen;
+	msg->channel = payload->channel->name;
+	msg->channel_id = payload->channel;
+	msg->prio = payload->prio;
+	msg->payload = payload;
+}
+
+// allocate shared message body, reference count is set to 1
+static struct psb_payload* payload_new(psb_channel* channel, void* data, int datalen)
+{
+	// single allocation: header and data object
+	struct psb_payload* payload = (struct psb_payload*)slab_alloc(sizeof(struct psb_payload) + datalen);
+
+	if (payload != NULL)
+	{
+		atomic_inc(&channel->refcount);
+		payload->refcount = 1;
+		payload->datalen = datalen;
+		payload->prio = 0;
+		payload->flags = 0;
+		payload->channel = channel;
+		memcpy(payload + 1, data, datalen);
+	}
+
+	return payload;
+}
+
+// allocate shared message body referencing the publisher's data object, reference count is set to 1
+static struct psb_payload* payload_wrap(psb_channel* channel, void* data, int datalen,
+	psb_release_fn release, void* release_arg)
+{
+	struct psb_payload_wrap* wrap = (struct psb_payload_wrap*)slab_alloc(sizeof(struct psb_payload_wrap));
+
+	if (wrap == NULL)
+	{
+		return NULL;
+	}
+
+	atomic_inc(&channel->refcount);
+	wrap->header.refcount = 1;
+	wrap->header.datalen = datalen;
+	wrap->header.prio = 0;
+	wrap->header.flags = PSB_PAYLOAD_WRAP;
+	wrap->header.channel = channel;
+	wrap->data = data;
+	wrap->release = release;
+	wrap->release_arg = release_arg;
+
+	return &wrap->header;
+}
+
+// drop reference to shared message body, the body freed with last reference
+static void payload_release(struct psb_payload* payload)
+{
+	if (atomic_dec(&payload->refcount) == 0)
+	{
+		if (payload->flags & PSB_PAYLOAD_WRAP)
+		{
+			struct psb_payload_wrap* wrap = (struct psb_payload_wrap*)payload;
+			wrap->release(wrap->data, wrap->release_arg);
+		}
+		channel_release(payload->channel);
+		if (payload->flags & PSB_PAYLOAD_SLOT)
+		{
+			thread_queue_free_inline(payload);
+		}
+		else
+		{
+			slab_free(payload);
+		}
+	}
+}
+
+// data object of message body
+static void* payload_data(struct psb_payload* payload)
+{
+	if (payload->flags & PSB_PAYLOAD_WRAP)
+	{
+		return ((struct psb_payload_wrap*)payload)->data;
+	}
+	return payload + 1;
+}
+
+// queue's size function: data object size of message body
+static long payload_size(void* data)
+{
+	return ((struct psb_payload*)data)->datalen;
+}
+
+// put message body to subscriber's queue, the caller's reference is passed to queue on success
+// (a message dropped by overflow policy is released by queue). Returns 0 on success,
+// -EAGAIN if the queue is full and 'wait' is 0 (retry with 'wait' outside of read section) or other negative error
+static int message_put(psb_subscriber* subscriber, struct psb_payload* payload, int wait)
+{
+	// SPSC ring: the small body is copied into the slot, the subscriber doesn't touch the shared one
+	if (!(payload->flags & PSB_PAYLOAD_WRAP) &&
+		(message_put_inline(subscriber, payload->channel, payload + 1, payload->datalen, payload->prio) == 0))
+	{
+		payload_release(payload);	// the caller's reference
+		return 0;
+	}
+
+	if (wait)
+	{
+		return -thread_queue_put_msg_prio(subscriber->thqueue, payload, 0, payload->prio);
+	}
+	return -thread_queue_try_put_msg_prio(subscriber->thqueue, payload, 0, payload->prio);
+}
+
+// build message body of data object in the slot of PSB_QUEUE_SPSC subscriber's queue. Returns 0 on success
+// or -EAGAIN if the subscriber's queue is not SPSC one, the data object does not fit the slot or the ring is full
+static int message_put_inline(psb_subscriber* subscriber, psb_channel* channel, void* data, int datalen, int prio)
+{
+	struct psb_payload* slot;
+
+	if (subscriber->thqueue->type != THREAD_QUEUE_SPSC)
+	{
+		return -EAGAIN;
+	}
+
+	slot = (struct psb_payload*)thread_queue_reserve_inline(subscriber->thqueue, sizeof(struct psb_payload) + datalen);
+	if (slot == NULL)
+	{
+		return -EAGAIN;
+	}
+
+	atomic_inc(&channel->refcount);
+	slot->refcount = 1;
+	slot->datalen = datalen;
+	slot->prio = prio;
+	slot->flags = PSB_PAYLOAD_SLOT;
+	slot->channel = channel;
+	memcpy(slot + 1, data, datalen);
+	thread_queue_commit_inline(subscriber->thqueue, 0);
+
+	return 0;
 }
 
-// duplicate memory object
-static void* memdup(const void* mem, size_t size)
+// route message body and put it to matched subscriber's queues, the publisher's reference is dropped.
+// Without 'payload' the body of data object is built after routing: in the slot of the only matched
+// PSB_QUEUE_SPSC subscriber or shared by all matched subscribers (nothing if nobody matched)
+static int publish_payload(psb_channel* channel, void* data, int datalen, int prio,
+	struct psb_payload* payload, psb_publisher* publisher)
 {
-	void* out = malloc(size);
+	psb_broker* broker = channel->broker;
+	int cnt = 0;
+	int err = 0;
+	int rval;
+	int i;
+	int ndeferred = 0;
+	int token;
+	long generation;
+	struct psb_match local;
+	struct psb_match* match = (publisher != NULL) ? &publisher->match : &local;
+
+	local.subs = local.local;
+
+	// enter read section, routing and matched subscribers stay valid till leave
+	token = epoch_enter(&broker->epoch);
+	generation = atomic_load_long(&broker->generation);
+
+	// walk the channel index once (unless the publisher's subscribers are still valid)
+	if ((publisher == NULL) || (publisher->generation != generation))
+	{
+		match_free(match);
+		if (broker_match(broker, channel, match) < 0)
+		{
+			cnt = -ENOMEM;
+		}
+		if (publisher != NULL)
+		{
+			publisher->generation = (cnt < 0) ? PSB_GENERATION_NONE : generation;
+		}
+	}
+
+	// the only SPSC subscriber gets the message in its slot, the others share single copy of data
+	if ((payload == NULL) && (cnt >= 0) && (match->count > 0))
+	{
+		if ((match->count == 1) && (message_put_inline(match->subs[0], channel, data, datalen, prio) == 0))
+		{
+			cnt = 1;
+		}
+		else
+		{
+			payload = payload_new(channel, data, datalen);
+			if (payload == NULL)
+			{
+				cnt = -ENOMEM;
+			}
+			else
+			{
+				payload->prio = prio;
+			}
+		}
+	}
+
+	// put reference to shared body to matched subscriber's queues
+	for (i = 0; (cnt >= 0) && (payload != NULL) && (i < match->count); i++)
+	{
+		atomic_inc(&payload->refcount);
+		rval = message_put(match->subs[i], payload, 0);
+		if (rval == 0)
+		{
+			cnt++;	// increment counter
+		}
+		else if (rval == -EAGAIN)
+		{
+			// bounded queue is full, wait for free space (fail or drop) after leaving the read section
+			atomic_inc(&match->subs[i]->refcount);
+			match->subs[ndeferred++] = match->subs[i];
+		}
+		else
+		{
+			payload_release(payload);	// queue reference
+			if (rval == -ENOMEM)
+			{
+				cnt = -ENOMEM;
+			}
+			else
+			{
+				err = rval;	// overflow, the other subscribers get the message anyway
+			}
+		}
+	}
+
+	// the deferred subscribers replaced the publisher's ones
+	if ((publisher != NULL) && (ndeferred > 0))
+	{
+		publisher->generation = PSB_GENERATION_NONE;
+	}
+	
+	// leave read section, free match cache entries replaced by publishers
+	epoch_leave(&broker->epoch, token);
+	epoch_reclaim(&broker->epoch);
+
+	// the waiting must not block subscriptions change (it waits for publishers leave the read section),
+	// nor the release callback of dropped messages run in it
+	for (i = 0; i < ndeferred; i++)
+	{
+		rval = (cnt >= 0) ? message_put(match->subs[i], payload, 1) : cnt;
+		if (rval == 0)
+		{
+			cnt++;
+		}
+		else
+		{
+			payload_release(payload);
+			if (cnt >= 0)
+			{
+				err = rval;
+			}
+		}
+		subscriber_release(match->subs[i]);
+	}
+
+	match_free(&local);
 
-	if(out != NULL)
+	// drop publisher reference, body is freed here if nobody matched
+	if (payload != NULL)
 	{
-		memcpy(out, mem, size);
+		payload_release(payload);
 	}
 
-	return out;
+	return ((cnt >= 0) && (err != 0)) ? err : cnt;
 }
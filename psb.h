@@ -32,6 +32,13 @@ extern "C"
  * If the subscriber is subscribed to multiple channels, message matching any of them will be delivered.
  *
  * The subscriber with matched channel name will get copy of data passed to psb_publish_message(), not the data itself.
+ * The copy is made once per publish and shared (read-only) between all matched subscribers.
+ * psb_publish_message_nocopy() passes the publisher's data object itself instead of copy.
+ *
+ * Channel names are interned by broker: psb_channel_get() returns the channel handle
+ * that can be published to by psb_publish_channel(), received messages carry the handle
+ * of their channel. psb_publisher bound to a channel keeps its matched subscribers
+ * between psb_publish() calls while subscriptions are not changed.
  *
  * The subscribers must call psb_free_message() for freeing message after processing the incoming message.
  *
@@ -44,15 +51,74 @@ extern "C"
 
 #define DEFAULT_BROKER		NULL
 
+// Subscriber queue types, see psb_new_subscriber_ex()
+#define PSB_QUEUE_LOCKED	0	// mutex guarded queue (default)
+#define PSB_QUEUE_MPSC		1	// lock-free multi-producer single-consumer queue
+#define PSB_QUEUE_SPSC		2	// single-producer single-consumer ring, see psb_new_subscriber_spsc()
+
+// Ring of PSB_QUEUE_SPSC subscriber created by psb_new_subscriber_ex()
+#define PSB_SPSC_SLOTS		1024	// number of slots
+#define PSB_SPSC_INLINE		128		// maximum size of data object copied into the slot
+
+// Overflow policies of bounded subscriber queue, see psb_set_queue_limit()
+#define PSB_OVERFLOW_BLOCK			0	// publisher waits for free space, fails with -ETIMEDOUT
+#define PSB_OVERFLOW_DROP_NEWEST	1	// the new message is dropped
+#define PSB_OVERFLOW_DROP_OLDEST	2	// the oldest queued messages are dropped
+#define PSB_OVERFLOW_FAIL			3	// publish fails with -ENOBUFS
+
+// Number of message priorities, see psb_publish_message_prio()
+#define PSB_PRIORITIES		4
+
 typedef struct psb_subscriber psb_subscriber;
 typedef struct psb_broker psb_broker;
 typedef struct psb_message psb_message;
+typedef struct psb_channel psb_channel;
+typedef struct psb_publisher psb_publisher;
+typedef struct psb_batch_entry psb_batch_entry;
+typedef struct psb_queue_stats psb_queue_stats;
+typedef struct psb_pool_stats psb_pool_stats;
+typedef struct psb_cache_stats psb_cache_stats;
+
+// Callback releasing the publisher's data object, see psb_publish_message_nocopy()
+typedef void (*psb_release_fn)(void* data, void* arg);
 
 struct psb_message
 {
-	void*	data;
+	void*	data;		// message data (shared between subscribers, read-only)
 	int		datalen;
-	char*	channel;
+	char*	channel;	// channel name (shared between subscribers, read-only)
+	psb_channel*	channel_id;	// channel handle, the same for all messages of the channel, see psb_channel_get()
+	int		prio;		// message priority, see psb_publish_message_prio()
+	void*	payload;	// internal reference to the shared message body, never touch
+};
+
+struct psb_batch_entry
+{
+	char*	channel;	// channel name to publish
+	void*	data;		// data object
+	int		datalen;	// data object size
+};
+
+struct psb_queue_stats
+{
+	long	length;		// number of queued messages
+	long	bytes;		// total size of queued data objects (bounded queue only)
+	long	dropped;	// messages dropped by PSB_OVERFLOW_DROP_NEWEST/PSB_OVERFLOW_DROP_OLDEST policy
+	long	rejected;	// messages refused by PSB_OVERFLOW_FAIL/PSB_OVERFLOW_BLOCK policy
+};
+
+struct psb_pool_stats
+{
+	long	size;		// maximum block size of the size class
+	long	blocks;		// number of blocks allocated from system
+	long	free;		// number of blocks in the shared pool
+	long	held;		// number of blocks used or cached by threads
+};
+
+struct psb_cache_stats
+{
+	long	hits;		// publishes resolved by match cache
+	long	misses;		// publishes resolved by channel index search
 };
 
 /**
@@ -68,6 +134,21 @@ struct psb_message
  */
 psb_broker* psb_new_broker();
 
+/**
+ * Create new sharded broker
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_new_broker_ex() is psb_new_broker() with subscribers partitioned over 'nshards' shards.
+ * Every shard has own lock and routing, so subscriptions change locks and rebuilds the routing
+ * of the subscriber's shard only and subscribers of different shards are changed in parallel.
+ * The publish searches subscribers of all shards.
+ *
+ * @param nshards number of shards (1 to 256)
+ * @return allocated psb_broker or NULL in case of error
+ */
+psb_broker* psb_new_broker_ex(int nshards);
+
 /**
  * Delete broker
  *
@@ -93,6 +174,46 @@ int psb_delete_broker(psb_broker* broker);
  */
 psb_subscriber* psb_new_subscriber(psb_broker* broker);
 
+/**
+ * Create new subscriber with given queue type
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_new_subscriber_ex() is psb_new_subscriber() with the choice of message queue.
+ * PSB_QUEUE_LOCKED is the default mutex guarded queue.
+ * PSB_QUEUE_MPSC is lock-free for publishers and blocks the subscriber only when
+ * the queue is empty, it suits channels with many concurrent publishers.
+ * Messages of PSB_QUEUE_MPSC subscriber must be received by one thread at a time.
+ * PSB_QUEUE_SPSC is psb_new_subscriber_spsc() with PSB_SPSC_SLOTS slots of PSB_SPSC_INLINE bytes.
+ *
+ * @param parent broker
+ * @param queue_type PSB_QUEUE_LOCKED, PSB_QUEUE_MPSC or PSB_QUEUE_SPSC
+ * @return allocated psb_subscriber or NULL in case of error
+ */
+psb_subscriber* psb_new_subscriber_ex(psb_broker* broker, int queue_type);
+
+/**
+ * Create new subscriber with single publisher ring
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_new_subscriber_spsc() creates subscriber of PSB_QUEUE_SPSC queue: a ring of 'slots'
+ * cache line aligned slots (rounded up to power of two) passing messages by acquire/release atomics,
+ * without lock. Messages with data objects up to 'inline_size' bytes are stored in the slot itself:
+ * the message published to this subscriber only is built in the slot without allocation, the message
+ * matched by other subscribers too is copied into the slot from the shared body. Bigger ones
+ * (and psb_publish_message_nocopy() ones) are passed as shared body the usual way. The subscriber
+ * must be published to by one thread at a time and its messages must be received by one thread at a time.
+ * The ring is the capacity of queue: the publisher waits for free slot when the ring is full
+ * (the received but not freed messages hold their slots), see psb_set_queue_limit() for other choices.
+ *
+ * @param parent broker
+ * @param slots number of slots
+ * @param inline_size maximum size of data object copied into the slot, 0 for none
+ * @return allocated psb_subscriber or NULL in case of error
+ */
+psb_subscriber* psb_new_subscriber_spsc(psb_broker* broker, long slots, int inline_size);
+
 /**
  * Delete psb_subscriber
  *
@@ -105,6 +226,39 @@ psb_subscriber* psb_new_subscriber(psb_broker* broker);
  */
 int psb_delete_subscriber(psb_subscriber* subscriber);
 
+/**
+ * Join consumer group
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_join_group() returns the subscriber shared by all members of consumer group 'group_name',
+ * the first member creates it. Every message delivered to the group is put to the group's
+ * queue once and is received by exactly one member that calls psb_get_message() (or other get function)
+ * with the returned subscriber, so the work is balanced between the members without copies.
+ * Subscriptions and the queue settings of the subscriber are those of the group: a channel subscribed by
+ * one member is delivered to the group.
+ * Every member must leave the group by psb_leave_group() (or psb_delete_subscriber()),
+ * the last one deletes the group's subscriber.
+ *
+ * @param broker the broker (NULL for the global broker)
+ * @param group_name name of consumer group
+ * @return the group's subscriber or NULL in case of error
+ */
+psb_subscriber* psb_join_group(psb_broker* broker, char* group_name);
+
+/**
+ * Leave consumer group
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_leave_group() ends the membership taken by psb_join_group(). The last member
+ * deletes the group's subscriber with all queued messages, as psb_delete_subscriber() does.
+ *
+ * @param subscriber the group's subscriber returned by psb_join_group()
+ * @return 0 if success or -EINVAL if subscriber is not a group's subscriber
+ */
+int psb_leave_group(psb_subscriber* subscriber);
+
 /**
  * Subscribe to channel
  *
@@ -113,6 +267,9 @@ int psb_delete_subscriber(psb_subscriber* subscriber);
  * psb_subscribe() bind subscriber with channel 'channel_name'.
  * A subscriber can be subscribed to many channels.
  * if subscriber already subscribed to channel error EINVAL returned
+ * The subscription is routed once the broker's router thread rebuilt the routing, shortly
+ * after the call; psb_sync_subscriptions() waits for it. The same holds for other
+ * subscribe and unsubscribe functions.
  *
  * @param  subscriber
  * @param  channel_name
@@ -127,6 +284,8 @@ int psb_subscribe(psb_subscriber* subscriber, char* channel_name);
  *
  * psb_unsubscribe() unbind subscriber from channel 'channel_name'.
  * if subscriber is not subscribed to channel error EINVAL returned
+ * Messages published before the router rebuilt the routing may still be delivered
+ * (see psb_sync_subscriptions()).
  *
  * @param  subscriber
  * @param  channel_name
@@ -134,6 +293,104 @@ int psb_subscribe(psb_subscriber* subscriber, char* channel_name);
  */
 int psb_unsubscribe(psb_subscriber* subscriber, char* channel_name);
 
+/**
+ * Subscribe to channels matching pattern
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_subscribe_pattern() bind subscriber with all channels matching MQTT-style 'pattern'.
+ * Channel names are split to levels by the broker's separator (see psb_set_separator()),
+ * the pattern level '+' matches any single level and the last pattern level '#' matches
+ * any number of levels: "sensors/+/temperature" matches "sensors/kitchen/temperature",
+ * "sensors/#" matches "sensors" and "sensors/kitchen/humidity". Other levels match equal
+ * levels only, so a pattern without wildcards matches the very channel (not the channels
+ * it is prefix of, as psb_subscribe() does).
+ * The patterns of all subscribers are matched together in one walk over the channel levels,
+ * and a message is delivered to the subscriber once however many of its subscriptions match.
+ *
+ * @param  subscriber
+ * @param  pattern
+ * @return 0 if success or negative value EINVAL if the pattern is invalid or already subscribed
+ */
+int psb_subscribe_pattern(psb_subscriber* subscriber, char* pattern);
+
+/**
+ * Unsubscribe pattern
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_unsubscribe_pattern() unbind subscriber from 'pattern' subscribed by psb_subscribe_pattern().
+ *
+ * @param  subscriber
+ * @param  pattern
+ * @return 0 if success or negative value EINVAL if the pattern is not subscribed
+ */
+int psb_unsubscribe_pattern(psb_subscriber* subscriber, char* pattern);
+
+/**
+ * Subscribe to exact channel
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_subscribe_exact() bind subscriber with the very channel 'channel_name' (not the channels
+ * it is prefix of, as psb_subscribe() does).
+ * Exact channels are kept in a hash table probed before the prefix and pattern indexes
+ * with the hash kept in the channel handle, so publishing to subscribers having only exact
+ * subscriptions costs a single table probe. Publishing by handle (psb_publish_channel(),
+ * psb_publish()) never hashes the name, publishing by name hashes it once to find the handle.
+ *
+ * @param  subscriber
+ * @param  channel_name
+ * @return 0 if success or negative value EINVAL if channel already subscribed
+ */
+int psb_subscribe_exact(psb_subscriber* subscriber, char* channel_name);
+
+/**
+ * Unsubscribe exact channel
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_unsubscribe_exact() unbind subscriber from channel 'channel_name' subscribed by psb_subscribe_exact().
+ *
+ * @param  subscriber
+ * @param  channel_name
+ * @return 0 if success or negative value EINVAL if channel is not subscribed
+ */
+int psb_unsubscribe_exact(psb_subscriber* subscriber, char* channel_name);
+
+/**
+ * Set level separator
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_set_separator() sets the character separating levels of channel names for pattern
+ * subscriptions, '/' by default. The separator can be set before the first subscription
+ * of the broker only.
+ *
+ * @param  broker the broker or NULL for the global broker
+ * @param  separator level separator, not '+' or '#'
+ * @return 0 if success or negative value EINVAL if the separator is invalid,
+ *         EBUSY if the broker already has subscriptions
+ */
+int psb_set_separator(psb_broker* broker, char separator);
+
+/**
+ * Wait for subscriptions routing
+ *
+ * @ingroup PubSubBroker
+ *
+ * Subscriptions change the broker's routing table in place, publishers route by a snapshot
+ * of it rebuilt by the broker's router thread (delayed a little to rebuild a burst of changes
+ * once), so publishers never wait for subscriptions change. psb_sync_subscriptions() returns
+ * when the snapshots contain all subscriptions changed before the call: the messages published
+ * after it are routed by them. psb_delete_subscriber() does not need it, it removes the subscriber
+ * from routing before returning.
+ *
+ * @param  broker the broker or NULL for the global broker
+ * @return 0 if success or negative value ENOMEM if the routing could not be rebuilt
+ */
+int psb_sync_subscriptions(psb_broker* broker);
+
 /**
  * Gets a messages from all channels subscribed.
  *
@@ -152,6 +409,77 @@ int psb_unsubscribe(psb_subscriber* subscriber, char* channel_name);
  */
 int psb_get_message(psb_subscriber* subscriber, psb_message* msg, int timeout_ms);
 
+/**
+ * Gets several messages from all channels subscribed.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_get_messages waits for a message as psb_get_message does, then takes up to 'max'
+ * messages queued for the subscriber. The queue is locked once per 256 messages.
+ *
+ * @param subscriber Pointer to the subscriber.
+ * @param msgs array of 'max' psb_message. Every received message should be deallocated with psb_free_message()
+ * @param max maximum number of messages to receive
+ * @param timeout timeout on how long to wait on a message in milliseconds
+ *
+ * @return number of received messages on success, -EINVAL if subscriber is NULL and ETIMEDOUT (or ERROR_TIMEOUT for windows) if timeout occurs
+ */
+int psb_get_messages(psb_subscriber* subscriber, psb_message* msgs, int max, int timeout_ms);
+
+/**
+ * Gets a message without waiting
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_try_get_message takes a message from the subscriber's queue if there is one and returns at once otherwise.
+ * Together with psb_subscriber_get_fd() it lets an event loop receive messages: when the descriptor
+ * becomes readable, take messages until -EAGAIN.
+ *
+ * @param subscriber Pointer to the subscriber.
+ * @param msg pointer to psb_message. The msg should be deallocated with psb_free_message()
+ *
+ * @return 0 on success, -EINVAL if subscriber is NULL and -EAGAIN if the queue is empty
+ */
+int psb_try_get_message(psb_subscriber* subscriber, psb_message* msg);
+
+/**
+ * Gets the subscriber's event descriptor
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_subscriber_get_fd returns a descriptor (Linux eventfd) to wait for messages with poll/epoll/select.
+ * The descriptor becomes readable when a message arrives to the empty queue and stays readable until
+ * psb_try_get_message() returns -EAGAIN, so the subscriber should take messages until then
+ * (the descriptor is fit for edge-triggered epoll). It may be readable spuriously.
+ * The descriptor is created on the first call and closed with the subscriber by psb_delete_subscriber(); the caller must not
+ * read or close it. Publishers make the write system call only after the subscriber
+ * has found the queue empty, not per message.
+ *
+ * @param subscriber Pointer to the subscriber
+ * @return the descriptor, -EINVAL if subscriber is NULL, -ENOSYS if not supported (non-Linux) or other negative errno
+ */
+int psb_subscriber_get_fd(psb_subscriber* subscriber);
+
+/**
+ * Waits for messages of several subscribers
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_poll() blocks the calling thread until any of the subscribers has a message or the (optional) timeout occurs,
+ * then the messages are received by psb_get_message() or psb_try_get_message() of the ready subscribers.
+ * The publishers wake up the caller through a single wait object shared by the subscribers, and only
+ * the first message after the subscribers were found empty costs the wake up.
+ * A subscriber can be polled by one thread at a time.
+ *
+ * @param subscribers array of 'count' subscribers
+ * @param count number of subscribers
+ * @param timeout_ms timeout on how long to wait on a message in milliseconds, 0 for no timeout
+ * @param ready array of 'count' flags, set to nonzero for subscribers with messages
+ * @return number of subscribers with messages, 0 if timeout occurs, -EINVAL in case of invalid arguments,
+ * -EBUSY if a subscriber is polled by other thread or -ENOMEM if out of memory
+ */
+int psb_poll(psb_subscriber** subscribers, int count, int timeout_ms, int* ready);
+
 /**
  * Gets the count of messages in subscriber's queue
  *
@@ -165,12 +493,100 @@ int psb_get_message(psb_subscriber* subscriber, psb_message* msg, int timeout_ms
 int psb_get_messages_count(psb_subscriber* subscriber);
 
 
+/**
+ * Limit the subscriber's queue
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_set_queue_limit() bounds the subscriber's queue by number of messages and/or by
+ * total size of data objects and selects what happens to the message published to full queue:
+ * PSB_OVERFLOW_BLOCK - the publisher waits for free space up to 'timeout_ms', then the publish fails with -ETIMEDOUT;
+ * PSB_OVERFLOW_DROP_NEWEST - the new message is dropped;
+ * PSB_OVERFLOW_DROP_OLDEST - the oldest queued messages are dropped;
+ * PSB_OVERFLOW_FAIL - the publish fails with -ENOBUFS.
+ * The other matched subscribers get the message anyway. Dropped and refused messages
+ * are counted, see psb_get_queue_stats().
+ * PSB_QUEUE_MPSC subscriber supports PSB_OVERFLOW_DROP_NEWEST and PSB_OVERFLOW_FAIL only,
+ * its limit must be set before subscribing.
+ * PSB_QUEUE_SPSC subscriber is bounded by its ring: 'max_msgs' and 'max_bytes' must be 0,
+ * the policy (except PSB_OVERFLOW_DROP_OLDEST) applies to the full ring.
+ *
+ * @param subscriber Pointer to the subscriber.
+ * @param max_msgs maximum number of queued messages, 0 for unlimited
+ * @param max_bytes maximum total size of queued data objects, 0 for unlimited
+ * @param policy overflow policy
+ * @param timeout_ms PSB_OVERFLOW_BLOCK: how long the publisher waits for free space in milliseconds
+ * @return 0 if success or -EINVAL in case of invalid arguments
+ */
+int psb_set_queue_limit(psb_subscriber* subscriber, long max_msgs, long max_bytes, int policy, int timeout_ms);
+
+/**
+ * Select how the subscriber waits for messages
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_set_queue_wait() trades the subscriber's processor time for the wake up latency of
+ * psb_get_message() and psb_get_messages(): on the empty queue the subscriber polls it 'spin' times,
+ * then yields the processor 'yield' times polling after each yield, then sleeps until a publisher wakes it up.
+ * Publishers make the wake up system call only if the subscriber sleeps.
+ * Zero counts (the default) sleep at once; busy polling makes sense only if the subscriber has a processor of its own.
+ *
+ * @param subscriber Pointer to the subscriber.
+ * @param spin number of busy polls before yielding
+ * @param yield number of yields before sleeping
+ * @return 0 if success or -EINVAL in case of invalid arguments
+ */
+int psb_set_queue_wait(psb_subscriber* subscriber, long spin, long yield);
+
+/**
+ * Gets statistics of the subscriber's queue
+ *
+ * @ingroup PubSubBroker
+ *
+ * @param subscriber Pointer to the subscriber.
+ * @param stats filled in with length, size of data and overflow counters of the queue
+ * @return 0 if success or -EINVAL if subscriber or stats is NULL
+ */
+int psb_get_queue_stats(psb_subscriber* subscriber, psb_queue_stats* stats);
+
+/**
+ * Gets statistics of the message memory pool
+ *
+ * @ingroup PubSubBroker
+ *
+ * Message bodies and queue entries are allocated from the process-wide pool of
+ * size classes (the bodies outlive their broker until the last psb_free_message()).
+ * psb_get_pool_stats() reports occupancy of each size class.
+ *
+ * @param stats array of 'max' entries filled in with statistics of size classes
+ * @param max size of stats array
+ * @return number of filled entries or -EINVAL if stats is NULL
+ */
+int psb_get_pool_stats(psb_pool_stats* stats, int max);
+
+/**
+ * Gets statistics of the broker's match cache
+ *
+ * @ingroup PubSubBroker
+ *
+ * Subscribers matched by published channel are cached until subscriptions of the broker
+ * are changed. psb_get_cache_stats() reports how many publishes were resolved by the cache
+ * and how many searched the channel index (of any shard). Each publish is counted once,
+ * publishes before the first subscription are not counted.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param stats filled in with hit and miss counters of the cache
+ * @return 0 if success or -EINVAL if stats is NULL
+ */
+int psb_get_cache_stats(psb_broker* broker, psb_cache_stats* stats);
+
 /**
  * Freeing a memory allocated for messages.
  *
  * @ingroup PubSubBroker
  *
- * psb_free_message freeing memory allocated or channel name and data but not for psb_message itself
+ * psb_free_message drops the subscriber's reference to the shared channel name and data,
+ * the memory is freed when the last subscriber frees its message. The psb_message itself is not freed.
  * use it after psb_get_message().
  *
  * @param msg Pointer to the message.
@@ -184,16 +600,162 @@ int psb_free_message(psb_message* msg);
  * @ingroup PubSubBroker
  *
  * psb_publish_message() search for all subscribers that subscribe on channel and
- * copy data object to subscriber's queue.
+ * put data object to subscriber's queue. The data object is copied only once
+ * and the copy is shared by all matched subscribers.
  *
  * @param broker Pointer to the pub/sub broker.
  * @param channel Pointer to the channel name to publish.
  * @param data Pointer to the data object.
  * @param datalen data object size.
  * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
  */
 int psb_publish_message(psb_broker* broker, char* channel, void* data, int datalen);
 
+/**
+ * Publish the data object within channel with priority.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_message_prio() is psb_publish_message() for message of priority 'prio':
+ * subscribers receive it before all queued messages of lower priority, so control messages
+ * don't wait behind the backlog of bulk data. psb_publish_message() publishes with priority 0 (the lowest).
+ * PSB_OVERFLOW_DROP_OLDEST policy drops messages of the lowest priority first and never
+ * drops a message of higher priority for the new one.
+ * PSB_QUEUE_MPSC subscribers receive messages in order of publishing regardless of priority.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel Pointer to the channel name to publish.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @param prio message priority, 0 to PSB_PRIORITIES - 1
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_message_prio(psb_broker* broker, char* channel, void* data, int datalen, int prio);
+
+/**
+ * Gets the channel handle
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_channel_get() returns the broker's interned channel of name 'channel_name',
+ * the channel is created on first use. The handle is the same for the same name
+ * and is valid until the broker is deleted. Every received message refers to its
+ * channel handle (psb_message::channel_id), so channels are compared by handle instead of name.
+ * Channels published by name only are dropped by the broker when no message or match cache
+ * entry refers to them, so their psb_message::channel_id is valid until the message is freed.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel_name Pointer to the channel name.
+ * @return channel handle or NULL in case of error
+ */
+psb_channel* psb_channel_get(psb_broker* broker, char* channel_name);
+
+/**
+ * Publish the data object within channel given by handle.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_channel() is psb_publish_message() for channel handle returned
+ * by psb_channel_get(), it skips the channel name lookup.
+ *
+ * @param channel channel handle.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_channel(psb_channel* channel, void* data, int datalen);
+
+/**
+ * Create new publisher
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_new_publisher() creates a publisher bound to channel 'channel_name'. The publisher
+ * keeps the list of subscribers matched by its channel, psb_publish() reuses the list
+ * while subscriptions of the broker are not changed, so it does not search the channel
+ * index. A publisher must be used by one thread at a time and deleted before its broker.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel_name Pointer to the channel name to publish.
+ * @return allocated psb_publisher or NULL in case of error
+ */
+psb_publisher* psb_new_publisher(psb_broker* broker, char* channel_name);
+
+/**
+ * Delete publisher
+ *
+ * @ingroup PubSubBroker
+ *
+ * @param publisher Pointer to the publisher.
+ * @return 0 if success or -EINVAL if publisher is NULL
+ */
+int psb_delete_publisher(psb_publisher* publisher);
+
+/**
+ * Publish the data object within the publisher's channel.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish() is psb_publish_message() for the channel of publisher,
+ * the subscribers matched by the previous call are reused if subscriptions
+ * of the broker are not changed since.
+ *
+ * @param publisher Pointer to the publisher.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish(psb_publisher* publisher, void* data, int datalen);
+
+/**
+ * Publish the caller's data object within channel without copy.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_message_nocopy() delivers the data object itself (not a copy) to all
+ * subscribers that subscribe on channel, as psb_publish_message() does otherwise.
+ * The data object is passed to the broker: it must not be changed or freed by the caller,
+ * the broker calls 'release' once, when the last subscriber called psb_free_message()
+ * (immediately if nobody matched) or the message is dropped by the overflow policy of all
+ * subscribers holding it. The callback is called in any case, also if the publish fails;
+ * it may be called from the publisher's or any subscriber's thread. The publisher calls it
+ * after routing, out of the broker's and the queues' locks.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param channel Pointer to the channel name to publish.
+ * @param data Pointer to the data object.
+ * @param datalen data object size.
+ * @param release callback releasing the data object
+ * @param release_arg argument passed to 'release'
+ * @return total count of subscribers with matched channels or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_message_nocopy(psb_broker* broker, char* channel, void* data, int datalen,
+	psb_release_fn release, void* release_arg);
+
+/**
+ * Publish several data objects at once.
+ *
+ * @ingroup PubSubBroker
+ *
+ * psb_publish_batch() publishes 'count' entries as psb_publish_message() does
+ * (each data object copied once and shared by matched subscribers), but routes
+ * the whole batch in one read section and puts all messages of a subscriber
+ * to its queue under single lock with single wakeup.
+ * The messages are delivered to every subscriber in the order of entries.
+ *
+ * @param broker Pointer to the pub/sub broker.
+ * @param entries Pointer to the array of channel/data entries.
+ * @param count number of entries.
+ * @return total count of delivered messages or negative value in case of error
+ * -ENOBUFS or -ETIMEDOUT if the bounded queue of a subscriber is full, see psb_set_queue_limit()
+ */
+int psb_publish_batch(psb_broker* broker, psb_batch_entry* entries, int count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,400 @@
+/*
+ * Size-class slab allocator with per-thread caches
+ * slab.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: alexo
+ */
+
+#include <stdlib.h>
+#include "slab.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+
+#define slab_key_t                  DWORD
+#define slab_key_create(k, fn)      ((*(k) = FlsAlloc(fn)) != FLS_OUT_OF_INDEXES)
+#define slab_key_set(k, v)          FlsSetValue((k), (v))
+#define DEFINE_SLAB_DESTRUCTOR(NAME, PARAM)  VOID WINAPI NAME(PVOID PARAM)
+
+#else
+
+#define slab_key_t                  pthread_key_t
+#define slab_key_create(k, fn)      (pthread_key_create((k), (fn)) == 0)
+#define slab_key_set(k, v)          pthread_setspecific((k), (v))
+#define DEFINE_SLAB_DESTRUCTOR(NAME, PARAM)  void NAME(void* PARAM)
+
+#endif
+
+// Block header, keeps size class of block (SLAB_CLASSES for block allocated by malloc()) and its chunk.
+// The header size keeps the block aligned as malloc() does.
+union slab_header
+{
+	struct slab_block
+	{
+		int sclass;					// size class of block
+		struct slab_chunk* chunk;	// chunk the block is carved from
+	} block;
+	double align[2];
+};
+
+// link of free block is stored after its header
+#define SLAB_NEXT(h)	(*(union slab_header**)((h) + 1))
+
+// Chunk header, the blocks follow it. Free blocks of the shared pool are kept by their chunks,
+// so the chunk with all blocks free can be returned to the system.
+union slab_chunk_header
+{
+	struct slab_chunk
+	{
+		struct slab_chunk* next;	// next chunk of the same pool list
+		struct slab_chunk* prev;	// previous chunk of the same pool list
+		union slab_header* free;	// free blocks of chunk in the shared pool
+		int nfree;					// number of free blocks
+		int nblocks;				// number of blocks carved from chunk
+	} chunk;
+	double align[4];
+};
+
+// Shared pool of size class
+struct slab_pool
+{
+	mutex_t mutex;				// guards the pool
+	struct slab_chunk* partial;	// chunks with some blocks free, blocks are taken from them first
+	struct slab_chunk* empty;	// chunks with all blocks free
+	int nempty;					// number of empty chunks
+	long nfree;					// number of free blocks
+	long blocks;				// number of blocks carved from chunks
+};
+
+// Thread's cache of free blocks
+struct slab_cache
+{
+	union slab_header* free[SLAB_CLASSES];	// free blocks of each size class
+	int count[SLAB_CLASSES];	// number of free blocks
+	int registered;				// the cache is flushed at thread exit
+};
+
+#define SLAB_POOL_INITIALIZER	{MUTEX_INITIALIZER, NULL, NULL, 0, 0, 0}
+
+static struct slab_pool g_slab_pools[SLAB_CLASSES] =
+{
+	SLAB_POOL_INITIALIZER, SLAB_POOL_INITIALIZER, SLAB_POOL_INITIALIZER,
+	SLAB_POOL_INITIALIZER, SLAB_POOL_INITIALIZER, SLAB_POOL_INITIALIZER,
+	SLAB_POOL_INITIALIZER, SLAB_POOL_INITIALIZER, SLAB_POOL_INITIALIZER,
+};
+
+static THREAD_LOCAL struct slab_cache g_slab_cache;
+
+// thread exit hook, created on first use
+static mutex_t g_slab_mutex = MUTEX_INITIALIZER;
+static int g_slab_key_created = 0;
+static slab_key_t g_slab_key;
+
+// size of blocks of size class
+static size_t slab_class_size(int sclass)
+{
+	return (size_t)SLAB_MIN_SIZE << sclass;
+}
+
+// number of free blocks of size class the thread may cache
+static int slab_cache_limit(int sclass)
+{
+	int limit = (int)(SLAB_CACHE_SIZE / slab_class_size(sclass));
+	return (limit < 2) ? 2 : limit;
+}
+
+// the smallest size class for 'size' bytes block (with header), SLAB_CLASSES if too big
+static int slab_class(size_t size)
+{
+	int sclass = 0;
+
+	while ((sclass < SLAB_CLASSES) && (slab_class_size(sclass) < size))
+	{
+		sclass++;
+	}
+
+	return sclass;
+}
+
+// insert chunk to the pool's list
+static void slab_chunk_link(struct slab_chunk** list, struct slab_chunk* chunk)
+{
+	chunk->prev = NULL;
+	chunk->next = *list;
+	if (*list != NULL)
+	{
+		(*list)->prev = chunk;
+	}
+	*list = chunk;
+}
+
+// remove chunk from the pool's list
+static void slab_chunk_unlink(struct slab_chunk** list, struct slab_chunk* chunk)
+{
+	if (chunk->prev != NULL)
+	{
+		chunk->prev->next = chunk->next;
+	}
+	else
+	{
+		*list = chunk->next;
+	}
+	if (chunk->next != NULL)
+	{
+		chunk->next->prev = chunk->prev;
+	}
+}
+
+// return free block to its chunk (under the pool's mutex), the chunk is freed if it is empty
+// and the pool keeps enough empty chunks
+static void slab_chunk_put(struct slab_pool* pool, union slab_header* block)
+{
+	struct slab_chunk* chunk = block->block.chunk;
+
+	SLAB_NEXT(block) = chunk->free;
+	chunk->free = block;
+	pool->nfree++;
+
+	if (++chunk->nfree == 1)
+	{
+		slab_chunk_link(&pool->partial, chunk);
+	}
+	if (chunk->nfree == chunk->nblocks)
+	{
+		slab_chunk_unlink(&pool->partial, chunk);
+		if (pool->nempty < SLAB_EMPTY_CHUNKS)
+		{
+			slab_chunk_link(&pool->empty, chunk);
+			pool->nempty++;
+		}
+		else
+		{
+			pool->nfree -= chunk->nblocks;
+			pool->blocks -= chunk->nblocks;
+			free(chunk);
+		}
+	}
+}
+
+// take free block from the pool (under the pool's mutex), NULL if the pool is empty
+static union slab_header* slab_chunk_get(struct slab_pool* pool)
+{
+	struct slab_chunk* chunk = pool->partial;
+	union slab_header* block;
+
+	// fill partially used chunks first, so the other ones may get empty
+	if (chunk == NULL)
+	{
+		chunk = pool->empty;
+		if (chunk == NULL)
+		{
+			return NULL;
+		}
+		slab_chunk_unlink(&pool->empty, chunk);
+		slab_chunk_link(&pool->partial, chunk);
+		pool->nempty--;
+	}
+
+	block = chunk->free;
+	chunk->free = SLAB_NEXT(block);
+	pool->nfree--;
+	if (--chunk->nfree == 0)
+	{
+		slab_chunk_unlink(&pool->partial, chunk);
+	}
+
+	return block;
+}
+
+// move 'count' free blocks of thread's cache to the shared pool
+static void slab_flush(struct slab_cache* cache, int sclass, int count)
+{
+	struct slab_pool* pool = &g_slab_pools[sclass];
+	union slab_header* block;
+
+	if (count <= 0)
+	{
+		return;
+	}
+
+	cache->count[sclass] -= count;
+
+	mutex_lock(&pool->mutex);
+	while (count-- > 0)
+	{
+		block = cache->free[sclass];
+		cache->free[sclass] = SLAB_NEXT(block);
+		slab_chunk_put(pool, block);
+	}
+	mutex_unlock(&pool->mutex);
+}
+
+// thread exit: return all cached blocks to the shared pools
+static DEFINE_SLAB_DESTRUCTOR(slab_thread_exit, param)
+{
+	struct slab_cache* cache = (struct slab_cache*)param;
+	int sclass;
+
+	for (sclass = 0; sclass < SLAB_CLASSES; sclass++)
+	{
+		slab_flush(cache, sclass, cache->count[sclass]);
+	}
+	cache->registered = 0;
+}
+
+// arrange flush of thread's cache at thread exit
+static void slab_register(struct slab_cache* cache)
+{
+	mutex_lock(&g_slab_mutex);
+	if (!g_slab_key_created)
+	{
+		g_slab_key_created = slab_key_create(&g_slab_key, slab_thread_exit);
+	}
+	mutex_unlock(&g_slab_mutex);
+
+	if (g_slab_key_created)
+	{
+		slab_key_set(g_slab_key, cache);
+	}
+	cache->registered = 1;
+}
+
+// move a batch of free blocks from the shared pool to thread's cache (carve a new chunk
+// if the pool is empty), returns 0 if out of memory
+static int slab_refill(struct slab_cache* cache, int sclass)
+{
+	struct slab_pool* pool = &g_slab_pools[sclass];
+	size_t size = slab_class_size(sclass);
+	union slab_header* block;
+	int count = slab_cache_limit(sclass) / 2;
+	int i, n;
+
+	if (!cache->registered)
+	{
+		slab_register(cache);
+	}
+
+	mutex_lock(&pool->mutex);
+
+	if (pool->nfree < count)
+	{
+		union slab_chunk_header* chunk = (union slab_chunk_header*)malloc(sizeof(union slab_chunk_header) +
+			SLAB_CHUNK_SIZE);
+		if (chunk != NULL)
+		{
+			n = (int)(SLAB_CHUNK_SIZE / size);
+			chunk->chunk.free = NULL;
+			chunk->chunk.nfree = n;
+			chunk->chunk.nblocks = n;
+			for (i = 0; i < n; i++)
+			{
+				block = (union slab_header*)((char*)(chunk + 1) + i * size);
+				block->block.sclass = sclass;
+				block->block.chunk = &chunk->chunk;
+				SLAB_NEXT(block) = chunk->chunk.free;
+				chunk->chunk.free = block;
+			}
+			slab_chunk_link(&pool->partial, &chunk->chunk);
+			pool->nfree += n;
+			pool->blocks += n;
+		}
+	}
+
+	// take the batch (or what is left in the pool)
+	for (n = 0; (n < count) && ((block = slab_chunk_get(pool)) != NULL); n++)
+	{
+		SLAB_NEXT(block) = cache->free[sclass];
+		cache->free[sclass] = block;
+	}
+	cache->count[sclass] += n;
+
+	mutex_unlock(&pool->mutex);
+
+	return n;
+}
+
+void* slab_alloc(size_t size)
+{
+	struct slab_cache* cache = &g_slab_cache;
+	union slab_header* block;
+	int sclass = slab_class(size + sizeof(union slab_header));
+
+	// too big block
+	if (sclass == SLAB_CLASSES)
+	{
+		block = (union slab_header*)malloc(size + sizeof(union slab_header));
+		if (block == NULL)
+		{
+			return NULL;
+		}
+		block->block.sclass = SLAB_CLASSES;
+		return block + 1;
+	}
+
+	if ((cache->free[sclass] == NULL) && (slab_refill(cache, sclass) == 0))
+	{
+		return NULL;
+	}
+
+	block = cache->free[sclass];
+	cache->free[sclass] = SLAB_NEXT(block);
+	cache->count[sclass]--;
+
+	return block + 1;
+}
+
+void slab_free(void* ptr)
+{
+	struct slab_cache* cache = &g_slab_cache;
+	union slab_header* block;
+	int sclass;
+	int limit;
+
+	if (ptr == NULL)
+	{
+		return;
+	}
+
+	block = (union slab_header*)ptr - 1;
+	sclass = block->block.sclass;
+	if (sclass == SLAB_CLASSES)
+	{
+		free(block);
+		return;
+	}
+
+	if (!cache->registered)
+	{
+		slab_register(cache);
+	}
+
+	SLAB_NEXT(block) = cache->free[sclass];
+	cache->free[sclass] = block;
+	cache->count[sclass]++;
+
+	// keep half of the cache for the following allocations
+	limit = slab_cache_limit(sclass);
+	if (cache->count[sclass] > limit)
+	{
+		slab_flush(cache, sclass, limit / 2);
+	}
+}
+
+int slab_get_stats(struct slab_stats* stats, int max)
+{
+	int sclass;
+
+	for (sclass = 0; (sclass < SLAB_CLASSES) && (sclass < max); sclass++)
+	{
+		struct slab_pool* pool = &g_slab_pools[sclass];
+
+		mutex_lock(&pool->mutex);
+		stats[sclass].size = slab_class_size(sclass) - sizeof(union slab_header);
+		stats[sclass].blocks = pool->blocks;
+		stats[sclass].free = pool->nfree;
+		stats[sclass].held = pool->blocks - pool->nfree;
+		mutex_unlock(&pool->mutex);
+	}
+
+	return sclass;
+}
@@ -0,0 +1,98 @@
+/*
+ * Size-class slab allocator with per-thread caches
+ * slab.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: alexo
+ */
+
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * @defgroup Slab Slab
+ *
+ * Little allocator for short-living blocks allocated on one thread and freed on another.
+ * Blocks are rounded up to power of two size class and carved from big chunks; freed
+ * blocks are kept in the calling thread's cache and exchanged with the shared pool
+ * of size class by batches, so the steady-state allocation takes no lock and never
+ * calls the system allocator. The shared pool keeps free blocks by their chunks:
+ * a chunk with all blocks free is returned to the system unless the pool keeps
+ * SLAB_EMPTY_CHUNKS empty chunks already, so a burst does not pin its peak memory.
+ * Blocks bigger than the biggest size class are allocated by malloc().
+ *
+ */
+
+/* Number of size classes, the smallest class is 64 bytes, each next is twice bigger */
+#define SLAB_CLASSES		9
+
+/* The smallest size class, bytes */
+#define SLAB_MIN_SIZE		64
+
+/* Size of chunk blocks are carved from, bytes */
+#define SLAB_CHUNK_SIZE		65536
+
+/* Maximum size of blocks cached by thread, bytes per size class */
+#define SLAB_CACHE_SIZE		32768
+
+/* Number of empty chunks kept by the shared pool of size class, the other ones are freed */
+#define SLAB_EMPTY_CHUNKS	2
+
+/**
+ * Size class statistics
+ *
+ * @ingroup Slab
+ */
+struct slab_stats
+{
+	size_t size;			// maximum block size of the class
+	long blocks;			// number of blocks carved from chunks
+	long free;				// number of blocks in the shared pool
+	long held;				// number of blocks used or cached by threads
+};
+
+/**
+ * Allocate a block
+ *
+ * @ingroup Slab
+ *
+ * @param size block size
+ * @return pointer to the block or NULL if out of memory
+ */
+void* slab_alloc(size_t size);
+
+/**
+ * Free a block
+ *
+ * @ingroup Slab
+ *
+ * The block may be freed by any thread, not only the allocating one.
+ *
+ * @param ptr pointer returned by slab_alloc() or NULL
+ */
+void slab_free(void* ptr);
+
+/**
+ * Gets statistics of size classes
+ *
+ * @ingroup Slab
+ *
+ * @param stats array of 'max' entries filled in with statistics of size classes
+ * @param max size of stats array
+ * @return number of filled entries
+ */
+int slab_get_stats(struct slab_stats* stats, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SLAB_H_ */
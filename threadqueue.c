@@ -1,8 +1,16 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <errno.h> 
+#include <errno.h>
 
 #include "threadqueue.h"
+#include "slab.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/eventfd.h>
+#define THREAD_QUEUE_EVENTFD
+#endif
 
 #define MSGPOOL_SIZE 256
 
@@ -24,7 +32,7 @@ static struct msglist *get_msglist(struct threadqueue *queue)
 	}
 	else
 	{
-		tmp = (struct msglist*) malloc(sizeof *tmp);
+		tmp = (struct msglist*) slab_alloc(sizeof *tmp);
 	}
 
 	return tmp;
@@ -35,7 +43,7 @@ static void release_msglist(struct threadqueue *queue, struct msglist *node)
 
 	if (queue->msgpool_length > (queue->length / 8 + MSGPOOL_SIZE))
 	{
-		free(node);
+		slab_free(node);
 	}
 	else
 	{
@@ -49,77 +57,1209 @@ static void release_msglist(struct threadqueue *queue, struct msglist *node)
 	{
 		struct msglist *tmp = queue->msgpool;
 		queue->msgpool = tmp->next;
-		free(tmp);
+		slab_free(tmp);
 		queue->msgpool_length--;
 	}
 }
 
-int thread_queue_init(struct threadqueue *queue)
+// return the list of unused nodes to pool (or free them for MPSC queue)
+static void release_msglists(struct threadqueue *queue, struct msglist *nodes)
 {
-	if (queue == NULL)
+	struct msglist *tmp;
+
+	while (nodes != NULL)
 	{
-		return EINVAL;
+		tmp = nodes;
+		nodes = nodes->next;
+		if (queue->type == THREAD_QUEUE_MPSC)
+		{
+			slab_free(tmp);
+		}
+		else
+		{
+			release_msglist(queue, tmp);
+		}
 	}
-	memset(queue, 0, sizeof(struct threadqueue));
-	cond_init(&queue->cond);
+}
 
-	mutex_init(&queue->mutex);
+// take 'count' nodes (linked by 'next'), NULL if out of memory
+static struct msglist *get_msglists(struct threadqueue *queue, int count)
+{
+	struct msglist *nodes = NULL;
+	struct msglist *tmp;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (queue->type == THREAD_QUEUE_MPSC)
+		{
+			tmp = (struct msglist*) slab_alloc(sizeof *tmp);
+		}
+		else
+		{
+			tmp = get_msglist(queue);
+		}
+		if (tmp == NULL)
+		{
+			release_msglists(queue, nodes);
+			return NULL;
+		}
+		tmp->next = nodes;
+		nodes = tmp;
+	}
+
+	return nodes;
+}
+
+// Waiter of several queues, signaled by the first producer putting to any of them
+struct threadqueue_poller
+{
+	mutex_t mutex;
+	cond_t cond;
+	int signaled;
+};
+
+// wake up the consumer waiting for the event descriptor or poller,
+// see thread_queue_try_get_msg() and thread_queue_poll()
+static void queue_notify(struct threadqueue *queue)
+{
+	// the consumer is idle, the lock is taken once per wake up
+	if (atomic_load_long(&queue->armed))
+	{
+		atomic_store_long(&queue->armed, 0);
+		mutex_lock(&queue->mutex);
+#ifdef THREAD_QUEUE_EVENTFD
+		if (queue->notify_fd >= 0)
+		{
+			eventfd_write(queue->notify_fd, 1);
+		}
+#endif
+		if (queue->poller != NULL)
+		{
+			mutex_lock(&queue->poller->mutex);
+			queue->poller->signaled = 1;
+			cond_signal(&queue->poller->cond);
+			mutex_unlock(&queue->poller->mutex);
+		}
+		mutex_unlock(&queue->mutex);
+	}
+}
+
+static int queue_limited(struct threadqueue *queue)
+{
+	return (queue->limit.max_msgs != 0) || (queue->limit.max_bytes != 0);
+}
+
+static long queue_size(struct threadqueue *queue, void *data)
+{
+	return (queue->limit.size != NULL) ? queue->limit.size(data) : 0;
+}
+
+// check if 'count' more messages of 'bytes' total size are within the limit
+static int queue_fits(struct threadqueue *queue, long length, long bytes, long count, long size)
+{
+	return ((queue->limit.max_msgs == 0) || (length + count <= queue->limit.max_msgs)) &&
+		((queue->limit.max_bytes == 0) || (bytes + size <= queue->limit.max_bytes));
+}
+
+// message is dropped by overflow policy, the queue must not be locked: the free function is the user's
+static void queue_drop(struct threadqueue *queue, void *data)
+{
+	atomic_inc(&queue->dropped);
+	if (queue->limit.free != NULL)
+	{
+		queue->limit.free(data);
+	}
+}
+
+// free messages of locked queue dropped by overflow policy, after the queue is unlocked
+static void queue_drop_list(struct threadqueue *queue, struct msglist *dropped)
+{
+	struct msglist *rec;
+
+	while (dropped != NULL)
+	{
+		rec = dropped;
+		dropped = rec->next;
+		queue_drop(queue, rec->msg.data);
+		slab_free(rec);		// the pool of nodes needs the lock
+	}
+}
+
+// MPSC: count the messages in queue length, fails if they are out of the limit
+static int mpsc_reserve(struct threadqueue *queue, long count, long size)
+{
+	long length = atomic_add(&queue->length, count);
+	long bytes = (size != 0) ? atomic_add(&queue->bytes, size) : atomic_load_long(&queue->bytes);
+
+	if (!queue_fits(queue, length - count, bytes - size, count, size))
+	{
+		atomic_add(&queue->length, -count);
+		if (size != 0)
+		{
+			atomic_add(&queue->bytes, -size);
+		}
+		return 0;
+	}
+	return 1;
+}
+
+// MPSC: append the chain first..last, producers never lock the queue
+static void mpsc_push(struct threadqueue *queue, struct msglist *first, struct msglist *last)
+{
+	struct msglist *prev;
+
+	prev = (struct msglist*) atomic_xchg_ptr(&queue->head, last);
+	// the consumer sees the chain after this store
+	atomic_store_ptr(&prev->next, first);
+
+	// wake up the consumer if it sleeps, see thread_queue_wait()
+	if (atomic_load_long(&queue->waiting))
+	{
+		mutex_lock(&queue->mutex);
+		cond_signal(&queue->cond);
+		mutex_unlock(&queue->mutex);
+	}
+	queue_notify(queue);
+}
+
+// MPSC: put messages, THREAD_QUEUE_FAIL and THREAD_QUEUE_DROP_NEWEST policies only
+static int mpsc_put(struct threadqueue *queue, void **data, int count, long msgtype, int wait)
+{
+	struct msglist *nodes;
+	struct msglist *first = NULL;
+	struct msglist *last = NULL;
+	struct msglist *newmsg;
+	long size = 0;
+	int i;
+
+	// take all nodes first, so nothing is changed if out of memory
+	nodes = get_msglists(queue, count);
+	if (nodes == NULL)
+	{
+		return ENOMEM;
+	}
+
+	// all or nothing, reserve the space for all messages at once; the try put doesn't drop
+	if (queue->limit.policy != THREAD_QUEUE_DROP_NEWEST || !queue_limited(queue) || !wait)
+	{
+		for (i = 0; (queue->limit.size != NULL) && (i < count); i++)
+		{
+			size += queue_size(queue, data[i]);
+		}
+		if (!mpsc_reserve(queue, count, size))
+		{
+			release_msglists(queue, nodes);
+			if (!wait)
+			{
+				return EAGAIN;
+			}
+			atomic_add(&queue->rejected, count);
+			return ENOBUFS;
+		}
+	}
+
+	// build the chain aside and publish it with single exchange
+	for (i = 0; i < count; i++)
+	{
+		if (queue->limit.policy == THREAD_QUEUE_DROP_NEWEST && queue_limited(queue) && wait &&
+			!mpsc_reserve(queue, 1, queue_size(queue, data[i])))
+		{
+			queue_drop(queue, data[i]);
+			continue;
+		}
+		newmsg = nodes;
+		nodes = nodes->next;
+		newmsg->msg.data = data[i];
+		newmsg->msg.msgtype = msgtype;
+		newmsg->next = NULL;
+		if (last == NULL)
+		{
+			first = newmsg;
+		}
+		else
+		{
+			last->next = newmsg;
+		}
+		last = newmsg;
+	}
+	release_msglists(queue, nodes);
+
+	if (first != NULL)
+	{
+		mpsc_push(queue, first, last);
+	}
 
 	return 0;
+}
+
+// MPSC: take the first message, returns 0 if there is nothing to take
+static int mpsc_pop(struct threadqueue *queue, struct threadmsg *msg)
+{
+	struct msglist *stub = queue->tail;
+	struct msglist *next = (struct msglist*) atomic_load_ptr(&stub->next);
+
+	if (next == NULL)
+	{
+		return 0;
+	}
 
+	// the taken node becomes the new stub
+	queue->tail = next;
+	msg->data = next->msg.data;
+	msg->msgtype = next->msg.msgtype;
+	msg->qlength = atomic_dec(&queue->length);
+	next->msg.data = NULL;
+	if (queue->limit.size != NULL)
+	{
+		atomic_add(&queue->bytes, -queue_size(queue, msg->data));
+	}
+
+	slab_free(stub);
+	return 1;
 }
 
-int thread_queue_put_msg(struct threadqueue *queue, void *data, long msgtype)
+// SPSC ring: the producer fills the slot at 'head' and marks it FILLED, the consumer takes the slot
+// at 'read' and marks it FREE (or TAKEN while it holds the inline message). The slot state is the only
+// shared word of message hand-off, the slot fields are published by its release store.
+#define RING_FREE	0
+#define RING_FILLED	1
+#define RING_TAKEN	2
+
+// alignment of slots, the cache line size
+#define RING_ALIGN	64
+
+struct ring_slot
+{
+	volatile long state;	// RING_FREE, RING_FILLED or RING_TAKEN
+	long msgtype;
+	void *data;				// message data, the inline area for inline message
+	struct threadqueue_ring *ring;	// the ring, for thread_queue_free_inline()
+};
+
+// the inline message follows the slot header, aligned as malloc() does
+#define RING_SLOT_HEADER	((sizeof(struct ring_slot) + 15) & ~(size_t)15)
+#define RING_INLINE(slot)	((char*)(slot) + RING_SLOT_HEADER)
+
+struct threadqueue_ring
+{
+	long mask;				// number of slots - 1
+	size_t slot_size;		// slot size, multiple of RING_ALIGN
+	size_t inline_size;		// maximum size of inline message
+	char *slots;			// RING_ALIGN aligned slots, follow the structure
+	volatile long refs;		// the queue and not freed inline messages
+	volatile long blocked;	// number of producers waiting for free slot
+	int forever;			// no limit is set, the producer waits without timeout
+	mutex_t mutex;			// guards the waiting for free slot
+	cond_t space;
+	char pad0[RING_ALIGN];
+	long head;				// producer: position of the next slot to fill
+	struct ring_slot *reserved;	// producer: slot of thread_queue_reserve_inline()
+	char pad1[RING_ALIGN];
+	long read;				// consumer: position of the next slot to take
+	char pad2[RING_ALIGN];
+};
+
+static struct ring_slot *ring_slot(struct threadqueue_ring *ring, long pos)
+{
+	return (struct ring_slot*)(ring->slots + (size_t)(pos & ring->mask) * ring->slot_size);
+}
+
+// check if 'count' slots from the producer position are free, 'seq' orders the check after
+// the blocked counter, see ring_free_slot()
+static int ring_fits(struct threadqueue_ring *ring, long count, int seq)
+{
+	long i;
+
+	if (count > ring->mask + 1)
+	{
+		return 0;
+	}
+	for (i = count - 1; i >= 0; i--)
+	{
+		struct ring_slot *slot = ring_slot(ring, ring->head + i);
+		long state = seq ? atomic_load_long(&slot->state) : atomic_load_acquire(&slot->state);
+
+		if (state != RING_FREE)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// return the slot to producer, wake it up if it waits for free slot
+static void ring_free_slot(struct threadqueue_ring *ring, struct ring_slot *slot)
+{
+	atomic_store_long(&slot->state, RING_FREE);
+	if (atomic_load_long(&ring->blocked))
+	{
+		mutex_lock(&ring->mutex);
+		cond_broadcast(&ring->space);
+		mutex_unlock(&ring->mutex);
+	}
+}
+
+// drop reference to ring, freed with the last one
+static void ring_release(struct threadqueue_ring *ring)
+{
+	if (atomic_dec(&ring->refs) == 0)
+	{
+		mutex_destroy(&ring->mutex);
+		cond_destroy(&ring->space);
+		free(ring);
+	}
+}
+
+// SPSC: wait for 'count' free slots while the policy is to wait, the ring is locked
+static int ring_wait_space(struct threadqueue *queue, struct threadqueue_ring *ring, long count)
 {
 	int ret = 0;
-	struct msglist *newmsg;
 
-	mutex_lock(&queue->mutex);
-	newmsg = get_msglist(queue);
-	if (newmsg == NULL)
+	atomic_inc(&ring->blocked);
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600
+	while (!ring_fits(ring, count, 1) && (ring->forever || queue->limit.policy == THREAD_QUEUE_BLOCK) &&
+		ret != ERROR_TIMEOUT)
+	{  //Need to loop to handle spurious wakeups
+		if (ring->forever)
+		{
+			cond_wait(&ring->space, &ring->mutex);
+		}
+		else if (!SleepConditionVariableSRW(&ring->space, &ring->mutex,
+			queue->limit.timeout.tv_sec*1000 + queue->limit.timeout.tv_nsec/1000000, 0))
+		{
+			ret = GetLastError();
+		}
+	}
+	if (ret == ERROR_TIMEOUT)
+	{
+		ret = ETIMEDOUT;
+	}
+#else
+	{
+		struct timespec abstimeout;
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		abstimeout.tv_sec = now.tv_sec + queue->limit.timeout.tv_sec;
+		abstimeout.tv_nsec = (now.tv_usec * 1000) + queue->limit.timeout.tv_nsec;
+		if (abstimeout.tv_nsec >= 1000000000)
+		{
+			abstimeout.tv_sec++;
+			abstimeout.tv_nsec -= 1000000000;
+		}
+
+		while (!ring_fits(ring, count, 1) && (ring->forever || queue->limit.policy == THREAD_QUEUE_BLOCK) &&
+			ret != ETIMEDOUT)
+		{  //Need to loop to handle spurious wakeups
+			if (ring->forever)
+			{
+				cond_wait(&ring->space, &ring->mutex);
+			}
+			else
+			{
+				ret = cond_timedwait(&ring->space, &ring->mutex, &abstimeout);
+			}
+		}
+	}
+#endif
+	atomic_dec(&ring->blocked);
+
+	// the slot might be freed at the moment of timeout
+	if (ring_fits(ring, count, 1))
+	{
+		return 0;
+	}
+	return (ret != 0) ? ret : ENOBUFS;
+}
+
+// SPSC: make the slots filled before 'head' visible and wake up the consumer
+static void spsc_publish(struct threadqueue *queue, long head)
+{
+	atomic_store_release(&queue->ring->head, head);
+
+	// the slot state is stored before, the sleeping consumer sees it, see thread_queue_wait()
+	if (atomic_load_long(&queue->waiting))
 	{
+		mutex_lock(&queue->mutex);
+		cond_signal(&queue->cond);
 		mutex_unlock(&queue->mutex);
-		return ENOMEM;
 	}
-	newmsg->msg.data = data;
-	newmsg->msg.msgtype = msgtype;
+	queue_notify(queue);
+}
+
+// SPSC: put messages to the ring, the full ring is handled by the policy of limit
+static int spsc_put(struct threadqueue *queue, void **data, int count, long msgtype, int wait)
+{
+	struct threadqueue_ring *ring = queue->ring;
+	struct ring_slot *slot;
+	long head = ring->head;
+	int drop = 0;
+	int ret = 0;
+	int i;
+
+	ring->reserved = NULL;
+
+	// all or nothing, unless the newest messages are dropped
+	if (!ring_fits(ring, count, 0))
+	{
+		mutex_lock(&ring->mutex);
+		if (!wait)
+		{
+			ret = EAGAIN;
+		}
+		else if (!ring->forever && queue->limit.policy == THREAD_QUEUE_DROP_NEWEST)
+		{
+			drop = 1;
+		}
+		else if ((count > ring->mask + 1) || (!ring->forever && queue->limit.policy != THREAD_QUEUE_BLOCK))
+		{
+			ret = ENOBUFS;
+		}
+		else
+		{
+			ret = ring_wait_space(queue, ring, count);
+		}
+		mutex_unlock(&ring->mutex);
+
+		if (ret != 0)
+		{
+			if (ret != EAGAIN)
+			{
+				atomic_add(&queue->rejected, count);
+			}
+			return ret;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		slot = ring_slot(ring, head);
+		if (drop && atomic_load_acquire(&slot->state) != RING_FREE)
+		{
+			queue_drop(queue, data[i]);
+			continue;
+		}
+		slot->msgtype = msgtype;
+		slot->data = data[i];
+		// sequentially consistent store: the consumer going to sleep sees it or is seen waiting
+		atomic_store_long(&slot->state, RING_FILLED);
+		head++;
+	}
+
+	if (head != ring->head)
+	{
+		spsc_publish(queue, head);
+	}
+
+	return 0;
+}
+
+// SPSC: take the message at the consumer position, returns 0 if there is nothing to take
+static int spsc_pop(struct threadqueue *queue, struct threadmsg *msg)
+{
+	struct threadqueue_ring *ring = queue->ring;
+	long read = ring->read;
+	struct ring_slot *slot = ring_slot(ring, read);
+	long length;
+
+	if (atomic_load_acquire(&slot->state) != RING_FILLED)
+	{
+		return 0;
+	}
+
+	msg->data = slot->data;
+	msg->msgtype = slot->msgtype;
+	atomic_store_release(&ring->read, read + 1);
+	// the producer moves its position after the slot is filled
+	length = atomic_load_acquire(&ring->head) - (read + 1);
+	msg->qlength = (length > 0) ? length : 0;
 
-	newmsg->next = NULL;
-	if (queue->last == NULL)
+	// inline message holds its slot till thread_queue_free_inline()
+	if (msg->data == RING_INLINE(slot))
 	{
-		queue->last = newmsg;
-		queue->first = newmsg;
+		atomic_store_release(&slot->state, RING_TAKEN);
 	}
 	else
 	{
-		queue->last->next = newmsg;
-		queue->last = newmsg;
+		ring_free_slot(ring, slot);
+	}
+
+	return 1;
+}
+
+// SPSC: free the queued messages and drop the queue reference to ring
+static void spsc_cleanup(struct threadqueue *queue, user_free_fn freedata)
+{
+	struct threadqueue_ring *ring = queue->ring;
+	struct ring_slot *slot;
+	long pos;
+
+	for (pos = ring->read; pos != ring->head; pos++)
+	{
+		slot = ring_slot(ring, pos);
+		if (freedata)
+		{
+			freedata(slot->data);
+		}
+		else if (slot->data == RING_INLINE(slot))
+		{
+			thread_queue_free_inline(slot->data);
+		}
+	}
+
+	ring_release(ring);
+	queue->ring = NULL;
+}
+
+// take the first message of lock-free queue, returns 0 if there is nothing to take
+static int nolock_pop(struct threadqueue *queue, struct threadmsg *msg)
+{
+	if (queue->type == THREAD_QUEUE_SPSC)
+	{
+		return spsc_pop(queue, msg);
+	}
+	return mpsc_pop(queue, msg);
+}
+
+static int queue_empty(struct threadqueue *queue)
+{
+	if (queue->type == THREAD_QUEUE_MPSC)
+	{
+		return atomic_load_ptr(&queue->tail->next) == NULL;
+	}
+	if (queue->type == THREAD_QUEUE_SPSC)
+	{
+		return atomic_load_long(&ring_slot(queue->ring, queue->ring->read)->state) != RING_FILLED;
+	}
+	return queue->first == NULL;
+}
+
+// Messages of locked queue are kept in single list ordered by priority, the messages of
+// each priority (lane) follow the messages of higher priorities.
+
+// the link to the first message of lane: next of the last message of higher lane or the queue head
+static struct msglist **lane_link(struct threadqueue *queue, int prio)
+{
+	int p;
+
+	for (p = prio + 1; p < THREAD_QUEUE_PRIOS; p++)
+	{
+		if (queue->lane_last[p] != NULL)
+		{
+			return &queue->lane_last[p]->next;
+		}
+	}
+	return &queue->first;
+}
+
+// append the chain first..last to the lane of locked queue
+static void lane_append(struct threadqueue *queue, int prio, struct msglist *first, struct msglist *last)
+{
+	struct msglist **link;
+
+	link = (queue->lane_last[prio] != NULL) ? &queue->lane_last[prio]->next : lane_link(queue, prio);
+	last->next = *link;
+	*link = first;
+	queue->lane_last[prio] = last;
+}
+
+// remove the first message of the lane of locked queue, the lane must not be empty
+static struct msglist *lane_pop(struct threadqueue *queue, int prio)
+{
+	struct msglist **link = lane_link(queue, prio);
+	struct msglist *rec = *link;
+
+	*link = rec->next;
+	if (queue->lane_last[prio] == rec)
+	{
+		queue->lane_last[prio] = NULL;
+	}
+	queue->bytes -= queue_size(queue, rec->msg.data);
+
+	// the length is written atomically, consumers poll it without the lock (see queue_spin())
+	if (queue->first == NULL)
+	{
+		atomic_store_long(&queue->length, 0);
+		queue->bytes = 0;
+	}
+	else
+	{
+		atomic_dec(&queue->length);
+	}
+
+	return rec;
+}
+
+// remove the first message of locked queue, the queue must not be empty
+static struct msglist *queue_pop(struct threadqueue *queue)
+{
+	int prio = THREAD_QUEUE_PRIOS - 1;
+
+	// the first message is of the highest not empty lane
+	while (queue->lane_last[prio] == NULL)
+	{
+		prio--;
+	}
+	return lane_pop(queue, prio);
+}
+
+// wait for free space for 'count' messages of 'size' bytes, the queue is locked
+static int queue_wait_space(struct threadqueue *queue, long count, long size)
+{
+	int ret = 0;
+
+	queue->blocked++;
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600
+	while (!queue_fits(queue, queue->length, queue->bytes, count, size) && ret != ERROR_TIMEOUT)
+	{  //Need to loop to handle spurious wakeups
+		if(!SleepConditionVariableSRW(&queue->space, &queue->mutex,
+			queue->limit.timeout.tv_sec*1000 + queue->limit.timeout.tv_nsec/1000000, 0))
+		{
+			ret = GetLastError();
+		}
+	}
+	if (ret == ERROR_TIMEOUT)
+	{
+		ret = ETIMEDOUT;
+	}
+#else
+	{
+		struct timespec abstimeout;
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		abstimeout.tv_sec = now.tv_sec + queue->limit.timeout.tv_sec;
+		abstimeout.tv_nsec = (now.tv_usec * 1000) + queue->limit.timeout.tv_nsec;
+		if (abstimeout.tv_nsec >= 1000000000)
+		{
+			abstimeout.tv_sec++;
+			abstimeout.tv_nsec -= 1000000000;
+		}
+
+		while (!queue_fits(queue, queue->length, queue->bytes, count, size) && ret != ETIMEDOUT)
+		{  //Need to loop to handle spurious wakeups
+			ret = cond_timedwait(&queue->space, &queue->mutex, &abstimeout);
+		}
+	}
+#endif
+	queue->blocked--;
+
+	// the space might be freed at the moment of timeout
+	if (queue_fits(queue, queue->length, queue->bytes, count, size))
+	{
+		ret = 0;
+	}
+
+	return ret;
+}
+
+// THREAD_QUEUE_BLOCK and THREAD_QUEUE_FAIL policies: check (or wait for) space for all messages,
+// the put without waiting neither drops the messages under THREAD_QUEUE_DROP_* policies
+static int queue_reserve(struct threadqueue *queue, void **data, int count, int wait)
+{
+	long size = 0;
+	int ret;
+	int i;
+
+	if (!queue_limited(queue) ||
+		(wait && queue->limit.policy != THREAD_QUEUE_BLOCK && queue->limit.policy != THREAD_QUEUE_FAIL))
+	{
+		return 0;
+	}
+
+	for (i = 0; (queue->limit.size != NULL) && (i < count); i++)
+	{
+		size += queue_size(queue, data[i]);
+	}
+	if (queue_fits(queue, queue->length, queue->bytes, count, size))
+	{
+		return 0;
+	}
+	if (!wait)
+	{
+		return EAGAIN;
+	}
+
+	// the messages can't fit even empty queue, waiting is pointless
+	if (queue->limit.policy == THREAD_QUEUE_BLOCK && queue_fits(queue, 0, 0, count, size))
+	{
+		ret = queue_wait_space(queue, count, size);
+	}
+	else
+	{
+		ret = ENOBUFS;
+	}
+
+	if (ret != 0)
+	{
+		atomic_add(&queue->rejected, count);
+	}
+	return ret;
+}
+
+// THREAD_QUEUE_DROP_* policies: make space for the message of priority 'prio', the dropped
+// messages are added to 'dropped'. Returns 0 if there is no space and the message itself is to be dropped
+static int queue_make_space(struct threadqueue *queue, long size, int prio, struct msglist **dropped)
+{
+	int lane;
+
+	if (!queue_limited(queue) ||
+		(queue->limit.policy != THREAD_QUEUE_DROP_NEWEST && queue->limit.policy != THREAD_QUEUE_DROP_OLDEST))
+	{
+		return 1;
+	}
+
+	if (queue->limit.policy == THREAD_QUEUE_DROP_OLDEST)
+	{
+		// the oldest messages of the lowest priority, but not higher than the message's one
+		for (lane = 0; (lane <= prio) && !queue_fits(queue, queue->length, queue->bytes, 1, size); )
+		{
+			struct msglist *rec;
+
+			if (queue->lane_last[lane] == NULL)
+			{
+				lane++;
+				continue;
+			}
+			rec = lane_pop(queue, lane);
+			rec->next = *dropped;
+			*dropped = rec;
+		}
+	}
+
+	return queue_fits(queue, queue->length, queue->bytes, 1, size);
+}
+
+// put 'count' messages of priority 'prio', waits for free space if 'wait' is nonzero
+static int queue_put(struct threadqueue *queue, void **data, int count, long msgtype, int prio, int wait)
+{
+	struct msglist *nodes;
+	struct msglist *newmsg;
+	struct msglist *last = NULL;
+	struct msglist *dropped = NULL;
+	long size;
+	int ret;
+	int i;
+
+	if (queue == NULL || data == NULL || prio < 0 || prio >= THREAD_QUEUE_PRIOS)
+	{
+		return EINVAL;
+	}
+	if (count <= 0)
+	{
+		return 0;
+	}
+
+	if (queue->type == THREAD_QUEUE_MPSC)
+	{
+		return mpsc_put(queue, data, count, msgtype, wait);
+	}
+	if (queue->type == THREAD_QUEUE_SPSC)
+	{
+		return spsc_put(queue, data, count, msgtype, wait);
+	}
+
+	mutex_lock(&queue->mutex);
+
+	// take all nodes first, so nothing is changed if out of memory
+	nodes = get_msglists(queue, count);
+	if (nodes == NULL)
+	{
+		mutex_unlock(&queue->mutex);
+		return ENOMEM;
+	}
+
+	// unbounded queue: fill the nodes and splice the chain to the end of lane
+	if (!queue_limited(queue) && (queue->limit.size == NULL))
+	{
+		for (newmsg = nodes, i = 0; i < count; newmsg = newmsg->next, i++)
+		{
+			newmsg->msg.data = data[i];
+			newmsg->msg.msgtype = msgtype;
+			last = newmsg;
+		}
+
+		lane_append(queue, prio, nodes, last);
+
+		atomic_add(&queue->length, count);
+		if (queue->waiting)
+			cond_broadcast(&queue->cond);
+		mutex_unlock(&queue->mutex);
+		queue_notify(queue);
+
+		return 0;
+	}
+
+	ret = queue_reserve(queue, data, count, wait);
+	if (ret != 0)
+	{
+		release_msglists(queue, nodes);
+		mutex_unlock(&queue->mutex);
+		return ret;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		size = queue_size(queue, data[i]);
+		newmsg = nodes;
+		nodes = nodes->next;
+		newmsg->msg.data = data[i];
+		newmsg->msg.msgtype = msgtype;
+		if (!queue_make_space(queue, size, prio, &dropped))
+		{
+			newmsg->next = dropped;
+			dropped = newmsg;
+			continue;
+		}
+
+		lane_append(queue, prio, newmsg, newmsg);
+
+		atomic_inc(&queue->length);
+		queue->bytes += size;
+	}
+
+	if (queue->waiting)
+		cond_broadcast(&queue->cond);
+	release_msglists(queue, nodes);
+	mutex_unlock(&queue->mutex);
+	queue_notify(queue);
+
+	// the free function of limit is not called under the lock
+	queue_drop_list(queue, dropped);
+
+	return 0;
+}
+
+int thread_queue_init(struct threadqueue *queue)
+{
+	return thread_queue_init_ex(queue, THREAD_QUEUE_LOCKED);
+}
+
+int thread_queue_init_ex(struct threadqueue *queue, int type)
+{
+	struct msglist *stub;
+
+	if (queue == NULL || (type != THREAD_QUEUE_LOCKED && type != THREAD_QUEUE_MPSC))
+	{
+		return EINVAL;
+	}
+	memset(queue, 0, sizeof(struct threadqueue));
+	queue->type = type;
+	queue->notify_fd = -1;
+
+	if (type == THREAD_QUEUE_MPSC)
+	{
+		stub = (struct msglist*) slab_alloc(sizeof *stub);
+		if (stub == NULL)
+		{
+			return ENOMEM;
+		}
+		stub->msg.data = NULL;
+		stub->msg.msgtype = 0;
+		stub->next = NULL;
+		queue->head = stub;
+		queue->tail = stub;
+	}
+
+	cond_init(&queue->cond);
+	cond_init(&queue->space);
+
+	mutex_init(&queue->mutex);
+
+	return 0;
+
+}
+
+int thread_queue_init_spsc(struct threadqueue *queue, long slots, size_t inline_size)
+{
+	struct threadqueue_ring *ring;
+	struct ring_slot *slot;
+	size_t slot_size;
+	long size = 1;
+	long i;
+
+	if (queue == NULL || slots <= 0 || slots > (1L << 24) || inline_size > (1 << 24))
+	{
+		return EINVAL;
+	}
+	while (size < slots)
+	{
+		size <<= 1;
+	}
+	slot_size = (RING_SLOT_HEADER + inline_size + RING_ALIGN - 1) & ~(size_t)(RING_ALIGN - 1);
+
+	// single allocation: the ring and its aligned slots
+	ring = (struct threadqueue_ring*) malloc(sizeof(struct threadqueue_ring) + RING_ALIGN - 1 + size * slot_size);
+	if (ring == NULL)
+	{
+		return ENOMEM;
+	}
+	memset(ring, 0, sizeof(struct threadqueue_ring));
+	ring->mask = size - 1;
+	ring->slot_size = slot_size;
+	ring->inline_size = slot_size - RING_SLOT_HEADER;
+	ring->slots = (char*)(((uintptr_t)(ring + 1) + RING_ALIGN - 1) & ~(uintptr_t)(RING_ALIGN - 1));
+	ring->refs = 1;
+	ring->forever = 1;
+	for (i = 0; i < size; i++)
+	{
+		slot = ring_slot(ring, i);
+		slot->state = RING_FREE;
+		slot->msgtype = 0;
+		slot->data = NULL;
+		slot->ring = ring;
+	}
+	mutex_init(&ring->mutex);
+	cond_init(&ring->space);
+
+	memset(queue, 0, sizeof(struct threadqueue));
+	queue->type = THREAD_QUEUE_SPSC;
+	queue->notify_fd = -1;
+	queue->ring = ring;
+
+	cond_init(&queue->cond);
+	cond_init(&queue->space);
+
+	mutex_init(&queue->mutex);
+
+	return 0;
+}
+
+void *thread_queue_reserve_inline(struct threadqueue *queue, size_t size)
+{
+	struct threadqueue_ring *ring;
+	struct ring_slot *slot;
+
+	if (queue == NULL || queue->type != THREAD_QUEUE_SPSC || size > queue->ring->inline_size)
+	{
+		return NULL;
+	}
+
+	ring = queue->ring;
+	slot = ring_slot(ring, ring->head);
+	if (atomic_load_acquire(&slot->state) != RING_FREE)
+	{
+		return NULL;
+	}
+	ring->reserved = slot;
+
+	return RING_INLINE(slot);
+}
+
+int thread_queue_commit_inline(struct threadqueue *queue, long msgtype)
+{
+	struct threadqueue_ring *ring;
+	struct ring_slot *slot;
+
+	if (queue == NULL || queue->type != THREAD_QUEUE_SPSC || queue->ring->reserved == NULL)
+	{
+		return EINVAL;
+	}
+
+	ring = queue->ring;
+	slot = ring->reserved;
+	ring->reserved = NULL;
+
+	slot->msgtype = msgtype;
+	slot->data = RING_INLINE(slot);
+	// the message keeps the ring until it is freed
+	atomic_inc(&ring->refs);
+	atomic_store_long(&slot->state, RING_FILLED);
+	spsc_publish(queue, ring->head + 1);
+
+	return 0;
+}
+
+void thread_queue_free_inline(void *data)
+{
+	struct ring_slot *slot;
+	struct threadqueue_ring *ring;
+
+	if (data == NULL)
+	{
+		return;
+	}
+
+	slot = (struct ring_slot*)((char*)data - RING_SLOT_HEADER);
+	ring = slot->ring;
+	ring_free_slot(ring, slot);
+	ring_release(ring);
+}
+
+int thread_queue_set_limit(struct threadqueue *queue, const struct threadqueue_limit *limit)
+{
+	struct msglist *rec;
+
+	if (queue == NULL)
+	{
+		return EINVAL;
+	}
+	if (limit != NULL)
+	{
+		if (limit->max_msgs < 0 || limit->max_bytes < 0 || (limit->max_bytes > 0 && limit->size == NULL) ||
+			limit->policy < THREAD_QUEUE_BLOCK || limit->policy > THREAD_QUEUE_FAIL)
+		{
+			return EINVAL;
+		}
+		// MPSC producers can't take the oldest message, nor wait for the consumer
+		if (queue->type == THREAD_QUEUE_MPSC &&
+			(limit->policy == THREAD_QUEUE_BLOCK || limit->policy == THREAD_QUEUE_DROP_OLDEST) &&
+			(limit->max_msgs != 0 || limit->max_bytes != 0))
+		{
+			return EINVAL;
+		}
+		// SPSC queue is bounded by its ring
+		if (queue->type == THREAD_QUEUE_SPSC &&
+			(limit->policy == THREAD_QUEUE_DROP_OLDEST || limit->max_msgs != 0 || limit->max_bytes != 0))
+		{
+			return EINVAL;
+		}
+	}
+
+	// the waiting producer reads the policy under the ring's lock, see ring_wait_space()
+	if (queue->type == THREAD_QUEUE_SPSC)
+	{
+		mutex_lock(&queue->ring->mutex);
+		if (limit != NULL)
+		{
+			queue->limit = *limit;
+		}
+		else
+		{
+			memset(&queue->limit, 0, sizeof(queue->limit));
+		}
+		queue->ring->forever = (limit == NULL);
+		cond_broadcast(&queue->ring->space);
+		mutex_unlock(&queue->ring->mutex);
+
+		return 0;
+	}
+
+	mutex_lock(&queue->mutex);
+	if (limit != NULL)
+	{
+		// count the size of queued messages by the new function
+		if (queue->type != THREAD_QUEUE_MPSC && limit->size != queue->limit.size)
+		{
+			queue->bytes = 0;
+			for (rec = queue->first; (rec != NULL) && (limit->size != NULL); rec = rec->next)
+			{
+				queue->bytes += limit->size(rec->msg.data);
+			}
+		}
+		queue->limit = *limit;
+	}
+	else
+	{
+		memset(&queue->limit, 0, sizeof(queue->limit));
+		queue->bytes = 0;
+	}
+
+	// the blocked producers recheck the space
+	cond_broadcast(&queue->space);
+	mutex_unlock(&queue->mutex);
+
+	return 0;
+}
+
+int thread_queue_set_wait(struct threadqueue *queue, const struct threadqueue_wait *wait)
+{
+	if (queue == NULL || (wait != NULL && (wait->spin < 0 || wait->yield < 0)))
+	{
+		return EINVAL;
+	}
+
+	atomic_store_long(&queue->wait.spin, (wait != NULL) ? wait->spin : 0);
+	atomic_store_long(&queue->wait.yield, (wait != NULL) ? wait->yield : 0);
+
+	return 0;
+}
+
+int thread_queue_put_msg(struct threadqueue *queue, void *data, long msgtype)
+{
+	return queue_put(queue, &data, 1, msgtype, 0, 1);
+}
+
+int thread_queue_try_put_msg(struct threadqueue *queue, void *data, long msgtype)
+{
+	return queue_put(queue, &data, 1, msgtype, 0, 0);
+}
+
+int thread_queue_put_msg_prio(struct threadqueue *queue, void *data, long msgtype, int prio)
+{
+	return queue_put(queue, &data, 1, msgtype, prio, 1);
+}
+
+int thread_queue_try_put_msg_prio(struct threadqueue *queue, void *data, long msgtype, int prio)
+{
+	return queue_put(queue, &data, 1, msgtype, prio, 0);
+}
+
+int thread_queue_put_msgs(struct threadqueue *queue, void **data, int count, long msgtype)
+{
+	return queue_put(queue, data, count, msgtype, 0, 1);
+}
+
+int thread_queue_try_put_msgs(struct threadqueue *queue, void **data, int count, long msgtype)
+{
+	return queue_put(queue, data, count, msgtype, 0, 0);
+}
+
+// the queue has a message for the consumer, read without the lock
+static int queue_ready(struct threadqueue *queue)
+{
+	if (queue->type == THREAD_QUEUE_MPSC)
+	{
+		return atomic_load_ptr(&queue->tail->next) != NULL;
+	}
+	if (queue->type == THREAD_QUEUE_SPSC)
+	{
+		return !queue_empty(queue);
+	}
+	return atomic_load_long(&queue->length) != 0;
+}
+
+// poll the empty queue before sleeping (see thread_queue_set_wait()),
+// returns nonzero if a message has arrived
+static int queue_spin(struct threadqueue *queue)
+{
+	long spin = atomic_load_long(&queue->wait.spin);
+	long yield = atomic_load_long(&queue->wait.yield);
+	long i;
+
+	for (i = 0; i < spin + yield; i++)
+	{
+		if (queue_ready(queue))
+		{
+			return 1;
+		}
+
+		if (i < spin)
+		{
+			cpu_relax();
+		}
+		else
+		{
+			thread_yield();
+		}
 	}
 
-	if (queue->length == 0)
-		cond_broadcast(&queue->cond);
-	queue->length++;
-	mutex_unlock(&queue->mutex);
-
 	return 0;
-
 }
 
-int thread_queue_get_msg(struct threadqueue *queue, const struct timespec *timeout, struct threadmsg *msg)
+// wait for a message in queue, on success returns 0 with the queue locked
+static int thread_queue_wait(struct threadqueue *queue, const struct timespec *timeout)
 {
-	struct msglist *firstrec;
 	int ret = 0;
 
-	if (queue == NULL || msg == NULL)
-	{
-		return EINVAL;
-	}
-
 #if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600
 	mutex_lock(&queue->mutex);
+	// producers wake up sleeping consumers only, see mpsc_push() and queue_put()
+	atomic_inc(&queue->waiting);
 
 	// Will wait until awakened by a signal or broadcast
-	while (queue->first == NULL && ret != ERROR_TIMEOUT)
+	while (queue_empty(queue) && ret != ERROR_TIMEOUT)
 	{  //Need to loop to handle spurious wakeups
 		if (timeout)
 		{
@@ -134,10 +1274,11 @@ int thread_queue_get_msg(struct threadqueue *queue, const struct timespec *timeo
 
 		}
 	}
+	atomic_dec(&queue->waiting);
 	if (ret == ERROR_TIMEOUT)
 	{
 		mutex_unlock(&queue->mutex);
-		return -ERROR_TIMEOUT;
+		return ERROR_TIMEOUT;
 	}
 
 #else
@@ -157,9 +1298,11 @@ int thread_queue_get_msg(struct threadqueue *queue, const struct timespec *timeo
 			}
 		}
 		mutex_lock(&queue->mutex);
+		// producers wake up sleeping consumers only, see mpsc_push() and queue_put()
+		atomic_inc(&queue->waiting);
 
 		// Will wait until awakened by a signal or broadcast
-		while (queue->first == NULL && ret != ETIMEDOUT)
+		while (queue_empty(queue) && ret != ETIMEDOUT)
 		{  //Need to loop to handle spurious wakeups
 			if (timeout)
 			{
@@ -171,34 +1314,399 @@ int thread_queue_get_msg(struct threadqueue *queue, const struct timespec *timeo
 
 			}
 		}
+		atomic_dec(&queue->waiting);
 		if (ret == ETIMEDOUT)
 		{
 			mutex_unlock(&queue->mutex);
-			return -ETIMEDOUT;
+			return ETIMEDOUT;
 		}
 	}
 #endif
 
-	firstrec = queue->first;
-	queue->first = queue->first->next;
-	queue->length--;
+	return 0;
+}
+
+int thread_queue_get_msg(struct threadqueue *queue, const struct timespec *timeout, struct threadmsg *msg)
+{
+	struct msglist *firstrec;
+	int ret;
+
+	if (queue == NULL || msg == NULL)
+	{
+		return EINVAL;
+	}
+
+	if (queue->type != THREAD_QUEUE_LOCKED)
+	{
+		// lock is taken only to sleep on empty queue
+		while (!nolock_pop(queue, msg))
+		{
+			if (queue_spin(queue))
+			{
+				continue;
+			}
+			ret = thread_queue_wait(queue, timeout);
+			if (ret != 0)
+			{
+				return ret;
+			}
+			mutex_unlock(&queue->mutex);
+		}
+		return 0;
+	}
+
+	queue_spin(queue);
+	ret = thread_queue_wait(queue, timeout);
+	if (ret != 0)
+	{
+		return ret;
+	}
+
+	firstrec = queue_pop(queue);
+
+	msg->data = firstrec->msg.data;
+	msg->msgtype = firstrec->msg.msgtype;
+	msg->qlength = queue->length;
+
+	release_msglist(queue, firstrec);
+	if (queue->blocked)
+		cond_broadcast(&queue->space);
+	mutex_unlock(&queue->mutex);
+
+	return 0;
+}
+
+// take up to 'max' messages from the head of the locked queue and unlock it
+static int queue_take(struct threadqueue *queue, struct threadmsg *msgs, int max)
+{
+	struct msglist *rec;
+	int i;
+
+	for (i = 0; (i < max) && (queue->first != NULL); i++)
+	{
+		rec = queue_pop(queue);
+
+		msgs[i].data = rec->msg.data;
+		msgs[i].msgtype = rec->msg.msgtype;
+		msgs[i].qlength = queue->length;
+
+		release_msglist(queue, rec);
+	}
+
+	if (queue->blocked)
+		cond_broadcast(&queue->space);
+	mutex_unlock(&queue->mutex);
+
+	return i;
+}
+
+int thread_queue_get_msgs(struct threadqueue *queue, const struct timespec *timeout, struct threadmsg *msgs, int max)
+{
+	int ret;
+	int i;
+
+	if (queue == NULL || msgs == NULL || max <= 0)
+	{
+		return -EINVAL;
+	}
+
+	if (queue->type != THREAD_QUEUE_LOCKED)
+	{
+		while (!nolock_pop(queue, &msgs[0]))
+		{
+			if (queue_spin(queue))
+			{
+				continue;
+			}
+			ret = thread_queue_wait(queue, timeout);
+			if (ret != 0)
+			{
+				return -ret;
+			}
+			mutex_unlock(&queue->mutex);
+		}
+		for (i = 1; (i < max) && nolock_pop(queue, &msgs[i]); i++)
+			;
+		return i;
+	}
+
+	queue_spin(queue);
+	ret = thread_queue_wait(queue, timeout);
+	if (ret != 0)
+	{
+		return -ret;
+	}
+
+	return queue_take(queue, msgs, max);
+}
+
+int thread_queue_try_get_msgs(struct threadqueue *queue, struct threadmsg *msgs, int max)
+{
+	int i;
+
+	if (queue == NULL || msgs == NULL || max <= 0)
+	{
+		return -EINVAL;
+	}
+
+	if (queue->type != THREAD_QUEUE_LOCKED)
+	{
+		for (i = 0; (i < max) && nolock_pop(queue, &msgs[i]); i++)
+			;
+		return i;
+	}
+
+	mutex_lock(&queue->mutex);
+	return queue_take(queue, msgs, max);
+}
+
+// take the first message if the queue is not empty, returns 0 if there is nothing to take
+static int queue_try_pop(struct threadqueue *queue, struct threadmsg *msg)
+{
+	struct msglist *firstrec;
 
+	if (queue->type != THREAD_QUEUE_LOCKED)
+	{
+		return nolock_pop(queue, msg);
+	}
+
+	mutex_lock(&queue->mutex);
 	if (queue->first == NULL)
 	{
-		queue->last = NULL;     // we know this since we hold the lock
-		queue->length = 0;
+		mutex_unlock(&queue->mutex);
+		return 0;
 	}
 
+	firstrec = queue_pop(queue);
+
 	msg->data = firstrec->msg.data;
 	msg->msgtype = firstrec->msg.msgtype;
 	msg->qlength = queue->length;
 
 	release_msglist(queue, firstrec);
+	if (queue->blocked)
+		cond_broadcast(&queue->space);
+	mutex_unlock(&queue->mutex);
+
+	return 1;
+}
+
+int thread_queue_try_get_msg(struct threadqueue *queue, struct threadmsg *msg)
+{
+	if (queue == NULL || msg == NULL)
+	{
+		return EINVAL;
+	}
+
+	if (queue_try_pop(queue, msg))
+	{
+		return 0;
+	}
+
+	// reset the descriptor and ask producers to set it, then recheck the queue:
+	// a message pushed after the check finds the flag set (see queue_notify())
+	if (queue->notify_fd >= 0)
+	{
+#ifdef THREAD_QUEUE_EVENTFD
+		eventfd_t value;
+		eventfd_read(queue->notify_fd, &value);
+#endif
+		atomic_store_long(&queue->armed, 1);
+		if (queue_try_pop(queue, msg))
+		{
+			return 0;
+		}
+	}
+
+	return EAGAIN;
+}
+
+int thread_queue_get_fd(struct threadqueue *queue)
+{
+	if (queue == NULL)
+	{
+		return -EINVAL;
+	}
+
+#ifdef THREAD_QUEUE_EVENTFD
+	mutex_lock(&queue->mutex);
+	if (queue->notify_fd < 0)
+	{
+		queue->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (queue->notify_fd < 0)
+		{
+			int ret = -errno;
+			mutex_unlock(&queue->mutex);
+			return ret;
+		}
+
+		// readable at once if there are messages already
+		atomic_store_long(&queue->armed, 1);
+		if (!queue_empty(queue))
+		{
+			eventfd_write(queue->notify_fd, 1);
+		}
+	}
+	mutex_unlock(&queue->mutex);
+
+	return queue->notify_fd;
+#else
+	return -ENOSYS;
+#endif
+}
+
+// attach poller to queue, returns EBUSY if other poller is attached
+static int queue_poll_attach(struct threadqueue *queue, struct threadqueue_poller *poller)
+{
+	mutex_lock(&queue->mutex);
+	if (queue->poller != NULL)
+	{
+		mutex_unlock(&queue->mutex);
+		return EBUSY;
+	}
+	queue->poller = poller;
+	// producers look at the flag after put, see queue_notify()
+	atomic_store_long(&queue->armed, 1);
 	mutex_unlock(&queue->mutex);
 
 	return 0;
 }
 
+static void queue_poll_detach(struct threadqueue *queue)
+{
+	mutex_lock(&queue->mutex);
+	queue->poller = NULL;
+	mutex_unlock(&queue->mutex);
+}
+
+// wait for the poller signal, returns nonzero if timeout occurs
+static int queue_poll_wait(struct threadqueue_poller *poller, const struct timespec *timeout)
+{
+	int ret = 0;
+
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600
+	mutex_lock(&poller->mutex);
+	while (!poller->signaled && ret != ERROR_TIMEOUT)
+	{
+		if (timeout)
+		{
+			if (!SleepConditionVariableSRW(&poller->cond, &poller->mutex, timeout->tv_sec*1000 + timeout->tv_nsec/1000000, 0))
+			{
+				ret = GetLastError();
+			}
+		}
+		else
+		{
+			cond_wait(&poller->cond, &poller->mutex);
+		}
+	}
+	poller->signaled = 0;
+	mutex_unlock(&poller->mutex);
+
+	return ret == ERROR_TIMEOUT;
+#else
+	mutex_lock(&poller->mutex);
+	while (!poller->signaled && ret != ETIMEDOUT)
+	{
+		if (timeout)
+		{
+			ret = cond_timedwait(&poller->cond, &poller->mutex, timeout);
+		}
+		else
+		{
+			cond_wait(&poller->cond, &poller->mutex);
+		}
+	}
+	poller->signaled = 0;
+	mutex_unlock(&poller->mutex);
+
+	return ret == ETIMEDOUT;
+#endif
+}
+
+int thread_queue_poll(struct threadqueue **queues, int count, const struct timespec *timeout, int *ready)
+{
+	struct threadqueue_poller poller;
+	int attached;
+	int nready = 0;
+	int timedout = 0;
+	int i;
+#if !(defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600)
+	struct timespec abstimeout;
+
+	if (timeout)
+	{
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		abstimeout.tv_sec = now.tv_sec + timeout->tv_sec;
+		abstimeout.tv_nsec = (now.tv_usec * 1000) + timeout->tv_nsec;
+		if (abstimeout.tv_nsec >= 1000000000)
+		{
+			abstimeout.tv_sec++;
+			abstimeout.tv_nsec -= 1000000000;
+		}
+		timeout = &abstimeout;
+	}
+#endif
+
+	if (queues == NULL || ready == NULL || count <= 0)
+	{
+		return -EINVAL;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (queues[i] == NULL)
+		{
+			return -EINVAL;
+		}
+	}
+
+	mutex_init(&poller.mutex);
+	cond_init(&poller.cond);
+	poller.signaled = 0;
+
+	for (attached = 0; attached < count; attached++)
+	{
+		if (queue_poll_attach(queues[attached], &poller) != 0)
+		{
+			nready = -EBUSY;
+			break;
+		}
+	}
+
+	// a message put after the check signals the poller
+	while (nready == 0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			ready[i] = queue_ready(queues[i]);
+			nready += ready[i];
+		}
+		if (nready != 0 || timedout)
+		{
+			break;
+		}
+
+		timedout = queue_poll_wait(&poller, timeout);
+
+		// rearm the queues for the next wait (other consumer may take the message meanwhile)
+		for (i = 0; i < count; i++)
+		{
+			atomic_store_long(&queues[i]->armed, 1);
+		}
+	}
+
+	for (i = 0; i < attached; i++)
+	{
+		queue_poll_detach(queues[i]);
+	}
+	mutex_destroy(&poller.mutex);
+	cond_destroy(&poller.cond);
+
+	return nready;
+}
+
 //maybe caller should supply a callback for cleaning the elements ?
 int thread_queue_cleanup(struct threadqueue *queue, user_free_fn freedata)
 {
@@ -212,7 +1720,20 @@ int thread_queue_cleanup(struct threadqueue *queue, user_free_fn freedata)
 	}
 
 	mutex_lock(&queue->mutex);
-	recs[0] = queue->first;
+	if (queue->type == THREAD_QUEUE_MPSC)
+	{
+		recs[0] = queue->tail->next;
+		slab_free(queue->tail);
+	}
+	else if (queue->type == THREAD_QUEUE_SPSC)
+	{
+		spsc_cleanup(queue, freedata);
+		recs[0] = NULL;
+	}
+	else
+	{
+		recs[0] = queue->first;
+	}
 	recs[1] = queue->msgpool;
 	for (i = 0; i < 2; i++)
 	{
@@ -225,7 +1746,7 @@ int thread_queue_cleanup(struct threadqueue *queue, user_free_fn freedata)
 				freedata(rec->msg.data);
 			}
 
-			free(rec);
+			slab_free(rec);
 			rec = next;
 		}
 	}
@@ -233,6 +1754,13 @@ int thread_queue_cleanup(struct threadqueue *queue, user_free_fn freedata)
 	mutex_unlock(&queue->mutex);
 	mutex_destroy(&queue->mutex);
 	cond_destroy(&queue->cond);
+	cond_destroy(&queue->space);
+#ifdef THREAD_QUEUE_EVENTFD
+	if (queue->notify_fd >= 0)
+	{
+		close(queue->notify_fd);
+	}
+#endif
 
 	return 0;
 }
@@ -240,6 +1768,14 @@ int thread_queue_cleanup(struct threadqueue *queue, user_free_fn freedata)
 long thread_queue_length(struct threadqueue *queue)
 {
 	long counter;
+	if (queue->type == THREAD_QUEUE_MPSC)
+	{
+		return atomic_load_long(&queue->length);
+	}
+	if (queue->type == THREAD_QUEUE_SPSC)
+	{
+		return atomic_load_acquire(&queue->ring->head) - atomic_load_acquire(&queue->ring->read);
+	}
 	// get the length properly
 	mutex_lock(&queue->mutex);
 	counter = queue->length;
@@ -248,11 +1784,46 @@ long thread_queue_length(struct threadqueue *queue)
 
 }
 
+int thread_queue_stats(struct threadqueue *queue, struct threadqueue_stats *stats)
+{
+	if (queue == NULL || stats == NULL)
+	{
+		return EINVAL;
+	}
+
+	if (queue->type == THREAD_QUEUE_MPSC)
+	{
+		stats->length = atomic_load_long(&queue->length);
+		stats->bytes = atomic_load_long(&queue->bytes);
+	}
+	else if (queue->type == THREAD_QUEUE_SPSC)
+	{
+		stats->length = thread_queue_length(queue);
+		stats->bytes = 0;
+	}
+	else
+	{
+		mutex_lock(&queue->mutex);
+		stats->length = queue->length;
+		stats->bytes = queue->bytes;
+		mutex_unlock(&queue->mutex);
+	}
+	stats->dropped = atomic_load_long(&queue->dropped);
+	stats->rejected = atomic_load_long(&queue->rejected);
+
+	return 0;
+}
+
 struct threadqueue* thread_queue_alloc()
+{
+	return thread_queue_alloc_ex(THREAD_QUEUE_LOCKED);
+}
+
+struct threadqueue* thread_queue_alloc_ex(int type)
 {
 	struct threadqueue* queue;
 	queue = (struct threadqueue*) malloc(sizeof(struct threadqueue));
-	if (thread_queue_init(queue) != 0)
+	if (thread_queue_init_ex(queue, type) != 0)
 	{
 		free(queue);
 		return NULL;
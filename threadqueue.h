@@ -53,6 +53,119 @@ struct threadmsg
 	long qlength;			// Holds the current queue lenght. Might not be meaningful if there's several readers
 };
 
+/**
+ * Queue types
+ *
+ * @ingroup ThreadQueue
+ *
+ * THREAD_QUEUE_LOCKED is the classic queue guarded by mutex, any number of
+ * threads can put and get messages.
+ * THREAD_QUEUE_MPSC is a lock-free queue for many producers and single consumer:
+ * producers never take a lock, the consumer takes the lock only for sleep when
+ * the queue is empty. Only one thread at a time may get messages from such queue.
+ * THREAD_QUEUE_SPSC is a ring of fixed slots for single producer and single consumer,
+ * see thread_queue_init_spsc().
+ */
+#define THREAD_QUEUE_LOCKED	0
+#define THREAD_QUEUE_MPSC	1
+#define THREAD_QUEUE_SPSC	2
+
+/**
+ * Overflow policies of bounded queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * THREAD_QUEUE_BLOCK - put waits for free space up to the limit's timeout, then fails with ETIMEDOUT.
+ * THREAD_QUEUE_DROP_NEWEST - the new message is dropped.
+ * THREAD_QUEUE_DROP_OLDEST - the oldest queued messages are dropped to make space for the new one.
+ * THREAD_QUEUE_FAIL - put fails with ENOBUFS.
+ * Dropped messages are passed to the limit's free function.
+ */
+#define THREAD_QUEUE_BLOCK			0
+#define THREAD_QUEUE_DROP_NEWEST	1
+#define THREAD_QUEUE_DROP_OLDEST	2
+#define THREAD_QUEUE_FAIL			3
+
+/**
+ * Number of message priorities
+ *
+ * @ingroup ThreadQueue
+ *
+ * Messages of locked queue are taken by priority, the higher first, and in the order
+ * of put within the same priority. Priority 0 is the lowest one, used by the put functions without priority.
+ * MPSC queue ignores priorities.
+ */
+#define THREAD_QUEUE_PRIOS			4
+
+/**
+ * A TthreadQueue
+ *
+ * @ingroup ThreadQueue
+ *
+ * User provided callback function used in thread_queue_free() for freeing user data
+ */
+typedef void (*user_free_fn)(void* data);
+
+/**
+ * A TthreadQueue
+ *
+ * @ingroup ThreadQueue
+ *
+ * User provided callback function returning the size of user data, used for the queue limit in bytes
+ */
+typedef long (*user_size_fn)(void* data);
+
+/**
+ * A queue limit
+ *
+ * @ingroup ThreadQueue
+ *
+ * Capacity limit and overflow policy of queue, see thread_queue_set_limit().
+ */
+struct threadqueue_limit
+{
+	long max_msgs;					// Maximum number of messages, 0 for unlimited
+	long max_bytes;					// Maximum total size of messages, 0 for unlimited
+	int policy;						// Overflow policy, THREAD_QUEUE_BLOCK etc.
+	struct timespec timeout;		// THREAD_QUEUE_BLOCK: how long put waits for free space
+	user_size_fn size;				// Size of message, required for max_bytes
+	user_free_fn free;				// Frees dropped message (or NULL), called without the queue locked
+};
+
+/**
+ * Queue statistics
+ *
+ * @ingroup ThreadQueue
+ */
+struct threadqueue_stats
+{
+	long length;			// Number of messages in queue
+	long bytes;				// Total size of messages in queue (if the size function is set)
+	long dropped;			// Number of messages dropped by THREAD_QUEUE_DROP_* policies
+	long rejected;			// Number of messages refused by THREAD_QUEUE_FAIL and THREAD_QUEUE_BLOCK policies
+};
+
+/**
+ * A wait strategy
+ *
+ * @ingroup ThreadQueue
+ *
+ * How the consumer waits for a message, see thread_queue_set_wait(). The consumer polls
+ * the empty queue 'spin' times, then yields the processor 'yield' times polling after
+ * each yield, then sleeps until a producer wakes it up. Zero counts (the default) sleep at once.
+ */
+struct threadqueue_wait
+{
+	long spin;						// Number of busy polls before yielding
+	long yield;						// Number of thread_yield() before sleeping
+};
+
+/* Waiter of several queues, see thread_queue_poll() */
+struct threadqueue_poller;
+
+/* Ring of SPSC queue, see thread_queue_init_spsc() */
+struct threadqueue_ring;
+
 /**
  * A TthreadQueue
  *
@@ -66,32 +179,112 @@ struct threadqueue
 	long length;					// Length of the queue, never set this, never read this.
 	mutex_t mutex;					// Mutex for the queue, never touch.
 	cond_t cond;					// Condition variable for the queue, never touch.
-	struct msglist *first, *last;	// Internal pointers for the queue, never touch.
+	struct msglist *first;			// Internal pointer for the queue (ordered by priority), never touch.
+	struct msglist *lane_last[THREAD_QUEUE_PRIOS];	// Last message of each priority, NULL if there is no one
 	struct msglist *msgpool;		// Internal cache of msglists
 	long msgpool_length;			// No. of elements in the msgpool
+	int type;						// THREAD_QUEUE_LOCKED or THREAD_QUEUE_MPSC
+	struct msglist *head;			// MPSC: last pushed node, swapped by producers
+	struct msglist *tail;			// MPSC: stub node, next of it is the first message
+	long waiting;					// No. of consumers sleeping on cond (MPSC: nonzero while the consumer sleeps)
+	struct threadqueue_wait wait;	// How consumers wait for a message
+	struct threadqueue_limit limit;	// Capacity limit, zero max_msgs and max_bytes for unbounded queue
+	long bytes;						// Total size of messages (if limit.size is set)
+	cond_t space;					// Producers wait on it for free space
+	long blocked;					// No. of producers waiting for free space
+	long dropped;					// No. of messages dropped by overflow policy
+	long rejected;					// No. of messages refused by overflow policy
+	int notify_fd;					// Event descriptor, see thread_queue_get_fd() (-1 if not created)
+	long armed;						// Nonzero if the consumer waits for notify_fd or poller
+	struct threadqueue_poller *poller;	// Poller waiting for the queue, see thread_queue_poll()
+	struct threadqueue_ring *ring;	// SPSC: ring of slots, outlives the queue while inline messages are held
 };
 
 /**
- * A TthreadQueue
+ * Initializes a queue.
  *
  * @ingroup ThreadQueue
  *
- * User provided callback function used in thread_queue_free() for freeing user data
+ * thread_queue_init initializes a new threadqueue. A new queue must always
+ * be initialized before it is used.
+ *
+ * @param queue Pointer to the queue that should be initialized
+ * @return 0 on success see pthread_mutex_init
  */
-typedef void (*user_free_fn)(void* data);
+int thread_queue_init(struct threadqueue *queue);
 
 /**
- * Initializes a queue.
+ * Initializes a queue of given type.
  *
  * @ingroup ThreadQueue
  *
- * thread_queue_init initializes a new threadqueue. A new queue must always
- * be initialized before it is used.
+ * thread_queue_init_ex is thread_queue_init with the choice of queue type,
+ * THREAD_QUEUE_LOCKED or THREAD_QUEUE_MPSC.
  *
  * @param queue Pointer to the queue that should be initialized
- * @return 0 on success see pthread_mutex_init
+ * @param type type of queue
+ * @return 0 on success EINVAL if queue is NULL or type is unknown, ENOMEM if out of memory
  */
-int thread_queue_init(struct threadqueue *queue);
+int thread_queue_init_ex(struct threadqueue *queue, int type);
+
+/**
+ * Initializes a single producer single consumer queue.
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_init_spsc initializes THREAD_QUEUE_SPSC queue: a ring of 'slots' cache line aligned slots
+ * (rounded up to power of two). Messages are passed through the ring by acquire/release atomics, without
+ * lock and allocation, only one thread at a time may put and only one thread at a time may get messages.
+ * The ring is the capacity of queue: when it is full, put waits for a free slot, see thread_queue_set_limit().
+ * Besides data pointers, each slot can hold 'inline_size' bytes of message itself, see thread_queue_reserve_inline().
+ * Priorities are ignored.
+ *
+ * @param queue Pointer to the queue that should be initialized
+ * @param slots number of slots
+ * @param inline_size size of inline message of slot, 0 for pointers only
+ * @return 0 on success EINVAL if queue is NULL or slots is not positive, ENOMEM if out of memory
+ */
+int thread_queue_init_spsc(struct threadqueue *queue, long slots, size_t inline_size);
+
+/**
+ * Reserves inline message of SPSC queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_reserve_inline returns the inline area of the next free slot for the message of 'size' bytes.
+ * The producer fills it and puts the message by thread_queue_commit_inline(). The message is received
+ * with data pointing to the inline area, which is valid until thread_queue_free_inline() is called
+ * for it (by any thread). The received but not freed messages hold their slots, so the producer waits for them
+ * when the ring wraps around. The queue's free function passed to thread_queue_cleanup() must call thread_queue_free_inline()
+ * for inline messages.
+ *
+ * @param queue Pointer to the queue.
+ * @param size size of message
+ * @return the inline area or NULL if the queue is not SPSC one, the message is too big or the next slot is not free
+ */
+void *thread_queue_reserve_inline(struct threadqueue *queue, size_t size);
+
+/**
+ * Puts reserved inline message of SPSC queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * @param queue Pointer to the queue.
+ * @param msgtype a long specifying the message type, choice of the user.
+ * @return 0 on success EINVAL if queue is NULL or no message is reserved
+ */
+int thread_queue_commit_inline(struct threadqueue *queue, long msgtype);
+
+/**
+ * Frees inline message of SPSC queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * The slot is returned to the ring, the ring is freed with the last message if the queue is freed already.
+ *
+ * @param data the inline area returned by thread_queue_reserve_inline()
+ */
+void thread_queue_free_inline(void *data);
 
 /**
  * Put a message to a queue
@@ -105,11 +298,131 @@ int thread_queue_init(struct threadqueue *queue);
  * given back when a message is retreived from the queue.
  * @param queue Pointer to the queue on where the message should be added.
  * @param data the "message".
+ * If the queue is bounded, the message is subject to the overflow policy (see
+ * thread_queue_set_limit()); a dropped message is considered as put.
  * @param msgtype a long specifying the message type, choice of the user.
- * @return 0 on succes ENOMEM if out of memory EINVAL if queue is NULL
+ * @return 0 on succes ENOMEM if out of memory EINVAL if queue is NULL,
+ * ENOBUFS if the queue is full (THREAD_QUEUE_FAIL) or ETIMEDOUT if no space freed in time (THREAD_QUEUE_BLOCK)
  */
 int thread_queue_put_msg(struct threadqueue *queue, void *data, long msgtype);
 
+/**
+ * Put a message to a queue without waiting
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_try_put_msg is thread_queue_put_msg that never waits for free space, refuses
+ * nor drops messages: if the queue is full it returns EAGAIN whatever the policy is,
+ * the message is not counted as rejected and the free function of limit is not called.
+ * @param queue Pointer to the queue on where the message should be added.
+ * @param data the "message".
+ * @param msgtype a long specifying the message type, choice of the user.
+ * @return as thread_queue_put_msg, or EAGAIN if the queue is full
+ */
+int thread_queue_try_put_msg(struct threadqueue *queue, void *data, long msgtype);
+
+/**
+ * Put several messages to a queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_put_msgs adds 'count' messages to the specified queue at once:
+ * the queue is locked once and waiting thread is woken up once.
+ * Either all messages are added or none: THREAD_QUEUE_BLOCK and THREAD_QUEUE_FAIL
+ * policies require free space for all messages, THREAD_QUEUE_DROP_* policies
+ * are applied to each message.
+ * @param queue Pointer to the queue on where the messages should be added.
+ * @param data array of "messages".
+ * @param count number of messages in array.
+ * @param msgtype a long specifying the message type of all messages, choice of the user.
+ * @return 0 on succes ENOMEM if out of memory EINVAL if queue is NULL,
+ * ENOBUFS if the queue is full (THREAD_QUEUE_FAIL) or ETIMEDOUT if no space freed in time (THREAD_QUEUE_BLOCK)
+ */
+int thread_queue_put_msgs(struct threadqueue *queue, void **data, int count, long msgtype);
+
+/**
+ * Put several messages to a queue without waiting
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_try_put_msgs is thread_queue_put_msgs that never waits for free space, refuses
+ * nor drops messages: if there is no space for all of them it returns EAGAIN whatever the policy is,
+ * the messages are not counted as rejected and the free function of limit is not called.
+ * @param queue Pointer to the queue on where the messages should be added.
+ * @param data array of "messages".
+ * @param count number of messages in array.
+ * @param msgtype a long specifying the message type of all messages, choice of the user.
+ * @return as thread_queue_put_msgs, or EAGAIN if the queue is full
+ */
+int thread_queue_try_put_msgs(struct threadqueue *queue, void **data, int count, long msgtype);
+
+/**
+ * Adds a message with priority to a queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_put_msg_prio is thread_queue_put_msg for message of priority 'prio',
+ * it is taken before all messages of lower priority.
+ * THREAD_QUEUE_DROP_OLDEST policy drops messages of the lowest priority first and
+ * never drops a message of higher priority than the new one.
+ *
+ * @param queue Pointer to the queue on where the message should be added.
+ * @param data the "message".
+ * @param msgtype a long specifying the message type, choice of the user.
+ * @param prio priority, 0 to THREAD_QUEUE_PRIOS - 1
+ * @return as thread_queue_put_msg, EINVAL if the priority is out of range
+ */
+int thread_queue_put_msg_prio(struct threadqueue *queue, void *data, long msgtype, int prio);
+
+/**
+ * Adds a message with priority to a queue without waiting
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_try_put_msg_prio is thread_queue_put_msg_prio that fails with EAGAIN
+ * if the queue is full, as thread_queue_try_put_msg does.
+ *
+ * @param queue Pointer to the queue on where the message should be added.
+ * @param data the "message".
+ * @param msgtype a long specifying the message type, choice of the user.
+ * @param prio priority, 0 to THREAD_QUEUE_PRIOS - 1
+ * @return as thread_queue_put_msg_prio, or EAGAIN if the queue is full
+ */
+int thread_queue_try_put_msg_prio(struct threadqueue *queue, void *data, long msgtype, int prio);
+
+/**
+ * Set capacity limit of a queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_set_limit bounds the queue by number of messages and/or by total
+ * size of messages and sets the overflow policy. The limit is copied.
+ * The size function may be set with zero limits, then the queue only counts bytes.
+ * MPSC queue supports THREAD_QUEUE_DROP_NEWEST and THREAD_QUEUE_FAIL policies only,
+ * and its limit must be set before producers start.
+ * SPSC queue is bounded by its ring, the limit selects the policy of full ring only (max_msgs and max_bytes must be 0,
+ * THREAD_QUEUE_DROP_OLDEST is not supported); the default is to wait for free slot without timeout.
+ * @param queue Pointer to the queue.
+ * @param limit the limit, NULL for unbounded queue.
+ * @return 0 on succes EINVAL if queue is NULL or the limit is not valid
+ */
+int thread_queue_set_limit(struct threadqueue *queue, const struct threadqueue_limit *limit);
+
+/**
+ * Set wait strategy of a queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_set_wait selects how thread_queue_get_msg() and thread_queue_get_msgs() wait
+ * for a message: busy polling cuts the wake up latency at the cost of the consumer's processor time,
+ * a sleeping consumer is woken up by the producer with a system call.
+ * Producers wake up consumers only if there are sleeping ones. The strategy is copied.
+ * @param queue Pointer to the queue.
+ * @param wait the strategy, NULL to sleep at once.
+ * @return 0 on succes EINVAL if queue is NULL or the counts are negative
+ */
+int thread_queue_set_wait(struct threadqueue *queue, const struct threadqueue_wait *wait);
+
 /**
  * Gets a message from a queue
  *
@@ -136,6 +449,90 @@ int thread_queue_put_msg(struct threadqueue *queue, void *data, long msgtype);
  */
 int thread_queue_get_msg(struct threadqueue *queue, const struct timespec *timeout, struct threadmsg *msg);
 
+/**
+ * Gets several messages from a queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_get_msgs waits as thread_queue_get_msg does, then takes up to
+ * 'max' messages from the queue at once (under single lock).
+ *
+ * @param queue Pointer to the queue to wait on for a message.
+ * @param timeout timeout on how long to wait on a message
+ * @param msgs array of 'max' messages that is filled in with mesagetype and data
+ * @param max maximum number of messages to take
+ *
+ * @return number of messages taken on success, -EINVAL if queue is NULL and -ETIMEDOUT (or -ERROR_TIMEOUT for windows) if timeout occurs
+ */
+int thread_queue_get_msgs(struct threadqueue *queue, const struct timespec *timeout, struct threadmsg *msgs, int max);
+
+/**
+ * Gets several messages from a queue without waiting
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_try_get_msgs takes up to 'max' messages that are in the queue already.
+ * Unlike thread_queue_try_get_msg() it leaves the event descriptor as is.
+ *
+ * @param queue Pointer to the queue to take messages from.
+ * @param msgs array of 'max' messages that is filled in with mesagetype and data
+ * @param max maximum number of messages to take
+ *
+ * @return number of messages taken, 0 if the queue is empty and -EINVAL if queue is NULL
+ */
+int thread_queue_try_get_msgs(struct threadqueue *queue, struct threadmsg *msgs, int max);
+
+/**
+ * Gets a message from a queue without waiting
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_try_get_msg takes the first message if the queue is not empty.
+ * If the queue is empty and the event descriptor is created (see thread_queue_get_fd())
+ * the descriptor is reset, so it becomes readable again with the next message.
+ *
+ * @param queue Pointer to the queue to take a message from.
+ * @param msg pointer that is filled in with mesagetype and data
+ *
+ * @return 0 on success EINVAL if queue is NULL and EAGAIN if the queue is empty
+ */
+int thread_queue_try_get_msg(struct threadqueue *queue, struct threadmsg *msg);
+
+/**
+ * Gets the event descriptor of a queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_get_fd returns a descriptor (eventfd) that becomes readable when a message
+ * arrives to the queue, for use with poll/epoll. The descriptor is created on the first call
+ * and closed by thread_queue_cleanup(). Once readable, it stays readable until
+ * thread_queue_try_get_msg() finds the queue empty, so the consumer should take
+ * messages until EAGAIN. The descriptor may be readable spuriously.
+ * Producers make the write system call only if the consumer waits for the descriptor.
+ *
+ * @param queue Pointer to the queue.
+ * @return the descriptor, -EINVAL if queue is NULL, -ENOSYS if not supported (non-Linux) or other negative errno
+ */
+int thread_queue_get_fd(struct threadqueue *queue);
+
+/**
+ * Waits for messages in several queues
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_poll blocks until any of the queues is not empty or the timeout occurs.
+ * The producers of the queues wake up the caller through a single wait object, the queues
+ * are not polled in turn. A queue can be polled by one thread at a time.
+ *
+ * @param queues array of 'count' queues.
+ * @param count number of queues.
+ * @param timeout timeout on how long to wait, NULL for no timeout
+ * @param ready array of 'count' flags, set to nonzero for not empty queues.
+ * @return number of not empty queues, 0 if timeout occurs, -EINVAL if an argument is NULL,
+ * -EBUSY if a queue is polled by other thread or -ENOMEM if out of memory
+ */
+int thread_queue_poll(struct threadqueue **queues, int count, const struct timespec *timeout, int *ready);
+
 /**
  * Gets the length of a queue
  *
@@ -148,6 +545,17 @@ int thread_queue_get_msg(struct threadqueue *queue, const struct timespec *timeo
  */
 long thread_queue_length(struct threadqueue *queue);
 
+/**
+ * Gets statistics of a queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * @param queue Pointer to the queue
+ * @param stats filled in with length, size and overflow counters of the queue
+ * @return 0 on succes EINVAL if queue or stats is NULL
+ */
+int thread_queue_stats(struct threadqueue *queue, struct threadqueue_stats *stats);
+
 /**
  * @ingroup ThreadQueue
  * Cleans up the queue.
@@ -180,6 +588,19 @@ int thread_queue_cleanup(struct threadqueue *queue, user_free_fn freedata);
  */
 struct threadqueue* thread_queue_alloc();
 
+/**
+ * Allocate a queue of given type.
+ *
+ * @ingroup ThreadQueue
+ *
+ * thread_queue_alloc_ex is thread_queue_alloc with the choice of queue type,
+ * see thread_queue_init_ex().
+ *
+ * @param type type of queue
+ * @return pointer to newly allocated queue or NULL
+ */
+struct threadqueue* thread_queue_alloc_ex(int type);
+
 /**
  * Deallocate a queue.
  *
@@ -28,52 +28,344 @@
 
 #include "trie.h"
 
+#ifdef PTRIE_SSE2
+#include <emmintrin.h>
+#if defined _MSC_VER
+#include <intrin.h>
+static int ptrie_ctz (unsigned int x)
+{
+    unsigned long index;
+    _BitScanForward (&index, x);
+    return (int) index;
+}
+#else
+#define ptrie_ctz(x) __builtin_ctz (x)
+#endif
+#endif
+
 /*  Double check that the size of node structure is as small as
     we believe it to be. */
-//CT_ASSERT (sizeof (struct ptrie_node) == 24);
+//CT_ASSERT (sizeof (struct ptrie_node) == 32);
+
+/*  The first bytes of the arena are not used, so that 0 is never an offset
+    of a node. */
+#define PTRIE_ARENA_HEADER 8
+
+/*  Maximum number of children whose characters, and maximum length of the
+    prefix, that are stored in the frozen node itself. */
+#define PTRIE_FROZEN_LOCAL 4
+#define PTRIE_FROZEN_PREFIX 12
+
+/*  Maximum length of a merged prefix of the frozen node. */
+#define PTRIE_FROZEN_PREFIX_MAX 255
+
+/*  The character array of the frozen trie is padded, so that it can be
+    read by 16 characters at a time. */
+#define PTRIE_FROZEN_PAD 16
+
+/*  The initial size of the arena. */
+#define PTRIE_ARENA_MIN 256
+
+/*  Capacity of the child array of each node size class. Sparse nodes grow
+    by two children, dense ones by power of two. */
+static const uint16_t pnode_classes [PTRIE_NODE_CLASSES] =
+    {0, 2, 4, 6, 8, 16, 32, 64, 128, 256};
+
+/*  Node of the frozen trie. Children of a node follow each other in the
+    node array. Their characters are sorted and stored in the node if there
+    are up to PTRIE_FROZEN_LOCAL of them, in the character array otherwise.
+    Chains of nodes with a single child and no subscription are merged,
+    so the prefix may be longer than PTRIE_PREFIX_MAX; long prefixes are
+    stored in the character array as well. */
+struct ptrie_fnode {
+
+    /*  User value of the subscribed string. */
+    void *value;
+
+    /*  Index of the first child in the node array. */
+    uint32_t child;
+
+    /*  Number of children. */
+    uint16_t children;
+
+    /*  1 if the string is subscribed, 0 otherwise. */
+    uint8_t subscribed;
+
+    /*  Length of the prefix. */
+    uint8_t prefix_len;
+
+    /*  The children's characters or their offset in the character
+        array. */
+    union {
+        uint8_t local [PTRIE_FROZEN_LOCAL];
+        uint32_t offset;
+    } chars;
+
+    /*  The prefix or its offset in the character array. */
+    union {
+        uint8_t local [PTRIE_FROZEN_PREFIX];
+        uint32_t offset;
+    } prefix;
+};
+
+/*  The frozen trie is allocated as a single block: this header, the node
+    array and the character array. */
+struct ptrie_frozen {
+    uint32_t nodes;
+    struct ptrie_fnode *node;
+    uint8_t *chars;
+};
 
 /*  Forward declarations. */
-static struct ptrie_node *pnode_compact (struct ptrie_node *self);
+static struct ptrie_node *pnode_ptr (const struct ptrie *trie,
+    uint32_t node);
+static uint32_t *pnode_slot (struct ptrie *trie, uint32_t ref);
+static uint32_t pnode_ref (struct ptrie *trie, uint32_t *slot);
+static struct ptrie_node *pnode_at (struct ptrie *trie, uint32_t ref);
+static int pnode_class (int children);
+static size_t pnode_class_size (int cls);
+static int pnode_reserve (struct ptrie *trie, size_t size);
+static uint32_t pnode_alloc (struct ptrie *trie, int children);
+static void pnode_free (struct ptrie *trie, uint32_t node, int children);
+static uint32_t pnode_resize (struct ptrie *trie, uint32_t node,
+    int old_children, int new_children);
+static uint32_t pnode_compact (struct ptrie *trie, uint32_t node);
 static int pnode_check_prefix (struct ptrie_node *self,
     const uint8_t *data, size_t size);
-static struct ptrie_node **pnode_child (struct ptrie_node *self,
-    int index);
-static struct ptrie_node **pnode_next (struct ptrie_node *self,
-    uint8_t c);
-static int pnode_unsubscribe (struct ptrie_node **self,
+static uint32_t *pnode_child (struct ptrie_node *self, int index);
+static uint32_t *pnode_next (struct ptrie_node *self, uint8_t c);
+static int pnode_unsubscribe (struct ptrie *trie, uint32_t self,
     const uint8_t *data, size_t size);
-static void pnode_term (struct ptrie_node *self);
+static uint32_t pnode_copy (struct ptrie *trie, const struct ptrie *src,
+    uint32_t node, ptrie_clone_fn fn, void *arg, int *rc);
+static void pnode_walk (struct ptrie *trie, uint32_t node,
+    ptrie_match_fn fn, void *arg);
+static int pnode_children (const struct ptrie_node *self);
 static int pnode_has_subscribers (struct ptrie_node *self);
-static void pnode_dump (struct ptrie_node *self, int indent);
+static void pnode_dump (struct ptrie *trie, uint32_t node, int indent);
 static void pnode_indent (int indent);
 static void pnode_putchar (uint8_t c);
+static uint32_t pnode_chain (struct ptrie *trie, uint32_t node,
+    uint8_t *prefix, int *prefix_len);
+static uint32_t pnode_count (struct ptrie *trie, uint32_t node,
+    size_t *chars);
+static int fnode_next (const struct ptrie_frozen *frozen,
+    const struct ptrie_fnode *self, uint8_t c);
 
 void ptrie_init (struct ptrie *self)
 {
-    self->root = NULL;
+    self->base = NULL;
+    self->size = PTRIE_ARENA_HEADER;
+    self->capacity = 0;
+    self->unused = 0;
+    self->root = 0;
+    memset (self->free, 0, sizeof (self->free));
 }
 
 void ptrie_term (struct ptrie *self)
 {
-    pnode_term (self->root);
+    /*  All the nodes are in the arena. */
+    free (self->base);
+    ptrie_init (self);
+}
+
+int ptrie_clone (struct ptrie *self, const struct ptrie *src,
+    ptrie_clone_fn fn, void *arg)
+{
+    int rc;
+
+    /*  The copy takes exactly the space of the nodes, laid out in
+        depth-first order. */
+    ptrie_init (self);
+    if (!src->root)
+        return 0;
+    self->base = malloc (src->size - src->unused);
+    if (!self->base)
+        return -ENOMEM;
+    self->capacity = src->size - src->unused;
+    rc = 0;
+    self->root = pnode_copy (self, src, src->root, fn, arg, &rc);
+    return rc;
+}
+
+int ptrie_compact (struct ptrie *self)
+{
+    struct ptrie copy;
+
+    if (ptrie_clone (&copy, self, NULL, NULL) != 0)
+        return -ENOMEM;
+    free (self->base);
+    *self = copy;
+    return 0;
+}
+
+void ptrie_memory (struct ptrie *self, size_t *used, size_t *allocated)
+{
+    *used = self->size - self->unused - PTRIE_ARENA_HEADER;
+    *allocated = self->capacity;
+}
+
+void ptrie_walk (struct ptrie *self, ptrie_match_fn fn, void *arg)
+{
+    pnode_walk (self, self->root, fn, arg);
 }
 
 void ptrie_dump (struct ptrie *self)
 {
-    pnode_dump (self->root, 0);
+    pnode_dump (self, self->root, 0);
+}
+
+struct ptrie_node *pnode_ptr (const struct ptrie *trie, uint32_t node)
+{
+    /*  Pointer to the node at the offset. It is valid until the next
+        allocation in the arena. */
+
+    return (struct ptrie_node*) (trie->base + node);
 }
 
-void pnode_dump (struct ptrie_node *self, int indent)
+uint32_t *pnode_slot (struct ptrie *trie, uint32_t ref)
+{
+    /*  Pointer to the slot holding the offset of a node: 0 refers to the
+        root, other references are offsets of child slots in the arena. */
+
+    return ref ? (uint32_t*) (trie->base + ref) : &trie->root;
+}
+
+uint32_t pnode_ref (struct ptrie *trie, uint32_t *slot)
+{
+    /*  Reference to the slot, it survives moving of the arena. */
+
+    return slot == &trie->root ? 0 : (uint32_t) ((uint8_t*) slot - trie->base);
+}
+
+struct ptrie_node *pnode_at (struct ptrie *trie, uint32_t ref)
+{
+    /*  The node the slot points to. */
+
+    return pnode_ptr (trie, *pnode_slot (trie, ref));
+}
+
+int pnode_class (int children)
+{
+    /*  The smallest size class fitting the child array. */
+
+    int cls;
+
+    for (cls = 0; pnode_classes [cls] < children; ++cls)
+        ;
+    return cls;
+}
+
+size_t pnode_class_size (int cls)
+{
+    /*  Size of nodes of the class, keeps the nodes aligned for the value. */
+
+    return (sizeof (struct ptrie_node) +
+        pnode_classes [cls] * sizeof (uint32_t) + 7) & ~(size_t) 7;
+}
+
+int pnode_reserve (struct ptrie *trie, size_t size)
+{
+    /*  Grows the arena to at least 'size' bytes. The nodes move, only the
+        offsets stay valid. Returns -ENOMEM and leaves the arena as is if
+        it cannot grow. */
+
+    size_t capacity;
+    uint8_t *base;
+
+    if (size <= trie->capacity)
+        return 0;
+    capacity = trie->capacity ? trie->capacity : PTRIE_ARENA_MIN;
+    while (capacity < size)
+        capacity *= 2;
+    if (capacity > UINT32_MAX)
+        return -ENOMEM;
+    base = realloc (trie->base, capacity);
+    if (!base)
+        return -ENOMEM;
+    trie->base = base;
+    trie->capacity = (uint32_t) capacity;
+    return 0;
+}
+
+uint32_t pnode_alloc (struct ptrie *trie, int children)
+{
+    /*  Allocates a node for 'children' children, freed nodes of the size
+        class are reused first. Returns offset of the node, or 0 if the
+        arena cannot grow. Adding and copying reserve the space in advance,
+        removing does without the new node. */
+
+    int cls;
+    size_t size;
+    uint32_t node;
+
+    cls = pnode_class (children);
+    size = pnode_class_size (cls);
+    node = trie->free [cls];
+    if (node) {
+        trie->free [cls] = *(uint32_t*) (trie->base + node);
+        trie->unused -= size;
+        return node;
+    }
+
+    if (pnode_reserve (trie, trie->size + size) != 0)
+        return 0;
+    node = trie->size;
+    trie->size += size;
+    return node;
+}
+
+void pnode_free (struct ptrie *trie, uint32_t node, int children)
+{
+    /*  Puts the node to the free list of its size class. The free list
+        link is stored in the first bytes of the node. */
+
+    int cls;
+
+    cls = pnode_class (children);
+    *(uint32_t*) (trie->base + node) = trie->free [cls];
+    trie->free [cls] = node;
+    trie->unused += pnode_class_size (cls);
+}
+
+uint32_t pnode_resize (struct ptrie *trie, uint32_t node,
+    int old_children, int new_children)
+{
+    /*  Changes the size of the child array. The node is moved if its size
+        class changes, the header and the children that fit are copied.
+        Returns the offset of the node. A shrinking node stays in place
+        if the arena cannot grow, the free lists take it as the smaller
+        class later. */
+
+    uint32_t new_node;
+    int children;
+
+    if (pnode_class (old_children) == pnode_class (new_children))
+        return node;
+
+    new_node = pnode_alloc (trie, new_children);
+    if (!new_node)
+        return node;
+    children = old_children < new_children ? old_children : new_children;
+    memcpy (pnode_ptr (trie, new_node), pnode_ptr (trie, node),
+        sizeof (struct ptrie_node) + children * sizeof (uint32_t));
+    pnode_free (trie, node, old_children);
+    return new_node;
+}
+
+void pnode_dump (struct ptrie *trie, uint32_t node, int indent)
 {
     int i;
     int children;
+    struct ptrie_node *self;
 
-    if (!self) {
+    if (!node) {
         pnode_indent (indent);
         printf ("NULL\n");
         return;
     }
 
+    self = pnode_ptr (trie, node);
     pnode_indent (indent);
     printf ("===================\n");
     pnode_indent (indent);
@@ -111,7 +403,7 @@ void pnode_dump (struct ptrie_node *self, int indent)
     }
 
     for (i = 0; i != children; ++i)
-        pnode_dump (((struct ptrie_node**) (self + 1)) [i], indent + 1);
+        pnode_dump (trie, *pnode_child (self, i), indent + 1);
 
     pnode_indent (indent);
     printf ("===================\n");
@@ -133,23 +425,70 @@ void pnode_putchar (uint8_t c)
         putchar (c);
 }
 
-void pnode_term (struct ptrie_node *self)
+int pnode_children (const struct ptrie_node *self)
+{
+    /*  Size of the array of children. */
+
+    return self->type <= PTRIE_SPARSE_MAX ?
+        self->type : (self->u.dense.max - self->u.dense.min + 1);
+}
+
+uint32_t pnode_copy (struct ptrie *trie, const struct ptrie *src,
+    uint32_t node, ptrie_clone_fn fn, void *arg, int *rc)
+{
+    /*  The arena of the copy is allocated in advance. If 'fn' fails,
+        -ENOMEM is stored to 'rc', the value is left NULL and the rest
+        of the subtree is not copied. */
+
+    struct ptrie_node *self;
+    struct ptrie_node *cur;
+    uint32_t copy;
+    uint32_t ch;
+    int children;
+    int i;
+
+    /*  Trivial case of the recursive algorithm. */
+    if (!node)
+        return 0;
+
+    /*  Copy the node as is, then replace children and the user value. */
+    self = pnode_ptr (src, node);
+    children = pnode_children (self);
+    copy = pnode_alloc (trie, children);
+    cur = pnode_ptr (trie, copy);
+    memcpy (cur, self, sizeof (struct ptrie_node));
+    memset (cur + 1, 0, children * sizeof (uint32_t));
+    if (fn && pnode_has_subscribers (self) && self->value) {
+        cur->value = fn (self->value, arg);
+        if (!cur->value)
+            *rc = -ENOMEM;
+    }
+    for (i = 0; i != children && !*rc; ++i) {
+        ch = pnode_copy (trie, src, *pnode_child (self, i), fn, arg, rc);
+        *pnode_child (pnode_ptr (trie, copy), i) = ch;
+    }
+
+    return copy;
+}
+
+void pnode_walk (struct ptrie *trie, uint32_t node, ptrie_match_fn fn,
+    void *arg)
 {
+    struct ptrie_node *self;
     int children;
     int i;
 
     /*  Trivial case of the recursive algorithm. */
-    if (!self)
+    if (!node)
         return;
 
-    /*  Recursively destroy the child nodes. */
-    children = self->type <= PTRIE_SPARSE_MAX ?
-        self->type : (self->u.dense.max - self->u.dense.min + 1);
-    for (i = 0; i != children; ++i)
-        pnode_term (*pnode_child (self, i));
+    self = pnode_ptr (trie, node);
+    if (pnode_has_subscribers (self))
+        fn (self->value, arg);
 
-    /*  Deallocate this node. */
-    free (self);
+    children = pnode_children (self);
+    for (i = 0; i != children; ++i)
+        pnode_walk (trie, *pnode_child (self, i), fn, arg);
 }
 
 int pnode_check_prefix (struct ptrie_node *self,
@@ -159,6 +498,23 @@ int pnode_check_prefix (struct ptrie_node *self,
 
     int i;
 
+#ifdef PTRIE_SSE2
+    /*  The first 8 characters at once (the prefix is at most 10 long),
+        neither the data nor the node is read past its end. */
+    if (self->prefix_len >= 8 && size >= 8) {
+        __m128i p = _mm_loadl_epi64 ((const __m128i*) self->prefix);
+        __m128i d = _mm_loadl_epi64 ((const __m128i*) data);
+        unsigned int diff = ~_mm_movemask_epi8 (_mm_cmpeq_epi8 (p, d)) & 0xff;
+        if (diff)
+            return ptrie_ctz (diff);
+        for (i = 8; i != self->prefix_len; ++i) {
+            if (size == (size_t) i || self->prefix [i] != data [i])
+                return i;
+        }
+        return self->prefix_len;
+    }
+#endif
+
     for (i = 0; i != self->prefix_len; ++i) {
         if (!size || self->prefix [i] != *data)
             return i;
@@ -168,14 +524,14 @@ int pnode_check_prefix (struct ptrie_node *self,
     return self->prefix_len;
 }
 
-struct ptrie_node **pnode_child (struct ptrie_node *self, int index)
+uint32_t *pnode_child (struct ptrie_node *self, int index)
 {
     /*  Finds pointer to the n-th child of the node. */
 
-    return ((struct ptrie_node**) (self + 1)) + index;
+    return ((uint32_t*) (self + 1)) + index;
 }
 
-struct ptrie_node **pnode_next (struct ptrie_node *self, uint8_t c)
+uint32_t *pnode_next (struct ptrie_node *self, uint8_t c)
 {
     /*  Finds the pointer to the next node based on the supplied character.
         If there is no such pointer, it returns NULL. */
@@ -187,6 +543,18 @@ struct ptrie_node **pnode_next (struct ptrie_node *self, uint8_t c)
 
     /*  Sparse mode. */
     if (self->type <= 8) {
+#ifdef PTRIE_SSE2
+        /*  Compare all the characters at once (the array is always 8 long).
+            Most nodes of topic trees have one or two children, the loop
+            is cheaper for them. */
+        if (self->type > 2) {
+            __m128i chars = _mm_loadl_epi64 (
+                (const __m128i*) self->u.sparse.children);
+            unsigned int found = _mm_movemask_epi8 (_mm_cmpeq_epi8 (chars,
+                _mm_set1_epi8 ((char) c))) & ((1u << self->type) - 1);
+            return found ? pnode_child (self, ptrie_ctz (found)) : NULL;
+        }
+#endif
         for (i = 0; i != self->type; ++i)
             if (self->u.sparse.children [i] == c)
                 return pnode_child (self, i);
@@ -199,25 +567,30 @@ struct ptrie_node **pnode_next (struct ptrie_node *self, uint8_t c)
     return pnode_child (self, c - self->u.dense.min);
 }
 
-struct ptrie_node *pnode_compact (struct ptrie_node *self)
+uint32_t pnode_compact (struct ptrie *trie, uint32_t node)
 {
-    /*  Tries to merge the node with the child node. Returns pointer to
+    /*  Tries to merge the node with the child node. Returns offset of
         the compacted node. */
 
+    struct ptrie_node *self;
     struct ptrie_node *ch;
+    uint32_t child;
+
+    self = pnode_ptr (trie, node);
 
     /*  Node that is a subscription cannot be compacted. */
     if (pnode_has_subscribers (self))
-        return self;
+        return node;
 
     /*  Only a node with a single child can be compacted. */
     if (self->type != 1)
-        return self;
+        return node;
 
     /*  Check whether combined prefixes would fix into a single node. */
-    ch = *pnode_child (self, 0);
+    child = *pnode_child (self, 0);
+    ch = pnode_ptr (trie, child);
     if (self->prefix_len + ch->prefix_len + 1 > PTRIE_PREFIX_MAX)
-        return self;
+        return node;
 
     /*  Concatenate the prefixes. */
     memmove (ch->prefix + self->prefix_len + 1, ch->prefix, ch->prefix_len);
@@ -226,19 +599,26 @@ struct ptrie_node *pnode_compact (struct ptrie_node *self)
     ch->prefix_len += self->prefix_len + 1;
 
     /*  Get rid of the obsolete parent node. */
-    free (self);
+    pnode_free (trie, node, 1);
 
     /*  Return the new compacted node. */
-    return ch;
+    return child;
 }
 
 int ptrie_add_str (struct ptrie *self, const uint8_t *data, size_t size)
 {
+    /*  'node' refers to the slot of the current node. The nodes may move
+        whenever a node is allocated, so the pointers to them are taken
+        again after each allocation. */
+
     int i;
-    struct ptrie_node **node;
-    struct ptrie_node **n;
-    struct ptrie_node *ch;
-    struct ptrie_node *old_node;
+    uint32_t node;
+    uint32_t *n;
+    struct ptrie_node *cur;
+    struct ptrie_node *old;
+    uint32_t ch;
+    uint32_t new_node;
+    uint32_t old_node;
     int pos;
     uint8_t c;
     uint8_t c2;
@@ -249,22 +629,31 @@ int ptrie_add_str (struct ptrie *self, const uint8_t *data, size_t size)
     int inserted;
     int more_nodes;
 
+    /*  Step 0 -- Reserve the arena for the worst case: the split node,
+        the largest resized node and the chain of new nodes. Nothing
+        fails later, so the trie is never left half changed. */
+    if (pnode_reserve (self, (size_t) self->size +
+          pnode_class_size (1) + pnode_class_size (PTRIE_NODE_CLASSES - 1) +
+          (size / (PTRIE_PREFIX_MAX + 1) + 1) * pnode_class_size (1)) != 0)
+        return -ENOMEM;
+
     /*  Step 1 -- Traverse the trie. */
 
-    node = &self->root;
+    node = 0;
     while (1) {
 
         /*  If there are no more nodes on the path, go to step 4. */
-        if (!*node)
+        if (!*pnode_slot (self, node))
             goto step4;
 
         /*  Check whether prefix matches the new subscription. */
-        pos = pnode_check_prefix (*node, data, size);
+        cur = pnode_at (self, node);
+        pos = pnode_check_prefix (cur, data, size);
         data += pos;
         size -= pos;
 
         /*  If only part of the prefix matches, go to step 2. */
-        if (pos < (*node)->prefix_len)
+        if (pos < cur->prefix_len)
             goto step2;
 
         /*  Even if whole prefix matches and there's no more data to match,
@@ -273,10 +662,10 @@ int ptrie_add_str (struct ptrie *self, const uint8_t *data, size_t size)
             goto step5;
 
         /*  Move to the next node. If it is not present, go to step 3. */
-        n = pnode_next (*node, *data);
+        n = pnode_next (cur, *data);
         if (!n || !*n)
             goto step3;
-        node = n;
+        node = pnode_ref (self, n);
         ++data;
         --size;
     }
@@ -284,18 +673,21 @@ int ptrie_add_str (struct ptrie *self, const uint8_t *data, size_t size)
     /*  Step 2 -- Split the prefix into two parts if required. */
 step2:
 
-    ch = *node;
-    *node = malloc (sizeof (struct ptrie_node) + sizeof (struct ptrie_node*));
-    assert (*node);
-    (*node)->refcount = 0;
-    (*node)->prefix_len = pos;
-    (*node)->type = 1;
-    memcpy ((*node)->prefix, ch->prefix, pos);
-    (*node)->u.sparse.children [0] = ch->prefix [pos];
-    ch->prefix_len -= (pos + 1);
-    memmove (ch->prefix, ch->prefix + pos + 1, ch->prefix_len);
-    ch = pnode_compact (ch);
-    *pnode_child (*node, 0) = ch;
+    ch = *pnode_slot (self, node);
+    new_node = pnode_alloc (self, 1);
+    cur = pnode_ptr (self, new_node);
+    old = pnode_ptr (self, ch);
+    cur->refcount = 0;
+    cur->value = NULL;
+    cur->prefix_len = pos;
+    cur->type = 1;
+    memcpy (cur->prefix, old->prefix, pos);
+    cur->u.sparse.children [0] = old->prefix [pos];
+    old->prefix_len -= (pos + 1);
+    memmove (old->prefix, old->prefix + pos + 1, old->prefix_len);
+    ch = pnode_compact (self, ch);
+    *pnode_child (pnode_ptr (self, new_node), 0) = ch;
+    *pnode_slot (self, node) = new_node;
 
     /*  Step 3 -- Adjust the child array to accommodate the new character. */
 step3:
@@ -306,14 +698,16 @@ step3:
         goto step5;
 
     /*  If the new branch fits into sparse array... */
-    if ((*node)->type < PTRIE_SPARSE_MAX) {
-        *node = realloc (*node, sizeof (struct ptrie_node) +
-            ((*node)->type + 1) * sizeof (struct ptrie_node*));
-        assert (*node);
-        (*node)->u.sparse.children [(*node)->type] = *data;
-        ++(*node)->type;
-        node = pnode_child (*node, (*node)->type - 1);
-        *node = NULL;
+    cur = pnode_at (self, node);
+    if (cur->type < PTRIE_SPARSE_MAX) {
+        new_node = pnode_resize (self, *pnode_slot (self, node),
+            cur->type, cur->type + 1);
+        *pnode_slot (self, node) = new_node;
+        cur = pnode_ptr (self, new_node);
+        cur->u.sparse.children [cur->type] = *data;
+        ++cur->type;
+        *pnode_child (cur, cur->type - 1) = 0;
+        node = pnode_ref (self, pnode_child (cur, cur->type - 1));
         ++data;
         --size;
         goto step4;
@@ -321,35 +715,36 @@ step3:
 
     /*  If the node is already a dense array, resize it to fit the next
         character. */
-    if ((*node)->type == PTRIE_DENSE_TYPE) {
+    if (cur->type == PTRIE_DENSE_TYPE) {
         c = *data;
-        if (c < (*node)->u.dense.min || c > (*node)->u.dense.max) {
-            new_min = (*node)->u.dense.min < c ? (*node)->u.dense.min : c;
-            new_max = (*node)->u.dense.max > c ? (*node)->u.dense.max : c;
-            *node = realloc (*node, sizeof (struct ptrie_node) +
-                (new_max - new_min + 1) * sizeof (struct ptrie_node*));
-            assert (*node);
-            old_children = (*node)->u.dense.max - (*node)->u.dense.min + 1;
+        if (c < cur->u.dense.min || c > cur->u.dense.max) {
+            new_min = cur->u.dense.min < c ? cur->u.dense.min : c;
+            new_max = cur->u.dense.max > c ? cur->u.dense.max : c;
+            old_children = cur->u.dense.max - cur->u.dense.min + 1;
             new_children = new_max - new_min + 1;
-            if ((*node)->u.dense.min != new_min) {
-                inserted = (*node)->u.dense.min - new_min;
-                memmove (pnode_child (*node, inserted),
-                    pnode_child (*node, 0),
-                    old_children * sizeof (struct ptrie_node*));
-                memset (pnode_child (*node, 0), 0,
-                    inserted * sizeof (struct ptrie_node*));
+            new_node = pnode_resize (self, *pnode_slot (self, node),
+                old_children, new_children);
+            *pnode_slot (self, node) = new_node;
+            cur = pnode_ptr (self, new_node);
+            if (cur->u.dense.min != new_min) {
+                inserted = cur->u.dense.min - new_min;
+                memmove (pnode_child (cur, inserted),
+                    pnode_child (cur, 0),
+                    old_children * sizeof (uint32_t));
+                memset (pnode_child (cur, 0), 0,
+                    inserted * sizeof (uint32_t));
             }
             else {
-                memset (pnode_child (*node, old_children), 0,
+                memset (pnode_child (cur, old_children), 0,
                     (new_children - old_children) *
-                    sizeof (struct ptrie_node*));
+                    sizeof (uint32_t));
             }
-            (*node)->u.dense.min = new_min;
-            (*node)->u.dense.max = new_max;
+            cur->u.dense.min = new_min;
+            cur->u.dense.max = new_max;
         }
-        ++(*node)->u.dense.nbr;
+        ++cur->u.dense.nbr;
 
-        node = pnode_child (*node, c - (*node)->u.dense.min);
+        node = pnode_ref (self, pnode_child (cur, c - cur->u.dense.min));
         ++data;
         --size;
         goto step4;
@@ -361,8 +756,8 @@ step3:
         /*  First, determine the range of children. */
         new_min = 255;
         new_max = 0;
-        for (i = 0; i != (*node)->type; ++i) {
-            c2 = (*node)->u.sparse.children [i];
+        for (i = 0; i != cur->type; ++i) {
+            c2 = cur->u.sparse.children [i];
             new_min = new_min < c2 ? new_min : c2;
             new_max = new_max > c2 ? new_max : c2;
         }
@@ -370,56 +765,59 @@ step3:
         new_max = new_max > *data ? new_max : *data;
 
         /*  Create a new mode, while keeping the old one for a while. */
-        old_node = *node;
-        *node = (struct ptrie_node*) malloc (sizeof (struct ptrie_node) +
-            (new_max - new_min + 1) * sizeof (struct ptrie_node*));
-        assert (*node);
+        old_node = *pnode_slot (self, node);
+        new_node = pnode_alloc (self, new_max - new_min + 1);
+        old = pnode_ptr (self, old_node);
+        cur = pnode_ptr (self, new_node);
 
         /*  Fill in the new node. */
-        (*node)->refcount = 0;
-        (*node)->prefix_len = old_node->prefix_len;
-        (*node)->type = PTRIE_DENSE_TYPE;
-        memcpy ((*node)->prefix, old_node->prefix, old_node->prefix_len);
-        (*node)->u.dense.min = new_min;
-        (*node)->u.dense.max = new_max;
-        (*node)->u.dense.nbr = old_node->type + 1;
-        memset (*node + 1, 0, (new_max - new_min + 1) *
-            sizeof (struct ptrie_node*));
-        for (i = 0; i != old_node->type; ++i)
-            *pnode_child (*node, old_node->u.sparse.children [i] - new_min) =
-                *pnode_child (old_node, i);
-        node = pnode_next (*node, *data);
+        cur->refcount = old->refcount;
+        cur->value = old->value;
+        cur->prefix_len = old->prefix_len;
+        cur->type = PTRIE_DENSE_TYPE;
+        memcpy (cur->prefix, old->prefix, old->prefix_len);
+        cur->u.dense.min = new_min;
+        cur->u.dense.max = new_max;
+        cur->u.dense.nbr = old->type + 1;
+        memset (cur + 1, 0, (new_max - new_min + 1) * sizeof (uint32_t));
+        for (i = 0; i != old->type; ++i)
+            *pnode_child (cur, old->u.sparse.children [i] - new_min) =
+                *pnode_child (old, i);
+        *pnode_slot (self, node) = new_node;
+        node = pnode_ref (self, pnode_next (cur, *data));
         ++data;
         --size;
 
         /*  Get rid of the obsolete old node. */
-        free (old_node);
+        pnode_free (self, old_node, old->type);
     }
 
     /*  Step 4 -- Create new nodes for remaining part of the subscription. */
 step4:
 
-    assert (!*node);
+    assert (!*pnode_slot (self, node));
     while (1) {
 
         /*  Create a new node to hold the next part of the subscription. */
         more_nodes = size > PTRIE_PREFIX_MAX;
-        *node = malloc (sizeof (struct ptrie_node) +
-            (more_nodes ? sizeof (struct ptrie_node*) : 0));
-        assert (*node);
+        new_node = pnode_alloc (self, more_nodes ? 1 : 0);
+        *pnode_slot (self, node) = new_node;
+        cur = pnode_ptr (self, new_node);
 
         /*  Fill in the new node. */
-        (*node)->refcount = 0;
-        (*node)->type = more_nodes ? 1 : 0;
-        (*node)->prefix_len = size < (uint8_t) PTRIE_PREFIX_MAX ?
+        cur->refcount = 0;
+        cur->value = NULL;
+        cur->type = more_nodes ? 1 : 0;
+        cur->prefix_len = size < (uint8_t) PTRIE_PREFIX_MAX ?
             (uint8_t) size : (uint8_t) PTRIE_PREFIX_MAX;
-        memcpy ((*node)->prefix, data, (*node)->prefix_len);
-        data += (*node)->prefix_len;
-        size -= (*node)->prefix_len;
+        memcpy (cur->prefix, data, cur->prefix_len);
+        data += cur->prefix_len;
+        size -= cur->prefix_len;
         if (!more_nodes)
             break;
-        (*node)->u.sparse.children [0] = *data;
-        node = pnode_child (*node, 0);
+        cur->u.sparse.children [0] = *data;
+        *pnode_child (cur, 0) = 0;
+        node = pnode_ref (self, pnode_child (cur, 0));
         ++data;
         --size;
     }
@@ -427,18 +825,19 @@ step4:
     /*  Step 5 -- Create the subscription as such. */
 step5:
 
-    ++(*node)->refcount;
+    cur = pnode_at (self, node);
+    ++cur->refcount;
 
     /*  Return 1 in case of a fresh subscription. */
-    return (*node)->refcount == 1 ? 1 : 0;
+    return cur->refcount == 1 ? 1 : 0;
 }
 
 int ptrie_match_str (struct ptrie *self, const uint8_t *data, size_t size)
 {
     struct ptrie_node *node;
-    struct ptrie_node **tmp;
+    uint32_t *tmp;
 
-    node = self->root;
+    node = self->root ? pnode_ptr (self, self->root) : NULL;
     while (1) {
 
         /*  If we are at the end of the trie, return. */
@@ -458,9 +857,11 @@ int ptrie_match_str (struct ptrie *self, const uint8_t *data, size_t size)
         if (pnode_has_subscribers (node))
             return 1;
 
-        /*  Move to the next node. */
+        /*  Move to the next node, there is none past the end of the data. */
+        if (!size)
+            return 0;
         tmp = pnode_next (node, *data);
-        node = tmp ? *tmp : NULL;
+        node = tmp && *tmp ? pnode_ptr (self, *tmp) : NULL;
         ++data;
         --size;
     }
@@ -468,96 +869,166 @@ int ptrie_match_str (struct ptrie *self, const uint8_t *data, size_t size)
     return -1; // We should never come here, but kiss GCC to ass.
 }
 
+void **ptrie_value (struct ptrie *self, const uint8_t *data, size_t size)
+{
+    struct ptrie_node *node;
+    uint32_t *tmp;
+
+    node = self->root ? pnode_ptr (self, self->root) : NULL;
+    while (node) {
+
+        /*  The string must match the whole prefix. */
+        if (pnode_check_prefix (node, data, size) != node->prefix_len)
+            return NULL;
+        data += node->prefix_len;
+        size -= node->prefix_len;
+
+        /*  End of the string: it is in the trie only if subscribed. */
+        if (!size)
+            return pnode_has_subscribers (node) ? &node->value : NULL;
+
+        /*  Move to the next node. */
+        tmp = pnode_next (node, *data);
+        node = tmp && *tmp ? pnode_ptr (self, *tmp) : NULL;
+        ++data;
+        --size;
+    }
+
+    return NULL;
+}
+
+int ptrie_match_all (struct ptrie *self, const uint8_t *data, size_t size,
+    ptrie_match_fn fn, void *arg)
+{
+    struct ptrie_node *node;
+    uint32_t *tmp;
+    int matches;
+
+    matches = 0;
+    node = self->root ? pnode_ptr (self, self->root) : NULL;
+    while (node) {
+
+        /*  Check whether whole prefix matches the data. If not so,
+            no longer string can match. */
+        if (pnode_check_prefix (node, data, size) != node->prefix_len)
+            break;
+        data += node->prefix_len;
+        size -= node->prefix_len;
+
+        /*  Every subscribed node on the path is a prefix of the data. */
+        if (pnode_has_subscribers (node)) {
+            fn (node->value, arg);
+            ++matches;
+        }
+
+        /*  Move to the next node. */
+        if (!size)
+            break;
+        tmp = pnode_next (node, *data);
+        node = tmp && *tmp ? pnode_ptr (self, *tmp) : NULL;
+        ++data;
+        --size;
+    }
+
+    return matches;
+}
+
 int ptrie_remove_str (struct ptrie *self, const uint8_t *data, size_t size)
 {
-	return pnode_unsubscribe (&self->root, data, size);
-	/*
-	if (self->root)
-	{
-		return pnode_unsubscribe (&self->root, data, size);
-	}
-	else
-	{
-		return 0;
-	}
-	*/
+    return pnode_unsubscribe (self, 0, data, size);
 }
 
-static int pnode_unsubscribe (struct ptrie_node **self,
+static int pnode_unsubscribe (struct ptrie *trie, uint32_t self,
     const uint8_t *data, size_t size)
 {
+    /*  'self' refers to the slot of the node, see ptrie_add_str. */
+
     int i;
     int j;
     int index;
     int new_min;
-    struct ptrie_node **ch;
-    struct ptrie_node *new_node;
-    struct ptrie_node *ch2;
+    int old_min;
+    int range;
+    int rc;
+    uint32_t ch;
+    uint32_t node;
+    uint32_t new_node;
+    uint32_t ch2;
+    struct ptrie_node *cur;
+    struct ptrie_node *new_cur;
 
     if (!size)
         goto found;
 
+    /*  Empty (sub)trie cannot contain the subscription. */
+    if (!*pnode_slot (trie, self))
+        return 0;
+
     /*  If prefix does not match the data, return. */
-    if (pnode_check_prefix (*self, data, size) != (*self)->prefix_len)
+    cur = pnode_at (trie, self);
+    if (pnode_check_prefix (cur, data, size) != cur->prefix_len)
         return 0;
 
     /*  Skip the prefix. */
-    data += (*self)->prefix_len;
-    size -= (*self)->prefix_len;
+    data += cur->prefix_len;
+    size -= cur->prefix_len;
 
     if (!size)
         goto found;
 
     /*  Move to the next node. */
-    ch = pnode_next (*self, *data);
-    if (!ch)
+    if (!pnode_next (cur, *data) || !*pnode_next (cur, *data))
         return 0; /*  TODO: This should be an error. */
+    ch = pnode_ref (trie, pnode_next (cur, *data));
 
     /*  Recursive traversal of the trie happens here. If the subscription
         wasn't really removed, nothing have changed in the trie and
         no additional pruning is needed. */
-    if (pnode_unsubscribe (ch, data + 1, size - 1) == 0)
-        return 0;
+    rc = pnode_unsubscribe (trie, ch, data + 1, size - 1);
+    if (rc != 1)
+        return rc;
 
     /*  Subscription removal is already done. Now we are going to compact
         the trie. However, if the following node remains in place, there's
         nothing to compact here. */
-    if (*ch)
+    if (*pnode_slot (trie, ch))
         return 1;
 
     /*  Sparse array. */
-    if ((*self)->type < PTRIE_DENSE_TYPE) {
+    node = *pnode_slot (trie, self);
+    cur = pnode_ptr (trie, node);
+    if (cur->type < PTRIE_DENSE_TYPE) {
 
         /*  Get the indices of the removed child. */
-        for (index = 0; index != (*self)->type; ++index)
-            if ((*self)->u.sparse.children [index] == *data)
+        for (index = 0; index != cur->type; ++index)
+            if (cur->u.sparse.children [index] == *data)
                 break;
-        assert (index != (*self)->type);
+        assert (index != cur->type);
 
         /*  Remove the destroyed child from both lists of children. */
         memmove (
-            (*self)->u.sparse.children + index,
-            (*self)->u.sparse.children + index + 1,
-            (*self)->type - index - 1);
+            cur->u.sparse.children + index,
+            cur->u.sparse.children + index + 1,
+            cur->type - index - 1);
         memmove (
-            pnode_child (*self, index),
-            pnode_child (*self, index + 1),
-            ((*self)->type - index - 1) * sizeof (struct ptrie_node*));
-        --(*self)->type;
-        *self = realloc (*self, sizeof (struct ptrie_node) +
-            ((*self)->type * sizeof (struct ptrie_node*)));
-        assert (*self);
-        
+            pnode_child (cur, index),
+            pnode_child (cur, index + 1),
+            (cur->type - index - 1) * sizeof (uint32_t));
+        --cur->type;
+        node = pnode_resize (trie, node, cur->type + 1, cur->type);
+        *pnode_slot (trie, self) = node;
+        cur = pnode_ptr (trie, node);
+
         /*  If there are no more children and no refcount, we can delete
             the node altogether. */
-        if (!(*self)->type && !pnode_has_subscribers (*self)) {
-            free (*self);
-            *self = NULL;
+        if (!cur->type && !pnode_has_subscribers (cur)) {
+            pnode_free (trie, node, 0);
+            *pnode_slot (trie, self) = 0;
             return 1;
         }
 
         /*  Try to merge the node with the following node. */
-        *self = pnode_compact (*self);
+        *pnode_slot (trie, self) = pnode_compact (trie, node);
 
         return 1;
     }
@@ -566,70 +1037,80 @@ static int pnode_unsubscribe (struct ptrie_node **self,
 
     /*  In this case the array stays dense. We have to adjust the limits of
         the array, if appropriate. */
-    if ((*self)->u.dense.nbr > PTRIE_SPARSE_MAX + 1) {
+    if (cur->u.dense.nbr > PTRIE_SPARSE_MAX + 1) {
 
         /*  If the removed item is the leftmost one, trim the array from
             the left side. */
-        if (*data == (*self)->u.dense.min) {
-             for (i = 0; i != (*self)->u.dense.max - (*self)->u.dense.min + 1;
+        if (*data == cur->u.dense.min) {
+             for (i = 0; i != cur->u.dense.max - cur->u.dense.min + 1;
                    ++i)
-                 if (*pnode_child (*self, i))
+                 if (*pnode_child (cur, i))
                      break;
-             new_min = i + (*self)->u.dense.min;
-             memmove (pnode_child (*self, 0), pnode_child (*self, i),
-                 ((*self)->u.dense.max - new_min + 1) *
-                 sizeof (struct ptrie_node*));
-             (*self)->u.dense.min = new_min;
-             --(*self)->u.dense.nbr;
-             *self = realloc (*self, sizeof (struct ptrie_node) +
-                 ((*self)->u.dense.max - new_min + 1) *
-                 sizeof (struct ptrie_node*));
-             assert (*self);
+             new_min = i + cur->u.dense.min;
+             memmove (pnode_child (cur, 0), pnode_child (cur, i),
+                 (cur->u.dense.max - new_min + 1) *
+                 sizeof (uint32_t));
+             node = pnode_resize (trie, node,
+                 cur->u.dense.max - cur->u.dense.min + 1,
+                 cur->u.dense.max - new_min + 1);
+             *pnode_slot (trie, self) = node;
+             cur = pnode_at (trie, self);
+             cur->u.dense.min = new_min;
+             --cur->u.dense.nbr;
              return 1;
         }
 
         /*  If the removed item is the rightmost one, trim the array from
             the right side. */
-        if (*data == (*self)->u.dense.max) {
-             for (i = (*self)->u.dense.max - (*self)->u.dense.min; i != 0; --i)
-                 if (*pnode_child (*self, i))
+        if (*data == cur->u.dense.max) {
+             for (i = cur->u.dense.max - cur->u.dense.min; i != 0; --i)
+                 if (*pnode_child (cur, i))
                      break;
-             (*self)->u.dense.max = i + (*self)->u.dense.min;
-             --(*self)->u.dense.nbr;
-             *self = realloc (*self, sizeof (struct ptrie_node) +
-                 ((*self)->u.dense.max - (*self)->u.dense.min + 1) *
-                 sizeof (struct ptrie_node*));
-             assert (*self);
+             node = pnode_resize (trie, node,
+                 cur->u.dense.max - cur->u.dense.min + 1, i + 1);
+             *pnode_slot (trie, self) = node;
+             cur = pnode_at (trie, self);
+             cur->u.dense.max = i + cur->u.dense.min;
+             --cur->u.dense.nbr;
              return 1;
         }
 
         /*  If the item is removed from the middle of the array, do nothing. */
-        --(*self)->u.dense.nbr;
+        --cur->u.dense.nbr;
         return 1;
     }
 
-    /*  Convert dense array into sparse array. */
+    /*  Convert dense array into sparse array. If the arena cannot grow,
+        the node is converted in place, the children only move down. */
     {
-        new_node = malloc (sizeof (struct ptrie_node) +
-            PTRIE_SPARSE_MAX * sizeof (struct ptrie_node*));
-        assert (new_node);
-        new_node->refcount = 0;
-        new_node->prefix_len = (*self)->prefix_len;
-        memcpy (new_node->prefix, (*self)->prefix, new_node->prefix_len);
-        new_node->type = PTRIE_SPARSE_MAX;
+        old_min = cur->u.dense.min;
+        range = cur->u.dense.max - cur->u.dense.min + 1;
+        new_node = pnode_alloc (trie, PTRIE_SPARSE_MAX);
+        if (!new_node)
+            new_node = node;
+        cur = pnode_ptr (trie, node);
+        new_cur = pnode_ptr (trie, new_node);
+        if (new_node != node) {
+            new_cur->refcount = cur->refcount;
+            new_cur->value = cur->value;
+            new_cur->prefix_len = cur->prefix_len;
+            memcpy (new_cur->prefix, cur->prefix, new_cur->prefix_len);
+        }
+        new_cur->type = PTRIE_SPARSE_MAX;
         j = 0;
-        for (i = 0; i != (*self)->u.dense.max - (*self)->u.dense.min + 1;
-              ++i) {
-            ch2 = *pnode_child (*self, i);
+        for (i = 0; i != range; ++i) {
+            ch2 = *pnode_child (cur, i);
             if (ch2) {
-                new_node->u.sparse.children [j] = i + (*self)->u.dense.min;
-                *pnode_child (new_node, j) = ch2;
+                new_cur->u.sparse.children [j] = (uint8_t) (i + old_min);
+                *pnode_child (new_cur, j) = ch2;
                 ++j;
             }
         }
         assert (j == PTRIE_SPARSE_MAX);
-        free (*self);
-        *self = new_node;
+        if (new_node != node) {
+            pnode_free (trie, node, range);
+            *pnode_slot (trie, self) = new_node;
+        }
         return 1;
     }
 
@@ -638,25 +1119,27 @@ found:
     /*  We are at the end of the subscription here. */
 
     /*  Subscription doesn't exist. */
-    if (!*self || !pnode_has_subscribers (*self))
+    if (!*pnode_slot (trie, self) || !pnode_has_subscribers (pnode_at (trie, self)))
         return -EINVAL;
 
     /*  Subscription exists. Unsubscribe. */
-    --(*self)->refcount;
+    node = *pnode_slot (trie, self);
+    cur = pnode_ptr (trie, node);
+    --cur->refcount;
 
     /*  If reference count has dropped to zero we can try to compact
         the node. */
-    if (!(*self)->refcount) {
+    if (!cur->refcount) {
 
         /*  If there are no children, we can delete the node altogether. */
-        if (!(*self)->type) {
-            free (*self);
-            *self = NULL;
+        if (!cur->type) {
+            pnode_free (trie, node, 0);
+            *pnode_slot (trie, self) = 0;
             return 1;
         }
 
         /*  Try to merge the node with the following node. */
-        *self = pnode_compact (*self);
+        *pnode_slot (trie, self) = pnode_compact (trie, node);
         return 1;
     }
 
@@ -669,3 +1152,259 @@ int pnode_has_subscribers (struct ptrie_node *node)
     return node->refcount ? 1 : 0;
 }
 
+uint32_t pnode_chain (struct ptrie *trie, uint32_t node, uint8_t *prefix,
+    int *prefix_len)
+{
+    /*  Follows the chain of nodes that the frozen trie merges into a single
+        node, starting with 'node'. The merged prefix is stored to 'prefix'.
+        Returns the last node of the chain, which has the subscription and
+        the children of the merged node. */
+
+    struct ptrie_node *self;
+
+    self = pnode_ptr (trie, node);
+    memcpy (prefix, self->prefix, self->prefix_len);
+    *prefix_len = self->prefix_len;
+    while (!pnode_has_subscribers (self) && self->type == 1 &&
+          *prefix_len + 1 + pnode_ptr (trie, *pnode_child (self, 0))->
+          prefix_len <= PTRIE_FROZEN_PREFIX_MAX) {
+        prefix [(*prefix_len)++] = self->u.sparse.children [0];
+        node = *pnode_child (self, 0);
+        self = pnode_ptr (trie, node);
+        memcpy (prefix + *prefix_len, self->prefix, self->prefix_len);
+        *prefix_len += self->prefix_len;
+    }
+    return node;
+}
+
+uint32_t pnode_count (struct ptrie *trie, uint32_t node, size_t *chars)
+{
+    /*  Counts the frozen nodes of the subtree and adds the number of
+        characters that do not fit into them to 'chars'. */
+
+    struct ptrie_node *self;
+    uint8_t prefix [PTRIE_FROZEN_PREFIX_MAX];
+    int prefix_len;
+    uint32_t count;
+    int children;
+    int i;
+
+    if (!node)
+        return 0;
+
+    node = pnode_chain (trie, node, prefix, &prefix_len);
+    if (prefix_len > PTRIE_FROZEN_PREFIX)
+        *chars += prefix_len;
+    self = pnode_ptr (trie, node);
+    children = pnode_children (self);
+    if (children > PTRIE_FROZEN_LOCAL)
+        *chars += self->type == PTRIE_DENSE_TYPE ?
+            self->u.dense.nbr : self->type;
+    count = 1;
+    for (i = 0; i != children; ++i)
+        count += pnode_count (trie, *pnode_child (self, i), chars);
+    return count;
+}
+
+struct ptrie_frozen *ptrie_freeze (struct ptrie *self)
+{
+    struct ptrie_frozen *frozen;
+    struct ptrie_node *node;
+    struct ptrie_fnode *fnode;
+    uint32_t *queue;
+    uint32_t nodes;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ch;
+    size_t chars;
+    size_t pos;
+    uint8_t prefix [PTRIE_FROZEN_PREFIX_MAX];
+    int prefix_len;
+    uint8_t *sorted;
+    int children;
+    int i;
+    int j;
+    uint8_t c;
+
+    /*  Size up the trie. */
+    chars = 0;
+    nodes = pnode_count (self, self->root, &chars);
+
+    frozen = malloc (sizeof (struct ptrie_frozen) +
+        nodes * sizeof (struct ptrie_fnode) + chars + PTRIE_FROZEN_PAD);
+    if (!frozen)
+        return NULL;
+    queue = malloc ((nodes ? nodes : 1) * sizeof (uint32_t));
+    if (!queue) {
+        free (frozen);
+        return NULL;
+    }
+    frozen->nodes = nodes;
+    frozen->node = (struct ptrie_fnode*) (frozen + 1);
+    frozen->chars = (uint8_t*) (frozen->node + nodes);
+    memset (frozen->chars + chars, 0, PTRIE_FROZEN_PAD);
+
+    /*  Breadth-first traversal, the n-th frozen node is made of the chain
+        starting by queue [n]. */
+    head = 0;
+    tail = 0;
+    pos = 0;
+    if (self->root)
+        queue [tail++] = self->root;
+    while (head != tail) {
+        node = pnode_ptr (self,
+            pnode_chain (self, queue [head], prefix, &prefix_len));
+        fnode = &frozen->node [head];
+        ++head;
+
+        memset (fnode, 0, sizeof (struct ptrie_fnode));
+        if (pnode_has_subscribers (node)) {
+            fnode->value = node->value;
+            fnode->subscribed = 1;
+        }
+        fnode->prefix_len = (uint8_t) prefix_len;
+        if (prefix_len > PTRIE_FROZEN_PREFIX) {
+            fnode->prefix.offset = (uint32_t) pos;
+            memcpy (frozen->chars + pos, prefix, prefix_len);
+            pos += prefix_len;
+        }
+        else
+            memcpy (fnode->prefix.local, prefix, prefix_len);
+        fnode->child = tail;
+
+        /*  Children in the order of their characters. Dense array is
+            ordered already, sparse one is sorted by insertion. */
+        children = pnode_children (node);
+        if (children > PTRIE_FROZEN_LOCAL) {
+            fnode->chars.offset = (uint32_t) pos;
+            sorted = frozen->chars + pos;
+        }
+        else
+            sorted = fnode->chars.local;
+        for (i = 0; i != children; ++i) {
+            ch = *pnode_child (node, i);
+            if (!ch)
+                continue;
+            c = node->type == PTRIE_DENSE_TYPE ?
+                (uint8_t) (node->u.dense.min + i) :
+                node->u.sparse.children [i];
+            for (j = fnode->children; j != 0 && sorted [j - 1] > c; --j) {
+                sorted [j] = sorted [j - 1];
+                queue [tail + j] = queue [tail + j - 1];
+            }
+            sorted [j] = c;
+            queue [tail + j] = ch;
+            ++fnode->children;
+        }
+        tail += fnode->children;
+        if (children > PTRIE_FROZEN_LOCAL)
+            pos += fnode->children;
+    }
+    assert (tail == nodes && pos == chars);
+
+    free (queue);
+    return frozen;
+}
+
+int fnode_next (const struct ptrie_frozen *frozen,
+    const struct ptrie_fnode *self, uint8_t c)
+{
+    /*  Finds the index of the child for the character, -1 if there is no
+        such child. */
+
+    const uint8_t *chars;
+    int i;
+#ifndef PTRIE_SSE2
+    int lo;
+    int hi;
+#endif
+
+    /*  Few characters are in the node itself. */
+    if (self->children <= PTRIE_FROZEN_LOCAL) {
+        for (i = 0; i != self->children; ++i)
+            if (self->chars.local [i] == c)
+                return i;
+        return -1;
+    }
+
+    chars = frozen->chars + self->chars.offset;
+
+#ifdef PTRIE_SSE2
+    /*  The array is padded, so the last 16 characters can be read even if
+        there are less children. */
+    for (i = 0; i < self->children; i += 16) {
+        unsigned int found = _mm_movemask_epi8 (_mm_cmpeq_epi8 (
+            _mm_loadu_si128 ((const __m128i*) (chars + i)),
+            _mm_set1_epi8 ((char) c)));
+        if (self->children - i < 16)
+            found &= (1u << (self->children - i)) - 1;
+        if (found)
+            return i + ptrie_ctz (found);
+    }
+    return -1;
+#else
+    /*  Binary search in the sorted characters. */
+    lo = 0;
+    hi = self->children;
+    while (lo < hi) {
+        i = (lo + hi) / 2;
+        if (chars [i] == c)
+            return i;
+        if (chars [i] < c)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return -1;
+#endif
+}
+
+int ptrie_frozen_match (const struct ptrie_frozen *self, const uint8_t *data,
+    size_t size, ptrie_match_fn fn, void *arg)
+{
+    const struct ptrie_fnode *node;
+    const uint8_t *prefix;
+    int matches;
+    int i;
+
+    matches = 0;
+    node = self->nodes ? self->node : NULL;
+    while (node) {
+
+        /*  Check whether whole prefix matches the data. If not so,
+            no longer string can match. */
+        if (size < node->prefix_len)
+            break;
+        prefix = node->prefix_len > PTRIE_FROZEN_PREFIX ?
+            self->chars + node->prefix.offset : node->prefix.local;
+        for (i = 0; i != node->prefix_len; ++i)
+            if (prefix [i] != data [i])
+                break;
+        if (i != node->prefix_len)
+            break;
+        data += node->prefix_len;
+        size -= node->prefix_len;
+
+        /*  Every subscribed node on the path is a prefix of the data. */
+        if (node->subscribed) {
+            fn (node->value, arg);
+            ++matches;
+        }
+
+        /*  Move to the next node. */
+        if (!size)
+            break;
+        i = fnode_next (self, node, *data);
+        node = i >= 0 ? &self->node [node->child + i] : NULL;
+        ++data;
+        --size;
+    }
+
+    return matches;
+}
+
+void ptrie_frozen_free (struct ptrie_frozen *self)
+{
+    /*  The whole frozen trie is a single block. */
+    free (self);
+}
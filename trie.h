@@ -42,12 +42,25 @@ extern "C"
 /* 'type' is set to this value when in the dense mode. */
 #define PTRIE_DENSE_TYPE (PTRIE_SPARSE_MAX + 1)
 
+/*  Sparse children lookup and prefix comparison use SSE2 when the compiler
+    targets it. Define PTRIE_NO_SIMD to use the plain byte loops. */
+#if !defined PTRIE_NO_SIMD && (defined __SSE2__ || defined _M_X64 || \
+    (defined _M_IX86_FP && _M_IX86_FP >= 2))
+#define PTRIE_SSE2
+#endif
+
+/*  Number of node size classes, see trie.c. */
+#define PTRIE_NODE_CLASSES 10
+
 /*  This structure represents a node in patricia trie. It's a header to be
-    followed by the array of pointers to child nodes. Each node represents
+    followed by the array of offsets of child nodes. Each node represents
     the string composed of all the prefixes on the way from the trie root,
     including the prefix in that node. */
 struct ptrie_node
 {
+    /*  User value associated with the subscribed string, see ptrie_value. */
+    void *value;
+
     /*  Number of subscriptions to the given string. */
     uint32_t refcount;
 
@@ -63,7 +76,7 @@ struct ptrie_node
     uint8_t prefix [PTRIE_PREFIX_MAX];
 
     /*  The array of characters pointing to individual children of the node.
-        Actual pointers to child nodes are stored in the memory following
+        Actual offsets of child nodes are stored in the memory following
         ptrie_node structure. */
     union {
 
@@ -87,12 +100,30 @@ struct ptrie_node
         } dense;
     } u;
 };
-/*  The structure is followed by the array of pointers to children. */
+/*  The structure is followed by the array of offsets of children, 0 stands
+    for no child. */
 
+/*  All the nodes of the trie live in a single arena and refer to each other
+    by 32-bit offsets into it, which halves the child arrays and keeps the
+    nodes close to each other. Nodes are rounded up to size classes, freed
+    nodes are kept on per-class free lists and reused. */
 struct ptrie {
 
+    /*  The arena, moved by realloc as it grows. */
+    uint8_t *base;
+
+    /*  Bytes of the arena used so far and allocated. */
+    uint32_t size;
+    uint32_t capacity;
+
+    /*  Bytes of the used space that are on the free lists. */
+    uint32_t unused;
+
     /*  The root node of the trie (representing the empty subscription). */
-    struct ptrie_node *root;
+    uint32_t root;
+
+    /*  Free nodes of each size class, linked through the node memory. */
+    uint32_t free [PTRIE_NODE_CLASSES];
 
 };
 
@@ -104,18 +135,75 @@ void ptrie_term (struct ptrie *self);
 
 /*  Add the string to the trie. If the string is not yet there, 1 is returned.
     If it already exists in the trie, its reference count is incremented and
-    0 is returned. */
+    0 is returned. If the arena cannot grow, -ENOMEM is returned and the trie
+    is not changed. */
 int ptrie_add_str (struct ptrie *self, const uint8_t *data, size_t size);
 
 /*  Remove the string from the trie. If the string was actually removed,
     1 is returned. If reference count was decremented without falling to zero,
-    0 is returned. */
+    0 is returned. Removing never fails for lack of memory. */
 int ptrie_remove_str (struct ptrie *self, const uint8_t *data, size_t size);
 
 /*  Checks the supplied string. If it matches it returns 1, if it does not
     it returns 0. */
 int ptrie_match_str (struct ptrie *self, const uint8_t *data, size_t size);
 
+/*  Returns pointer to the user value associated with the string, initially
+    NULL. If the string is not in the trie, NULL is returned. The value is
+    not touched by the trie and must be released by the user before the
+    string is removed from the trie. The pointer is valid until the trie
+    is modified, nodes move when the arena grows. */
+void **ptrie_value (struct ptrie *self, const uint8_t *data, size_t size);
+
+/*  Callback invoked by ptrie_match_all for every matching string. */
+typedef void (*ptrie_match_fn) (void *value, void *arg);
+
+/*  Calls 'fn' with the user value of every string in the trie that is
+    a prefix of the supplied string (the string itself included), shortest
+    first. Returns the number of matching strings. */
+int ptrie_match_all (struct ptrie *self, const uint8_t *data, size_t size,
+    ptrie_match_fn fn, void *arg);
+
+/*  Callback invoked by ptrie_clone to copy the user value. */
+typedef void *(*ptrie_clone_fn) (void *value, void *arg);
+
+/*  Initialise the trie as a deep copy of 'src'. The user values are copied
+    by 'fn', or kept if 'fn' is NULL. The copy is compact, see
+    ptrie_compact. Returns 0, or -ENOMEM if the arena cannot be allocated
+    (the copy is empty) or 'fn' returns NULL (the copy is partial, values not
+    copied are NULL; release them by ptrie_walk before ptrie_term). */
+int ptrie_clone (struct ptrie *self, const struct ptrie *src,
+    ptrie_clone_fn fn, void *arg);
+
+/*  Rebuilds the arena without the free nodes, the nodes are laid out in
+    depth-first order so that matching touches fewer cache lines. The
+    values are kept. Returns -ENOMEM and keeps the trie as is if the new
+    arena cannot be allocated. */
+int ptrie_compact (struct ptrie *self);
+
+/*  Gets the number of bytes taken by the nodes and by the whole arena. */
+void ptrie_memory (struct ptrie *self, size_t *used, size_t *allocated);
+
+/*  Calls 'fn' with the user value of every string in the trie. */
+void ptrie_walk (struct ptrie *self, ptrie_match_fn fn, void *arg);
+
+/*  Immutable copy of the trie compiled for matching, see ptrie_freeze. */
+struct ptrie_frozen;
+
+/*  Compiles the trie into a frozen form: a single block of fixed-size nodes
+    laid out in breadth-first order, children of each node next to each
+    other. The frozen form refers to the user values but does not own them.
+    It is never modified, so any number of threads can match against it
+    without locks. Returns NULL if out of memory. */
+struct ptrie_frozen *ptrie_freeze (struct ptrie *self);
+
+/*  Same as ptrie_match_all, but matches against the frozen form. */
+int ptrie_frozen_match (const struct ptrie_frozen *self, const uint8_t *data,
+    size_t size, ptrie_match_fn fn, void *arg);
+
+/*  Release the frozen form. */
+void ptrie_frozen_free (struct ptrie_frozen *self);
+
 /*  Debugging interface. */
 void ptrie_dump (struct ptrie *self);
 
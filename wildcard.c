@@ -0,0 +1,522 @@
+/*
+ * Index of level-aware wildcard patterns
+ * wildcard.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: alexo
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "wildcard.h"
+
+// Initial size of array of literal children
+#define WILDCARD_LITERALS	4
+
+// Node of pattern tree - path of pattern levels from the root
+struct wildcard_node
+{
+	struct wildcard_node** literals;	// children with literal levels sorted by level (binary search)
+	size_t nliterals;				// number of literal children
+	size_t literals_size;			// allocated size of literals array
+	struct wildcard_node* single;	// child with level '+'
+	void* value;					// user value of pattern ending by the node
+	void* multi;					// user value of pattern ending by the node and level '#'
+	char has_value;					// pattern ending by the node is in index
+	char has_multi;					// pattern ending by the node and level '#' is in index
+	size_t level_len;				// length of the node's level
+	char level[1];					// the node's level, allocated with the structure
+};
+
+// allocate a node of level
+static struct wildcard_node* wildcard_node_new(const char* level, size_t level_len)
+{
+	struct wildcard_node* node = (struct wildcard_node*)malloc(sizeof(struct wildcard_node) + level_len);
+
+	if (node != NULL)
+	{
+		memset(node, 0, sizeof(struct wildcard_node));
+		node->level_len = level_len;
+		memcpy(node->level, level, level_len);
+	}
+
+	return node;
+}
+
+// free the node with its children
+static void wildcard_node_free(struct wildcard_node* node)
+{
+	size_t i;
+
+	if (node != NULL)
+	{
+		for (i = 0; i < node->nliterals; i++)
+		{
+			wildcard_node_free(node->literals[i]);
+		}
+		free(node->literals);
+		wildcard_node_free(node->single);
+		free(node);
+	}
+}
+
+// length of the level starting at 'name', 'last' is set if it is the last level of name
+static size_t wildcard_level(const struct wildcard_index* index, const char* name, const char* end, int* last)
+{
+	const char* sep = (const char*)memchr(name, index->separator, end - name);
+
+	*last = (sep == NULL);
+	return (sep == NULL) ? (size_t)(end - name) : (size_t)(sep - name);
+}
+
+// whether the level is the wildcard 'c'
+static int wildcard_is(const char* level, size_t level_len, char c)
+{
+	return (level_len == 1) && (level[0] == c);
+}
+
+// compare the node's level with level, shorter level is less if it is prefix of the other one
+static int wildcard_compare(const struct wildcard_node* node, const char* level, size_t level_len)
+{
+	int cmp = memcmp(node->level, level, (node->level_len < level_len) ? node->level_len : level_len);
+
+	if (cmp == 0)
+	{
+		return (node->level_len < level_len) ? -1 : (node->level_len > level_len);
+	}
+	return cmp;
+}
+
+// binary search of the node's literal child of level, returns its position or the position to insert it
+static size_t wildcard_search(const struct wildcard_node* node, const char* level, size_t level_len, int* found)
+{
+	size_t low = 0;
+	size_t high = node->nliterals;
+	size_t mid;
+	int cmp;
+
+	while (low < high)
+	{
+		mid = low + (high - low) / 2;
+		cmp = wildcard_compare(node->literals[mid], level, level_len);
+		if (cmp == 0)
+		{
+			*found = 1;
+			return mid;
+		}
+		if (cmp < 0)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	*found = 0;
+	return low;
+}
+
+// insert new literal child of level at position 'pos', returns the child or NULL if out of memory
+static struct wildcard_node* wildcard_insert(struct wildcard_node* node, size_t pos, const char* level,
+	size_t level_len)
+{
+	struct wildcard_node** literals;
+	struct wildcard_node* child;
+	size_t size;
+
+	if (node->nliterals == node->literals_size)
+	{
+		size = (node->literals_size > 0) ? node->literals_size * 2 : WILDCARD_LITERALS;
+		literals = (struct wildcard_node**)realloc(node->literals, size * sizeof(struct wildcard_node*));
+		if (literals == NULL)
+		{
+			return NULL;
+		}
+		node->literals = literals;
+		node->literals_size = size;
+	}
+
+	child = wildcard_node_new(level, level_len);
+	if (child != NULL)
+	{
+		memmove(&node->literals[pos + 1], &node->literals[pos], (node->nliterals - pos) * sizeof(struct wildcard_node*));
+		node->literals[pos] = child;
+		node->nliterals++;
+	}
+
+	return child;
+}
+
+// find the node's child of level, the child is created if 'create' is set
+static struct wildcard_node* wildcard_child(struct wildcard_node* node, const char* level, size_t level_len,
+	int create)
+{
+	size_t pos;
+	int found;
+
+	if (wildcard_is(level, level_len, WILDCARD_SINGLE))
+	{
+		if ((node->single == NULL) && create)
+		{
+			node->single = wildcard_node_new(level, level_len);
+		}
+		return node->single;
+	}
+
+	pos = wildcard_search(node, level, level_len, &found);
+	if (found)
+	{
+		return node->literals[pos];
+	}
+	return create ? wildcard_insert(node, pos, level, level_len) : NULL;
+}
+
+// unlink the node's child of level (the child is not freed)
+static void wildcard_unlink(struct wildcard_node* node, const char* level, size_t level_len)
+{
+	size_t pos;
+	int found;
+
+	if (wildcard_is(level, level_len, WILDCARD_SINGLE))
+	{
+		node->single = NULL;
+		return;
+	}
+
+	pos = wildcard_search(node, level, level_len, &found);
+	if (found)
+	{
+		node->nliterals--;
+		memmove(&node->literals[pos], &node->literals[pos + 1], (node->nliterals - pos) * sizeof(struct wildcard_node*));
+	}
+}
+
+// whether the node can be removed: no pattern ends by the node or goes through it
+static int wildcard_node_empty(const struct wildcard_node* node)
+{
+	return !node->has_value && !node->has_multi && (node->nliterals == 0) && (node->single == NULL);
+}
+
+void wildcard_init(struct wildcard_index* index, int separator)
+{
+	index->root = NULL;
+	index->separator = separator;
+}
+
+void wildcard_term(struct wildcard_index* index)
+{
+	wildcard_node_free(index->root);
+	index->root = NULL;
+}
+
+int wildcard_valid(const struct wildcard_index* index, const char* pattern, size_t pattern_len)
+{
+	const char* end = pattern + pattern_len;
+	size_t level_len, i;
+	int last = 0;
+
+	while (!last)
+	{
+		level_len = wildcard_level(index, pattern, end, &last);
+
+		// '#' is allowed as the whole last level, '+' as a whole level
+		if (wildcard_is(pattern, level_len, WILDCARD_MULTI))
+		{
+			return last;
+		}
+		if (!wildcard_is(pattern, level_len, WILDCARD_SINGLE))
+		{
+			for (i = 0; i < level_len; i++)
+			{
+				if ((pattern[i] == WILDCARD_SINGLE) || (pattern[i] == WILDCARD_MULTI))
+				{
+					return 0;
+				}
+			}
+		}
+
+		pattern += level_len + 1;
+	}
+
+	return 1;
+}
+
+void** wildcard_add(struct wildcard_index* index, const char* pattern, size_t pattern_len)
+{
+	const char* end = pattern + pattern_len;
+	struct wildcard_node* node;
+	size_t level_len;
+	int last = 0;
+
+	if ((index->root == NULL) && ((index->root = wildcard_node_new("", 0)) == NULL))
+	{
+		return NULL;
+	}
+
+	// create missing nodes of the pattern levels (empty nodes are left to the following removal)
+	node = index->root;
+	while (1)
+	{
+		level_len = wildcard_level(index, pattern, end, &last);
+		if (wildcard_is(pattern, level_len, WILDCARD_MULTI))
+		{
+			node->has_multi = 1;
+			return &node->multi;
+		}
+
+		node = wildcard_child(node, pattern, level_len, 1);
+		if (node == NULL)
+		{
+			return NULL;
+		}
+		if (last)
+		{
+			node->has_value = 1;
+			return &node->value;
+		}
+
+		pattern += level_len + 1;
+	}
+}
+
+void** wildcard_value(struct wildcard_index* index, const char* pattern, size_t pattern_len)
+{
+	const char* end = pattern + pattern_len;
+	struct wildcard_node* node = index->root;
+	size_t level_len;
+	int last = 0;
+
+	while (node != NULL)
+	{
+		level_len = wildcard_level(index, pattern, end, &last);
+		if (wildcard_is(pattern, level_len, WILDCARD_MULTI))
+		{
+			return node->has_multi ? &node->multi : NULL;
+		}
+
+		node = wildcard_child(node, pattern, level_len, 0);
+		if ((node != NULL) && last)
+		{
+			return node->has_value ? &node->value : NULL;
+		}
+
+		pattern += level_len + 1;
+	}
+
+	return NULL;
+}
+
+// remove pattern from the subtree of node, emptied nodes below the node are freed
+static void wildcard_remove_node(struct wildcard_index* index, struct wildcard_node* node,
+	const char* pattern, const char* end)
+{
+	struct wildcard_node* child;
+	size_t level_len;
+	int last;
+
+	level_len = wildcard_level(index, pattern, end, &last);
+	if (wildcard_is(pattern, level_len, WILDCARD_MULTI))
+	{
+		node->has_multi = 0;
+		node->multi = NULL;
+	}
+	else
+	{
+		child = wildcard_child(node, pattern, level_len, 0);
+		if (child == NULL)
+		{
+			return;
+		}
+
+		if (last)
+		{
+			child->has_value = 0;
+			child->value = NULL;
+		}
+		else
+		{
+			wildcard_remove_node(index, child, pattern + level_len + 1, end);
+		}
+
+		// unlink the empty child (it has no children)
+		if (wildcard_node_empty(child))
+		{
+			wildcard_unlink(node, pattern, level_len);
+			wildcard_node_free(child);
+		}
+	}
+}
+
+void wildcard_remove(struct wildcard_index* index, const char* pattern, size_t pattern_len)
+{
+	if (index->root != NULL)
+	{
+		wildcard_remove_node(index, index->root, pattern, pattern + pattern_len);
+		if (wildcard_node_empty(index->root))
+		{
+			wildcard_node_free(index->root);
+			index->root = NULL;
+		}
+	}
+}
+
+// match the rest of name starting at 'name' with the subtree of node ('done' is set if name has no more levels)
+static int wildcard_match_node(const struct wildcard_index* index, const struct wildcard_node* node,
+	const char* name, const char* end, int done, wildcard_match_fn fn, void* arg)
+{
+	const char* rest;
+	size_t level_len;
+	size_t pos;
+	int matches = 0;
+	int found;
+	int last;
+
+	// '#' matches the rest of name, none level included
+	if (node->has_multi)
+	{
+		fn(node->multi, arg);
+		matches++;
+	}
+
+	if (done)
+	{
+		if (node->has_value)
+		{
+			fn(node->value, arg);
+			matches++;
+		}
+		return matches;
+	}
+
+	// the next level is matched by the equal literal level and by '+'
+	level_len = wildcard_level(index, name, end, &last);
+	rest = last ? end : name + level_len + 1;
+	pos = wildcard_search(node, name, level_len, &found);
+	if (found)
+	{
+		matches += wildcard_match_node(index, node->literals[pos], rest, end, last, fn, arg);
+	}
+	if (node->single != NULL)
+	{
+		matches += wildcard_match_node(index, node->single, rest, end, last, fn, arg);
+	}
+
+	return matches;
+}
+
+int wildcard_match(const struct wildcard_index* index, const char* name, size_t name_len,
+	wildcard_match_fn fn, void* arg)
+{
+	if (index->root == NULL)
+	{
+		return 0;
+	}
+
+	// every name has at least one level (may be empty)
+	return wildcard_match_node(index, index->root, name, name + name_len, 0, fn, arg);
+}
+
+// copy the subtree of node, 'nomem' is set if some node is not copied
+static struct wildcard_node* wildcard_clone_node(const struct wildcard_node* node, wildcard_clone_fn fn, void* arg,
+	int* nomem)
+{
+	struct wildcard_node* copy = wildcard_node_new(node->level, node->level_len);
+	struct wildcard_node* child_copy;
+	size_t i;
+
+	if (copy == NULL)
+	{
+		*nomem = 1;
+		return NULL;
+	}
+
+	copy->has_value = node->has_value;
+	copy->has_multi = node->has_multi;
+	copy->value = node->has_value ? fn(node->value, arg) : NULL;
+	copy->multi = node->has_multi ? fn(node->multi, arg) : NULL;
+	if ((node->has_value && (node->value != NULL) && (copy->value == NULL)) ||
+		(node->has_multi && (node->multi != NULL) && (copy->multi == NULL)))
+	{
+		*nomem = 1;	// 'fn' failed
+	}
+
+	// the children stay sorted, children not copied are left out
+	if (node->nliterals > 0)
+	{
+		copy->literals = (struct wildcard_node**)malloc(node->nliterals * sizeof(struct wildcard_node*));
+		if (copy->literals == NULL)
+		{
+			*nomem = 1;
+		}
+		else
+		{
+			copy->literals_size = node->nliterals;
+			for (i = 0; i < node->nliterals; i++)
+			{
+				child_copy = wildcard_clone_node(node->literals[i], fn, arg, nomem);
+				if (child_copy != NULL)
+				{
+					copy->literals[copy->nliterals++] = child_copy;
+				}
+			}
+		}
+	}
+	if (node->single != NULL)
+	{
+		copy->single = wildcard_clone_node(node->single, fn, arg, nomem);
+	}
+
+	return copy;
+}
+
+int wildcard_clone(struct wildcard_index* index, const struct wildcard_index* src,
+	wildcard_clone_fn fn, void* arg)
+{
+	int nomem = 0;
+
+	wildcard_init(index, src->separator);
+	if (src->root != NULL)
+	{
+		index->root = wildcard_clone_node(src->root, fn, arg, &nomem);
+		if (index->root == NULL)
+		{
+			nomem = 1;
+		}
+	}
+
+	return nomem ? -ENOMEM : 0;
+}
+
+// call 'fn' for patterns of the subtree of node
+static void wildcard_walk_node(struct wildcard_node* node, wildcard_match_fn fn, void* arg)
+{
+	size_t i;
+
+	if (node->has_value)
+	{
+		fn(node->value, arg);
+	}
+	if (node->has_multi)
+	{
+		fn(node->multi, arg);
+	}
+	for (i = 0; i < node->nliterals; i++)
+	{
+		wildcard_walk_node(node->literals[i], fn, arg);
+	}
+	if (node->single != NULL)
+	{
+		wildcard_walk_node(node->single, fn, arg);
+	}
+}
+
+void wildcard_walk(struct wildcard_index* index, wildcard_match_fn fn, void* arg)
+{
+	if (index->root != NULL)
+	{
+		wildcard_walk_node(index->root, fn, arg);
+	}
+}
@@ -0,0 +1,182 @@
+/*
+ * Index of level-aware wildcard patterns
+ * wildcard.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: alexo
+ */
+
+#ifndef WILDCARD_H_
+#define WILDCARD_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * @defgroup Wildcard Wildcard
+ *
+ * Little index of MQTT-style patterns. Names are split to levels by the separator;
+ * a pattern level '+' matches any single level and the last pattern level '#' matches
+ * any number of levels (none included), other levels match equal levels only.
+ * For example with separator '/' the pattern "sensors/+/temperature" matches
+ * "sensors/kitchen/temperature", the pattern "sensors/#" matches "sensors"
+ * and "sensors/kitchen/humidity".
+ *
+ * Patterns are kept in the tree of their levels, so all the patterns are matched
+ * in one walk over the name levels. Every pattern has a user value, the index
+ * never touches the values.
+ *
+ */
+
+/* Wildcard of single level */
+#define WILDCARD_SINGLE		'+'
+
+/* Wildcard of any number of levels, must be the last level of pattern */
+#define WILDCARD_MULTI		'#'
+
+/* Default level separator */
+#define WILDCARD_SEPARATOR	'/'
+
+/**
+ * Pattern index
+ *
+ * @ingroup Wildcard
+ *
+ * You should threat this struct as opaque, never ever set/get any
+ * of the variables.
+ */
+struct wildcard_index
+{
+	struct wildcard_node* root;	// the empty level path (NULL if there is no pattern)
+	int separator;				// level separator
+};
+
+/**
+ * Callback invoked by wildcard_match() for every matching pattern and by wildcard_walk()
+ *
+ * @ingroup Wildcard
+ */
+typedef void (*wildcard_match_fn)(void* value, void* arg);
+
+/**
+ * Callback invoked by wildcard_clone() to copy the user value
+ *
+ * @ingroup Wildcard
+ */
+typedef void* (*wildcard_clone_fn)(void* value, void* arg);
+
+/**
+ * Initializes an empty index.
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index
+ * @param separator level separator
+ */
+void wildcard_init(struct wildcard_index* index, int separator);
+
+/**
+ * Releases the index, the user values must be released before (see wildcard_walk()).
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index
+ */
+void wildcard_term(struct wildcard_index* index);
+
+/**
+ * Checks the pattern: '+' must be a whole level, '#' must be the whole last level.
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index
+ * @param pattern pattern
+ * @param pattern_len length of pattern
+ * @return 1 if the pattern is valid, 0 otherwise
+ */
+int wildcard_valid(const struct wildcard_index* index, const char* pattern, size_t pattern_len);
+
+/**
+ * Adds the pattern to the index (if it is not there yet).
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index
+ * @param pattern valid pattern
+ * @param pattern_len length of pattern
+ * @return pointer to the pattern's user value (NULL for a new pattern) or NULL if out of memory
+ */
+void** wildcard_add(struct wildcard_index* index, const char* pattern, size_t pattern_len);
+
+/**
+ * Gets the pattern's user value.
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index
+ * @param pattern pattern
+ * @param pattern_len length of pattern
+ * @return pointer to the pattern's user value or NULL if the pattern is not in index
+ */
+void** wildcard_value(struct wildcard_index* index, const char* pattern, size_t pattern_len);
+
+/**
+ * Removes the pattern from the index, the user value must be released before.
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index
+ * @param pattern pattern
+ * @param pattern_len length of pattern
+ */
+void wildcard_remove(struct wildcard_index* index, const char* pattern, size_t pattern_len);
+
+/**
+ * Calls 'fn' with the user value of every pattern matching the name.
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index
+ * @param name name to match
+ * @param name_len length of name
+ * @param fn callback
+ * @param arg callback argument
+ * @return number of matching patterns
+ */
+int wildcard_match(const struct wildcard_index* index, const char* name, size_t name_len,
+	wildcard_match_fn fn, void* arg);
+
+/**
+ * Initializes the index as a deep copy of 'src'.
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index to be initialized
+ * @param src Pointer to the copied index
+ * @param fn callback copying the user values, NULL fails the copy
+ * @param arg callback argument
+ * @return 0 if success or negative value ENOMEM (the copy is partial, values not copied are NULL)
+ */
+int wildcard_clone(struct wildcard_index* index, const struct wildcard_index* src,
+	wildcard_clone_fn fn, void* arg);
+
+/**
+ * Calls 'fn' with the user value of every pattern in index.
+ *
+ * @ingroup Wildcard
+ *
+ * @param index Pointer to the index
+ * @param fn callback
+ * @param arg callback argument
+ */
+void wildcard_walk(struct wildcard_index* index, wildcard_match_fn fn, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WILDCARD_H_ */